@@ -0,0 +1,368 @@
+#include "common/bandwidth.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+#include "utils/uv_callbacks.h"
+
+namespace ryu::net {
+
+namespace {
+constexpr uint64_t kNsPerSec = 1'000'000'000;
+}  // namespace
+
+TokenBucket::TokenBucket(BandwidthManager* manager, TokenBucket* parent, uint64_t rate,
+                         uint64_t burst)
+    : manager_(manager), parent_(parent) {
+    uint64_t now = manager_->NowNs();
+    refilled_ns_ = now;
+    created_ns_ = now;
+    last_slot_ = now / kSlotNs;
+    SetLimit(rate, burst);
+}
+
+TokenBucket::~TokenBucket() { CancelWait(); }
+
+void TokenBucket::SetLimit(uint64_t rate, uint64_t burst) {
+    Refill(manager_->NowNs());
+    bool was_limited = rate_ != 0;
+    rate_ = std::min(rate, kMaxRate);
+    burst_ = rate_ == 0 ? 0 : manager_->DefaultBurst(rate_, burst);
+    // a new limit starts full, a changed one keeps its debt
+    if (!was_limited) {
+        tokens_ = static_cast<int64_t>(burst_);
+        carry_ = 0;
+    }
+    tokens_ = std::min(tokens_, static_cast<int64_t>(burst_));
+}
+
+uint64_t TokenBucket::Available() { return AvailableAt(manager_->NowNs()); }
+
+uint64_t TokenBucket::Request(uint64_t want) {
+    uint64_t now = manager_->NowNs();
+    uint64_t granted = std::min(want, AvailableAt(now));
+    if (granted > 0) ConsumeAt(now, granted);
+    return granted;
+}
+
+void TokenBucket::Consume(uint64_t bytes) {
+    if (bytes > 0) ConsumeAt(manager_->NowNs(), bytes);
+}
+
+uint64_t TokenBucket::AvailableAt(uint64_t now_ns) {
+    uint64_t available = std::numeric_limits<uint64_t>::max();
+    for (TokenBucket* bucket = this; bucket != nullptr; bucket = bucket->parent_) {
+        if (bucket->rate_ == 0) continue;
+        bucket->Refill(now_ns);
+        available = std::min(available, static_cast<uint64_t>(std::max<int64_t>(
+                                            bucket->tokens_, 0)));
+    }
+    return available;
+}
+
+void TokenBucket::ConsumeAt(uint64_t now_ns, uint64_t bytes) {
+    for (TokenBucket* bucket = this; bucket != nullptr; bucket = bucket->parent_) {
+        if (bucket->rate_ != 0) {
+            bucket->Refill(now_ns);
+            bucket->tokens_ -= static_cast<int64_t>(bytes);
+        }
+        bucket->Record(now_ns, bytes);
+    }
+}
+
+void TokenBucket::Refill(uint64_t now_ns) {
+    if (now_ns <= refilled_ns_) return;
+    uint64_t elapsed = now_ns - refilled_ns_;
+    refilled_ns_ = now_ns;
+    if (rate_ == 0) return;
+    if (tokens_ >= static_cast<int64_t>(burst_)) {
+        carry_ = 0;
+        return;
+    }
+    uint64_t missing = static_cast<uint64_t>(static_cast<int64_t>(burst_) - tokens_);
+    uint64_t seconds = elapsed / kNsPerSec;
+    // long idle, also keeps seconds * rate_ from overflowing
+    if (seconds > missing / rate_) {
+        tokens_ = static_cast<int64_t>(burst_);
+        carry_ = 0;
+        return;
+    }
+    // below 1e9 * kMaxRate + 1e9, fits
+    carry_ += (elapsed % kNsPerSec) * rate_;
+    uint64_t added = seconds * rate_ + carry_ / kNsPerSec;
+    carry_ %= kNsPerSec;
+    tokens_ = added >= missing ? static_cast<int64_t>(burst_)
+                               : tokens_ + static_cast<int64_t>(added);
+}
+
+void TokenBucket::Record(uint64_t now_ns, uint64_t bytes) {
+    total_ += bytes;
+    uint64_t slot = now_ns / kSlotNs;
+    if (slot > last_slot_) {
+        uint64_t stale = std::min<uint64_t>(slot - last_slot_, kSlots);
+        for (uint64_t i = 1; i <= stale; i++) slots_[(last_slot_ + i) % kSlots] = 0;
+        last_slot_ = slot;
+    }
+    slots_[last_slot_ % kSlots] += bytes;
+}
+
+uint64_t TokenBucket::Rate() const {
+    uint64_t now = manager_->NowNs();
+    uint64_t slot = now / kSlotNs;
+    if (slot >= last_slot_ + kSlots) return 0;
+    uint64_t sum = 0;
+    // slots still inside the window ending now
+    size_t count = kSlots - (slot > last_slot_ ? slot - last_slot_ : 0);
+    for (size_t i = 0; i < count; i++) sum += slots_[(last_slot_ + kSlots - i) % kSlots];
+    // nine whole slots and the current partial one, or the bucket's whole life if shorter
+    uint64_t window = std::min((kSlots - 1) * kSlotNs + now % kSlotNs, now - created_ns_);
+    if (window == 0) return 0;
+    return static_cast<uint64_t>(static_cast<double>(sum) * kNsPerSec / window);
+}
+
+void TokenBucket::Wait(std::function<void()> on_ready) {
+    on_ready_ = std::move(on_ready);
+    if (waiting_) return;
+    waiting_ = true;
+    manager_->AddWaiter(this);
+}
+
+void TokenBucket::CancelWait() {
+    if (!waiting_) return;
+    manager_->RemoveWaiter(this);
+    waiting_ = false;
+    on_ready_ = nullptr;
+}
+
+BandwidthManager::BandwidthManager(uv_loop_t* loop, Options options)
+    : loop_(loop), options_(std::move(options)) {}
+
+Result<ResultVoid, std::string> BandwidthManager::Start() {
+    timer_ = std::make_unique<uv_timer_t>();
+    if (uv_timer_init(loop_, timer_.get()) != 0) {
+        timer_.reset();
+        return Err("BandwidthManager::Start uv_timer_init() failed");
+    }
+    timer_->data = this;
+    if (!waiting_.empty()) {
+        timer_running_ = true;
+        uv_timer_start(timer_.get(), uv_callbacks::Timer<&BandwidthManager::TimerFired>,
+                       options_.tick_ms, options_.tick_ms);
+    }
+    return {};
+}
+
+void BandwidthManager::Halt(std::function<void()> on_closed) {
+    if (draining_) return;
+    draining_ = true;
+    on_closed_ = std::move(on_closed);
+
+    for (TokenBucket* bucket : waiting_) {
+        bucket->waiting_ = false;
+        bucket->on_ready_ = nullptr;
+    }
+    waiting_.clear();
+    if (timer_) {
+        uv_close(reinterpret_cast<uv_handle_t*>(timer_.get()),
+                 uv_callbacks::Close<&BandwidthManager::HandleClosed>);
+    } else {
+        timer_closed_ = true;
+    }
+    CheckHalted();
+}
+
+void BandwidthManager::CheckHalted() {
+    if (!draining_ || !timer_closed_) return;
+    auto cb = std::move(on_closed_);
+    on_closed_ = nullptr;
+    // may delete this
+    if (cb) cb();
+}
+
+void BandwidthManager::HandleClosed(uv_handle_t* handle) {
+    timer_closed_ = true;
+    CheckHalted();
+}
+
+uint64_t BandwidthManager::NowNs() const {
+    return options_.clock ? options_.clock() : uv_hrtime();
+}
+
+uint64_t BandwidthManager::DefaultBurst(uint64_t rate, uint64_t burst) const {
+    if (burst == 0) burst = rate * options_.burst_ms / 1000;
+    return std::max({burst, rate * 2 * options_.tick_ms / 1000, uint64_t{1}});
+}
+
+void BandwidthManager::AddWaiter(TokenBucket* bucket) {
+    waiting_.push_back(bucket);
+    bucket->wait_iter_ = std::prev(waiting_.end());
+    if (timer_running_ || !timer_ || draining_) return;
+    timer_running_ = true;
+    uv_timer_start(timer_.get(), uv_callbacks::Timer<&BandwidthManager::TimerFired>,
+                   options_.tick_ms, options_.tick_ms);
+}
+
+void BandwidthManager::RemoveWaiter(TokenBucket* bucket) {
+    waiting_.erase(bucket->wait_iter_);
+}
+
+void BandwidthManager::TimerFired(uv_timer_t* handle) {
+    uint64_t now = NowNs();
+    // one pass, waiters queued by the callbacks wait for the next tick
+    for (size_t n = waiting_.size(); n > 0 && !waiting_.empty(); n--) {
+        TokenBucket* bucket = waiting_.front();
+        waiting_.pop_front();
+        if (bucket->AvailableAt(now) == 0) {
+            waiting_.push_back(bucket);
+            bucket->wait_iter_ = std::prev(waiting_.end());
+            continue;
+        }
+        bucket->waiting_ = false;
+        auto cb = std::move(bucket->on_ready_);
+        bucket->on_ready_ = nullptr;
+        // may destroy the bucket or others in the queue
+        if (cb) cb();
+    }
+    if (waiting_.empty() && timer_running_ && !draining_) {
+        timer_running_ = false;
+        uv_timer_stop(timer_.get());
+    }
+}
+
+ReadThrottle::ReadThrottle(TokenBucket* bucket, uv_stream_t* stream, uv_alloc_cb alloc_cb,
+                           uv_read_cb read_cb)
+    : bucket_(bucket), stream_(stream), alloc_cb_(alloc_cb), read_cb_(read_cb) {}
+
+int ReadThrottle::Start() {
+    if (started_) return 0;
+    started_ = true;
+    if (bucket_->Available() == 0) {
+        bucket_->Wait([this] { Resume(); });
+        return 0;
+    }
+    int retcode = uv_read_start(stream_, alloc_cb_, read_cb_);
+    if (retcode) {
+        started_ = false;
+        return retcode;
+    }
+    reading_ = true;
+    return 0;
+}
+
+void ReadThrottle::Stop() {
+    if (!started_) return;
+    started_ = false;
+    bucket_->CancelWait();
+    if (reading_) uv_read_stop(stream_);
+    reading_ = false;
+}
+
+void ReadThrottle::Consumed(size_t nread) {
+    bucket_->Consume(nread);
+    if (!reading_ || bucket_->Available() > 0) return;
+    uv_read_stop(stream_);
+    reading_ = false;
+    bucket_->Wait([this] { Resume(); });
+}
+
+size_t ReadThrottle::BufferSize(size_t suggested) {
+    uint64_t available = bucket_->Available();
+    return static_cast<size_t>(std::clamp<uint64_t>(available, 1, suggested));
+}
+
+void ReadThrottle::Resume() {
+    if (!started_ || reading_) return;
+    if (bucket_->Available() == 0) {
+        bucket_->Wait([this] { Resume(); });
+        return;
+    }
+    if (uv_read_start(stream_, alloc_cb_, read_cb_) == 0) reading_ = true;
+}
+
+WriteThrottle::WriteThrottle(TokenBucket* bucket, uv_stream_t* stream)
+    : bucket_(bucket), stream_(stream) {}
+
+WriteThrottle::~WriteThrottle() {
+    if (waiting_) bucket_->CancelWait();
+}
+
+void WriteThrottle::Write(std::string data, Callback cb) {
+    auto chunk = std::make_shared<Chunk>();
+    queued_ += data.size();
+    chunk->data = std::move(data);
+    chunk->callback = std::move(cb);
+    queue_.push_back(std::move(chunk));
+    if (!waiting_) Pump();
+}
+
+void WriteThrottle::Clear() {
+    if (waiting_) {
+        bucket_->CancelWait();
+        waiting_ = false;
+    }
+    auto queue = std::move(queue_);
+    queue_.clear();
+    queued_ = 0;
+    for (auto& chunk : queue) {
+        chunk->queued = false;
+        if (chunk->status == 0) chunk->status = UV_ECANCELED;
+        MaybeFinish(chunk);
+    }
+}
+
+void WriteThrottle::Pump() {
+    while (!queue_.empty()) {
+        std::shared_ptr<Chunk> chunk = queue_.front();
+        uint64_t granted = 0;
+        if (chunk->sent < chunk->data.size()) {
+            granted = bucket_->Request(chunk->data.size() - chunk->sent);
+            if (granted == 0) {
+                waiting_ = true;
+                bucket_->Wait([this] {
+                    waiting_ = false;
+                    Pump();
+                });
+                return;
+            }
+            auto piece = std::make_unique<Piece>();
+            piece->data = this;
+            piece->chunk = chunk;
+            piece->size = granted;
+            uv_buf_t buf = uv_buf_init(chunk->data.data() + chunk->sent, granted);
+            int retcode = uv_write(piece.get(), stream_, &buf, 1,
+                                   uv_callbacks::Write<&WriteThrottle::PieceWritten>);
+            if (retcode) {
+                if (chunk->status == 0) chunk->status = retcode;
+            } else {
+                // owned by libuv until PieceWritten()
+                piece.release();
+                chunk->pending++;
+                in_flight_ += granted;
+            }
+            chunk->sent += granted;
+            queued_ -= granted;
+        }
+        if (chunk->sent < chunk->data.size()) continue;
+        queue_.pop_front();
+        chunk->queued = false;
+        MaybeFinish(chunk);
+    }
+}
+
+void WriteThrottle::PieceWritten(uv_write_t* req, int status) {
+    std::unique_ptr<Piece> piece(static_cast<Piece*>(req));
+    in_flight_ -= piece->size;
+    piece->chunk->pending--;
+    if (status != 0 && piece->chunk->status == 0) piece->chunk->status = status;
+    MaybeFinish(piece->chunk);
+}
+
+void WriteThrottle::MaybeFinish(const std::shared_ptr<Chunk>& chunk) {
+    if (chunk->queued || chunk->pending > 0 || !chunk->callback) return;
+    auto cb = std::move(chunk->callback);
+    chunk->callback = nullptr;
+    cb(chunk->status);
+}
+
+}  // namespace ryu::net
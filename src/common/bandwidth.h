@@ -0,0 +1,235 @@
+#ifndef RYU_BANDWIDTH_H
+#define RYU_BANDWIDTH_H
+
+#include <uv.h>
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+
+#include "result.h"
+
+namespace ryu {
+namespace net {
+
+class BandwidthManager;
+
+// A byte budget refilled at `Limit()` bytes per second and holding at most `Burst()` bytes.
+//
+// Buckets nest, e.g. global -> torrent -> connection, one tree per direction. Bytes moved through
+// a bucket are taken from all of its ancestors too, so a connection runs at the pace of the
+// tightest bucket above it. A limit of 0 means unlimited, such a bucket only measures.
+// Tokens are refilled lazily from the manager's nanosecond clock and the sub-byte remainder is
+// carried over, so the pace doesn't depend on how often or how late the timer fires.
+// Not thread safe.
+class TokenBucket {
+  public:
+    // Limits above this are clamped, about 68 Gbit/s
+    static constexpr uint64_t kMaxRate = uint64_t{1} << 33;
+
+    // `manager` and `parent` must outlive the bucket. `burst` 0 picks the manager's default.
+    TokenBucket(BandwidthManager* manager, TokenBucket* parent, uint64_t rate = 0,
+                uint64_t burst = 0);
+    ~TokenBucket();
+    TokenBucket(const TokenBucket&) = delete;
+    TokenBucket& operator=(const TokenBucket&) = delete;
+
+    void SetLimit(uint64_t rate, uint64_t burst = 0);
+    [[nodiscard]] uint64_t Limit() const { return rate_; }
+    [[nodiscard]] uint64_t Burst() const { return burst_; }
+
+    // Bytes that may move now, the smallest balance on the way to the root. UINT64_MAX when
+    // neither this bucket nor any ancestor is limited.
+    [[nodiscard]] uint64_t Available();
+    // Take up to `want` bytes from the whole chain, returns how many were granted
+    uint64_t Request(uint64_t want);
+    // Account bytes that already moved, e.g. a completed read. May put the chain in debt, which
+    // later refills pay off before anything is granted again.
+    void Consume(uint64_t bytes);
+
+    // Call `on_ready` from the manager's timer once Available() is positive. Replaces an earlier
+    // wait. Waiters are woken in FIFO order, a waiter that has to wait again goes to the back.
+    void Wait(std::function<void()> on_ready);
+    void CancelWait();
+    [[nodiscard]] bool Waiting() const { return waiting_; }
+
+    // Measured throughput over the last second, in bytes per second
+    [[nodiscard]] uint64_t Rate() const;
+    // Bytes moved since creation
+    [[nodiscard]] uint64_t Total() const { return total_; }
+
+  private:
+    friend class BandwidthManager;
+
+    static constexpr uint64_t kSlotNs = 100'000'000;
+    static constexpr size_t kSlots = 10;
+
+    uint64_t AvailableAt(uint64_t now_ns);
+    void ConsumeAt(uint64_t now_ns, uint64_t bytes);
+    void Refill(uint64_t now_ns);
+    void Record(uint64_t now_ns, uint64_t bytes);
+
+    BandwidthManager* const manager_;
+    TokenBucket* const parent_;
+    uint64_t rate_ = 0;
+    uint64_t burst_ = 0;
+    // negative while in debt
+    int64_t tokens_ = 0;
+    // rate * ns not yet worth a whole byte, below 1e9
+    uint64_t carry_ = 0;
+    uint64_t refilled_ns_ = 0;
+
+    uint64_t created_ns_ = 0;
+    uint64_t total_ = 0;
+    // bytes moved per 100ms slot, over the last second
+    std::array<uint64_t, kSlots> slots_{};
+    uint64_t last_slot_ = 0;
+
+    bool waiting_ = false;
+    std::list<TokenBucket*>::iterator wait_iter_;
+    std::function<void()> on_ready_;
+};
+
+// Wakes waiting buckets from a single timer per loop.
+//
+// The timer only runs while some bucket is waiting and ticks every `tick_ms`. Buckets without
+// an explicit burst hold `burst_ms` worth of their rate, and never less than two ticks worth so
+// a tick that fires late loses nothing. Not thread safe.
+class BandwidthManager {
+  public:
+    struct Options {
+        uint64_t tick_ms = 10;
+        uint64_t burst_ms = 100;
+        // nanosecond clock, uv_hrtime() if empty
+        std::function<uint64_t()> clock;
+    };
+
+    BandwidthManager(uv_loop_t* loop, Options options);
+    explicit BandwidthManager(uv_loop_t* loop) : BandwidthManager(loop, Options{}) {}
+    BandwidthManager(const BandwidthManager&) = delete;
+    BandwidthManager& operator=(const BandwidthManager&) = delete;
+
+    Result<ResultVoid, std::string> Start();
+    // Drop every wait, `on_closed` is called once the manager can be destroyed
+    void Halt(std::function<void()> on_closed);
+
+    [[nodiscard]] uint64_t NowNs() const;
+    [[nodiscard]] size_t Waiting() const { return waiting_.size(); }
+
+    // UV callbacks
+    void TimerFired(uv_timer_t* handle);
+    void HandleClosed(uv_handle_t* handle);
+
+  private:
+    friend class TokenBucket;
+
+    uint64_t DefaultBurst(uint64_t rate, uint64_t burst) const;
+    void AddWaiter(TokenBucket* bucket);
+    void RemoveWaiter(TokenBucket* bucket);
+    void CheckHalted();
+
+    uv_loop_t* const loop_;
+    const Options options_;
+    std::unique_ptr<uv_timer_t> timer_;
+    bool timer_running_ = false;
+    std::list<TokenBucket*> waiting_;
+
+    bool draining_ = false;
+    bool timer_closed_ = false;
+    std::function<void()> on_closed_;
+};
+
+// Stops reading a stream while its bucket is empty and starts it again once refilled.
+//
+// libuv reads whatever the socket holds, so reads are accounted after the fact and a read may
+// overdraw the bucket, BufferSize() keeps that to one bucket's burst. The stream's alloc and
+// read callbacks are the caller's, the read callback reports each read through Consumed().
+class ReadThrottle {
+  public:
+    // `bucket` and `stream` must outlive the throttle
+    ReadThrottle(TokenBucket* bucket, uv_stream_t* stream, uv_alloc_cb alloc_cb,
+                 uv_read_cb read_cb);
+    ~ReadThrottle() { Stop(); }
+    ReadThrottle(const ReadThrottle&) = delete;
+    ReadThrottle& operator=(const ReadThrottle&) = delete;
+
+    // uv_read_start() now, or once the bucket has tokens
+    int Start();
+    void Stop();
+    // Account a read of `nread` bytes, pauses reading if that emptied the bucket
+    void Consumed(size_t nread);
+    // Size for the alloc callback
+    [[nodiscard]] size_t BufferSize(size_t suggested);
+    [[nodiscard]] bool Paused() const { return started_ && !reading_; }
+
+  private:
+    void Resume();
+
+    TokenBucket* const bucket_;
+    uv_stream_t* const stream_;
+    const uv_alloc_cb alloc_cb_;
+    const uv_read_cb read_cb_;
+    bool started_ = false;
+    bool reading_ = false;
+};
+
+// Queues writes to a stream and hands them to uv_write() as fast as its bucket allows.
+//
+// Large writes are split into pieces of what the bucket grants. Callbacks run in order once the
+// last piece of a write completed, with the first error of any piece. The throttle must outlive
+// the stream's close callback since pieces in flight point back at it.
+class WriteThrottle {
+  public:
+    using Callback = std::function<void(int status)>;
+
+    // `bucket` and `stream` must outlive the throttle
+    WriteThrottle(TokenBucket* bucket, uv_stream_t* stream);
+    ~WriteThrottle();
+    WriteThrottle(const WriteThrottle&) = delete;
+    WriteThrottle& operator=(const WriteThrottle&) = delete;
+
+    void Write(std::string data, Callback cb);
+    // Fail queued writes with UV_ECANCELED, pieces already handed to libuv still complete
+    void Clear();
+    // Bytes not yet handed to libuv
+    [[nodiscard]] size_t Queued() const { return queued_; }
+    [[nodiscard]] size_t InFlight() const { return in_flight_; }
+
+    // UV callbacks
+    void PieceWritten(uv_write_t* req, int status);
+
+  private:
+    struct Chunk {
+        std::string data;
+        Callback callback;
+        size_t sent = 0;
+        // pieces in flight
+        size_t pending = 0;
+        int status = 0;
+        // more pieces to come
+        bool queued = true;
+    };
+    struct Piece : public uv_write_t {
+        std::shared_ptr<Chunk> chunk;
+        size_t size = 0;
+    };
+
+    void Pump();
+    void MaybeFinish(const std::shared_ptr<Chunk>& chunk);
+
+    TokenBucket* const bucket_;
+    uv_stream_t* const stream_;
+    std::deque<std::shared_ptr<Chunk>> queue_;
+    bool waiting_ = false;
+    size_t queued_ = 0;
+    size_t in_flight_ = 0;
+};
+
+}  // namespace net
+}  // namespace ryu
+
+#endif  // RYU_BANDWIDTH_H
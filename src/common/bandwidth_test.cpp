@@ -0,0 +1,219 @@
+#include "bandwidth.h"
+
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+
+#include <memory>
+#include <string>
+
+#include "utils/uv_callbacks.h"
+
+using namespace ryu::net;
+
+namespace {
+
+class BandwidthTest : public ::testing::Test {
+  protected:
+    void SetUp() override { uv_loop_init(&loop_); }
+    void TearDown() override { EXPECT_EQ(0, uv_loop_close(&loop_)); }
+
+    // manager on a clock only the test moves
+    std::unique_ptr<BandwidthManager> ManualClock() {
+        return std::make_unique<BandwidthManager>(
+            &loop_, BandwidthManager::Options{.clock = [this] { return now_ns_; }});
+    }
+
+    template <typename Pred>
+    bool RunUntil(Pred pred) {
+        for (int i = 0; i < 1000 && !pred(); i++) uv_run(&loop_, UV_RUN_ONCE);
+        return pred();
+    }
+
+    void Shutdown(BandwidthManager* manager) {
+        bool closed = false;
+        manager->Halt([&] { closed = true; });
+        ASSERT_TRUE(RunUntil([&] { return closed; }));
+        uv_run(&loop_, UV_RUN_DEFAULT);
+    }
+
+    uv_loop_t loop_;
+    uint64_t now_ns_ = 1'000'000'000;
+};
+
+TEST_F(BandwidthTest, RefillIsExact) {
+    auto manager = ManualClock();
+    // 1 Gbit/s
+    TokenBucket bucket(manager.get(), nullptr, 125'000'000);
+    EXPECT_EQ(12'500'000u, bucket.Burst());
+    uint64_t granted = bucket.Request(UINT64_MAX);
+    EXPECT_EQ(bucket.Burst(), granted);
+    // odd steps leave a fraction of a byte each time
+    for (int i = 0; i < 100'000; i++) {
+        now_ns_ += 10'007;
+        granted += bucket.Request(UINT64_MAX);
+    }
+    EXPECT_EQ(bucket.Burst() + 125'000'000ull * 100'000 * 10'007 / 1'000'000'000, granted);
+    EXPECT_EQ(0u, bucket.Available());
+
+    // an idle bucket fills up to its burst and no further
+    now_ns_ += 60'000'000'000;
+    EXPECT_EQ(bucket.Burst(), bucket.Available());
+}
+
+TEST_F(BandwidthTest, Hierarchy) {
+    auto manager = ManualClock();
+    TokenBucket global(manager.get(), nullptr, 1000, 1000);
+    TokenBucket torrent(manager.get(), &global);
+    TokenBucket connection(manager.get(), &torrent, 400, 400);
+    EXPECT_EQ(1000u, torrent.Available());
+    EXPECT_EQ(400u, connection.Request(1000));
+    EXPECT_EQ(600u, torrent.Available());
+
+    // a read overdraws the chain, nothing is granted until the debt is paid
+    connection.Consume(1400);
+    EXPECT_EQ(0u, torrent.Request(1));
+    now_ns_ += 700'000'000;
+    EXPECT_EQ(0u, torrent.Available());
+    now_ns_ += 300'000'000;
+    EXPECT_EQ(200u, torrent.Available());
+    EXPECT_EQ(0u, connection.Available());
+    EXPECT_EQ(1800u, global.Total());
+    EXPECT_EQ(1800u, torrent.Total());
+
+    // lifting a limit on the way frees the rest of the chain
+    connection.SetLimit(0);
+    EXPECT_EQ(200u, connection.Available());
+}
+
+TEST_F(BandwidthTest, MeasuresRate) {
+    auto manager = ManualClock();
+    TokenBucket parent(manager.get(), nullptr);
+    TokenBucket bucket(manager.get(), &parent);
+    for (int i = 0; i < 30; i++) {
+        bucket.Consume(500);
+        now_ns_ += 100'000'000;
+    }
+    EXPECT_EQ(5000u, bucket.Rate());
+    EXPECT_EQ(5000u, parent.Rate());
+    EXPECT_EQ(15000u, parent.Total());
+    // off by at most the partial slot
+    now_ns_ += 500'000'000;
+    EXPECT_NEAR(2000, bucket.Rate(), 250);
+    now_ns_ += 1'000'000'000;
+    EXPECT_EQ(0u, bucket.Rate());
+}
+
+TEST_F(BandwidthTest, WakesWaitersInOrder) {
+    BandwidthManager manager(&loop_, {.tick_ms = 5, .burst_ms = 100, .clock = {}});
+    ASSERT_TRUE(manager.Start().Ok());
+    TokenBucket global(&manager, nullptr, 20'000, 500);
+    TokenBucket first(&manager, &global);
+    TokenBucket second(&manager, &global);
+    EXPECT_EQ(500u, first.Request(1000));
+
+    std::vector<int> woken;
+    first.Wait([&] { woken.push_back(1); });
+    second.Wait([&] {
+        woken.push_back(2);
+        second.Request(1000);
+    });
+    EXPECT_EQ(2u, manager.Waiting());
+    ASSERT_TRUE(RunUntil([&] { return woken.size() == 2; }));
+    EXPECT_EQ(1, woken[0]);
+    EXPECT_EQ(0u, manager.Waiting());
+
+    first.Wait([&] { woken.push_back(3); });
+    first.CancelWait();
+    EXPECT_EQ(0u, manager.Waiting());
+    Shutdown(&manager);
+    EXPECT_EQ(2u, woken.size());
+}
+
+// Pushes data through a socket pair limited on both ends
+class Pipe {
+  public:
+    Pipe(uv_loop_t* loop, TokenBucket* upload, TokenBucket* download) {
+        int fds[2];
+        EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        for (int i = 0; i < 2; i++) {
+            uv_pipe_init(loop, &ends_[i], 0);
+            uv_pipe_open(&ends_[i], fds[i]);
+            ends_[i].data = this;
+        }
+        writer_ = std::make_unique<WriteThrottle>(upload, Stream(0));
+        reader_ = std::make_unique<ReadThrottle>(download, Stream(1),
+                                                 ryu::uv_callbacks::Alloc<&Pipe::Alloc>,
+                                                 ryu::uv_callbacks::Read<&Pipe::Read>);
+    }
+
+    void Alloc(uv_handle_t* handle, size_t suggested, uv_buf_t* buf) {
+        buf->base = buffer_;
+        buf->len = reader_->BufferSize(sizeof(buffer_));
+    }
+
+    void Read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+        if (nread <= 0) return;
+        received.append(buf->base, nread);
+        reader_->Consumed(nread);
+    }
+
+    void Close(int* closed) {
+        reader_->Stop();
+        for (auto& end : ends_) {
+            end.data = closed;
+            uv_close(reinterpret_cast<uv_handle_t*>(&end), [](uv_handle_t* handle) {
+                ++*static_cast<int*>(handle->data);
+            });
+        }
+    }
+
+    uv_stream_t* Stream(int i) { return reinterpret_cast<uv_stream_t*>(&ends_[i]); }
+    WriteThrottle* writer() { return writer_.get(); }
+    ReadThrottle* reader() { return reader_.get(); }
+    std::string received;
+
+  private:
+    uv_pipe_t ends_[2];
+    char buffer_[65536];
+    std::unique_ptr<WriteThrottle> writer_;
+    std::unique_ptr<ReadThrottle> reader_;
+};
+
+TEST_F(BandwidthTest, ThrottlesStream) {
+    BandwidthManager manager(&loop_);
+    ASSERT_TRUE(manager.Start().Ok());
+    TokenBucket upload(&manager, nullptr, 1'000'000);
+    TokenBucket download(&manager, nullptr, 500'000);
+    auto pipe = std::make_unique<Pipe>(&loop_, &upload, &download);
+    ASSERT_EQ(0, pipe->reader()->Start());
+
+    std::string data(200'000, 'x');
+    data.back() = 'y';
+    std::vector<int> statuses;
+    uint64_t start = uv_hrtime();
+    pipe->writer()->Write(data.substr(0, 100'000), [&](int s) { statuses.push_back(s); });
+    pipe->writer()->Write(data.substr(100'000), [&](int s) { statuses.push_back(s); });
+    EXPECT_GT(pipe->writer()->Queued(), 0u);
+    ASSERT_TRUE(RunUntil([&] { return pipe->received.size() == data.size(); }));
+    uint64_t elapsed_ms = (uv_hrtime() - start) / 1'000'000;
+    EXPECT_EQ(data, pipe->received);
+    EXPECT_EQ((std::vector<int>{0, 0}), statuses);
+    // the reader's 500KB/s less its 50KB burst
+    EXPECT_GE(elapsed_ms, 280u);
+    EXPECT_EQ(data.size(), download.Total());
+
+    // the reader pauses once its bucket is empty
+    pipe->writer()->Write(std::string(200'000, 'z'), [&](int s) { statuses.push_back(s); });
+    ASSERT_TRUE(RunUntil([&] { return pipe->reader()->Paused(); }));
+    pipe->writer()->Clear();
+    ASSERT_TRUE(RunUntil([&] { return statuses.size() == 3; }));
+    EXPECT_EQ(UV_ECANCELED, statuses.back());
+
+    int closed = 0;
+    pipe->Close(&closed);
+    ASSERT_TRUE(RunUntil([&] { return closed == 2; }));
+    pipe.reset();
+    Shutdown(&manager);
+}
+
+}  // namespace
@@ -78,7 +78,7 @@ EncodeResult BencodeMap::Json() const {
     return ret;
 }
 
-PointerResult<BencodeObject> BencodeObject::Parse(const std::string& str,
+PointerResult<BencodeObject> BencodeObject::Parse(std::string_view str,
                                                             size_t* idx_inout) {
     if (*idx_inout >= str.size())
         return Err(absl::StrFormat("expecting object but end of input reached"));
@@ -99,15 +99,15 @@ PointerResult<BencodeObject> BencodeObject::Parse(const std::string& str,
     }
 }
 
-PointerResult<BencodeInteger> BencodeInteger::Parse(const std::string& str,
+PointerResult<BencodeInteger> BencodeInteger::Parse(std::string_view str,
                                                               size_t* idx_inout) {
     size_t start_idx = *idx_inout;
     auto epos = str.find('e', *idx_inout);
-    if (epos == std::string::npos) {
+    if (epos == std::string_view::npos) {
         return Err(absl::StrFormat("no ending mark found for integer at: %d", *idx_inout));
     } else {
         size_t len = epos - *idx_inout - 1;
-        const auto n_str = str.substr(*idx_inout + 1, len);
+        const std::string n_str(str.substr(*idx_inout + 1, len));
         char* ptr;
         errno = 0;
         int64_t n = strtoll(n_str.c_str(), &ptr, 10);
@@ -121,14 +121,14 @@ PointerResult<BencodeInteger> BencodeInteger::Parse(const std::string& str,
     }
 }
 
-PointerResult<BencodeString> BencodeString::Parse(const std::string& str,
+PointerResult<BencodeString> BencodeString::Parse(std::string_view str,
                                                             size_t* idx_inout) {
     size_t start_idx = *idx_inout;
     auto epos = str.find(':', *idx_inout);
-    if (epos == std::string::npos)
+    if (epos == std::string_view::npos)
         return Err(absl::StrFormat("cannot find `:` mark for string at: %d", *idx_inout));
 
-    std::string len_s = str.substr(*idx_inout, epos - *idx_inout);
+    std::string len_s(str.substr(*idx_inout, epos - *idx_inout));
     errno = 0;
     char* ptr;
     int64_t len = strtoll(len_s.c_str(), &ptr, 10);
@@ -137,7 +137,7 @@ PointerResult<BencodeString> BencodeString::Parse(const std::string& str,
     if (errno == ERANGE || len < 0)
         return Err(absl::StrFormat("string length out of range: %s at %d", len_s, *idx_inout));
 
-    std::string value = str.substr(epos + 1, len);
+    std::string value(str.substr(epos + 1, len));
     if (value.size() != static_cast<uint64_t>(len))
         return Err(absl::StrFormat("string ends prematurely at %d, expecting %d, has %d: %s",
                                    *idx_inout, len, value.size(), value));
@@ -146,7 +146,7 @@ PointerResult<BencodeString> BencodeString::Parse(const std::string& str,
     return std::make_unique<BencodeString>(value);
 }
 
-PointerResult<BencodeList> BencodeList::Parse(const std::string& str, size_t* idx_inout) {
+PointerResult<BencodeList> BencodeList::Parse(std::string_view str, size_t* idx_inout) {
     size_t start_idx = *idx_inout;
     auto ret = std::make_unique<BencodeList>();
     ++*idx_inout;
@@ -163,7 +163,7 @@ PointerResult<BencodeList> BencodeList::Parse(const std::string& str, size_t* id
     return ret;
 }
 
-PointerResult<BencodeMap> BencodeMap::Parse(const std::string& str, size_t* idx_inout) {
+PointerResult<BencodeMap> BencodeMap::Parse(std::string_view str, size_t* idx_inout) {
     size_t start_idx = *idx_inout;
     auto ret = std::make_unique<BencodeMap>();
     ++*idx_inout;
@@ -6,6 +6,7 @@
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <variant>
 #include <vector>
@@ -72,7 +73,7 @@ class BencodeObject {
     // parser and serializer
     // BencodeObject::parse() determines the type of next object
     // Subclass::parse() assume the object type is correct
-    static PointerResult<BencodeObject> Parse(const std::string& str, size_t* idx_inout);
+    static PointerResult<BencodeObject> Parse(std::string_view str, size_t* idx_inout);
     // convert this object to bencode format
     virtual EncodeResult Encode() const {
         return Err("Cannot encode invalid object");
@@ -96,7 +97,7 @@ class BencodeInteger : public BencodeObject {
 
     // constructor, parser, serializer
     explicit BencodeInteger(int64_t val) : val_(val) {}
-    static PointerResult<BencodeInteger> Parse(const std::string& str, size_t* idx_inout);
+    static PointerResult<BencodeInteger> Parse(std::string_view str, size_t* idx_inout);
     EncodeResult Encode() const override;
     EncodeResult Json() const override;
 
@@ -114,7 +115,7 @@ class BencodeString : public BencodeObject {
 
     // constructor, parser, serializer
     explicit BencodeString(const std::string& val) : val_(val) {}
-    static PointerResult<BencodeString> Parse(const std::string& str, size_t* idx_inout);
+    static PointerResult<BencodeString> Parse(std::string_view str, size_t* idx_inout);
     EncodeResult Encode() const override;
     EncodeResult Json() const override;
 
@@ -155,7 +156,7 @@ class BencodeList : public BencodeObject {
 
     // constructor, parser, serializer
     BencodeList() = default;
-    static PointerResult<BencodeList> Parse(const std::string& str, size_t* idx_inout);
+    static PointerResult<BencodeList> Parse(std::string_view str, size_t* idx_inout);
     EncodeResult Encode() const override;
     EncodeResult Json() const override;
 
@@ -183,12 +184,19 @@ class BencodeMap : public BencodeObject {
     bool Contains(const std::string& key) const override {
         return map_.contains(key);
     }
+    // keys in insertion order
+    std::vector<std::string> Keys() const {
+        std::vector<std::string> ret;
+        ret.reserve(map_.size());
+        for (const auto& it : map_) ret.push_back(it.first);
+        return ret;
+    }
     // both list and map
     virtual size_t Size() const override { return map_.size(); }
 
     // constructor, parser, serializer
     BencodeMap() = default;
-    static PointerResult<BencodeMap> Parse(const std::string& str, size_t* idx_inout);
+    static PointerResult<BencodeMap> Parse(std::string_view str, size_t* idx_inout);
     EncodeResult Encode() const override;
     EncodeResult Json() const override;
 
@@ -0,0 +1,303 @@
+#include "common/connector.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "absl/strings/str_cat.h"
+#include "utils/uv_callbacks.h"
+
+namespace ryu::net {
+
+namespace {
+// RFC 8305 section 4, alternate families starting with the first address
+std::vector<Endpoint> Interleave(const std::vector<Endpoint>& endpoints) {
+    std::vector<Endpoint> first, second;
+    for (const auto& endpoint : endpoints) {
+        (endpoint.Type() == endpoints.front().Type() ? first : second).push_back(endpoint);
+    }
+    std::vector<Endpoint> ret;
+    ret.reserve(endpoints.size());
+    for (size_t i = 0; i < std::max(first.size(), second.size()); i++) {
+        if (i < first.size()) ret.push_back(first[i]);
+        if (i < second.size()) ret.push_back(second[i]);
+    }
+    return ret;
+}
+}  // namespace
+
+Connector::Connector(uv_loop_t* loop, Options options, Resolver* resolver)
+    : loop_(loop), options_(options), resolver_(resolver) {}
+
+Result<ResultVoid, std::string> Connector::Start() {
+    timer_ = std::make_unique<uv_timer_t>();
+    if (uv_timer_init(loop_, timer_.get()) != 0) {
+        timer_.reset();
+        return Err("Connector::Start uv_timer_init() failed");
+    }
+    timer_->data = this;
+    return {};
+}
+
+void Connector::Halt(std::function<void()> on_closed) {
+    if (draining_) return;
+    draining_ = true;
+    on_closed_ = std::move(on_closed);
+
+    std::vector<ConnectId> ids;
+    for (const auto& [id, op] : ops_) ids.push_back(id);
+    for (ConnectId id : ids) Finish(id, Err("connector halted"));
+    blocked_.clear();
+    events_.clear();
+    if (timer_) {
+        uv_close(reinterpret_cast<uv_handle_t*>(timer_.get()),
+                 uv_callbacks::Close<&Connector::HandleClosed>);
+    } else {
+        timer_closed_ = true;
+    }
+    CheckHalted();
+}
+
+void Connector::CheckHalted() {
+    if (!draining_ || !timer_closed_ || !attempts_.empty()) return;
+    auto cb = std::move(on_closed_);
+    on_closed_ = nullptr;
+    // may delete this
+    if (cb) cb();
+}
+
+Connector::ConnectId Connector::NewOp(Callback cb) {
+    ConnectId id = next_id_++;
+    ConnectOp& op = ops_[id];
+    op.id = id;
+    op.callback = std::move(cb);
+    return id;
+}
+
+Connector::ConnectId Connector::Connect(const RemoteService& service, Callback cb) {
+    if (draining_) {
+        cb(Err("connector halted"));
+        return 0;
+    }
+    ConnectId id = NewOp(std::move(cb));
+    Resolver::RequestId resolve_id = service.Resolve(
+        resolver_, [this, id](Result<std::vector<Endpoint>, std::string> endpoints) {
+            if (endpoints) endpoints = Interleave(endpoints.Value());
+            Resolved(id, std::move(endpoints));
+        });
+    auto iter = ops_.find(id);
+    if (iter != ops_.end() && resolve_id != 0) iter->second.resolve_id = resolve_id;
+    return id;
+}
+
+Connector::ConnectId Connector::Connect(std::vector<Endpoint> endpoints, Callback cb) {
+    if (draining_) {
+        cb(Err("connector halted"));
+        return 0;
+    }
+    ConnectId id = NewOp(std::move(cb));
+    Resolved(id, std::move(endpoints));
+    return id;
+}
+
+void Connector::Cancel(ConnectId id) {
+    auto iter = ops_.find(id);
+    if (iter == ops_.end()) return;
+    iter->second.callback = nullptr;
+    Finish(id, Err("cancelled"));
+}
+
+void Connector::Resolved(ConnectId id, Result<std::vector<Endpoint>, std::string> endpoints) {
+    auto iter = ops_.find(id);
+    if (iter == ops_.end()) return;
+    iter->second.resolve_id = 0;
+    if (!endpoints) return Finish(id, Err(endpoints.Error()));
+    if (endpoints.Value().empty()) return Finish(id, Err("no address to connect to"));
+    iter->second.endpoints = std::move(endpoints).TakeValue();
+    Advance(id);
+}
+
+void Connector::Advance(ConnectId id) {
+    if (draining_) return;
+    auto iter = ops_.find(id);
+    if (iter == ops_.end()) return;
+    ConnectOp& op = iter->second;
+    if (op.next >= op.endpoints.size()) {
+        if (op.attempts.empty()) Finish(id, Err(op.last_error));
+        return;
+    }
+    // give the pending attempts a head start
+    if (!op.attempts.empty() && uv_now(loop_) < op.next_attempt_ms) return;
+    if (half_open_ >= options_.max_half_open) {
+        if (!op.blocked) {
+            op.blocked = true;
+            blocked_.push_back(id);
+        }
+        return;
+    }
+    StartAttempt(op);
+}
+
+void Connector::StartAttempt(ConnectOp& op) {
+    auto attempt = std::make_unique<Attempt>();
+    attempt->data = this;
+    attempt->id = next_id_++;
+    attempt->op = op.id;
+    attempt->endpoint = op.endpoints[op.next++];
+    attempt->tcp = std::make_unique<uv_tcp_t>();
+    attempt->tcp->data = this;
+
+    int retcode = uv_tcp_init(loop_, attempt->tcp.get());
+    if (retcode) {
+        op.last_error = absl::StrCat("uv_tcp_init() failed: ", uv_strerror(retcode));
+        return Advance(op.id);
+    }
+    sockaddr_storage addr;
+    attempt->endpoint.ToSockaddr(&addr);
+    Attempt* ptr = attempt.get();
+    attempts_[ptr->id] = std::move(attempt);
+    retcode = uv_tcp_connect(ptr, ptr->tcp.get(), reinterpret_cast<sockaddr*>(&addr),
+                             uv_callbacks::Connect<&Connector::AttemptConnected>);
+    if (retcode) {
+        op.last_error = absl::StrCat("connect to ", ptr->endpoint.ToString(),
+                                     " failed: ", uv_strerror(retcode));
+        // never counted, and no connect callback will come
+        ptr->pending = false;
+        ptr->connect_done = true;
+        uv_close(reinterpret_cast<uv_handle_t*>(ptr->tcp.get()),
+                 uv_callbacks::Close<&Connector::HandleClosed>);
+        return Advance(op.id);
+    }
+
+    half_open_++;
+    op.attempts.push_back(ptr->id);
+    uint64_t now = uv_now(loop_);
+    Schedule(now + options_.attempt_timeout_ms, Event::ATTEMPT_TIMEOUT, ptr->id);
+    if (op.next < op.endpoints.size()) {
+        op.next_attempt_ms = now + options_.attempt_delay_ms;
+        Schedule(op.next_attempt_ms, Event::NEXT_ATTEMPT, op.id);
+    }
+}
+
+void Connector::AttemptConnected(uv_connect_t* req, int status) {
+    auto* attempt = static_cast<Attempt*>(req);
+    attempt->connect_done = true;
+    if (!attempt->pending) return MaybeRelease(attempt);
+
+    ConnectId id = attempt->op;
+    if (status == 0) {
+        attempt->pending = false;
+        half_open_--;
+        auto& attempts = ops_.at(id).attempts;
+        attempts.erase(std::find(attempts.begin(), attempts.end(), attempt->id));
+        std::unique_ptr<uv_tcp_t> tcp = std::move(attempt->tcp);
+        MaybeRelease(attempt);
+        Finish(id, std::move(tcp));
+    } else {
+        Abandon(attempt, uv_strerror(status));
+        // a failure starts the next attempt without waiting for the delay
+        ops_.at(id).next_attempt_ms = 0;
+        Advance(id);
+    }
+    Unblock();
+}
+
+void Connector::TimerFired(uv_timer_t* handle) {
+    uint64_t now = uv_now(loop_);
+    std::vector<std::pair<Event, uint64_t>> due;
+    while (!events_.empty() && events_.begin()->first <= now) {
+        due.push_back(events_.begin()->second);
+        events_.erase(events_.begin());
+    }
+    for (auto [event, id] : due) {
+        if (event == Event::NEXT_ATTEMPT) {
+            Advance(id);
+            continue;
+        }
+        auto iter = attempts_.find(id);
+        if (iter == attempts_.end() || !iter->second->pending) continue;
+        ConnectId op = iter->second->op;
+        Abandon(iter->second.get(), "timed out");
+        ops_.at(op).next_attempt_ms = 0;
+        Advance(op);
+    }
+    Unblock();
+    UpdateTimer();
+}
+
+void Connector::HandleClosed(uv_handle_t* handle) {
+    if (handle == reinterpret_cast<uv_handle_t*>(timer_.get())) {
+        timer_closed_ = true;
+        return CheckHalted();
+    }
+    auto iter = std::find_if(attempts_.begin(), attempts_.end(), [handle](const auto& entry) {
+        return reinterpret_cast<uv_handle_t*>(entry.second->tcp.get()) == handle;
+    });
+    assert(iter != attempts_.end());
+    iter->second->tcp_closed = true;
+    MaybeRelease(iter->second.get());
+}
+
+void Connector::Abandon(Attempt* attempt, const std::string& error) {
+    if (!attempt->pending) return;
+    attempt->pending = false;
+    half_open_--;
+    auto op = ops_.find(attempt->op);
+    if (op != ops_.end()) {
+        auto& attempts = op->second.attempts;
+        attempts.erase(std::find(attempts.begin(), attempts.end(), attempt->id));
+        op->second.last_error =
+            absl::StrCat("connect to ", attempt->endpoint.ToString(), " failed: ", error);
+    }
+    // the connect callback follows with UV_ECANCELED
+    uv_close(reinterpret_cast<uv_handle_t*>(attempt->tcp.get()),
+             uv_callbacks::Close<&Connector::HandleClosed>);
+}
+
+void Connector::Finish(ConnectId id, Result<std::unique_ptr<uv_tcp_t>, std::string> result) {
+    auto iter = ops_.find(id);
+    if (iter == ops_.end()) return;
+    // the losers
+    std::vector<uint64_t> attempts = iter->second.attempts;
+    for (uint64_t attempt : attempts) Abandon(attempts_.at(attempt).get(), "cancelled");
+    if (iter->second.resolve_id != 0) resolver_->Cancel(iter->second.resolve_id);
+    Callback cb = std::move(iter->second.callback);
+    ops_.erase(iter);
+    if (cb) cb(std::move(result));
+    Unblock();
+}
+
+void Connector::MaybeRelease(Attempt* attempt) {
+    if (!attempt->connect_done || (attempt->tcp && !attempt->tcp_closed)) return;
+    attempts_.erase(attempt->id);
+    CheckHalted();
+}
+
+void Connector::Unblock() {
+    while (!draining_ && half_open_ < options_.max_half_open && !blocked_.empty()) {
+        ConnectId id = blocked_.front();
+        blocked_.pop_front();
+        auto iter = ops_.find(id);
+        if (iter == ops_.end()) continue;
+        iter->second.blocked = false;
+        Advance(id);
+    }
+}
+
+void Connector::Schedule(uint64_t when_ms, Event event, uint64_t id) {
+    events_.emplace(when_ms, std::make_pair(event, id));
+    UpdateTimer();
+}
+
+void Connector::UpdateTimer() {
+    if (draining_ || !timer_) return;
+    if (events_.empty()) {
+        uv_timer_stop(timer_.get());
+        return;
+    }
+    uint64_t now = uv_now(loop_);
+    uint64_t first = events_.begin()->first;
+    uv_timer_start(timer_.get(), uv_callbacks::Timer<&Connector::TimerFired>,
+                   first > now ? first - now : 0, 0);
+}
+
+}  // namespace ryu::net
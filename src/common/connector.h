@@ -0,0 +1,132 @@
+#ifndef RYU_CONNECTOR_H
+#define RYU_CONNECTOR_H
+
+#include <uv.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common/network.h"
+#include "common/resolver.h"
+#include "result.h"
+
+namespace ryu {
+namespace net {
+
+// Outgoing TCP connections raced over every address of a service, RFC 8305 "happy eyeballs".
+//
+// Addresses are tried alternating between families, starting with the family getaddrinfo()
+// preferred. A new attempt starts every `attempt_delay_ms` while earlier ones are still pending,
+// or right away when one fails. The first attempt to connect wins and the others are closed.
+// Each attempt gives up after `attempt_timeout_ms`. At most `max_half_open` attempts are pending
+// over all connects, the rest wait in FIFO order. Not thread safe.
+class Connector {
+  public:
+    struct Options {
+        uint64_t attempt_delay_ms = 250;
+        uint64_t attempt_timeout_ms = 10000;
+        size_t max_half_open = 64;
+    };
+
+    // The connected handle belongs to the caller, which must uv_close() it before freeing it.
+    // Its `data` is free for the caller to use.
+    using Callback = std::function<void(Result<std::unique_ptr<uv_tcp_t>, std::string>)>;
+    using ConnectId = uint64_t;
+
+    // `resolver` must outlive the connector
+    Connector(uv_loop_t* loop, Options options, Resolver* resolver);
+    Connector(const Connector&) = delete;
+    Connector& operator=(const Connector&) = delete;
+
+    Result<ResultVoid, std::string> Start();
+    // Fail every connect in progress, `on_closed` is called once the connector can be destroyed
+    void Halt(std::function<void()> on_closed);
+
+    // `cb` is always called exactly once unless the connect is cancelled, possibly before
+    // Connect() returns
+    ConnectId Connect(const RemoteService& service, Callback cb);
+    // Race the given addresses, in the order given
+    ConnectId Connect(std::vector<Endpoint> endpoints, Callback cb);
+    // Abort the connect, its callback won't be called
+    void Cancel(ConnectId id);
+
+    [[nodiscard]] size_t HalfOpen() const { return half_open_; }
+    [[nodiscard]] size_t Pending() const { return ops_.size(); }
+
+    // UV callbacks
+    void AttemptConnected(uv_connect_t* req, int status);
+    void TimerFired(uv_timer_t* handle);
+    void HandleClosed(uv_handle_t* handle);
+
+  private:
+    struct Attempt : public uv_connect_t {
+        uint64_t id{};
+        ConnectId op{};
+        Endpoint endpoint;
+        // owned here until handed to the winner's callback or closed
+        std::unique_ptr<uv_tcp_t> tcp;
+        // counted as half open
+        bool pending = true;
+        bool connect_done = false;
+        bool tcp_closed = false;
+    };
+
+    struct ConnectOp {
+        ConnectId id{};
+        Callback callback;
+        std::vector<Endpoint> endpoints;
+        size_t next = 0;
+        // attempts started and not yet failed
+        std::vector<uint64_t> attempts;
+        // when the next attempt may start while others are pending
+        uint64_t next_attempt_ms = 0;
+        Resolver::RequestId resolve_id{};
+        // queued for a half-open slot
+        bool blocked = false;
+        std::string last_error;
+    };
+
+    enum class Event { NEXT_ATTEMPT, ATTEMPT_TIMEOUT };
+
+    ConnectId NewOp(Callback cb);
+    void Resolved(ConnectId id, Result<std::vector<Endpoint>, std::string> endpoints);
+    // Start the next attempt of the connect if allowed, fail it if nothing is left
+    void Advance(ConnectId id);
+    void StartAttempt(ConnectOp& op);
+    // Stop counting the attempt as half open and close its socket
+    void Abandon(Attempt* attempt, const std::string& error);
+    void Finish(ConnectId id, Result<std::unique_ptr<uv_tcp_t>, std::string> result);
+    void MaybeRelease(Attempt* attempt);
+    // Start attempts blocked on the half-open cap
+    void Unblock();
+    void Schedule(uint64_t when_ms, Event event, uint64_t id);
+    void UpdateTimer();
+    void CheckHalted();
+
+    uv_loop_t* const loop_;
+    const Options options_;
+    Resolver* const resolver_;
+
+    std::unique_ptr<uv_timer_t> timer_;
+    std::unordered_map<ConnectId, ConnectOp> ops_;
+    std::unordered_map<uint64_t, std::unique_ptr<Attempt>> attempts_;
+    // deadline(ms) -> event, stale events are skipped when they fire
+    std::multimap<uint64_t, std::pair<Event, uint64_t>> events_;
+    std::deque<ConnectId> blocked_;
+    size_t half_open_ = 0;
+    uint64_t next_id_ = 1;
+
+    bool draining_ = false;
+    bool timer_closed_ = false;
+    std::function<void()> on_closed_;
+};
+
+}  // namespace net
+}  // namespace ryu
+
+#endif  // RYU_CONNECTOR_H
@@ -0,0 +1,195 @@
+#include "connector.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "utils/uv_callbacks.h"
+
+using namespace ryu;
+using namespace ryu::net;
+
+namespace {
+
+using ConnectResult = Result<std::unique_ptr<uv_tcp_t>, std::string>;
+
+// Accepts connections on 127.0.0.1 and keeps them until closed
+class Listener {
+  public:
+    explicit Listener(uv_loop_t* loop) : loop_(loop) {
+        uv_tcp_init(loop, &server_);
+        server_.data = this;
+        sockaddr_in addr{};
+        uv_ip4_addr("127.0.0.1", 0, &addr);
+        EXPECT_EQ(0, uv_tcp_bind(&server_, reinterpret_cast<sockaddr*>(&addr), 0));
+        EXPECT_EQ(0, uv_listen(reinterpret_cast<uv_stream_t*>(&server_), 16,
+                               uv_callbacks::Connection<&Listener::Accept>));
+        int len = sizeof(addr);
+        uv_tcp_getsockname(&server_, reinterpret_cast<sockaddr*>(&addr), &len);
+        port_ = ntohs(addr.sin_port);
+    }
+
+    void Accept(uv_stream_t* server, int status) {
+        auto client = std::make_unique<uv_tcp_t>();
+        uv_tcp_init(loop_, client.get());
+        if (uv_accept(server, reinterpret_cast<uv_stream_t*>(client.get())) == 0) accepted++;
+        clients_.push_back(std::move(client));
+    }
+
+    void Close() {
+        uv_close(reinterpret_cast<uv_handle_t*>(&server_), nullptr);
+        for (auto& client : clients_) {
+            uv_close(reinterpret_cast<uv_handle_t*>(client.release()),
+                     [](uv_handle_t* handle) { delete reinterpret_cast<uv_tcp_t*>(handle); });
+        }
+    }
+
+    uint16_t port() const { return port_; }
+    int accepted = 0;
+
+  private:
+    uv_loop_t* loop_;
+    uv_tcp_t server_;
+    uint16_t port_;
+    std::vector<std::unique_ptr<uv_tcp_t>> clients_;
+};
+
+// A loopback port nobody listens on
+uint16_t ClosedPort(uv_loop_t* loop) {
+    uv_tcp_t tcp;
+    uv_tcp_init(loop, &tcp);
+    sockaddr_in addr{};
+    uv_ip4_addr("127.0.0.1", 0, &addr);
+    uv_tcp_bind(&tcp, reinterpret_cast<sockaddr*>(&addr), 0);
+    int len = sizeof(addr);
+    uv_tcp_getsockname(&tcp, reinterpret_cast<sockaddr*>(&addr), &len);
+    uv_close(reinterpret_cast<uv_handle_t*>(&tcp), nullptr);
+    uv_run(loop, UV_RUN_NOWAIT);
+    return ntohs(addr.sin_port);
+}
+
+Endpoint Loopback(uint16_t port) { return Endpoint(IpAddress::FromBe32(htonl(0x7f000001)), port); }
+
+class ConnectorTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        uv_loop_init(&loop_);
+        resolver_ = std::make_unique<Resolver>(&loop_);
+    }
+    void TearDown() override {
+        bool closed = false;
+        resolver_->Halt([&] { closed = true; });
+        ASSERT_TRUE(RunUntil([&] { return closed; }));
+        resolver_.reset();
+        uv_run(&loop_, UV_RUN_DEFAULT);
+        EXPECT_EQ(0, uv_loop_close(&loop_));
+    }
+
+    std::unique_ptr<Connector> MakeConnector(Connector::Options options) {
+        auto connector = std::make_unique<Connector>(&loop_, options, resolver_.get());
+        EXPECT_TRUE(connector->Start().Ok());
+        return connector;
+    }
+
+    template <typename Pred>
+    bool RunUntil(Pred pred) {
+        for (int i = 0; i < 1000 && !pred(); i++) uv_run(&loop_, UV_RUN_ONCE);
+        return pred();
+    }
+
+    void Release(std::optional<ConnectResult>& result) {
+        if (!result || !result->Ok()) return;
+        uv_close(reinterpret_cast<uv_handle_t*>(std::move(*result).TakeValue().release()),
+                 [](uv_handle_t* handle) { delete reinterpret_cast<uv_tcp_t*>(handle); });
+    }
+
+    void Shutdown(std::unique_ptr<Connector> connector, Listener* listener) {
+        bool closed = false;
+        connector->Halt([&] { closed = true; });
+        if (listener) listener->Close();
+        ASSERT_TRUE(RunUntil([&] { return closed; }));
+    }
+
+    uv_loop_t loop_;
+    std::unique_ptr<Resolver> resolver_;
+};
+
+TEST_F(ConnectorTest, FallsBackToNextAddress) {
+    Listener listener(&loop_);
+    auto connector = MakeConnector({.attempt_delay_ms = 1000});
+    std::optional<ConnectResult> result;
+    connector->Connect({Loopback(ClosedPort(&loop_)), Loopback(listener.port())},
+                       [&](ConnectResult r) { result = std::move(r); });
+    uint64_t start = uv_now(&loop_);
+    ASSERT_TRUE(RunUntil([&] { return result.has_value() && listener.accepted == 1; }));
+    ASSERT_TRUE(result->Ok()) << result->Error();
+    // the refused attempt started the next one without waiting for the delay
+    EXPECT_LT(uv_now(&loop_) - start, 1000u);
+    EXPECT_EQ(0u, connector->HalfOpen());
+    Release(result);
+    Shutdown(std::move(connector), &listener);
+}
+
+TEST_F(ConnectorTest, AllAddressesFail) {
+    auto connector = MakeConnector({});
+    std::optional<ConnectResult> result;
+    connector->Connect({Loopback(ClosedPort(&loop_)), Loopback(ClosedPort(&loop_))},
+                       [&](ConnectResult r) { result = std::move(r); });
+    ASSERT_TRUE(RunUntil([&] { return result.has_value(); }));
+    EXPECT_FALSE(result->Ok());
+    Shutdown(std::move(connector), nullptr);
+}
+
+TEST_F(ConnectorTest, ResolvesService) {
+    Listener listener(&loop_);
+    auto connector = MakeConnector({.attempt_delay_ms = 50});
+    std::optional<ConnectResult> result;
+    // localhost may resolve to ::1 first, which is refused
+    connector->Connect(RemoteService::Tcp("localhost", listener.port()),
+                       [&](ConnectResult r) { result = std::move(r); });
+    ASSERT_TRUE(RunUntil([&] { return result.has_value(); }));
+    ASSERT_TRUE(result->Ok()) << result->Error();
+    Release(result);
+    Shutdown(std::move(connector), &listener);
+}
+
+TEST_F(ConnectorTest, HalfOpenCap) {
+    Listener listener(&loop_);
+    auto connector = MakeConnector({.max_half_open = 1});
+    std::optional<ConnectResult> first, second;
+    connector->Connect({Loopback(listener.port())}, [&](ConnectResult r) { first = std::move(r); });
+    connector->Connect({Loopback(listener.port())},
+                       [&](ConnectResult r) { second = std::move(r); });
+    EXPECT_EQ(1u, connector->HalfOpen());
+    EXPECT_EQ(2u, connector->Pending());
+    ASSERT_TRUE(RunUntil([&] { return first.has_value() && second.has_value(); }));
+    EXPECT_TRUE(first->Ok());
+    EXPECT_TRUE(second->Ok());
+    Release(first);
+    Release(second);
+    Shutdown(std::move(connector), &listener);
+}
+
+TEST_F(ConnectorTest, CancelAndHalt) {
+    Listener listener(&loop_);
+    auto connector = MakeConnector({});
+    bool called = false;
+    auto id = connector->Connect({Loopback(listener.port())}, [&](ConnectResult r) {
+        called = true;
+    });
+    connector->Cancel(id);
+    EXPECT_EQ(0u, connector->HalfOpen());
+
+    std::optional<ConnectResult> halted;
+    connector->Connect({Loopback(listener.port())},
+                       [&](ConnectResult r) { halted = std::move(r); });
+    Shutdown(std::move(connector), &listener);
+    EXPECT_FALSE(called);
+    ASSERT_TRUE(halted.has_value());
+    EXPECT_FALSE(halted->Ok());
+}
+
+}  // namespace
@@ -0,0 +1,212 @@
+#include "metrics.h"
+
+#include <cassert>
+#include <cmath>
+
+#include "absl/strings/str_cat.h"
+#include "utils/uv_callbacks.h"
+
+namespace ryu::metrics {
+
+namespace {
+
+// quantiles of the Prometheus summaries
+constexpr double kQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+const char* TypeName(Registry::Type type) {
+    switch (type) {
+        case Registry::Type::COUNTER:
+            return "counter";
+        case Registry::Type::GAUGE:
+            return "gauge";
+        case Registry::Type::HISTOGRAM:
+            return "summary";
+    }
+    return "untyped";
+}
+
+std::string Number(double value) {
+    if (std::floor(value) == value && std::fabs(value) < 1e15) {
+        return absl::StrCat(static_cast<int64_t>(value));
+    }
+    return absl::StrCat(value);
+}
+
+}  // namespace
+
+uint64_t Counter::Value() const {
+    uint64_t total = 0;
+    for (const Cell& cell : cells_) total += cell.value.load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t Histogram::Snapshot::Quantile(double q) const {
+    if (count == 0) return 0;
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * count)));
+    uint64_t seen = 0;
+    for (size_t b = 0; b < buckets.size(); b++) {
+        seen += buckets[b];
+        if (seen >= rank) return BucketHigh(b);
+    }
+    return BucketHigh(buckets.size() - 1);
+}
+
+Histogram::Snapshot Histogram::Snap() const {
+    Snapshot snapshot;
+    snapshot.buckets.assign(kBuckets, 0);
+    for (const Cell& cell : cells_) {
+        for (size_t b = 0; b < kBuckets; b++) {
+            uint64_t n = cell.buckets[b].load(std::memory_order_relaxed);
+            snapshot.buckets[b] += n;
+            snapshot.count += n;
+        }
+        snapshot.sum += cell.sum.load(std::memory_order_relaxed);
+    }
+    return snapshot;
+}
+
+uint64_t Histogram::BucketLow(size_t b) {
+    if (b < (1u << kSubBits)) return b;
+    int exp = static_cast<int>(b >> kSubBits) + kSubBits - 1;
+    uint64_t sub = b & ((1u << kSubBits) - 1);
+    return ((1u << kSubBits) + sub) << (exp - kSubBits);
+}
+
+uint64_t Histogram::BucketHigh(size_t b) {
+    if (b < (1u << kSubBits)) return b;
+    int exp = static_cast<int>(b >> kSubBits) + kSubBits - 1;
+    return BucketLow(b) + ((uint64_t{1} << (exp - kSubBits)) - 1);
+}
+
+Registry& Registry::Global() {
+    // never destroyed, threads may update metrics while the process exits
+    static Registry* registry = new Registry();
+    return *registry;
+}
+
+Counter* Registry::GetCounter(const std::string& name, const std::string& help) {
+    return Get(name, help, Type::COUNTER, 1)->counter.get();
+}
+
+Gauge* Registry::GetGauge(const std::string& name, const std::string& help) {
+    return Get(name, help, Type::GAUGE, 1)->gauge.get();
+}
+
+Histogram* Registry::GetHistogram(const std::string& name, const std::string& help,
+                                  double scale) {
+    return Get(name, help, Type::HISTOGRAM, scale)->histogram.get();
+}
+
+Registry::Family* Registry::Get(const std::string& name, const std::string& help, Type type,
+                                double scale) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto& family = families_[name];
+    if (family) {
+        assert(family->type == type);
+        return family.get();
+    }
+    family = std::make_unique<Family>();
+    family->name = name;
+    family->help = help;
+    family->type = type;
+    family->scale = scale;
+    switch (type) {
+        case Type::COUNTER:
+            family->counter = std::make_unique<Counter>();
+            break;
+        case Type::GAUGE:
+            family->gauge = std::make_unique<Gauge>();
+            break;
+        case Type::HISTOGRAM:
+            family->histogram = std::make_unique<Histogram>();
+            break;
+    }
+    return family.get();
+}
+
+void Registry::ForEach(const std::function<void(const Family&)>& visit) const {
+    std::lock_guard<std::mutex> lock(mu_);
+    for (const auto& [name, family] : families_) visit(*family);
+}
+
+std::string Registry::Prometheus() const {
+    std::string out;
+    ForEach([&out](const Family& family) {
+        absl::StrAppend(&out, "# HELP ", family.name, " ", family.help, "\n", "# TYPE ",
+                        family.name, " ", TypeName(family.type), "\n");
+        switch (family.type) {
+            case Type::COUNTER:
+                absl::StrAppend(&out, family.name, " ", family.counter->Value(), "\n");
+                break;
+            case Type::GAUGE:
+                absl::StrAppend(&out, family.name, " ", family.gauge->Value(), "\n");
+                break;
+            case Type::HISTOGRAM: {
+                Histogram::Snapshot snapshot = family.histogram->Snap();
+                for (double q : kQuantiles) {
+                    absl::StrAppend(&out, family.name, "{quantile=\"", q, "\"} ",
+                                    Number(snapshot.Quantile(q) * family.scale), "\n");
+                }
+                absl::StrAppend(&out, family.name, "_sum ", Number(snapshot.sum * family.scale),
+                                "\n", family.name, "_count ", snapshot.count, "\n");
+                break;
+            }
+        }
+    });
+    return out;
+}
+
+LoopMonitor::LoopMonitor(uv_loop_t* loop)
+    : loop_(loop),
+      iterations_(Registry::Global().GetCounter("ryu_loop_iterations_total",
+                                                "Event loop iterations, all loops")),
+      busy_(Registry::Global().GetHistogram(
+          "ryu_loop_busy_seconds", "Time an event loop iteration spent in callbacks", 1e-9)) {}
+
+Result<ResultVoid, std::string> LoopMonitor::Start() {
+    int retcode = uv_loop_configure(loop_, UV_METRICS_IDLE_TIME);
+    if (retcode) return Err(absl::StrCat("uv_loop_configure() failed: ", uv_strerror(retcode)));
+    retcode = uv_prepare_init(loop_, &prepare_);
+    if (retcode) return Err(absl::StrCat("uv_prepare_init() failed: ", uv_strerror(retcode)));
+    prepare_.data = this;
+    open_ = true;
+    uv_prepare_start(&prepare_, uv_callbacks::Prepare<&LoopMonitor::BeforePoll>);
+    uv_unref(reinterpret_cast<uv_handle_t*>(&prepare_));
+    return {};
+}
+
+void LoopMonitor::Halt(std::function<void()> on_closed) {
+    on_closed_ = std::move(on_closed);
+    if (!open_) {
+        auto cb = std::move(on_closed_);
+        on_closed_ = nullptr;
+        // may delete this
+        if (cb) cb();
+        return;
+    }
+    uv_close(reinterpret_cast<uv_handle_t*>(&prepare_),
+             uv_callbacks::Close<&LoopMonitor::HandleClosed>);
+}
+
+void LoopMonitor::BeforePoll(uv_prepare_t* handle) {
+    iterations_->Add();
+    uint64_t now_ns = uv_hrtime();
+    uint64_t idle_ns = uv_metrics_idle_time(loop_);
+    if (last_poll_ns_ != 0) {
+        uint64_t elapsed_ns = now_ns - last_poll_ns_;
+        uint64_t blocked_ns = idle_ns - last_idle_ns_;
+        busy_->Record(elapsed_ns > blocked_ns ? elapsed_ns - blocked_ns : 0);
+    }
+    last_poll_ns_ = now_ns;
+    last_idle_ns_ = idle_ns;
+}
+
+void LoopMonitor::HandleClosed(uv_handle_t* handle) {
+    open_ = false;
+    auto cb = std::move(on_closed_);
+    on_closed_ = nullptr;
+    // may delete this
+    if (cb) cb();
+}
+
+}  // namespace ryu::metrics
@@ -0,0 +1,167 @@
+#ifndef RYU_METRICS_H
+#define RYU_METRICS_H
+
+#include <uv.h>
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "result.h"
+
+namespace ryu {
+namespace metrics {
+
+// Updates go to one of kShards slots, picked per thread, so threads don't fight over cache
+// lines. Reads sum the slots.
+constexpr size_t kShards = 16;
+
+// Slot of the calling thread, threads take them in turn
+inline size_t ThreadShard() {
+    static std::atomic<size_t> next{0};
+    thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return shard;
+}
+
+class Counter {
+  public:
+    void Add(uint64_t n = 1) {
+        cells_[ThreadShard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+    [[nodiscard]] uint64_t Value() const;
+
+  private:
+    struct alignas(64) Cell {
+        std::atomic<uint64_t> value{0};
+    };
+    std::array<Cell, kShards> cells_;
+};
+
+class Gauge {
+  public:
+    void Set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+    void Add(int64_t delta) { value_.fetch_add(delta, std::memory_order_relaxed); }
+    [[nodiscard]] int64_t Value() const { return value_.load(std::memory_order_relaxed); }
+
+  private:
+    std::atomic<int64_t> value_{0};
+};
+
+// Log-linear buckets like HdrHistogram: values below 8 get a bucket each, above that every
+// power of two is split into 8 buckets, so a bucket is at most 12.5% wide. Any uint64_t fits.
+class Histogram {
+  public:
+    static constexpr int kSubBits = 3;
+    static constexpr size_t kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+    struct Snapshot {
+        std::vector<uint64_t> buckets;
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        // Highest value of the bucket holding the `q` quantile, 0 if empty
+        [[nodiscard]] uint64_t Quantile(double q) const;
+    };
+
+    void Record(uint64_t value) {
+        Cell& cell = cells_[ThreadShard()];
+        cell.buckets[BucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        cell.sum.fetch_add(value, std::memory_order_relaxed);
+    }
+    [[nodiscard]] Snapshot Snap() const;
+
+    static size_t BucketOf(uint64_t value) {
+        if (value < (1u << kSubBits)) return value;
+        int exp = 63 - __builtin_clzll(value);
+        size_t sub = (value >> (exp - kSubBits)) & ((1u << kSubBits) - 1);
+        return (static_cast<size_t>(exp - kSubBits + 1) << kSubBits) + sub;
+    }
+    // Values of bucket `b` are [BucketLow(b), BucketHigh(b)]
+    static uint64_t BucketLow(size_t b);
+    static uint64_t BucketHigh(size_t b);
+
+  private:
+    struct alignas(64) Cell {
+        std::array<std::atomic<uint64_t>, kBuckets> buckets{};
+        std::atomic<uint64_t> sum{0};
+    };
+    std::array<Cell, kShards> cells_;
+};
+
+// Named metrics of the process. Registering takes a lock, which is why users look their metrics
+// up once and keep the pointers, those stay valid for the life of the registry. Updates are
+// lock free from any thread.
+class Registry {
+  public:
+    enum class Type { COUNTER, GAUGE, HISTOGRAM };
+
+    struct Family {
+        std::string name;
+        std::string help;
+        Type type;
+        // exported values are multiplied by it, e.g. 1e-9 for durations recorded in ns
+        double scale = 1;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+    };
+
+    static Registry& Global();
+
+    // The same name gives the same metric
+    Counter* GetCounter(const std::string& name, const std::string& help);
+    Gauge* GetGauge(const std::string& name, const std::string& help);
+    Histogram* GetHistogram(const std::string& name, const std::string& help, double scale = 1);
+
+    // Calls `visit` with every metric in name order, under the registry's lock
+    void ForEach(const std::function<void(const Family&)>& visit) const;
+    // Prometheus text exposition format. Histograms are summaries with a few quantiles.
+    [[nodiscard]] std::string Prometheus() const;
+
+  private:
+    Family* Get(const std::string& name, const std::string& help, Type type, double scale);
+
+    mutable std::mutex mu_;
+    std::map<std::string, std::unique_ptr<Family>> families_;
+};
+
+// Counts the iterations of a loop and how long each spent running callbacks: the time from one
+// poll to the next, less the time blocked in poll as told by uv_metrics_idle_time(). I/O
+// callbacks run inside the poll phase and are counted. Turns on UV_METRICS_IDLE_TIME for the
+// loop. Its handle doesn't keep the loop alive.
+class LoopMonitor {
+  public:
+    explicit LoopMonitor(uv_loop_t* loop);
+    LoopMonitor(const LoopMonitor&) = delete;
+    LoopMonitor& operator=(const LoopMonitor&) = delete;
+
+    Result<ResultVoid, std::string> Start();
+    // `on_closed` is called once the monitor can be destroyed
+    void Halt(std::function<void()> on_closed);
+
+    // UV callbacks
+    void BeforePoll(uv_prepare_t* handle);
+    void HandleClosed(uv_handle_t* handle);
+
+  private:
+    uv_loop_t* const loop_;
+    uv_prepare_t prepare_;
+    Counter* const iterations_;
+    Histogram* const busy_;
+    // at the previous BeforePoll()
+    uint64_t last_poll_ns_ = 0;
+    uint64_t last_idle_ns_ = 0;
+    bool open_ = false;
+    std::function<void()> on_closed_;
+};
+
+}  // namespace metrics
+}  // namespace ryu
+
+#endif  // RYU_METRICS_H
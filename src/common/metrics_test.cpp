@@ -0,0 +1,140 @@
+#include "metrics.h"
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <thread>
+#include <vector>
+
+#include "absl/strings/match.h"
+
+using namespace ryu::metrics;
+
+namespace {
+
+TEST(MetricsTest, CounterSumsThreads) {
+    Counter counter;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 20; t++) {
+        threads.emplace_back([&counter] {
+            for (int i = 0; i < 10000; i++) counter.Add();
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    EXPECT_EQ(200000u, counter.Value());
+
+    Gauge gauge;
+    gauge.Set(5);
+    gauge.Add(-7);
+    EXPECT_EQ(-2, gauge.Value());
+}
+
+TEST(MetricsTest, HistogramBuckets) {
+    // buckets cover every value once, in order
+    uint64_t next = 0;
+    for (size_t b = 0; b < Histogram::kBuckets; b++) {
+        ASSERT_EQ(next, Histogram::BucketLow(b)) << b;
+        ASSERT_EQ(b, Histogram::BucketOf(Histogram::BucketLow(b)));
+        ASSERT_EQ(b, Histogram::BucketOf(Histogram::BucketHigh(b)));
+        next = Histogram::BucketHigh(b) + 1;
+    }
+    EXPECT_EQ(0u, next);
+    EXPECT_EQ(Histogram::kBuckets - 1, Histogram::BucketOf(UINT64_MAX));
+    // at most 12.5% wide
+    EXPECT_EQ(960u, Histogram::BucketLow(Histogram::BucketOf(1000)));
+    EXPECT_EQ(1023u, Histogram::BucketHigh(Histogram::BucketOf(1000)));
+}
+
+TEST(MetricsTest, HistogramQuantiles) {
+    Histogram histogram;
+    EXPECT_EQ(0u, histogram.Snap().Quantile(0.5));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&histogram] {
+            for (uint64_t v = 1; v <= 1000; v++) histogram.Record(v);
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    Histogram::Snapshot snapshot = histogram.Snap();
+    EXPECT_EQ(4000u, snapshot.count);
+    EXPECT_EQ(4u * 500500, snapshot.sum);
+    EXPECT_EQ(511u, snapshot.Quantile(0.5));
+    EXPECT_EQ(1023u, snapshot.Quantile(0.99));
+    EXPECT_EQ(1u, snapshot.Quantile(0));
+}
+
+TEST(MetricsTest, Registry) {
+    Registry registry;
+    Counter* requests = registry.GetCounter("test_requests_total", "Requests");
+    EXPECT_EQ(requests, registry.GetCounter("test_requests_total", "Requests"));
+    requests->Add(3);
+    registry.GetGauge("test_clients", "Clients")->Set(-2);
+    Histogram* latency = registry.GetHistogram("test_latency_seconds", "Latency", 1e-3);
+    latency->Record(100);
+    latency->Record(3);
+
+    std::vector<std::string> names;
+    registry.ForEach([&](const Registry::Family& family) { names.push_back(family.name); });
+    EXPECT_EQ((std::vector<std::string>{"test_clients", "test_latency_seconds",
+                                        "test_requests_total"}),
+              names);
+
+    std::string text = registry.Prometheus();
+    EXPECT_TRUE(absl::StrContains(text, "# TYPE test_requests_total counter\n"
+                                        "test_requests_total 3\n"));
+    EXPECT_TRUE(absl::StrContains(text, "# HELP test_clients Clients\n"));
+    EXPECT_TRUE(absl::StrContains(text, "test_clients -2\n"));
+    EXPECT_TRUE(absl::StrContains(text, "# TYPE test_latency_seconds summary\n"));
+    EXPECT_TRUE(absl::StrContains(text, "test_latency_seconds{quantile=\"0.5\"} 0.003\n"));
+    EXPECT_TRUE(absl::StrContains(text, "test_latency_seconds{quantile=\"0.99\"} 0.103\n"));
+    EXPECT_TRUE(absl::StrContains(text, "test_latency_seconds_sum 0.103\n"));
+    EXPECT_TRUE(absl::StrContains(text, "test_latency_seconds_count 2\n"));
+}
+
+TEST(MetricsTest, LoopMonitor) {
+    uv_loop_t loop;
+    uv_loop_init(&loop);
+    Counter* iterations = Registry::Global().GetCounter("ryu_loop_iterations_total", "");
+    uint64_t before = iterations->Value();
+    auto monitor = std::make_unique<LoopMonitor>(&loop);
+    ASSERT_TRUE(monitor->Start().Ok());
+
+    // a timer keeps the loop alive, every run is one iteration
+    uv_timer_t timer;
+    uv_timer_init(&loop, &timer);
+    uv_timer_start(&timer, [](uv_timer_t*) {}, 1000, 0);
+    for (int i = 0; i < 5; i++) uv_run(&loop, UV_RUN_NOWAIT);
+    uv_close(reinterpret_cast<uv_handle_t*>(&timer), nullptr);
+    EXPECT_EQ(5u, iterations->Value() - before);
+
+    // its handles alone don't keep the loop running
+    bool closed = false;
+    uv_run(&loop, UV_RUN_DEFAULT);
+    monitor->Halt([&] { closed = true; });
+    uv_run(&loop, UV_RUN_DEFAULT);
+    EXPECT_TRUE(closed);
+    EXPECT_EQ(0, uv_loop_close(&loop));
+}
+
+TEST(MetricsTest, LoopMonitorCountsIoCallbacks) {
+    uv_loop_t loop;
+    uv_loop_init(&loop);
+    Histogram* busy = Registry::Global().GetHistogram("ryu_loop_busy_seconds", "", 1e-9);
+    uint64_t before = busy->Snap().sum;
+    auto monitor = std::make_unique<LoopMonitor>(&loop);
+    ASSERT_TRUE(monitor->Start().Ok());
+
+    // runs inside the poll phase, like a socket read
+    uv_async_t async;
+    uv_async_init(&loop, &async, [](uv_async_t*) { usleep(20000); });
+    uv_async_send(&async);
+    for (int i = 0; i < 3; i++) uv_run(&loop, UV_RUN_NOWAIT);
+    EXPECT_GE(busy->Snap().sum - before, 20'000'000u);
+
+    uv_close(reinterpret_cast<uv_handle_t*>(&async), nullptr);
+    monitor->Halt([] {});
+    uv_run(&loop, UV_RUN_DEFAULT);
+    EXPECT_EQ(0, uv_loop_close(&loop));
+}
+
+}  // namespace
@@ -3,6 +3,8 @@
 
 #include <arpa/inet.h>
 
+#include <cstring>
+#include <functional>
 #include <stdexcept>
 #include <string>
 
@@ -73,6 +75,8 @@ class IpAddress {
     }
 
     [[nodiscard]] AddressType Type() const { return type_; }
+    // in6_addr, or in_addr followed by zeros
+    [[nodiscard]] const uint8_t* Bytes() const { return addr_; }
     [[nodiscard]] int AddressFamily() const {
         switch (type_) {
             case AddressType::IPv6:
@@ -92,30 +96,150 @@ class IpAddress {
         return {ret};
     }
 
+    bool operator==(const IpAddress& other) const {
+        return type_ == other.type_ && memcmp(addr_, other.addr_, STORAGE_SIZE) == 0;
+    }
+    bool operator!=(const IpAddress& other) const { return !(*this == other); }
+    // IPv4 before IPv6, then numeric order
+    bool operator<(const IpAddress& other) const {
+        if (type_ != other.type_) return type_ == AddressType::IPv4;
+        return memcmp(addr_, other.addr_, STORAGE_SIZE) < 0;
+    }
+
+    [[nodiscard]] size_t Hash() const {
+        uint64_t lo, hi;
+        memcpy(&lo, addr_, 8);
+        memcpy(&hi, addr_ + 8, 8);
+        uint64_t h = lo * 0x9E3779B97F4A7C15ULL;
+        h ^= (hi + static_cast<uint64_t>(type_)) * 0xC2B2AE3D27D4EB4FULL;
+        h ^= h >> 29;
+        return static_cast<size_t>(h * 0xBF58476D1CE4E5B9ULL);
+    }
+
   private:
-    AddressType type_;
-    // can be reinterpret_cast to in_addr or in6_addr, network byte order
-    uint8_t addr_[STORAGE_SIZE];
+    AddressType type_ = AddressType::IPv4;
+    // can be reinterpret_cast to in_addr or in6_addr, network byte order. Unused bytes are zero.
+    uint8_t addr_[STORAGE_SIZE]{};
 };
 
-// Remote TCP or UDP endpoint
-class RemoteService {
-    enum class Type {
-        HTTP_URL,
-        TCP_IP_PORT,
-        UDP_IP_PORT,
-        TCP_DOMAIN,
-        UDP_DOMAIN,
-    };
+// IP address and port kept in binary form. Cheap to copy, compare and hash, format it with
+// ToString() only when it is displayed. IPv4-mapped IPv6 addresses are stored as IPv4.
+class Endpoint {
+  public:
+    // BEP-0023 and BEP-0007 compact forms, address then port in network byte order
+    static constexpr size_t COMPACT_IPV4_SIZE = 6;
+    static constexpr size_t COMPACT_IPV6_SIZE = 18;
+
+    Endpoint() = default;
+    Endpoint(const IpAddress& ip, uint16_t port) : port_(port), type_(ip.Type()) {
+        memcpy(addr_, ip.Bytes(), IpAddress::STORAGE_SIZE);
+    }
+
+    static Endpoint FromCompactIpv4(const char* compact) {
+        Endpoint ret;
+        memcpy(ret.addr_, compact, 4);
+        ret.port_ = static_cast<uint16_t>(static_cast<uint8_t>(compact[4]) << 8 |
+                                          static_cast<uint8_t>(compact[5]));
+        return ret;
+    }
+
+    static Endpoint FromCompactIpv6(const char* compact) {
+        static constexpr uint8_t kMappedPrefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+        Endpoint ret;
+        if (memcmp(compact, kMappedPrefix, sizeof(kMappedPrefix)) == 0) {
+            memcpy(ret.addr_, compact + 12, 4);
+        } else {
+            memcpy(ret.addr_, compact, 16);
+            ret.type_ = AddressType::IPv6;
+        }
+        ret.port_ = static_cast<uint16_t>(static_cast<uint8_t>(compact[16]) << 8 |
+                                          static_cast<uint8_t>(compact[17]));
+        return ret;
+    }
+
+    static Result<Endpoint, std::string> FromSockaddr(const sockaddr* addr) {
+        if (addr->sa_family == AF_INET) {
+            const auto* in = reinterpret_cast<const sockaddr_in*>(addr);
+            return Endpoint(IpAddress::FromBe32(in->sin_addr.s_addr), ntohs(in->sin_port));
+        } else if (addr->sa_family == AF_INET6) {
+            const auto* in6 = reinterpret_cast<const sockaddr_in6*>(addr);
+            return Endpoint(IpAddress::FromBe128(in6->sin6_addr.s6_addr), ntohs(in6->sin6_port));
+        }
+        return Err(absl::StrCat("unsupported address family ", addr->sa_family));
+    }
+
+    void ToSockaddr(sockaddr_storage* out) const {
+        *out = {};
+        if (type_ == AddressType::IPv4) {
+            auto* in = reinterpret_cast<sockaddr_in*>(out);
+            in->sin_family = AF_INET;
+            memcpy(&in->sin_addr, addr_, 4);
+            in->sin_port = htons(port_);
+        } else {
+            auto* in6 = reinterpret_cast<sockaddr_in6*>(out);
+            in6->sin6_family = AF_INET6;
+            memcpy(&in6->sin6_addr, addr_, 16);
+            in6->sin6_port = htons(port_);
+        }
+    }
+
+    [[nodiscard]] AddressType Type() const { return type_; }
+    [[nodiscard]] uint16_t Port() const { return port_; }
+    [[nodiscard]] IpAddress Ip() const {
+        if (type_ == AddressType::IPv4) {
+            uint32_t be_ipv4;
+            memcpy(&be_ipv4, addr_, 4);
+            return IpAddress::FromBe32(be_ipv4);
+        }
+        return IpAddress::FromBe128(addr_);
+    }
+    // "a.b.c.d:port" or "[x:x::x]:port"
+    [[nodiscard]] std::string ToString() const {
+        std::string ip = Ip().ToString().Expect("failed to format endpoint");
+        if (type_ == AddressType::IPv6) return absl::StrCat("[", ip, "]:", port_);
+        return absl::StrCat(ip, ":", port_);
+    }
 
-    Type type_;
-    std::string uri_;
-    IpAddress ip_;
-    uint16_t port_;
-    IpAddress local_ip_;
+    bool operator==(const Endpoint& other) const {
+        return type_ == other.type_ && port_ == other.port_ &&
+               memcmp(addr_, other.addr_, sizeof(addr_)) == 0;
+    }
+    bool operator!=(const Endpoint& other) const { return !(*this == other); }
+    // Same order as IpAddress, then by port
+    bool operator<(const Endpoint& other) const {
+        if (type_ != other.type_) return type_ == AddressType::IPv4;
+        int cmp = memcmp(addr_, other.addr_, sizeof(addr_));
+        return cmp != 0 ? cmp < 0 : port_ < other.port_;
+    }
+
+    [[nodiscard]] size_t Hash() const {
+        uint64_t lo, hi;
+        memcpy(&lo, addr_, 8);
+        memcpy(&hi, addr_ + 8, 8);
+        uint64_t h = lo * 0x9E3779B97F4A7C15ULL;
+        h ^= (hi + (static_cast<uint64_t>(port_) << 8 | static_cast<uint64_t>(type_))) *
+             0xC2B2AE3D27D4EB4FULL;
+        h ^= h >> 29;
+        return static_cast<size_t>(h * 0xBF58476D1CE4E5B9ULL);
+    }
+
+  private:
+    uint8_t addr_[IpAddress::STORAGE_SIZE]{};
+    uint16_t port_{};  // host byte order
+    AddressType type_ = AddressType::IPv4;
 };
 
 }  // namespace net
 }  // namespace ryu
 
+template <>
+struct std::hash<ryu::net::IpAddress> {
+    size_t operator()(const ryu::net::IpAddress& ip) const { return ip.Hash(); }
+};
+
+template <>
+struct std::hash<ryu::net::Endpoint> {
+    size_t operator()(const ryu::net::Endpoint& endpoint) const { return endpoint.Hash(); }
+};
+
 #endif  // RYU_NETWORK_H
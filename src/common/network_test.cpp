@@ -4,10 +4,12 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <unordered_set>
 
 #include "result.h"
 
 using ryu::net::AddressType;
+using ryu::net::Endpoint;
 using ryu::net::IpAddress;
 
 #define ASSERT_OK_AND_ASSIGN(lhs, rhs) \
@@ -48,3 +50,47 @@ TEST(NetworkTest, Ipv4InV6Form) {
     EXPECT_EQ(parsed.Type(), AddressType::IPv4);
     EXPECT_EQ(parsed.ToString().Expect(""), "10.0.0.1");
 }
+
+TEST(NetworkTest, Endpoint) {
+    Endpoint v4 = Endpoint::FromCompactIpv4("\x0a\x00\x00\x01\x1a\xe1");
+    EXPECT_EQ(v4.Type(), AddressType::IPv4);
+    EXPECT_EQ(v4.Port(), 6881);
+    EXPECT_EQ(v4.ToString(), "10.0.0.1:6881");
+
+    // v4-mapped addresses compare equal to their IPv4 form
+    const char mapped[] = "\0\0\0\0\0\0\0\0\0\0\xff\xff\x0a\x00\x00\x01\x1a\xe1";
+    EXPECT_EQ(Endpoint::FromCompactIpv6(mapped), v4);
+    EXPECT_EQ(std::hash<Endpoint>()(Endpoint::FromCompactIpv6(mapped)), std::hash<Endpoint>()(v4));
+
+    ASSERT_OK_AND_ASSIGN(auto ip, IpAddress::FromString("fe80::1"));
+    Endpoint v6(ip, 80);
+    EXPECT_EQ(v6.Type(), AddressType::IPv6);
+    EXPECT_EQ(v6.ToString(), "[fe80::1]:80");
+    EXPECT_NE(v6, Endpoint(ip, 81));
+
+    sockaddr_storage storage;
+    v6.ToSockaddr(&storage);
+    ASSERT_OK_AND_ASSIGN(auto back, Endpoint::FromSockaddr(reinterpret_cast<sockaddr*>(&storage)));
+    EXPECT_EQ(back, v6);
+
+    std::unordered_set<Endpoint> set{v4, v6, Endpoint::FromCompactIpv6(mapped)};
+    EXPECT_EQ(set.size(), 2u);
+}
+
+TEST(NetworkTest, CompareAndHash) {
+    ASSERT_OK_AND_ASSIGN(auto a, IpAddress::FromString("10.0.0.1"));
+    ASSERT_OK_AND_ASSIGN(auto b, IpAddress::FromString("::ffff:10.0.0.1"));
+    ASSERT_OK_AND_ASSIGN(auto c, IpAddress::FromString("10.0.0.2"));
+    ASSERT_OK_AND_ASSIGN(auto v6, IpAddress::FromString("::1"));
+    EXPECT_EQ(a, b);
+    EXPECT_EQ(std::hash<IpAddress>()(a), std::hash<IpAddress>()(b));
+    EXPECT_NE(a, c);
+    EXPECT_TRUE(a < c);
+    EXPECT_TRUE(c < v6);
+    EXPECT_FALSE(v6 < a);
+
+    EXPECT_TRUE(Endpoint(a, 80) < Endpoint(a, 81));
+    EXPECT_TRUE(Endpoint(a, 81) < Endpoint(c, 80));
+    EXPECT_TRUE(Endpoint(c, 65535) < Endpoint(v6, 1));
+    EXPECT_FALSE(Endpoint(a, 80) < Endpoint(b, 80));
+}
@@ -0,0 +1,216 @@
+#include "peer_wire.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "absl/strings/str_cat.h"
+
+namespace ryu::net {
+
+namespace {
+
+uint32_t ReadBe32(std::string_view data, size_t pos) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < 4; i++) value = value << 8 | static_cast<uint8_t>(data[pos + i]);
+    return value;
+}
+
+void WriteBe32(char* out, uint32_t value) {
+    for (int i = 3; i >= 0; i--) {
+        out[i] = static_cast<char>(value & 0xff);
+        value >>= 8;
+    }
+}
+
+// Length of the message after the prefix, without variable payload
+size_t FixedSize(PeerMessageType type) {
+    switch (type) {
+        case PeerMessageType::HAVE:
+            return 5;
+        case PeerMessageType::REQUEST:
+        case PeerMessageType::CANCEL:
+            return 13;
+        case PeerMessageType::PIECE:
+            return 9;
+        default:
+            return 1;
+    }
+}
+
+}  // namespace
+
+std::string EncodeHandshake(const PeerHandshake& handshake) {
+    std::string out;
+    out.reserve(kHandshakeSize);
+    out.push_back(static_cast<char>(kPeerProtocol.size()));
+    out.append(kPeerProtocol);
+    out.append(handshake.reserved);
+    out.append(handshake.info_hash);
+    out.append(handshake.peer_id);
+    return out;
+}
+
+Result<PeerHandshake, std::string> ParseHandshake(std::string_view data) {
+    if (static_cast<uint8_t>(data[0]) != kPeerProtocol.size() ||
+        data.substr(1, kPeerProtocol.size()) != kPeerProtocol) {
+        return Err("not a BitTorrent handshake");
+    }
+    data.remove_prefix(1 + kPeerProtocol.size());
+    return PeerHandshake{
+        .reserved = std::string(data.substr(0, 8)),
+        .info_hash = std::string(data.substr(8, 20)),
+        .peer_id = std::string(data.substr(28, 20)),
+    };
+}
+
+PeerFrame EncodeMessage(const PeerMessage& message) {
+    PeerFrame frame;
+    if (message.type == PeerMessageType::KEEPALIVE) {
+        WriteBe32(frame.data.data(), 0);
+        frame.size = 4;
+        return frame;
+    }
+    size_t fixed = FixedSize(message.type);
+    size_t length = fixed;
+    if (message.type == PeerMessageType::BITFIELD) length += message.payload.size();
+    if (message.type == PeerMessageType::PIECE) length += message.length;
+    char* out = frame.data.data();
+    WriteBe32(out, static_cast<uint32_t>(length));
+    out[4] = static_cast<char>(message.type);
+    if (fixed >= 5) WriteBe32(out + 5, message.index);
+    if (fixed >= 9) WriteBe32(out + 9, message.begin);
+    if (fixed >= 13) WriteBe32(out + 13, message.length);
+    frame.size = 4 + fixed;
+    return frame;
+}
+
+PeerWireReader::PeerWireReader(size_t max_message, BlockSink sink)
+    : max_message_(max_message),
+      sink_(std::move(sink)),
+      recv_(4096, std::max(max_message, kHandshakeSize) + RecvBuffer::kFrameHeaderSize) {}
+
+void PeerWireReader::Prepare(uv_buf_t* buf) {
+    if (block_left_ > 0) {
+        buf->base = block_;
+        buf->len = block_left_;
+        return;
+    }
+    recv_.Prepare(buf);
+    std::string_view data = recv_.Data();
+    bool maybe_piece = data.size() < 5 || data[4] == static_cast<char>(PeerMessageType::PIECE);
+    if (streaming_ && skip_ == 0 && data.size() < kPieceHeaderSize && maybe_piece) {
+        buf->len = std::min(buf->len, kPieceHeaderSize - data.size());
+    }
+}
+
+void PeerWireReader::Commit(size_t size) {
+    if (block_left_ == 0) {
+        recv_.Commit(size);
+        return;
+    }
+    block_ += size;
+    block_left_ -= size;
+    if (block_left_ == 0) block_done_ = true;
+}
+
+Result<std::optional<PeerHandshake>, std::string> PeerWireReader::ReadHandshake() {
+    std::string_view data = recv_.Data();
+    if (data.size() < kHandshakeSize) return std::optional<PeerHandshake>();
+    PeerHandshake handshake = VALUE_OR_RAISE(ParseHandshake(data));
+    recv_.Consume(kHandshakeSize);
+    return std::optional<PeerHandshake>(std::move(handshake));
+}
+
+Result<std::optional<PeerMessage>, std::string> PeerWireReader::Next() {
+    if (block_left_ > 0) return std::optional<PeerMessage>();
+    if (block_done_) {
+        block_done_ = false;
+        block_ = nullptr;
+        return std::optional<PeerMessage>(piece_);
+    }
+    while (true) {
+        if (skip_ > 0) {
+            size_t size = std::min(skip_, recv_.size());
+            recv_.Consume(size);
+            skip_ -= size;
+            if (skip_ > 0) return std::optional<PeerMessage>();
+        }
+        std::string_view data = recv_.Data();
+        if (data.size() < 4) return std::optional<PeerMessage>();
+        size_t length = ReadBe32(data, 0);
+        if (length == 0) {
+            recv_.Consume(4);
+            return std::optional<PeerMessage>(PeerMessage{});
+        }
+        if (length > max_message_) {
+            return Err(absl::StrCat("peer message of ", length, " bytes is too long"));
+        }
+        if (data.size() < 5) return std::optional<PeerMessage>();
+        auto type = static_cast<PeerMessageType>(data[4]);
+        streaming_ = type == PeerMessageType::PIECE;
+
+        if (type == PeerMessageType::PIECE) {
+            if (length < FixedSize(type)) return Err("truncated piece message");
+            if (data.size() < kPieceHeaderSize) return std::optional<PeerMessage>();
+            PeerMessage piece{
+                .type = type,
+                .index = ReadBe32(data, 5),
+                .begin = ReadBe32(data, 9),
+                .length = static_cast<uint32_t>(length - FixedSize(type)),
+            };
+            recv_.Consume(kPieceHeaderSize);
+            // whatever came along with the header
+            size_t buffered = std::min<size_t>(recv_.size(), piece.length);
+            char* block = sink_(piece.index, piece.begin, piece.length);
+            if (!block) {
+                recv_.Consume(buffered);
+                skip_ = piece.length - buffered;
+                continue;
+            }
+            memcpy(block, recv_.Data().data(), buffered);
+            recv_.Consume(buffered);
+            if (buffered == piece.length) return std::optional<PeerMessage>(piece);
+            piece_ = piece;
+            block_ = block + buffered;
+            block_left_ = piece.length - buffered;
+            return std::optional<PeerMessage>();
+        }
+
+        if (data.size() < 4 + length) {
+            if (!recv_.Reserve(4 + length)) return Err("peer message does not fit the buffer");
+            return std::optional<PeerMessage>();
+        }
+        PeerMessage message{.type = type};
+        switch (type) {
+            case PeerMessageType::CHOKE:
+            case PeerMessageType::UNCHOKE:
+            case PeerMessageType::INTERESTED:
+            case PeerMessageType::NOT_INTERESTED:
+            case PeerMessageType::HAVE:
+            case PeerMessageType::REQUEST:
+            case PeerMessageType::CANCEL:
+                if (length != FixedSize(type)) {
+                    return Err(absl::StrCat("peer message of type ", static_cast<int>(type),
+                                            " has a bad length: ", length));
+                }
+                if (length >= 5) message.index = ReadBe32(data, 5);
+                if (length >= 13) {
+                    message.begin = ReadBe32(data, 9);
+                    message.length = ReadBe32(data, 13);
+                }
+                break;
+            case PeerMessageType::BITFIELD:
+                message.payload = data.substr(5, length - 1);
+                break;
+            default:
+                // extensions this side didn't announce, e.g. DHT port
+                recv_.Consume(4 + length);
+                continue;
+        }
+        recv_.Consume(4 + length);
+        return std::optional<PeerMessage>(message);
+    }
+}
+
+}  // namespace ryu::net
@@ -0,0 +1,140 @@
+#ifndef RYU_PEER_WIRE_H
+#define RYU_PEER_WIRE_H
+
+#include <uv.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "result.h"
+#include "utils/recv_buffer.h"
+
+namespace ryu {
+namespace net {
+
+// BitTorrent peer wire protocol, BEP 3. Both sides open with a handshake, then every message is
+// a 4 byte big endian length, a type byte and a payload. A length of 0 is a keepalive.
+
+constexpr std::string_view kPeerProtocol = "BitTorrent protocol";
+constexpr size_t kHandshakeSize = 68;
+// Blocks are requested in this size, the last block of the torrent is shorter
+constexpr uint32_t kBlockSize = 16384;
+// Length, type, index and begin of a piece message, the block follows
+constexpr size_t kPieceHeaderSize = 13;
+
+// Values match the wire encoding, but for KEEPALIVE which has no type byte
+enum class PeerMessageType : uint8_t {
+    CHOKE = 0,
+    UNCHOKE = 1,
+    INTERESTED = 2,
+    NOT_INTERESTED = 3,
+    HAVE = 4,
+    BITFIELD = 5,
+    REQUEST = 6,
+    PIECE = 7,
+    CANCEL = 8,
+    KEEPALIVE = 0xff,
+};
+
+struct PeerHandshake {
+    // extension bits, all zero when none is supported
+    std::string reserved = std::string(8, '\0');
+    std::string info_hash;
+    std::string peer_id;
+};
+
+std::string EncodeHandshake(const PeerHandshake& handshake);
+// `data` holds at least kHandshakeSize bytes
+Result<PeerHandshake, std::string> ParseHandshake(std::string_view data);
+
+struct PeerMessage {
+    PeerMessageType type = PeerMessageType::KEEPALIVE;
+    // HAVE, REQUEST, PIECE and CANCEL
+    uint32_t index = 0;
+    // REQUEST, PIECE and CANCEL, `length` is the block size
+    uint32_t begin = 0;
+    uint32_t length = 0;
+    // the bits of a BITFIELD
+    std::string_view payload{};
+};
+
+// A message without its payload, which is at most 17 bytes and encoded on the stack
+struct PeerFrame {
+    std::array<char, 17> data;
+    size_t size = 0;
+    [[nodiscard]] std::string_view View() const { return {data.data(), size}; }
+};
+
+// Everything but the bits of a BITFIELD and the block of a PIECE, which are written right after
+// the frame. The length prefix accounts for them, from `payload.size()` and `length`.
+PeerFrame EncodeMessage(const PeerMessage& message);
+
+// Bitfields hold a bit per piece, the high bit of the first byte is piece 0
+inline bool HasPiece(std::string_view bitfield, size_t index) {
+    return (static_cast<uint8_t>(bitfield[index / 8]) >> (7 - index % 8)) & 1;
+}
+inline void SetPiece(std::string* bitfield, size_t index, bool have = true) {
+    char mask = static_cast<char>(0x80 >> (index % 8));
+    (*bitfield)[index / 8] = static_cast<char>(have ? (*bitfield)[index / 8] | mask
+                                                    : (*bitfield)[index / 8] & ~mask);
+}
+
+// Splits what a peer sends into messages, parsed in place from the receive buffer.
+//
+// The block of a piece message is not buffered. Once the piece header is in, `sink` names where
+// the block goes, and Prepare() hands the rest of that buffer to libuv so the kernel copies the
+// payload straight into it. Only payload bytes that arrived in the same read as the header are
+// copied, once, out of the receive buffer. To keep those few, reads stop at the end of the next
+// piece header while pieces stream in. Blocks `sink` doesn't want, e.g. cancelled ones, are read
+// and dropped.
+class PeerWireReader {
+  public:
+    // The buffer the block of a piece message goes to, null to drop it. Must stay valid until
+    // Next() returned the piece.
+    using BlockSink = std::function<char*(uint32_t index, uint32_t begin, uint32_t length)>;
+
+    // Messages longer than `max_message` are an error, the length of a piece counts its block
+    PeerWireReader(size_t max_message, BlockSink sink);
+    PeerWireReader(const PeerWireReader&) = delete;
+    PeerWireReader& operator=(const PeerWireReader&) = delete;
+
+    // For the alloc callback, an empty buffer once a message doesn't fit
+    void Prepare(uv_buf_t* buf);
+    // For the read callback, `size` bytes were read into what Prepare() handed out
+    void Commit(size_t size);
+
+    // The handshake once kHandshakeSize bytes are in, must come before any Next()
+    Result<std::optional<PeerHandshake>, std::string> ReadHandshake();
+    // The next complete message, nullopt until more is read. A piece is returned once its whole
+    // block landed, without payload. A bitfield's payload points into the receive buffer until
+    // the next Prepare(). Messages of unknown types are skipped.
+    Result<std::optional<PeerMessage>, std::string> Next();
+
+    // Bytes buffered or expected for the current block
+    [[nodiscard]] size_t Pending() const { return recv_.size() + block_left_ + skip_; }
+
+  private:
+    const size_t max_message_;
+    const BlockSink sink_;
+    RecvBuffer recv_;
+    // the piece whose block is being read
+    PeerMessage piece_;
+    char* block_ = nullptr;
+    size_t block_left_ = 0;
+    // the whole block of `piece_` is in
+    bool block_done_ = false;
+    // bytes of a dropped block not read yet
+    size_t skip_ = 0;
+    // the last message was a piece, the next one likely is too
+    bool streaming_ = false;
+};
+
+}  // namespace net
+}  // namespace ryu
+
+#endif  // RYU_PEER_WIRE_H
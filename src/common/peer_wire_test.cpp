@@ -0,0 +1,212 @@
+#include "peer_wire.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace ryu::net;
+
+namespace {
+
+std::string Encode(const PeerMessage& message, std::string_view payload = {}) {
+    return std::string(EncodeMessage(message).View()).append(payload);
+}
+
+class PeerWireReaderTest : public ::testing::Test {
+  protected:
+    PeerWireReaderTest()
+        : reader_(9 + kBlockSize, [this](uint32_t index, uint32_t begin, uint32_t length) {
+              sunk_.push_back({.type = PeerMessageType::PIECE,
+                               .index = index, .begin = begin, .length = length});
+              return index == 1 ? block_.data() : nullptr;
+          }) {}
+
+    // Feed `data` through the reader in reads of at most `chunk` bytes, as libuv would
+    void Feed(std::string_view data, size_t chunk = 65536) {
+        while (!data.empty()) {
+            uv_buf_t buf;
+            reader_.Prepare(&buf);
+            ASSERT_GT(buf.len, 0u);
+            size_t size = std::min({data.size(), buf.len, chunk});
+            if (buf.base >= block_.data() && buf.base < block_.data() + block_.size()) {
+                direct_ += size;
+            }
+            memcpy(buf.base, data.data(), size);
+            reader_.Commit(size);
+            data.remove_prefix(size);
+            Drain();
+        }
+    }
+
+    void Drain() {
+        while (true) {
+            auto message = reader_.Next();
+            ASSERT_TRUE(message.Ok()) << message.Error();
+            if (!message.Value()) return;
+            messages_.push_back(*message.Value());
+            if (messages_.back().type == PeerMessageType::BITFIELD) {
+                bitfields_.emplace_back(messages_.back().payload);
+            }
+        }
+    }
+
+    std::string block_ = std::string(kBlockSize, '\0');
+    PeerWireReader reader_;
+    std::vector<PeerMessage> sunk_;
+    std::vector<PeerMessage> messages_;
+    std::vector<std::string> bitfields_;
+    // payload bytes the kernel would have written into the block itself
+    size_t direct_ = 0;
+};
+
+TEST(PeerWireTest, Handshake) {
+    PeerHandshake handshake{
+        .info_hash = std::string(20, 'h'),
+        .peer_id = "-RY0000-0123456789ab",
+    };
+    std::string encoded = EncodeHandshake(handshake);
+    ASSERT_EQ(kHandshakeSize, encoded.size());
+    EXPECT_EQ('\x13', encoded[0]);
+
+    auto parsed = ParseHandshake(encoded);
+    ASSERT_TRUE(parsed.Ok());
+    EXPECT_EQ(handshake.info_hash, parsed.Value().info_hash);
+    EXPECT_EQ(handshake.peer_id, parsed.Value().peer_id);
+    EXPECT_EQ(std::string(8, '\0'), parsed.Value().reserved);
+
+    encoded[5] = 'X';
+    EXPECT_FALSE(ParseHandshake(encoded).Ok());
+}
+
+TEST(PeerWireTest, EncodeMessage) {
+    EXPECT_EQ(std::string("\0\0\0\0", 4), Encode({}));
+    EXPECT_EQ(std::string("\0\0\0\1\2", 5), Encode({.type = PeerMessageType::INTERESTED}));
+    EXPECT_EQ(std::string("\0\0\0\5\4\0\0\1\2", 9),
+              Encode({.type = PeerMessageType::HAVE, .index = 0x102}));
+    EXPECT_EQ(std::string("\0\0\0\x0d\6\0\0\0\1\0\0\x40\0\0\0\x40\0", 17),
+              Encode({.type = PeerMessageType::REQUEST,
+                      .index = 1, .begin = 0x4000, .length = 0x4000}));
+    EXPECT_EQ(std::string("\0\0\0\3\5\xff\x80", 7),
+              Encode({.type = PeerMessageType::BITFIELD, .payload = "\xff\x80"}, "\xff\x80"));
+    // the block is written separately
+    EXPECT_EQ(std::string("\0\0\x40\x09\7\0\0\0\1\0\0\0\0", 13),
+              Encode({.type = PeerMessageType::PIECE, .index = 1, .length = kBlockSize}));
+}
+
+TEST(PeerWireTest, Bitfield) {
+    std::string bitfield(2, '\0');
+    SetPiece(&bitfield, 0);
+    SetPiece(&bitfield, 9);
+    EXPECT_EQ(std::string("\x80\x40", 2), bitfield);
+    EXPECT_TRUE(HasPiece(bitfield, 9));
+    SetPiece(&bitfield, 9, false);
+    EXPECT_FALSE(HasPiece(bitfield, 9));
+    EXPECT_TRUE(HasPiece(bitfield, 0));
+}
+
+TEST_F(PeerWireReaderTest, HandshakeThenMessages) {
+    std::string stream = EncodeHandshake({.info_hash = std::string(20, 'h'),
+                                          .peer_id = std::string(20, 'p')});
+    stream += Encode({.type = PeerMessageType::BITFIELD, .payload = "\xa0"}, "\xa0");
+    stream += Encode({.type = PeerMessageType::UNCHOKE});
+    stream += Encode({});
+    stream += Encode({.type = PeerMessageType::HAVE, .index = 7});
+    // a DHT port message, skipped
+    stream += std::string("\0\0\0\3\x09\x1a\xe1", 7);
+    stream += Encode({.type = PeerMessageType::CANCEL, .index = 2, .begin = 16384, .length = 5});
+
+    // byte by byte first
+    uv_buf_t buf;
+    for (size_t i = 0; i < kHandshakeSize; i++) {
+        auto handshake = reader_.ReadHandshake();
+        ASSERT_TRUE(handshake.Ok());
+        ASSERT_FALSE(handshake.Value());
+        reader_.Prepare(&buf);
+        buf.base[0] = stream[i];
+        reader_.Commit(1);
+    }
+    auto handshake = reader_.ReadHandshake();
+    ASSERT_TRUE(handshake.Ok());
+    ASSERT_TRUE(handshake.Value());
+    EXPECT_EQ(std::string(20, 'p'), handshake.Value()->peer_id);
+    Feed(std::string_view(stream).substr(kHandshakeSize), 3);
+
+    ASSERT_EQ(5u, messages_.size());
+    EXPECT_EQ(PeerMessageType::BITFIELD, messages_[0].type);
+    EXPECT_EQ(std::vector<std::string>{"\xa0"}, bitfields_);
+    EXPECT_EQ(PeerMessageType::UNCHOKE, messages_[1].type);
+    EXPECT_EQ(PeerMessageType::KEEPALIVE, messages_[2].type);
+    EXPECT_EQ(PeerMessageType::HAVE, messages_[3].type);
+    EXPECT_EQ(7u, messages_[3].index);
+    EXPECT_EQ(PeerMessageType::CANCEL, messages_[4].type);
+    EXPECT_EQ(2u, messages_[4].index);
+    EXPECT_EQ(16384u, messages_[4].begin);
+    EXPECT_EQ(5u, messages_[4].length);
+    EXPECT_EQ(0u, reader_.Pending());
+}
+
+TEST_F(PeerWireReaderTest, PieceLandsInBlock) {
+    std::string payload(kBlockSize, '\0');
+    for (size_t i = 0; i < payload.size(); i++) payload[i] = static_cast<char>(i * 7);
+    std::string stream = Encode({.type = PeerMessageType::UNCHOKE});
+    for (int i = 0; i < 2; i++) {
+        stream += Encode({.type = PeerMessageType::PIECE, .index = 1, .begin = 0x4000,
+                          .length = kBlockSize});
+        stream += payload;
+    }
+    stream += Encode({.type = PeerMessageType::HAVE, .index = 3});
+    Feed(stream);
+
+    ASSERT_EQ(4u, messages_.size());
+    EXPECT_EQ(PeerMessageType::UNCHOKE, messages_[0].type);
+    for (int i = 1; i <= 2; i++) {
+        EXPECT_EQ(PeerMessageType::PIECE, messages_[i].type);
+        EXPECT_EQ(1u, messages_[i].index);
+        EXPECT_EQ(0x4000u, messages_[i].begin);
+        EXPECT_EQ(kBlockSize, messages_[i].length);
+        EXPECT_TRUE(messages_[i].payload.empty());
+    }
+    EXPECT_EQ(PeerMessageType::HAVE, messages_[3].type);
+    EXPECT_EQ(2u, sunk_.size());
+    EXPECT_EQ(payload, block_);
+    // the first block came with the unchoke in one read, the second one was read on its own
+    // after its header
+    EXPECT_EQ(2 * kBlockSize - (4096 - 5 - kPieceHeaderSize), direct_);
+}
+
+TEST_F(PeerWireReaderTest, DropsUnwantedBlocks) {
+    std::string stream;
+    stream += Encode({.type = PeerMessageType::PIECE, .index = 2, .length = kBlockSize});
+    stream += std::string(kBlockSize, 'x');
+    stream += Encode({.type = PeerMessageType::PIECE, .index = 1, .length = 4});
+    stream += "abcd";
+    Feed(stream, 1000);
+
+    ASSERT_EQ(1u, messages_.size());
+    EXPECT_EQ(1u, messages_[0].index);
+    EXPECT_EQ(4u, messages_[0].length);
+    EXPECT_EQ("abcd", block_.substr(0, 4));
+    EXPECT_EQ(0u, direct_);
+}
+
+TEST_F(PeerWireReaderTest, RejectsBadMessages) {
+    uv_buf_t buf;
+    // too long for a block
+    std::string stream = Encode({.type = PeerMessageType::PIECE, .length = 2 * kBlockSize});
+    reader_.Prepare(&buf);
+    memcpy(buf.base, stream.data(), stream.size());
+    reader_.Commit(stream.size());
+    EXPECT_FALSE(reader_.Next().Ok());
+
+    PeerWireReader reader(100, nullptr);
+    stream = std::string("\0\0\0\2\4\0", 6);
+    reader.Prepare(&buf);
+    memcpy(buf.base, stream.data(), stream.size());
+    reader.Commit(stream.size());
+    EXPECT_FALSE(reader.Next().Ok());
+}
+
+}  // namespace
@@ -0,0 +1,242 @@
+#include "common/resolver.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/strip.h"
+#include "utils/uv_callbacks.h"
+
+namespace ryu::net {
+
+Resolver::Resolver(uv_loop_t* loop, Options options) : loop_(loop), options_(options) {}
+
+Resolver::RequestId Resolver::Resolve(const std::string& host, Callback cb) {
+    if (draining_) {
+        cb(Err("resolver halted"));
+        return 0;
+    }
+    if (auto ip = IpAddress::FromString(host); ip.Ok()) {
+        cb(std::vector<IpAddress>{ip.Value()});
+        return 0;
+    }
+
+    auto cached = cache_.find(host);
+    if (cached != cache_.end()) {
+        if (cached->second.expire_ms > uv_now(loop_)) {
+            if (!cached->second.error.empty()) {
+                stats_.negative_hits++;
+                cb(Err(cached->second.error));
+            } else {
+                stats_.hits++;
+                cb(cached->second.addresses);
+            }
+            return 0;
+        }
+        cache_.erase(cached);
+    }
+
+    RequestId id = next_id_++;
+    auto lookup = lookups_.find(host);
+    if (lookup != lookups_.end()) {
+        stats_.coalesced++;
+        lookup->second->waiters.emplace_back(id, std::move(cb));
+        requests_[id] = host;
+        return id;
+    }
+
+    auto req = std::make_unique<Lookup>();
+    req->data = this;
+    req->host = host;
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    // one entry per address instead of one per socket type
+    hints.ai_socktype = SOCK_STREAM;
+    int retcode =
+        uv_getaddrinfo(loop_, req.get(), uv_callbacks::GetAddrInfo<&Resolver::HostResolved>,
+                       req->host.c_str(), nullptr, &hints);
+    if (retcode) {
+        cb(Err(absl::StrCat("failed to resolve ", host, ": ", uv_strerror(retcode))));
+        return 0;
+    }
+    stats_.lookups++;
+    req->waiters.emplace_back(id, std::move(cb));
+    requests_[id] = host;
+    lookups_[host] = std::move(req);
+    return id;
+}
+
+void Resolver::Cancel(RequestId id) {
+    auto request = requests_.find(id);
+    if (request == requests_.end()) return;
+    auto& waiters = lookups_.at(request->second)->waiters;
+    waiters.erase(std::find_if(waiters.begin(), waiters.end(),
+                               [id](const auto& waiter) { return waiter.first == id; }));
+    requests_.erase(request);
+}
+
+void Resolver::Halt(std::function<void()> on_closed) {
+    if (draining_) return;
+    draining_ = true;
+    on_closed_ = std::move(on_closed);
+
+    for (auto& [host, lookup] : lookups_) {
+        uv_cancel(reinterpret_cast<uv_req_t*>(lookup.get()));
+    }
+    // callbacks may cancel other requests, forget them all first
+    std::vector<Callback> callbacks;
+    for (auto& [host, lookup] : lookups_) {
+        for (auto& [id, cb] : lookup->waiters) callbacks.push_back(std::move(cb));
+        lookup->waiters.clear();
+    }
+    requests_.clear();
+    for (auto& cb : callbacks) cb(Err("resolver halted"));
+    CheckHalted();
+}
+
+void Resolver::CheckHalted() {
+    if (!draining_ || !lookups_.empty()) return;
+    auto cb = std::move(on_closed_);
+    on_closed_ = nullptr;
+    // may delete this
+    if (cb) cb();
+}
+
+void Resolver::HostResolved(uv_getaddrinfo_t* req, int status, addrinfo* res) {
+    auto* lookup = static_cast<Lookup*>(req);
+    auto owned = std::move(lookups_.at(lookup->host));
+    lookups_.erase(lookup->host);
+
+    Entry entry;
+    if (status == 0) {
+        for (addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+            auto endpoint = Endpoint::FromSockaddr(ai->ai_addr);
+            if (!endpoint) continue;
+            IpAddress ip = endpoint.Value().Ip();
+            if (std::find(entry.addresses.begin(), entry.addresses.end(), ip) ==
+                entry.addresses.end()) {
+                entry.addresses.push_back(ip);
+            }
+        }
+        uv_freeaddrinfo(res);
+        if (entry.addresses.empty()) status = UV_EAI_NODATA;
+    }
+    if (status == UV_ECANCELED || draining_) return CheckHalted();
+
+    if (status != 0) {
+        entry.error = absl::StrCat("failed to resolve ", owned->host, ": ", uv_strerror(status));
+        entry.expire_ms = uv_now(loop_) + options_.negative_ttl_ms;
+    } else {
+        entry.expire_ms = uv_now(loop_) + options_.positive_ttl_ms;
+    }
+    Store(owned->host, entry);
+
+    for (auto& [id, cb] : owned->waiters) requests_.erase(id);
+    for (auto& [id, cb] : owned->waiters) {
+        if (entry.error.empty()) {
+            cb(entry.addresses);
+        } else {
+            cb(Err(entry.error));
+        }
+    }
+}
+
+void Resolver::Store(const std::string& host, Entry entry) {
+    if (options_.max_entries == 0) return;
+    if (cache_.size() >= options_.max_entries) {
+        uint64_t now = uv_now(loop_);
+        for (auto iter = cache_.begin(); iter != cache_.end();) {
+            iter = iter->second.expire_ms <= now ? cache_.erase(iter) : std::next(iter);
+        }
+        // nothing expired, drop the entry closest to expiring
+        if (cache_.size() >= options_.max_entries) {
+            cache_.erase(std::min_element(cache_.begin(), cache_.end(), [](auto& a, auto& b) {
+                return a.second.expire_ms < b.second.expire_ms;
+            }));
+        }
+    }
+    cache_[host] = std::move(entry);
+}
+
+RemoteService::RemoteService(Type type, std::string uri, std::string host, uint16_t port)
+    : type_(type), uri_(std::move(uri)), host_(std::move(host)), port_(port) {
+    if (auto ip = IpAddress::FromString(host_); ip.Ok()) ip_ = ip.Value();
+}
+
+Result<RemoteService, std::string> RemoteService::FromUrl(absl::string_view url) {
+    absl::string_view rest = url;
+    Type type;
+    uint16_t port;
+    if (absl::ConsumePrefix(&rest, "http://")) {
+        type = Type::HTTP_URL;
+        port = 80;
+    } else if (absl::ConsumePrefix(&rest, "https://")) {
+        type = Type::HTTP_URL;
+        port = 443;
+    } else if (absl::ConsumePrefix(&rest, "udp://")) {
+        type = Type::UDP_DOMAIN;
+        port = 0;
+    } else {
+        return Err(absl::StrCat("unsupported url: ", url));
+    }
+    rest = rest.substr(0, rest.find_first_of("/?#"));
+    // drop userinfo
+    if (size_t at = rest.rfind('@'); at != absl::string_view::npos) rest.remove_prefix(at + 1);
+
+    absl::string_view host, port_str;
+    if (absl::ConsumePrefix(&rest, "[")) {
+        size_t end = rest.find(']');
+        if (end == absl::string_view::npos) return Err(absl::StrCat("missing `]` in url: ", url));
+        host = rest.substr(0, end);
+        rest.remove_prefix(end + 1);
+        if (absl::ConsumePrefix(&rest, ":")) port_str = rest;
+    } else {
+        size_t colon = rest.rfind(':');
+        host = rest.substr(0, colon);
+        if (colon != absl::string_view::npos) port_str = rest.substr(colon + 1);
+    }
+    if (!port_str.empty()) {
+        uint32_t port_num;
+        if (!absl::SimpleAtoi(port_str, &port_num) || port_num == 0 || port_num > 65535)
+            return Err(absl::StrCat("invalid port in url: ", url));
+        port = port_num;
+    }
+    if (host.empty() || port == 0) return Err(absl::StrCat("invalid host or port in url: ", url));
+
+    RemoteService service(type, std::string(url), std::string(host), port);
+    if (type == Type::UDP_DOMAIN && service.IsResolved()) service.type_ = Type::UDP_IP_PORT;
+    return service;
+}
+
+RemoteService RemoteService::Tcp(std::string host, uint16_t port) {
+    std::string uri = absl::StrCat("tcp://", host, ":", port);
+    RemoteService service(Type::TCP_DOMAIN, std::move(uri), std::move(host), port);
+    if (service.IsResolved()) service.type_ = Type::TCP_IP_PORT;
+    return service;
+}
+
+RemoteService RemoteService::Udp(std::string host, uint16_t port) {
+    std::string uri = absl::StrCat("udp://", host, ":", port);
+    RemoteService service(Type::UDP_DOMAIN, std::move(uri), std::move(host), port);
+    if (service.IsResolved()) service.type_ = Type::UDP_IP_PORT;
+    return service;
+}
+
+Resolver::RequestId RemoteService::Resolve(Resolver* resolver, Callback cb) const {
+    if (ip_) {
+        cb(std::vector<Endpoint>{Endpoint(*ip_, port_)});
+        return 0;
+    }
+    uint16_t port = port_;
+    return resolver->Resolve(
+        host_, [port, cb = std::move(cb)](Result<std::vector<IpAddress>, std::string> ips) {
+            if (!ips) return cb(Err(ips.Error()));
+            std::vector<Endpoint> endpoints;
+            endpoints.reserve(ips.Value().size());
+            for (const auto& ip : ips.Value()) endpoints.emplace_back(ip, port);
+            cb(std::move(endpoints));
+        });
+}
+
+}  // namespace ryu::net
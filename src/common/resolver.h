@@ -0,0 +1,141 @@
+#ifndef RYU_RESOLVER_H
+#define RYU_RESOLVER_H
+
+#include <uv.h>
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "common/network.h"
+#include "result.h"
+
+namespace ryu {
+namespace net {
+
+// Host name lookups on the libuv threadpool, shared by everything running on one loop.
+//
+// Answers are cached, failures too, so neither an announce nor a retry of an unknown host ends
+// up in getaddrinfo() again before the entry expires. getaddrinfo() does not expose record TTLs,
+// so entries live for the configured times. Concurrent lookups of one host share a single
+// getaddrinfo() call. Not thread safe, use it from the loop thread only.
+class Resolver {
+  public:
+    struct Options {
+        uint64_t positive_ttl_ms = 300000;
+        uint64_t negative_ttl_ms = 30000;
+        size_t max_entries = 4096;
+    };
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t negative_hits = 0;
+        uint64_t lookups = 0;
+        // requests that joined a lookup already in flight
+        uint64_t coalesced = 0;
+    };
+
+    // Addresses in getaddrinfo() order without duplicates, never empty on success
+    using Callback = std::function<void(Result<std::vector<IpAddress>, std::string>)>;
+    // 0 for requests answered before Resolve() returned
+    using RequestId = uint64_t;
+
+    Resolver(uv_loop_t* loop, Options options);
+    explicit Resolver(uv_loop_t* loop) : Resolver(loop, Options{}) {}
+    Resolver(const Resolver&) = delete;
+    Resolver& operator=(const Resolver&) = delete;
+
+    // IP literals and cached hosts call `cb` before returning. Otherwise `cb` is called from the
+    // loop once the lookup finishes, unless the request is cancelled first.
+    RequestId Resolve(const std::string& host, Callback cb);
+    // `cb` of the request will not be called. The lookup itself still completes and is cached.
+    void Cancel(RequestId id);
+    // Fail every pending request and cancel the lookups, `on_closed` is called once the resolver
+    // can be destroyed
+    void Halt(std::function<void()> on_closed);
+
+    [[nodiscard]] size_t CacheSize() const { return cache_.size(); }
+    [[nodiscard]] const Stats& GetStats() const { return stats_; }
+
+    // UV callbacks
+    void HostResolved(uv_getaddrinfo_t* req, int status, addrinfo* res);
+
+  private:
+    struct Entry {
+        std::vector<IpAddress> addresses;
+        // set for negative entries
+        std::string error;
+        uint64_t expire_ms = 0;
+    };
+
+    struct Lookup : public uv_getaddrinfo_t {
+        std::string host;
+        std::vector<std::pair<RequestId, Callback>> waiters;
+    };
+
+    void Store(const std::string& host, Entry entry);
+    void CheckHalted();
+
+    uv_loop_t* const loop_;
+    const Options options_;
+    Stats stats_;
+
+    std::unordered_map<std::string, Entry> cache_;
+    // in-flight lookups by host
+    std::unordered_map<std::string, std::unique_ptr<Lookup>> lookups_;
+    // request id -> host of its lookup
+    std::unordered_map<RequestId, std::string> requests_;
+    RequestId next_id_ = 1;
+
+    bool draining_ = false;
+    std::function<void()> on_closed_;
+};
+
+// Remote TCP or UDP endpoint, by address or by name
+class RemoteService {
+  public:
+    enum class Type {
+        HTTP_URL,
+        TCP_IP_PORT,
+        UDP_IP_PORT,
+        TCP_DOMAIN,
+        UDP_DOMAIN,
+    };
+
+    using Callback = std::function<void(Result<std::vector<Endpoint>, std::string>)>;
+
+    // http://, https:// or udp:// url. The host may be a bracketed IPv6 literal, the port
+    // defaults to the one of the scheme.
+    static Result<RemoteService, std::string> FromUrl(absl::string_view url);
+    static RemoteService Tcp(std::string host, uint16_t port);
+    static RemoteService Udp(std::string host, uint16_t port);
+
+    [[nodiscard]] Type GetType() const { return type_; }
+    [[nodiscard]] const std::string& Uri() const { return uri_; }
+    [[nodiscard]] const std::string& Host() const { return host_; }
+    [[nodiscard]] uint16_t Port() const { return port_; }
+    // Host is an IP literal, Resolve() completes immediately
+    [[nodiscard]] bool IsResolved() const { return ip_.has_value(); }
+
+    // Endpoints of the service, see Resolver::Resolve()
+    Resolver::RequestId Resolve(Resolver* resolver, Callback cb) const;
+
+  private:
+    RemoteService(Type type, std::string uri, std::string host, uint16_t port);
+
+    Type type_;
+    std::string uri_;
+    std::string host_;
+    uint16_t port_;
+    std::optional<IpAddress> ip_;
+};
+
+}  // namespace net
+}  // namespace ryu
+
+#endif  // RYU_RESOLVER_H
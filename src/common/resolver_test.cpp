@@ -0,0 +1,130 @@
+#include "resolver.h"
+
+#include <gtest/gtest.h>
+
+#include <optional>
+#include <string>
+#include <vector>
+
+using namespace ryu::net;
+
+namespace {
+
+using Addresses = Result<std::vector<IpAddress>, std::string>;
+
+class ResolverTest : public ::testing::Test {
+  protected:
+    void SetUp() override { uv_loop_init(&loop_); }
+    void TearDown() override { EXPECT_EQ(0, uv_loop_close(&loop_)); }
+
+    template <typename Pred>
+    bool RunUntil(Pred pred) {
+        for (int i = 0; i < 1000 && !pred(); i++) uv_run(&loop_, UV_RUN_ONCE);
+        return pred();
+    }
+
+    void Shutdown(Resolver* resolver) {
+        bool closed = false;
+        resolver->Halt([&] { closed = true; });
+        ASSERT_TRUE(RunUntil([&] { return closed; }));
+        uv_run(&loop_, UV_RUN_DEFAULT);
+    }
+
+    uv_loop_t loop_;
+};
+
+TEST_F(ResolverTest, IpLiteral) {
+    Resolver resolver(&loop_);
+    std::optional<Addresses> result;
+    EXPECT_EQ(0u, resolver.Resolve("::1", [&](Addresses r) { result = r; }));
+    ASSERT_TRUE(result && result->Ok());
+    EXPECT_EQ("::1", result->Value().at(0).ToString().Expect(""));
+    EXPECT_EQ(0u, resolver.GetStats().lookups);
+    Shutdown(&resolver);
+}
+
+TEST_F(ResolverTest, CoalescesAndCaches) {
+    Resolver resolver(&loop_);
+    std::optional<Addresses> first, second, third, cancelled;
+    EXPECT_NE(0u, resolver.Resolve("localhost", [&](Addresses r) { first = r; }));
+    EXPECT_NE(0u, resolver.Resolve("localhost", [&](Addresses r) { second = r; }));
+    resolver.Cancel(resolver.Resolve("localhost", [&](Addresses r) { cancelled = r; }));
+    ASSERT_TRUE(RunUntil([&] { return first && second; }));
+    EXPECT_FALSE(cancelled);
+    ASSERT_TRUE(first->Ok()) << first->Error();
+    EXPECT_FALSE(first->Value().empty());
+    EXPECT_EQ(1u, resolver.GetStats().lookups);
+    EXPECT_EQ(2u, resolver.GetStats().coalesced);
+
+    // answered from the cache
+    EXPECT_EQ(0u, resolver.Resolve("localhost", [&](Addresses r) { third = r; }));
+    ASSERT_TRUE(third && third->Ok());
+    EXPECT_EQ(first->Value(), third->Value());
+    EXPECT_EQ(1u, resolver.GetStats().hits);
+    Shutdown(&resolver);
+}
+
+TEST_F(ResolverTest, NegativeCacheExpires) {
+    Resolver resolver(&loop_, {.negative_ttl_ms = 10});
+    std::optional<Addresses> first, second, third;
+    resolver.Resolve("nonexistent.invalid", [&](Addresses r) { first = r; });
+    ASSERT_TRUE(RunUntil([&] { return first.has_value(); }));
+    EXPECT_FALSE(first->Ok());
+
+    resolver.Resolve("nonexistent.invalid", [&](Addresses r) { second = r; });
+    ASSERT_TRUE(second && !second->Ok());
+    EXPECT_EQ(1u, resolver.GetStats().negative_hits);
+
+    uv_sleep(20);
+    uv_update_time(&loop_);
+    resolver.Resolve("nonexistent.invalid", [&](Addresses r) { third = r; });
+    ASSERT_TRUE(RunUntil([&] { return third.has_value(); }));
+    EXPECT_EQ(2u, resolver.GetStats().lookups);
+    Shutdown(&resolver);
+}
+
+TEST_F(ResolverTest, HaltFailsPending) {
+    Resolver resolver(&loop_);
+    std::optional<Addresses> result;
+    resolver.Resolve("localhost", [&](Addresses r) { result = r; });
+    Shutdown(&resolver);
+    ASSERT_TRUE(result.has_value());
+    EXPECT_FALSE(result->Ok());
+}
+
+TEST(RemoteServiceTest, FromUrl) {
+    auto http = RemoteService::FromUrl("http://tracker.example.org/announce");
+    ASSERT_TRUE(http.Ok());
+    EXPECT_EQ(RemoteService::Type::HTTP_URL, http.Value().GetType());
+    EXPECT_EQ("tracker.example.org", http.Value().Host());
+    EXPECT_EQ(80, http.Value().Port());
+    EXPECT_FALSE(http.Value().IsResolved());
+
+    auto https = RemoteService::FromUrl("https://user@tracker.example.org:8443/a?b=c");
+    ASSERT_TRUE(https.Ok());
+    EXPECT_EQ("tracker.example.org", https.Value().Host());
+    EXPECT_EQ(8443, https.Value().Port());
+
+    auto udp = RemoteService::FromUrl("udp://[::1]:6969/announce");
+    ASSERT_TRUE(udp.Ok());
+    EXPECT_EQ(RemoteService::Type::UDP_IP_PORT, udp.Value().GetType());
+    EXPECT_EQ("::1", udp.Value().Host());
+    EXPECT_TRUE(udp.Value().IsResolved());
+
+    EXPECT_EQ(RemoteService::Type::UDP_DOMAIN,
+              RemoteService::FromUrl("udp://tracker.example.org:80").Value().GetType());
+    EXPECT_FALSE(RemoteService::FromUrl("udp://tracker.example.org/announce").Ok());
+    EXPECT_FALSE(RemoteService::FromUrl("ws://tracker.example.org").Ok());
+    EXPECT_EQ(RemoteService::Type::TCP_IP_PORT, RemoteService::Tcp("10.0.0.1", 1).GetType());
+    EXPECT_EQ(RemoteService::Type::TCP_DOMAIN, RemoteService::Tcp("example.org", 1).GetType());
+}
+
+TEST(RemoteServiceTest, ResolveLiteral) {
+    auto service = RemoteService::Udp("10.0.0.1", 6969);
+    std::optional<Result<std::vector<Endpoint>, std::string>> result;
+    service.Resolve(nullptr, [&](auto r) { result = r; });
+    ASSERT_TRUE(result && result->Ok());
+    EXPECT_EQ("10.0.0.1:6969", result->Value().at(0).ToString());
+}
+
+}  // namespace
@@ -0,0 +1,1165 @@
+#include "common/utp.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cassert>
+#include <deque>
+#include <random>
+
+#include "absl/strings/str_cat.h"
+#include "utils/uv_callbacks.h"
+
+namespace ryu::net {
+
+namespace {
+
+constexpr size_t kHeaderSize = 20;
+constexpr uint8_t kVersion = 1;
+constexpr uint8_t kSelectiveAck = 1;
+// SACK bitmask covers ack_nr + 2 onwards, 32 bytes at most
+constexpr size_t kMaxSackBytes = 32;
+
+// packets sent and not yet acknowledged
+constexpr size_t kMaxOutstanding = 1024;
+// how far ahead of ack_nr a packet may be and still be buffered
+constexpr uint16_t kReorderLimit = 1024;
+constexpr int kDupAckLimit = 3;
+
+constexpr uint64_t kInitialRtoUs = 1'000'000;
+constexpr uint64_t kMinRtoUs = 500'000;
+constexpr uint64_t kMaxRtoUs = 60'000'000;
+// sends this much ahead of the pacing schedule are fine, the timer has 1ms resolution
+constexpr uint64_t kPacingSlackUs = 1000;
+// a closed receive window is probed with one packet this often, in case its update got lost
+constexpr uint64_t kZeroWindowProbeUs = 1'000'000;
+// the MTU search stops once floor and ceiling are this close
+constexpr size_t kMtuSearchDone = 16;
+// the base delay is the lowest delay seen over the last two minutes
+constexpr uint64_t kBaseDelayBucketUs = 60'000'000;
+
+enum PacketType : uint8_t { ST_DATA = 0, ST_FIN = 1, ST_STATE = 2, ST_RESET = 3, ST_SYN = 4 };
+
+struct Header {
+    uint8_t type = 0;
+    uint16_t conn_id = 0;
+    uint32_t timestamp_us = 0;
+    uint32_t timestamp_diff_us = 0;
+    uint32_t wnd_size = 0;
+    uint16_t seq_nr = 0;
+    uint16_t ack_nr = 0;
+};
+
+uint16_t GetU16(const char* p) {
+    return static_cast<uint16_t>(static_cast<uint8_t>(p[0]) << 8 | static_cast<uint8_t>(p[1]));
+}
+
+uint32_t GetU32(const char* p) {
+    return static_cast<uint32_t>(GetU16(p)) << 16 | GetU16(p + 2);
+}
+
+void PutU16(std::string* out, uint16_t v) {
+    out->push_back(static_cast<char>(v >> 8));
+    out->push_back(static_cast<char>(v));
+}
+
+void PutU32(std::string* out, uint32_t v) {
+    PutU16(out, static_cast<uint16_t>(v >> 16));
+    PutU16(out, static_cast<uint16_t>(v));
+}
+
+// Header, the SACK extension if any and the payload
+bool ParsePacket(const char* data, size_t len, Header* header, std::string_view* sack,
+                 std::string_view* payload) {
+    if (len < kHeaderSize) return false;
+    uint8_t type_ver = static_cast<uint8_t>(data[0]);
+    if ((type_ver & 0xf) != kVersion || (type_ver >> 4) > ST_SYN) return false;
+    header->type = type_ver >> 4;
+    uint8_t extension = static_cast<uint8_t>(data[1]);
+    header->conn_id = GetU16(data + 2);
+    header->timestamp_us = GetU32(data + 4);
+    header->timestamp_diff_us = GetU32(data + 8);
+    header->wnd_size = GetU32(data + 12);
+    header->seq_nr = GetU16(data + 16);
+    header->ack_nr = GetU16(data + 18);
+
+    size_t pos = kHeaderSize;
+    while (extension != 0) {
+        if (pos + 2 > len) return false;
+        uint8_t next = static_cast<uint8_t>(data[pos]);
+        size_t ext_len = static_cast<uint8_t>(data[pos + 1]);
+        pos += 2;
+        if (pos + ext_len > len) return false;
+        // unknown extensions are skipped
+        if (extension == kSelectiveAck) *sack = std::string_view(data + pos, ext_len);
+        pos += ext_len;
+        extension = next;
+    }
+    *payload = std::string_view(data + pos, len - pos);
+    return true;
+}
+
+std::string BuildPacket(const Header& header, std::string_view sack, std::string_view payload) {
+    std::string packet;
+    packet.reserve(kHeaderSize + (sack.empty() ? 0 : 2 + sack.size()) + payload.size());
+    packet.push_back(static_cast<char>(header.type << 4 | kVersion));
+    packet.push_back(static_cast<char>(sack.empty() ? 0 : kSelectiveAck));
+    PutU16(&packet, header.conn_id);
+    PutU32(&packet, header.timestamp_us);
+    PutU32(&packet, header.timestamp_diff_us);
+    PutU32(&packet, header.wnd_size);
+    PutU16(&packet, header.seq_nr);
+    PutU16(&packet, header.ack_nr);
+    if (!sack.empty()) {
+        packet.push_back(0);
+        packet.push_back(static_cast<char>(sack.size()));
+        packet.append(sack);
+    }
+    packet.append(payload);
+    return packet;
+}
+
+uint64_t NowUs() { return uv_hrtime() / 1000; }
+
+uint16_t RandomId() {
+    static std::mt19937 rng{std::random_device{}()};
+    return static_cast<uint16_t>(rng());
+}
+
+}  // namespace
+
+// The protocol state of one connection. Owned by the socket, which frees it once it is
+// closed and its stream is gone.
+class UtpConnection {
+  public:
+    enum class State { SYN_SENT, CONNECTED, CLOSED };
+
+    UtpConnection(UtpSocket* socket, const Endpoint& remote, uint16_t recv_id, uint16_t send_id)
+        : socket_(socket),
+          options_(socket->options_),
+          remote_(remote),
+          recv_id_(recv_id),
+          send_id_(send_id) {
+        mtu_floor_ = options_.min_payload;
+        mtu_ceiling_ = options_.max_payload;
+        // IPv6 headers are 20 bytes larger
+        if (remote.Type() == AddressType::IPv6) mtu_ceiling_ -= 20;
+        mtu_ceiling_ = std::max(mtu_ceiling_, mtu_floor_);
+        packet_size_ = mtu_floor_;
+        max_window_ = 3 * (packet_size_ + kHeaderSize);
+        peer_wnd_ = max_window_;
+    }
+
+    void StartConnect(UtpSocket::ConnectCallback cb, uint64_t now) {
+        connect_cb_ = std::move(cb);
+        state_ = State::SYN_SENT;
+        seq_nr_ = 1;
+        out_seq_ = seq_nr_;
+        Queue(ST_SYN, {});
+        Flush(now);
+        Reschedule(now);
+    }
+
+    void StartAccept(const Header& syn, uint64_t now) {
+        state_ = State::CONNECTED;
+        seq_nr_ = RandomId();
+        out_seq_ = seq_nr_;
+        ack_nr_ = syn.seq_nr;
+        peer_wnd_ = syn.wnd_size;
+        reply_micro_ = static_cast<uint32_t>(now) - syn.timestamp_us;
+        RequestAck();
+    }
+
+    void Incoming(const Header& header, std::string_view sack, std::string_view payload,
+                  uint64_t now) {
+        if (state_ == State::CLOSED) {
+            // our ack of the peer's FIN got lost
+            if (error_ == 0 && header.type == ST_FIN) RequestAck();
+            return;
+        }
+        if (header.type == ST_RESET) return Fail(UV_ECONNRESET);
+        if (header.type == ST_SYN) {
+            // our STATE got lost
+            return RequestAck();
+        }
+        reply_micro_ = static_cast<uint32_t>(now) - header.timestamp_us;
+        if (header.timestamp_diff_us != 0) AddDelaySample(header.timestamp_diff_us, now);
+        peer_wnd_ = header.wnd_size;
+
+        bool connected = false;
+        if (state_ == State::SYN_SENT) {
+            if (header.type != ST_STATE || header.ack_nr != out_seq_) return;
+            // the acceptor's first data packet carries this seq_nr
+            ack_nr_ = header.seq_nr - 1;
+            state_ = State::CONNECTED;
+            connected = true;
+        }
+        ProcessAck(header, sack, now);
+        if (header.type == ST_DATA || header.type == ST_FIN) ProcessData(header, payload);
+        if (state_ != State::CLOSED) {
+            Flush(now);
+            MaybeClose();
+            Reschedule(now);
+        }
+        if (connected) {
+            auto cb = std::move(connect_cb_);
+            connect_cb_ = nullptr;
+            // may destroy the stream
+            cb(std::unique_ptr<UtpStream>(new UtpStream(socket_, this)));
+        }
+        // delivered last, after the connection is consistent again
+        DeliverBuffered();
+        FireWriteCallbacks();
+    }
+
+    void OnTimer(uint64_t now) {
+        if (state_ == State::CLOSED) return;
+        if (retransmit_at_ != 0 && now >= retransmit_at_) {
+            retransmit_at_ = 0;
+            if (++timeouts_ > options_.max_retransmits) {
+                if (detached_) socket_->SendReset(remote_, send_id_, ack_nr_);
+                return Fail(UV_ETIMEDOUT);
+            }
+            rto_ = std::min(rto_ * 2, kMaxRtoUs);
+            if (probe_seq_ && !out_.empty() && !out_.back().acked) {
+                // most likely the probe was too large and everything else is fine
+                ProbeLost();
+            } else {
+                max_window_ = packet_size_ + kHeaderSize;
+                slow_start_ = false;
+            }
+            for (auto& packet : out_) MarkLost(packet);
+        }
+        if (detached_ && now >= linger_at_) {
+            socket_->SendReset(remote_, send_id_, ack_nr_);
+            return Fail(UV_ETIMEDOUT);
+        }
+        Flush(now);
+        Reschedule(now);
+    }
+
+    // A STATE carrying the current ack, the window and a SACK of the reorder buffer
+    void SendAck() {
+        ack_pending_ = false;
+        if (state_ == State::CLOSED && error_ != 0) return;
+        std::string sack;
+        if (!reorder_.empty()) {
+            std::array<uint8_t, kMaxSackBytes> bits{};
+            size_t used = 0;
+            for (const auto& [seq, packet] : reorder_) {
+                uint16_t bit = seq - ack_nr_ - 2;
+                if (bit >= kMaxSackBytes * 8) continue;
+                bits[bit / 8] |= 1 << (bit % 8);
+                used = std::max<size_t>(used, bit / 8 + 1);
+            }
+            // a multiple of 4 bytes
+            used = (used + 3) / 4 * 4;
+            sack.assign(reinterpret_cast<const char*>(bits.data()), used);
+        }
+        Header header = MakeHeader(ST_STATE, seq_nr_, NowUs());
+        socket_->Send(remote_, BuildPacket(header, sack, {}));
+    }
+
+    void Detach() {
+        detached_ = true;
+        read_cb_ = nullptr;
+        writes_.clear();
+        if (state_ == State::CLOSED) return;
+        uint64_t now = NowUs();
+        linger_at_ = now + options_.linger_ms * 1000;
+        if (!fin_queued_) {
+            fin_queued_ = true;
+            Flush(now);
+        }
+        MaybeClose();
+        Reschedule(now);
+    }
+
+    void Fail(int status) {
+        if (state_ == State::CLOSED) return;
+        state_ = State::CLOSED;
+        error_ = status;
+        retransmit_at_ = 0;
+        socket_->Defer(this);
+        if (connect_cb_) {
+            auto cb = std::move(connect_cb_);
+            connect_cb_ = nullptr;
+            cb(Err(absl::StrCat("utp connect to ", remote_.ToString(),
+                                " failed: ", uv_strerror(status))));
+            return;
+        }
+        auto writes = std::move(writes_);
+        writes_.clear();
+        for (auto& write : writes) {
+            if (write.second) write.second(status);
+        }
+        DeliverBuffered();
+    }
+
+    // stream interface
+    void ReadStart(UtpStream::ReadCallback cb) {
+        bool was_reading = reading_;
+        reading_ = true;
+        read_cb_ = std::move(cb);
+        // the advertised window opens again
+        if (!was_reading && !recv_buffer_.empty()) RequestAck();
+        DeliverBuffered();
+    }
+
+    void ReadStop() { reading_ = false; }
+
+    int Write(std::string data, UtpStream::WriteCallback cb) {
+        if (state_ == State::CLOSED || fin_queued_) return UV_EPIPE;
+        queued_bytes_ += data.size();
+        writes_.emplace_back(queued_bytes_, std::move(cb));
+        if (send_offset_ == send_buffer_.size()) {
+            send_buffer_ = std::move(data);
+            send_offset_ = 0;
+        } else {
+            send_buffer_.append(data);
+        }
+        uint64_t now = NowUs();
+        Flush(now);
+        Reschedule(now);
+        return 0;
+    }
+
+    void Shutdown() {
+        if (state_ == State::CLOSED || fin_queued_) return;
+        fin_queued_ = true;
+        uint64_t now = NowUs();
+        Flush(now);
+        Reschedule(now);
+    }
+
+    size_t WriteQueueSize() const { return queued_bytes_ - acked_bytes_; }
+
+    UtpStream::Stats GetStats() const {
+        return UtpStream::Stats{
+            .rtt_us = rtt_,
+            .rtt_var_us = rtt_var_,
+            .max_window = max_window_,
+            .in_flight = cur_window_,
+            .packet_size = packet_size_,
+            .bytes_sent = bytes_sent_,
+            .bytes_received = bytes_received_,
+            .retransmits = retransmits_,
+        };
+    }
+
+    [[nodiscard]] bool Reapable() const { return detached_ && state_ == State::CLOSED; }
+    [[nodiscard]] bool AckPending() const { return ack_pending_; }
+    [[nodiscard]] const Endpoint& Remote() const { return remote_; }
+    [[nodiscard]] uint16_t RecvId() const { return recv_id_; }
+    [[nodiscard]] uint16_t SendId() const { return send_id_; }
+    [[nodiscard]] uint16_t AckNr() const { return ack_nr_; }
+
+    // scheduled socket timer entry, 0 if none
+    uint64_t timer_at_ = 0;
+
+  private:
+    struct OutPacket {
+        uint8_t type = ST_DATA;
+        std::string payload;
+        uint64_t sent_us = 0;
+        int transmissions = 0;
+        bool acked = false;
+        // lost, not counted in flight until sent again
+        bool need_resend = false;
+        // SACKs seen for later packets since the last transmission
+        int skipped = 0;
+
+        size_t Size() const { return payload.size() + kHeaderSize; }
+    };
+
+    struct InPacket {
+        uint8_t type = ST_DATA;
+        std::string payload;
+    };
+
+    Header MakeHeader(uint8_t type, uint16_t seq_nr, uint64_t now) const {
+        Header header;
+        header.type = type;
+        header.conn_id = type == ST_SYN ? recv_id_ : send_id_;
+        header.timestamp_us = static_cast<uint32_t>(now);
+        header.timestamp_diff_us = reply_micro_;
+        header.wnd_size = RecvWindow();
+        header.seq_nr = seq_nr;
+        header.ack_nr = ack_nr_;
+        return header;
+    }
+
+    uint32_t RecvWindow() const {
+        size_t used = recv_buffer_.size() + reorder_bytes_;
+        if (used >= options_.recv_buffer) return 0;
+        return static_cast<uint32_t>(options_.recv_buffer - used);
+    }
+
+    void RequestAck() {
+        if (ack_pending_) return;
+        ack_pending_ = true;
+        socket_->Defer(this);
+    }
+
+    void Queue(uint8_t type, std::string payload) {
+        OutPacket packet;
+        packet.type = type;
+        packet.payload = std::move(payload);
+        packet.need_resend = true;
+        out_.push_back(std::move(packet));
+        seq_nr_++;
+    }
+
+    // Whether a packet of `size` bytes fits the window and the pacing schedule
+    bool CanSend(size_t size, uint64_t now) {
+        if (cur_window_ + size > max_window_ && cur_window_ > 0) {
+            window_limited_ = true;
+            return false;
+        }
+        if (cur_window_ + size > peer_wnd_) {
+            if (cur_window_ > 0) return false;
+            // nothing in flight and the peer's buffer is full
+            if (zero_window_at_ == 0) zero_window_at_ = now + kZeroWindowProbeUs;
+            if (now < zero_window_at_) return false;
+        }
+        zero_window_at_ = 0;
+        if (next_send_us_ > now + kPacingSlackUs) {
+            pacing_at_ = next_send_us_;
+            return false;
+        }
+        return true;
+    }
+
+    // 0, or the libuv error of the send
+    int Transmit(OutPacket& packet, uint16_t seq_nr, uint64_t now) {
+        if (packet.transmissions > 0) {
+            retransmits_++;
+            socket_->stats_.retransmits++;
+        }
+        packet.transmissions++;
+        packet.sent_us = now;
+        packet.need_resend = false;
+        packet.skipped = 0;
+        cur_window_ += packet.Size();
+        if (packet.type == ST_DATA) bytes_sent_ += packet.payload.size();
+        if (packet.type == ST_FIN) fin_sent_ = true;
+        if (retransmit_at_ == 0) retransmit_at_ = now + rto_;
+        // a window per RTT, with some headroom so pacing never is the bottleneck
+        if (rtt_ > 0) {
+            uint64_t gain = slow_start_ ? 2 : 1;
+            uint64_t interval = packet.Size() * rtt_ * 4 / (max_window_ * 5 * gain);
+            next_send_us_ = std::max(next_send_us_, now - std::min(now, kPacingSlackUs)) + interval;
+        }
+        // the packet carries the ack
+        ack_pending_ = false;
+        Header header = MakeHeader(packet.type, seq_nr, now);
+        return socket_->Send(remote_, BuildPacket(header, {}, packet.payload));
+    }
+
+    void Flush(uint64_t now) {
+        if (state_ == State::CLOSED) return;
+        pacing_at_ = 0;
+        window_limited_ = false;
+        // retransmissions first, in order
+        for (size_t i = 0; i < out_.size(); i++) {
+            OutPacket& packet = out_[i];
+            if (packet.acked || !packet.need_resend) continue;
+            if (!CanSend(packet.Size(), now)) return;
+            uint16_t seq_nr = out_seq_ + i;
+            if (Transmit(packet, seq_nr, now) != UV_EMSGSIZE) continue;
+            // the kernel learned a smaller path MTU, the packet never left
+            if (probe_seq_ == seq_nr) ProbeLost();
+            if (i + 1 == out_.size() && Shrink()) i--;
+        }
+        if (state_ == State::SYN_SENT || probe_seq_) return;
+
+        while (out_.size() < kMaxOutstanding) {
+            size_t buffered = send_buffer_.size() - send_offset_;
+            if (buffered == 0) {
+                if (!fin_queued_ || fin_sent_) break;
+                if (!CanSend(kHeaderSize, now)) break;
+                Queue(ST_FIN, {});
+                Transmit(out_.back(), seq_nr_ - 1, now);
+                break;
+            }
+            // probe when a full probe worth of data is waiting, one probe in flight at a time
+            size_t size = std::min(packet_size_, buffered);
+            size_t probe = (mtu_floor_ + mtu_ceiling_ + 1) / 2;
+            bool probing = mtu_ceiling_ - mtu_floor_ >= kMtuSearchDone && buffered >= probe;
+            if (probing) size = probe;
+            if (!CanSend(size + kHeaderSize, now)) break;
+
+            Queue(ST_DATA, send_buffer_.substr(send_offset_, size));
+            send_offset_ += size;
+            if (send_offset_ == send_buffer_.size()) {
+                send_buffer_.clear();
+                send_offset_ = 0;
+            } else if (send_offset_ > (1 << 20) && send_offset_ * 2 > send_buffer_.size()) {
+                send_buffer_.erase(0, send_offset_);
+                send_offset_ = 0;
+            }
+            uint16_t seq_nr = seq_nr_ - 1;
+            if (probing) probe_seq_ = seq_nr;
+            int retcode = Transmit(out_.back(), seq_nr, now);
+            if (!probing) continue;
+            // too large for the first hop already
+            if (retcode == UV_EMSGSIZE) {
+                ProbeLost();
+                Shrink();
+                continue;
+            }
+            // nothing new until the probe is through
+            break;
+        }
+    }
+
+    void MarkLost(OutPacket& packet) {
+        if (packet.acked || packet.need_resend || packet.transmissions == 0) return;
+        packet.need_resend = true;
+        cur_window_ -= packet.Size();
+    }
+
+    // The probe packet is the last one in flight. Its size is given up on, the packet itself
+    // goes out again unchanged: the peer may have it and only the ack got lost, so its seq_nr
+    // must keep carrying the same bytes.
+    void ProbeLost() {
+        OutPacket& probe = out_.back();
+        mtu_ceiling_ = std::max(mtu_floor_, probe.payload.size() - 1);
+        probe_seq_ = 0;
+        MarkLost(probe);
+    }
+
+    // Cut the last packet, which the kernel refused to send, down to the known good size and
+    // queue the rest as new data. Safe only because the peer cannot have received it.
+    bool Shrink() {
+        OutPacket& packet = out_.back();
+        if (packet.type != ST_DATA || packet.payload.size() <= packet_size_) return false;
+        MarkLost(packet);
+        send_buffer_.insert(send_offset_, packet.payload.substr(packet_size_));
+        packet.payload.resize(packet_size_);
+        return true;
+    }
+
+    void ProcessAck(const Header& header, std::string_view sack, uint64_t now) {
+        uint64_t acked_bytes = 0;
+        bool lost = false;
+        bool probe_lost = false;
+        // packets acked cumulatively, an ack from before the window acks nothing
+        uint16_t cumulative = header.ack_nr - out_seq_ + 1;
+        if (cumulative > out_.size()) cumulative = 0;
+        for (size_t i = 0; i < cumulative; i++) acked_bytes += Ack(out_[i], out_seq_ + i, now);
+
+        // bit k acknowledges ack_nr + 2 + k
+        size_t highest_sacked = 0;
+        for (size_t k = 0; k < sack.size() * 8; k++) {
+            if (!(static_cast<uint8_t>(sack[k / 8]) & (1 << (k % 8)))) continue;
+            uint16_t index = header.ack_nr + 2 + k - out_seq_;
+            if (index >= out_.size()) continue;
+            acked_bytes += Ack(out_[index], out_seq_ + index, now);
+            highest_sacked = std::max<size_t>(highest_sacked, index + 1);
+        }
+        // a packet is lost once three packets sent after it arrived
+        int later = 0;
+        for (size_t i = highest_sacked; i-- > 0;) {
+            OutPacket& packet = out_[i];
+            if (packet.acked) {
+                later++;
+                continue;
+            }
+            if (later >= kDupAckLimit && !packet.need_resend && packet.transmissions > 0) {
+                if (probe_seq_ == static_cast<uint16_t>(out_seq_ + i)) {
+                    probe_lost = true;
+                } else {
+                    MarkLost(packet);
+                    lost = true;
+                }
+            }
+        }
+
+        bool duplicate = acked_bytes == 0 && header.type == ST_STATE && !out_.empty() &&
+                         header.ack_nr == last_ack_ && cur_window_ > 0;
+        if (duplicate) {
+            if (++dup_acks_ == kDupAckLimit && !out_.front().acked) {
+                if (probe_seq_ == out_seq_) {
+                    probe_lost = true;
+                } else {
+                    MarkLost(out_.front());
+                    lost = true;
+                }
+            }
+        } else if (acked_bytes > 0) {
+            dup_acks_ = 0;
+        }
+        last_ack_ = header.ack_nr;
+
+        while (!out_.empty() && out_.front().acked) {
+            out_.pop_front();
+            out_seq_++;
+        }
+        if (probe_lost) ProbeLost();
+        if (lost && now - last_loss_us_ > rtt_) {
+            max_window_ = std::max<uint64_t>(max_window_ / 2, packet_size_ + kHeaderSize);
+            last_loss_us_ = now;
+            slow_start_ = false;
+        }
+        if (acked_bytes > 0) {
+            timeouts_ = 0;
+            retransmit_at_ = cur_window_ > 0 ? now + rto_ : 0;
+            UpdateWindow(acked_bytes);
+        }
+    }
+
+    // Bytes newly acknowledged by the packet
+    uint64_t Ack(OutPacket& packet, uint16_t seq_nr, uint64_t now) {
+        if (packet.acked) return 0;
+        packet.acked = true;
+        if (!packet.need_resend) cur_window_ -= packet.Size();
+        // Karn, retransmitted packets give no RTT sample
+        if (packet.transmissions == 1) AddRttSample(now - packet.sent_us);
+        if (packet.type == ST_DATA) acked_bytes_ += packet.payload.size();
+        if (packet.type == ST_FIN) fin_acked_ = true;
+        if (probe_seq_ && seq_nr == probe_seq_) {
+            probe_seq_ = 0;
+            mtu_floor_ = packet.payload.size();
+            packet_size_ = mtu_floor_;
+        }
+        return packet.Size();
+    }
+
+    void AddRttSample(uint64_t sample) {
+        if (rtt_ == 0) {
+            rtt_ = sample;
+            rtt_var_ = sample / 2;
+        } else {
+            uint64_t delta = rtt_ > sample ? rtt_ - sample : sample - rtt_;
+            rtt_var_ = (rtt_var_ * 3 + delta) / 4;
+            rtt_ = (rtt_ * 7 + sample) / 8;
+        }
+        rto_ = std::clamp(rtt_ + 4 * rtt_var_, kMinRtoUs, kMaxRtoUs);
+    }
+
+    // The peer's measure of our one-way delay, off by the difference of the clocks. The offset
+    // cancels out against the base delay.
+    void AddDelaySample(uint32_t sample, uint64_t now) {
+        if (now - base_delay_since_ >= kBaseDelayBucketUs || !has_base_delay_) {
+            base_delays_[1] = has_base_delay_ ? base_delays_[0] : sample;
+            base_delays_[0] = sample;
+            base_delay_since_ = now;
+            has_base_delay_ = true;
+        }
+        // wrapping compare, the clocks are unrelated
+        if (static_cast<int32_t>(sample - base_delays_[0]) < 0) base_delays_[0] = sample;
+        recent_delays_[recent_index_++ % recent_delays_.size()] = sample;
+    }
+
+    // Queuing delay, the lowest of the recent samples above the base delay
+    uint64_t QueuingDelay() const {
+        if (!has_base_delay_) return 0;
+        uint32_t base = base_delays_[0];
+        if (static_cast<int32_t>(base_delays_[1] - base) < 0) base = base_delays_[1];
+        uint64_t delay = UINT64_MAX;
+        size_t samples = std::min(recent_index_, recent_delays_.size());
+        for (size_t i = 0; i < samples; i++) {
+            int32_t above = static_cast<int32_t>(recent_delays_[i] - base);
+            delay = std::min<uint64_t>(delay, std::max(above, 0));
+        }
+        return samples == 0 ? 0 : delay;
+    }
+
+    // LEDBAT, RFC 6817
+    void UpdateWindow(uint64_t acked_bytes) {
+        uint64_t min_window = packet_size_ + kHeaderSize;
+        uint64_t delay = QueuingDelay();
+        if (slow_start_) {
+            if (delay * 2 <= options_.target_delay_us) {
+                if (window_limited_) max_window_ += acked_bytes;
+                return;
+            }
+            slow_start_ = false;
+        }
+        double off_target = (static_cast<double>(options_.target_delay_us) - delay) /
+                            options_.target_delay_us;
+        off_target = std::max(off_target, -1.0);
+        double window_factor = static_cast<double>(std::min(acked_bytes, max_window_)) /
+                               std::max<uint64_t>(max_window_, 1);
+        double gain = options_.max_window_increase * off_target * window_factor;
+        // don't grow a window the sender doesn't fill
+        if (gain > 0 && !window_limited_) return;
+        double window = std::max(static_cast<double>(max_window_) + gain,
+                                 static_cast<double>(min_window));
+        max_window_ = static_cast<uint64_t>(window);
+    }
+
+    void ProcessData(const Header& header, std::string_view payload) {
+        RequestAck();
+        uint16_t distance = header.seq_nr - ack_nr_ - 1;
+        // already delivered, the ack above tells the peer
+        if (distance > kReorderLimit) return;
+        if (got_fin_ && static_cast<uint16_t>(eof_seq_ - header.seq_nr) >= 0x8000) return;
+        if (header.type == ST_FIN) {
+            got_fin_ = true;
+            eof_seq_ = header.seq_nr;
+        }
+        if (distance > 0) {
+            auto [iter, inserted] = reorder_.try_emplace(header.seq_nr);
+            if (inserted) {
+                iter->second.type = header.type;
+                iter->second.payload.assign(payload);
+                reorder_bytes_ += payload.size();
+            }
+            return;
+        }
+        Deliver(header.type, payload);
+        while (true) {
+            auto iter = reorder_.find(static_cast<uint16_t>(ack_nr_ + 1));
+            if (iter == reorder_.end()) break;
+            InPacket packet = std::move(iter->second);
+            reorder_.erase(iter);
+            reorder_bytes_ -= packet.payload.size();
+            Deliver(packet.type, packet.payload);
+        }
+    }
+
+    // In order data, handed to the reader later so callbacks never run mid-update
+    void Deliver(uint8_t type, std::string_view payload) {
+        ack_nr_++;
+        bytes_received_ += payload.size();
+        recv_buffer_.append(payload);
+        if (type == ST_FIN) eof_ = true;
+    }
+
+    void DeliverBuffered() {
+        while (reading_ && read_cb_) {
+            // may stop reading or destroy the stream, which drops read_cb_
+            auto cb = read_cb_;
+            if (!recv_buffer_.empty()) {
+                std::string data = std::move(recv_buffer_);
+                recv_buffer_.clear();
+                cb(static_cast<ssize_t>(data.size()), data.data());
+                continue;
+            }
+            if (eof_ && !eof_delivered_) {
+                eof_delivered_ = true;
+                cb(UV_EOF, nullptr);
+                continue;
+            }
+            if (error_ != 0 && !eof_delivered_) {
+                eof_delivered_ = true;
+                cb(error_, nullptr);
+            }
+            break;
+        }
+    }
+
+    void FireWriteCallbacks() {
+        std::vector<UtpStream::WriteCallback> done;
+        while (!writes_.empty() && writes_.front().first <= acked_bytes_) {
+            done.push_back(std::move(writes_.front().second));
+            writes_.pop_front();
+        }
+        for (auto& cb : done) {
+            if (cb) cb(0);
+        }
+    }
+
+    // Both FINs are through
+    void MaybeClose() {
+        if (state_ != State::CONNECTED || !fin_acked_ || !eof_) return;
+        state_ = State::CLOSED;
+        socket_->Defer(this);
+    }
+
+    void Reschedule(uint64_t now) {
+        if (state_ == State::CLOSED) return;
+        uint64_t next = UINT64_MAX;
+        if (retransmit_at_ != 0) next = retransmit_at_;
+        if (pacing_at_ != 0) next = std::min(next, pacing_at_);
+        if (zero_window_at_ != 0) next = std::min(next, zero_window_at_);
+        if (detached_) next = std::min(next, linger_at_);
+        if (next != UINT64_MAX) socket_->Schedule(this, next);
+    }
+
+    UtpSocket* const socket_;
+    const UtpSocket::Options& options_;
+    const Endpoint remote_;
+    const uint16_t recv_id_;
+    const uint16_t send_id_;
+    State state_ = State::CONNECTED;
+    UtpSocket::ConnectCallback connect_cb_;
+    bool detached_ = false;
+    int error_ = 0;
+
+    // send side
+    uint16_t seq_nr_ = 0;
+    // seq_nr of out_.front()
+    uint16_t out_seq_ = 0;
+    std::deque<OutPacket> out_;
+    std::string send_buffer_;
+    size_t send_offset_ = 0;
+    // stream offsets of the ends of writes and of the acked data
+    uint64_t queued_bytes_ = 0;
+    uint64_t acked_bytes_ = 0;
+    std::deque<std::pair<uint64_t, UtpStream::WriteCallback>> writes_;
+    bool fin_queued_ = false;
+    bool fin_sent_ = false;
+    bool fin_acked_ = false;
+
+    // congestion control
+    uint64_t cur_window_ = 0;
+    uint64_t max_window_ = 0;
+    uint64_t peer_wnd_ = 0;
+    bool slow_start_ = true;
+    bool window_limited_ = false;
+    uint64_t last_loss_us_ = 0;
+    uint16_t last_ack_ = 0;
+    int dup_acks_ = 0;
+    uint64_t rtt_ = 0;
+    uint64_t rtt_var_ = 0;
+    uint64_t rto_ = kInitialRtoUs;
+    uint64_t retransmit_at_ = 0;
+    int timeouts_ = 0;
+    uint64_t next_send_us_ = 0;
+    uint64_t pacing_at_ = 0;
+    uint64_t zero_window_at_ = 0;
+    uint64_t linger_at_ = 0;
+    std::array<uint32_t, 2> base_delays_{};
+    uint64_t base_delay_since_ = 0;
+    bool has_base_delay_ = false;
+    std::array<uint32_t, 3> recent_delays_{};
+    size_t recent_index_ = 0;
+
+    // MTU search over the payload size
+    size_t packet_size_ = 0;
+    size_t mtu_floor_ = 0;
+    size_t mtu_ceiling_ = 0;
+    // seq_nr of the probe in flight, 0 if none
+    uint16_t probe_seq_ = 0;
+
+    // receive side
+    uint16_t ack_nr_ = 0;
+    uint32_t reply_micro_ = 0;
+    bool ack_pending_ = false;
+    std::unordered_map<uint16_t, InPacket> reorder_;
+    size_t reorder_bytes_ = 0;
+    std::string recv_buffer_;
+    bool reading_ = false;
+    UtpStream::ReadCallback read_cb_;
+    bool got_fin_ = false;
+    uint16_t eof_seq_ = 0;
+    bool eof_ = false;
+    bool eof_delivered_ = false;
+
+    uint64_t bytes_sent_ = 0;
+    uint64_t bytes_received_ = 0;
+    uint64_t retransmits_ = 0;
+};
+
+UtpStream::~UtpStream() { socket_->Detach(conn_); }
+
+void UtpStream::ReadStart(ReadCallback cb) { conn_->ReadStart(std::move(cb)); }
+
+void UtpStream::ReadStop() { conn_->ReadStop(); }
+
+int UtpStream::Write(std::string data, WriteCallback cb) {
+    int retcode = conn_->Write(std::move(data), std::move(cb));
+    socket_->UpdateTimer();
+    return retcode;
+}
+
+void UtpStream::Shutdown() {
+    conn_->Shutdown();
+    socket_->UpdateTimer();
+}
+
+const Endpoint& UtpStream::Remote() const { return conn_->Remote(); }
+
+size_t UtpStream::WriteQueueSize() const { return conn_->WriteQueueSize(); }
+
+UtpStream::Stats UtpStream::GetStats() const { return conn_->GetStats(); }
+
+UtpSocket::UtpSocket(uv_loop_t* loop, Options options) : loop_(loop), options_(options) {}
+
+UtpSocket::~UtpSocket() = default;
+
+Result<ResultVoid, std::string> UtpSocket::Bind(const Endpoint& local) {
+    udp_ = std::make_unique<uv_udp_t>();
+    int retcode = uv_udp_init(loop_, udp_.get());
+    if (retcode) {
+        udp_.reset();
+        return Err("UtpSocket uv_udp_init() failed");
+    }
+    udp_->data = this;
+    handles_open_++;
+    sockaddr_storage addr;
+    local.ToSockaddr(&addr);
+    retcode = uv_udp_bind(udp_.get(), reinterpret_cast<sockaddr*>(&addr), 0);
+    if (retcode) {
+        return Err(absl::StrCat("UtpSocket uv_udp_bind() failed: ", uv_strerror(retcode)));
+    }
+    // probes must not be fragmented. ICMP "fragmentation needed" updates the kernel's path
+    // MTU, after which oversized packets fail with UV_EMSGSIZE and can be cut safely.
+    uv_os_fd_t fd;
+    if (uv_fileno(reinterpret_cast<uv_handle_t*>(udp_.get()), &fd) == 0) {
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_DO)
+        int value = IP_PMTUDISC_DO;
+        setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value));
+#endif
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_DO)
+        int value6 = IPV6_PMTUDISC_DO;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &value6, sizeof(value6));
+#endif
+    }
+    retcode = uv_udp_recv_start(udp_.get(), uv_callbacks::Alloc<&UtpSocket::AllocRecvBuffer>,
+                                uv_callbacks::UdpRecv<&UtpSocket::DatagramReceived>);
+    if (retcode) return Err("UtpSocket uv_udp_recv_start() failed");
+
+    timer_ = std::make_unique<uv_timer_t>();
+    uv_timer_init(loop_, timer_.get());
+    timer_->data = this;
+    handles_open_++;
+    idle_ = std::make_unique<uv_idle_t>();
+    uv_idle_init(loop_, idle_.get());
+    idle_->data = this;
+    handles_open_++;
+    return {};
+}
+
+Result<Endpoint, std::string> UtpSocket::LocalEndpoint() const {
+    if (!udp_) return Err("UtpSocket not bound");
+    sockaddr_storage addr;
+    int len = sizeof(addr);
+    int retcode = uv_udp_getsockname(udp_.get(), reinterpret_cast<sockaddr*>(&addr), &len);
+    if (retcode) return Err(absl::StrCat("uv_udp_getsockname() failed: ", uv_strerror(retcode)));
+    return Endpoint::FromSockaddr(reinterpret_cast<sockaddr*>(&addr));
+}
+
+void UtpSocket::Connect(const Endpoint& remote, ConnectCallback cb) {
+    if (draining_ || !timer_) return cb(Err("utp socket halted or not bound"));
+    uint16_t recv_id = RandomId();
+    // the acceptor's ids are ours swapped, they must be free on both sides
+    while (conns_.count({remote, recv_id}) ||
+           conns_.count({remote, static_cast<uint16_t>(recv_id + 1)})) {
+        recv_id = RandomId();
+    }
+    UtpConnection* conn = NewConnection(remote, recv_id, static_cast<uint16_t>(recv_id + 1));
+    conn->StartConnect(std::move(cb), NowUs());
+    UpdateTimer();
+}
+
+UtpConnection* UtpSocket::NewConnection(const Endpoint& remote, uint16_t recv_id,
+                                        uint16_t send_id) {
+    auto& conn = conns_[{remote, recv_id}];
+    conn = std::make_unique<UtpConnection>(this, remote, recv_id, send_id);
+    return conn.get();
+}
+
+void UtpSocket::Halt(std::function<void()> on_closed) {
+    if (draining_) return;
+    draining_ = true;
+    on_closed_ = std::move(on_closed);
+
+    std::vector<ConnKey> keys;
+    for (const auto& [key, conn] : conns_) keys.push_back(key);
+    for (const auto& key : keys) {
+        auto iter = conns_.find(key);
+        if (iter == conns_.end()) continue;
+        UtpConnection* conn = iter->second.get();
+        if (!conn->Reapable()) SendReset(conn->Remote(), conn->SendId(), conn->AckNr());
+        // may detach other streams
+        conn->Fail(UV_ECANCELED);
+    }
+    RunDeferred();
+    deadlines_.clear();
+    for (uv_handle_t* handle : {reinterpret_cast<uv_handle_t*>(udp_.get()),
+                                reinterpret_cast<uv_handle_t*>(timer_.get()),
+                                reinterpret_cast<uv_handle_t*>(idle_.get())}) {
+        if (handle) uv_close(handle, uv_callbacks::Close<&UtpSocket::HandleClosed>);
+    }
+    CheckHalted();
+}
+
+void UtpSocket::CheckHalted() {
+    if (!draining_ || handles_open_ > 0 || !outgoing_.empty()) return;
+    auto cb = std::move(on_closed_);
+    on_closed_ = nullptr;
+    // may delete this
+    if (cb) cb();
+}
+
+void UtpSocket::HandleClosed(uv_handle_t* handle) {
+    handles_open_--;
+    CheckHalted();
+}
+
+UtpSocket::Stats UtpSocket::GetStats() const {
+    Stats stats = stats_;
+    stats.connections = conns_.size();
+    return stats;
+}
+
+void UtpSocket::AllocRecvBuffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    buf->base = recv_buf_.data();
+    buf->len = recv_buf_.size();
+}
+
+void UtpSocket::DatagramReceived(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf,
+                                 const sockaddr* addr, unsigned flags) {
+    if (nread <= 0 || addr == nullptr || (flags & UV_UDP_PARTIAL) || draining_) return;
+    auto remote = Endpoint::FromSockaddr(addr);
+    Header header;
+    std::string_view sack, payload;
+    if (!remote || !ParsePacket(buf->base, nread, &header, &sack, &payload)) {
+        stats_.packets_dropped++;
+        return;
+    }
+    stats_.packets_received++;
+    const Endpoint& from = remote.Value();
+    uint64_t now = NowUs();
+
+    if (header.type == ST_SYN) {
+        uint16_t recv_id = header.conn_id + 1;
+        auto iter = conns_.find({from, recv_id});
+        if (iter != conns_.end()) {
+            iter->second->Incoming(header, sack, payload, now);
+        } else if (!accept_cb_) {
+            SendReset(from, header.conn_id, header.seq_nr);
+        } else {
+            UtpConnection* conn = NewConnection(from, recv_id, header.conn_id);
+            conn->StartAccept(header, now);
+            // may destroy the stream
+            accept_cb_(std::unique_ptr<UtpStream>(new UtpStream(this, conn)));
+        }
+        return UpdateTimer();
+    }
+
+    UtpConnection* conn = nullptr;
+    auto iter = conns_.find({from, header.conn_id});
+    if (iter != conns_.end()) conn = iter->second.get();
+    if (!conn && header.type == ST_RESET) {
+        // a reset may carry either id of the connection
+        for (uint16_t id : {static_cast<uint16_t>(header.conn_id - 1),
+                            static_cast<uint16_t>(header.conn_id + 1)}) {
+            auto other = conns_.find({from, id});
+            if (other != conns_.end() && other->second->SendId() == header.conn_id) {
+                conn = other->second.get();
+            }
+        }
+    }
+    if (!conn) {
+        stats_.packets_dropped++;
+        if (header.type != ST_RESET) SendReset(from, header.conn_id, header.seq_nr);
+        return;
+    }
+    conn->Incoming(header, sack, payload, now);
+    UpdateTimer();
+}
+
+int UtpSocket::Send(const Endpoint& remote, const std::string& packet) {
+    if (!udp_) return UV_EINVAL;
+    sockaddr_storage storage;
+    remote.ToSockaddr(&storage);
+    const auto* addr = reinterpret_cast<const sockaddr*>(&storage);
+    stats_.packets_sent++;
+
+    uv_buf_t buf = uv_buf_init(const_cast<char*>(packet.data()), packet.size());
+    int retcode = uv_udp_try_send(udp_.get(), &buf, 1, addr);
+    if (retcode >= 0) return 0;
+    if (retcode != UV_EAGAIN && retcode != UV_ENOSYS) {
+        // lost, the retransmission will deal with it
+        return retcode;
+    }
+    auto send_buf = std::make_unique<SendBuf>();
+    send_buf->packet = packet;
+    send_buf->data = this;
+    buf = uv_buf_init(send_buf->packet.data(), send_buf->packet.size());
+    retcode = uv_udp_send(send_buf.get(), udp_.get(), &buf, 1, addr,
+                          uv_callbacks::UdpSend<&UtpSocket::SendComplete>);
+    if (retcode == 0) outgoing_[send_buf.get()] = std::move(send_buf);
+    return retcode;
+}
+
+void UtpSocket::SendComplete(uv_udp_send_t* req, int status) {
+    auto iter = outgoing_.find(static_cast<SendBuf*>(req));
+    assert(iter != outgoing_.end());
+    outgoing_.erase(iter);
+    CheckHalted();
+}
+
+void UtpSocket::SendReset(const Endpoint& remote, uint16_t conn_id, uint16_t ack_nr) {
+    Header header;
+    header.type = ST_RESET;
+    header.conn_id = conn_id;
+    header.timestamp_us = static_cast<uint32_t>(NowUs());
+    header.seq_nr = RandomId();
+    header.ack_nr = ack_nr;
+    stats_.resets_sent++;
+    Send(remote, BuildPacket(header, {}, {}));
+}
+
+void UtpSocket::Schedule(UtpConnection* conn, uint64_t when_us) {
+    if (draining_) return;
+    if (conn->timer_at_ != 0 && conn->timer_at_ <= when_us) return;
+    conn->timer_at_ = when_us;
+    deadlines_.emplace(when_us, ConnKey{conn->Remote(), conn->RecvId()});
+}
+
+void UtpSocket::UpdateTimer() {
+    if (draining_ || !timer_) return;
+    if (deadlines_.empty()) {
+        uv_timer_stop(timer_.get());
+        return;
+    }
+    uint64_t now = NowUs();
+    uint64_t first = deadlines_.begin()->first;
+    uint64_t delay_ms = first > now ? (first - now + 999) / 1000 : 0;
+    uv_timer_start(timer_.get(), uv_callbacks::Timer<&UtpSocket::TimerFired>, delay_ms, 0);
+}
+
+void UtpSocket::TimerFired(uv_timer_t* handle) {
+    uint64_t now = NowUs();
+    std::vector<std::pair<uint64_t, ConnKey>> due;
+    while (!deadlines_.empty() && deadlines_.begin()->first <= now + kPacingSlackUs) {
+        due.push_back(*deadlines_.begin());
+        deadlines_.erase(deadlines_.begin());
+    }
+    for (const auto& [when, key] : due) {
+        auto iter = conns_.find(key);
+        if (iter == conns_.end() || iter->second->timer_at_ != when) continue;
+        iter->second->timer_at_ = 0;
+        iter->second->OnTimer(now);
+    }
+    UpdateTimer();
+}
+
+void UtpSocket::Defer(UtpConnection* conn) {
+    deferred_.insert({conn->Remote(), conn->RecvId()});
+    if (idle_ && !draining_) {
+        uv_idle_start(idle_.get(), uv_callbacks::Idle<&UtpSocket::IdleFired>);
+    }
+}
+
+void UtpSocket::IdleFired(uv_idle_t* handle) {
+    RunDeferred();
+    UpdateTimer();
+}
+
+void UtpSocket::RunDeferred() {
+    auto deferred = std::move(deferred_);
+    deferred_.clear();
+    for (const auto& key : deferred) {
+        auto iter = conns_.find(key);
+        if (iter == conns_.end()) continue;
+        if (iter->second->AckPending()) iter->second->SendAck();
+        if (iter->second->Reapable()) conns_.erase(iter);
+    }
+    if (deferred_.empty() && idle_ && !draining_) uv_idle_stop(idle_.get());
+}
+
+void UtpSocket::Detach(UtpConnection* conn) {
+    conn->Detach();
+    Defer(conn);
+    UpdateTimer();
+}
+
+}  // namespace ryu::net
@@ -0,0 +1,191 @@
+#ifndef RYU_UTP_H
+#define RYU_UTP_H
+
+#include <uv.h>
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common/network.h"
+#include "result.h"
+
+namespace ryu {
+namespace net {
+
+class UtpConnection;
+class UtpSocket;
+
+// One uTP connection as seen by the peer layer, an ordered and reliable byte stream.
+//
+// Callbacks follow libuv: reads get `nread` > 0 with data, UV_EOF once the peer finished, or
+// another negative error after which the stream is dead. Writes complete once the peer
+// acknowledged every byte. Destroying the stream closes it gracefully, queued data and a FIN
+// still go out but no callback is called anymore. Streams must not outlive their socket.
+class UtpStream {
+  public:
+    using ReadCallback = std::function<void(ssize_t nread, const char* data)>;
+    using WriteCallback = std::function<void(int status)>;
+
+    struct Stats {
+        uint64_t rtt_us = 0;
+        uint64_t rtt_var_us = 0;
+        // congestion window and bytes in it
+        uint64_t max_window = 0;
+        uint64_t in_flight = 0;
+        // payload bytes per packet found by the MTU search
+        size_t packet_size = 0;
+        uint64_t bytes_sent = 0;
+        uint64_t bytes_received = 0;
+        uint64_t retransmits = 0;
+    };
+
+    ~UtpStream();
+    UtpStream(const UtpStream&) = delete;
+    UtpStream& operator=(const UtpStream&) = delete;
+
+    // Data received while stopped is buffered and shrinks the window advertised to the peer
+    void ReadStart(ReadCallback cb);
+    void ReadStop();
+    // UV_EPIPE after Shutdown() or once the connection failed
+    int Write(std::string data, WriteCallback cb);
+    // Send a FIN after the queued data, reading goes on
+    void Shutdown();
+
+    [[nodiscard]] const Endpoint& Remote() const;
+    // Bytes written and not yet acknowledged
+    [[nodiscard]] size_t WriteQueueSize() const;
+    [[nodiscard]] Stats GetStats() const;
+
+  private:
+    friend class UtpConnection;
+    friend class UtpSocket;
+    UtpStream(UtpSocket* socket, UtpConnection* conn) : socket_(socket), conn_(conn) {}
+
+    UtpSocket* const socket_;
+    UtpConnection* const conn_;
+};
+
+// uTP, BEP 29, with every connection multiplexed over a single UDP socket.
+//
+// Congestion control is LEDBAT: the window grows while the one-way delay stays under
+// `target_delay_us` above the lowest delay seen, and shrinks as queues build up, so bulk
+// transfers yield to other traffic on the uplink. Losses are found from selective ACKs and
+// duplicate ACKs and halve the window at most once per RTT, a timeout drops it to one packet.
+// Packets are paced over the RTT instead of sent in window sized bursts. Packets start at
+// `min_payload` bytes and a binary search with don't-fragment probes finds the largest size up
+// to `max_payload` the path carries.
+//
+// Acks are deferred to an idle handle, which runs before the loop polls again, so a burst of
+// datagrams gets one ack. Retransmissions, pacing and lingering closes share one timer. Not
+// thread safe.
+class UtpSocket {
+  public:
+    struct Options {
+        // receive buffer per connection, bounds the window advertised to peers
+        uint32_t recv_buffer = 1 << 20;
+        uint32_t target_delay_us = 100'000;
+        // window growth per RTT with no queuing delay at all
+        uint32_t max_window_increase = 3000;
+        // consecutive timeouts before a connection fails
+        int max_retransmits = 5;
+        // uTP payload per packet, 576 byte datagrams and 1500 byte Ethernet frames less the IPv4,
+        // UDP and uTP headers
+        size_t min_payload = 528;
+        size_t max_payload = 1452;
+        // how long a closed stream may wait for its FIN to be acknowledged
+        uint64_t linger_ms = 10'000;
+    };
+
+    struct Stats {
+        uint64_t packets_sent = 0;
+        uint64_t packets_received = 0;
+        uint64_t retransmits = 0;
+        uint64_t resets_sent = 0;
+        // not parsed or for no known connection
+        uint64_t packets_dropped = 0;
+        size_t connections = 0;
+    };
+
+    using AcceptCallback = std::function<void(std::unique_ptr<UtpStream>)>;
+    using ConnectCallback = std::function<void(Result<std::unique_ptr<UtpStream>, std::string>)>;
+
+    UtpSocket(uv_loop_t* loop, Options options);
+    explicit UtpSocket(uv_loop_t* loop) : UtpSocket(loop, Options{}) {}
+    ~UtpSocket();
+    UtpSocket(const UtpSocket&) = delete;
+    UtpSocket& operator=(const UtpSocket&) = delete;
+
+    Result<ResultVoid, std::string> Bind(const Endpoint& local);
+    Result<Endpoint, std::string> LocalEndpoint() const;
+    // Accept incoming connections, without a callback they are reset
+    void Listen(AcceptCallback cb) { accept_cb_ = std::move(cb); }
+    // `cb` is called exactly once, possibly before Connect() returns
+    void Connect(const Endpoint& remote, ConnectCallback cb);
+    // Reset every connection, `on_closed` is called once the socket can be destroyed.
+    // Streams still held get UV_ECANCELED.
+    void Halt(std::function<void()> on_closed);
+
+    [[nodiscard]] Stats GetStats() const;
+
+    // UV callbacks
+    void AllocRecvBuffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+    void DatagramReceived(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf,
+                          const sockaddr* addr, unsigned flags);
+    void SendComplete(uv_udp_send_t* req, int status);
+    void TimerFired(uv_timer_t* handle);
+    void IdleFired(uv_idle_t* handle);
+    void HandleClosed(uv_handle_t* handle);
+
+  private:
+    friend class UtpConnection;
+    friend class UtpStream;
+
+    struct SendBuf : public uv_udp_send_t {
+        std::string packet;
+    };
+    // connections are told apart by the remote and the id their packets carry
+    using ConnKey = std::pair<Endpoint, uint16_t>;
+
+    UtpConnection* NewConnection(const Endpoint& remote, uint16_t recv_id, uint16_t send_id);
+    // 0 if the datagram is too large for the path
+    int Send(const Endpoint& remote, const std::string& packet);
+    void SendReset(const Endpoint& remote, uint16_t conn_id, uint16_t ack_nr);
+    void Schedule(UtpConnection* conn, uint64_t when_us);
+    void UpdateTimer();
+    // Flush acks and free finished connections before the loop polls for I/O again
+    void Defer(UtpConnection* conn);
+    void RunDeferred();
+    void Detach(UtpConnection* conn);
+    void CheckHalted();
+
+    uv_loop_t* const loop_;
+    const Options options_;
+    std::unique_ptr<uv_udp_t> udp_;
+    std::unique_ptr<uv_timer_t> timer_;
+    std::unique_ptr<uv_idle_t> idle_;
+    std::array<char, 65536> recv_buf_;
+
+    AcceptCallback accept_cb_;
+    std::map<ConnKey, std::unique_ptr<UtpConnection>> conns_;
+    // deadline(us) -> connection, stale entries are skipped when they fire
+    std::multimap<uint64_t, ConnKey> deadlines_;
+    std::set<ConnKey> deferred_;
+    std::unordered_map<SendBuf*, std::unique_ptr<SendBuf>> outgoing_;
+    Stats stats_;
+
+    bool draining_ = false;
+    int handles_open_ = 0;
+    std::function<void()> on_closed_;
+};
+
+}  // namespace net
+}  // namespace ryu
+
+#endif  // RYU_UTP_H
@@ -0,0 +1,299 @@
+#include "utp.h"
+
+#include <gtest/gtest.h>
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+
+#include "utils/uv_callbacks.h"
+
+using namespace ryu;
+using namespace ryu::net;
+
+namespace {
+
+using ConnectResult = Result<std::unique_ptr<UtpStream>, std::string>;
+
+Endpoint Loopback(uint16_t port) { return Endpoint(IpAddress::FromBe32(htonl(0x7f000001)), port); }
+
+// Forwards datagrams between a client and a server, dropping and delaying some of them.
+// The client talks to front(), the server sees the relay's other port as the client.
+class LossyRelay {
+  public:
+    LossyRelay(uv_loop_t* loop, Endpoint server, double loss, uint64_t delay_ms)
+        : loop_(loop), server_(server), loss_(loss), delay_ms_(delay_ms) {
+        for (uv_udp_t* udp : {&front_, &back_}) {
+            uv_udp_init(loop, udp);
+            udp->data = this;
+            sockaddr_storage addr;
+            Loopback(0).ToSockaddr(&addr);
+            EXPECT_EQ(0, uv_udp_bind(udp, reinterpret_cast<sockaddr*>(&addr), 0));
+            uv_udp_recv_start(udp, ryu::uv_callbacks::Alloc<&LossyRelay::Alloc>,
+                              ryu::uv_callbacks::UdpRecv<&LossyRelay::Received>);
+        }
+        uv_timer_init(loop, &timer_);
+        timer_.data = this;
+    }
+
+    Endpoint front() const {
+        sockaddr_storage addr;
+        int len = sizeof(addr);
+        uv_udp_getsockname(&front_, reinterpret_cast<sockaddr*>(&addr), &len);
+        return Endpoint::FromSockaddr(reinterpret_cast<sockaddr*>(&addr)).Value();
+    }
+
+    void Alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+        buf->base = buf_;
+        buf->len = sizeof(buf_);
+    }
+
+    void Received(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf, const sockaddr* addr,
+                  unsigned flags) {
+        if (nread <= 0 || addr == nullptr) return;
+        if (handle == &front_) client_ = Endpoint::FromSockaddr(addr).Value();
+        if (std::uniform_real_distribution<double>(0, 1)(rng_) < loss_) {
+            dropped++;
+            return;
+        }
+        Packet packet{handle == &front_ ? &back_ : &front_,
+                      handle == &front_ ? server_ : client_, std::string(buf->base, nread)};
+        queue_.emplace(uv_now(loop_) + delay_ms_, std::move(packet));
+        uv_timer_start(&timer_, ryu::uv_callbacks::Timer<&LossyRelay::Deliver>,
+                       queue_.begin()->first - std::min(queue_.begin()->first, uv_now(loop_)), 0);
+    }
+
+    void Deliver(uv_timer_t* timer) {
+        while (!queue_.empty() && queue_.begin()->first <= uv_now(loop_)) {
+            Packet& packet = queue_.begin()->second;
+            sockaddr_storage addr;
+            packet.to.ToSockaddr(&addr);
+            uv_buf_t buf = uv_buf_init(packet.data.data(), packet.data.size());
+            uv_udp_try_send(packet.via, &buf, 1, reinterpret_cast<sockaddr*>(&addr));
+            queue_.erase(queue_.begin());
+        }
+        if (!queue_.empty()) {
+            uv_timer_start(&timer_, ryu::uv_callbacks::Timer<&LossyRelay::Deliver>,
+                           queue_.begin()->first - uv_now(loop_), 0);
+        }
+    }
+
+    void Close() {
+        for (auto* handle : {reinterpret_cast<uv_handle_t*>(&front_),
+                             reinterpret_cast<uv_handle_t*>(&back_),
+                             reinterpret_cast<uv_handle_t*>(&timer_)}) {
+            uv_close(handle, nullptr);
+        }
+    }
+
+    int dropped = 0;
+
+  private:
+    struct Packet {
+        uv_udp_t* via;
+        Endpoint to;
+        std::string data;
+    };
+
+    uv_loop_t* loop_;
+    Endpoint server_;
+    Endpoint client_;
+    double loss_;
+    uint64_t delay_ms_;
+    uv_udp_t front_;
+    uv_udp_t back_;
+    uv_timer_t timer_;
+    char buf_[65536];
+    std::mt19937 rng_{42};
+    std::multimap<uint64_t, Packet> queue_;
+};
+
+// Collects everything a stream reads
+struct Sink {
+    void Attach(UtpStream* stream) {
+        stream->ReadStart([this](ssize_t nread, const char* data) {
+            if (nread > 0) {
+                received.append(data, nread);
+            } else {
+                status = static_cast<int>(nread);
+            }
+        });
+    }
+    std::string received;
+    std::optional<int> status;
+};
+
+class UtpTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        uv_loop_init(&loop_);
+        server_ = MakeSocket({});
+        client_ = MakeSocket({});
+        server_->Listen([this](std::unique_ptr<UtpStream> stream) {
+            accepted_ = std::move(stream);
+        });
+    }
+
+    void TearDown() override {
+        accepted_.reset();
+        int closed = 0;
+        server_->Halt([&] { closed++; });
+        client_->Halt([&] { closed++; });
+        ASSERT_TRUE(RunUntil([&] { return closed == 2; }));
+        uv_run(&loop_, UV_RUN_DEFAULT);
+        EXPECT_EQ(0, uv_loop_close(&loop_));
+    }
+
+    std::unique_ptr<UtpSocket> MakeSocket(UtpSocket::Options options) {
+        auto socket = std::make_unique<UtpSocket>(&loop_, options);
+        EXPECT_TRUE(socket->Bind(Loopback(0)).Ok());
+        return socket;
+    }
+
+    Endpoint ServerEndpoint() { return server_->LocalEndpoint().Value(); }
+
+    std::unique_ptr<UtpStream> Connect(const Endpoint& remote) {
+        std::optional<ConnectResult> result;
+        client_->Connect(remote, [&](ConnectResult r) { result = std::move(r); });
+        EXPECT_TRUE(RunUntil([&] { return result.has_value() && accepted_ != nullptr; }));
+        if (!result || !result->Ok()) return nullptr;
+        return std::move(*result).TakeValue();
+    }
+
+    // Transfers take many loop iterations, bounded by time instead
+    template <typename Pred>
+    bool RunUntil(Pred pred, uint64_t timeout_ms = 10000) {
+        uint64_t deadline = uv_now(&loop_) + timeout_ms;
+        while (!pred() && uv_now(&loop_) < deadline) uv_run(&loop_, UV_RUN_ONCE);
+        return pred();
+    }
+
+    static std::string Pattern(size_t size) {
+        std::string data(size, 0);
+        for (size_t i = 0; i < size; i++) data[i] = static_cast<char>(i * 7 + i / 1000);
+        return data;
+    }
+
+    uv_loop_t loop_;
+    std::unique_ptr<UtpSocket> server_;
+    std::unique_ptr<UtpSocket> client_;
+    std::unique_ptr<UtpStream> accepted_;
+};
+
+TEST_F(UtpTest, EchoAndClose) {
+    auto stream = Connect(ServerEndpoint());
+    ASSERT_TRUE(stream);
+    UtpStream* accepted = accepted_.get();
+    accepted->ReadStart([accepted](ssize_t nread, const char* data) {
+        if (nread > 0) {
+            accepted->Write(std::string(data, nread), nullptr);
+        } else {
+            accepted->Shutdown();
+        }
+    });
+    Sink sink;
+    sink.Attach(stream.get());
+    std::optional<int> written;
+    EXPECT_EQ(0, stream->Write("hello", [&](int status) { written = status; }));
+    ASSERT_TRUE(RunUntil([&] { return sink.received == "hello" && written.has_value(); }));
+    EXPECT_EQ(0, *written);
+    EXPECT_EQ(0u, stream->WriteQueueSize());
+
+    // our FIN is echoed back
+    stream->Shutdown();
+    EXPECT_EQ(UV_EPIPE, stream->Write("late", nullptr));
+    ASSERT_TRUE(RunUntil([&] { return sink.status.has_value(); }));
+    EXPECT_EQ(UV_EOF, *sink.status);
+    EXPECT_GT(stream->GetStats().rtt_us, 0u);
+
+    // both sides are done and freed once the streams are gone
+    stream.reset();
+    accepted_.reset();
+    ASSERT_TRUE(RunUntil([&] {
+        return client_->GetStats().connections == 0 && server_->GetStats().connections == 0;
+    }));
+}
+
+TEST_F(UtpTest, RefusedWithoutListener) {
+    auto other = MakeSocket({});
+    std::optional<ConnectResult> result;
+    client_->Connect(other->LocalEndpoint().Value(),
+                     [&](ConnectResult r) { result = std::move(r); });
+    ASSERT_TRUE(RunUntil([&] { return result.has_value(); }));
+    EXPECT_FALSE(result->Ok());
+    EXPECT_EQ(1u, other->GetStats().resets_sent);
+    bool closed = false;
+    other->Halt([&] { closed = true; });
+    ASSERT_TRUE(RunUntil([&] { return closed; }));
+}
+
+TEST_F(UtpTest, ProbesPathMtu) {
+    auto stream = Connect(ServerEndpoint());
+    ASSERT_TRUE(stream);
+    Sink sink;
+    sink.Attach(accepted_.get());
+    std::string data = Pattern(300'000);
+    stream->Write(data, nullptr);
+    ASSERT_TRUE(RunUntil([&] { return sink.received.size() == data.size(); }));
+    EXPECT_EQ(data, sink.received);
+    // loopback carries anything, the search ends right below the ceiling
+    EXPECT_GT(stream->GetStats().packet_size, 1452u - 16);
+    EXPECT_EQ(0u, stream->GetStats().retransmits);
+}
+
+TEST_F(UtpTest, SurvivesLossAndDelay) {
+    LossyRelay relay(&loop_, ServerEndpoint(), 0.05, 20);
+    auto stream = Connect(relay.front());
+    ASSERT_TRUE(stream);
+    Sink sink;
+    sink.Attach(accepted_.get());
+
+    std::string data = Pattern(400'000);
+    std::optional<int> written;
+    stream->Write(data, [&](int status) { written = status; });
+    ASSERT_TRUE(RunUntil([&] { return written.has_value(); }, 30000));
+    EXPECT_EQ(0, *written);
+    EXPECT_EQ(data, sink.received);
+    EXPECT_GT(relay.dropped, 0);
+    EXPECT_GT(stream->GetStats().retransmits, 0u);
+    // 40ms round trips
+    EXPECT_GE(stream->GetStats().rtt_us, 40'000u);
+
+    stream.reset();
+    accepted_.reset();
+    relay.Close();
+}
+
+TEST_F(UtpTest, ReceiveWindowBackpressure) {
+    auto small = MakeSocket({.recv_buffer = 64 * 1024});
+    std::unique_ptr<UtpStream> accepted;
+    small->Listen([&](std::unique_ptr<UtpStream> stream) { accepted = std::move(stream); });
+    std::optional<ConnectResult> result;
+    client_->Connect(small->LocalEndpoint().Value(),
+                     [&](ConnectResult r) { result = std::move(r); });
+    ASSERT_TRUE(RunUntil([&] { return result.has_value() && accepted != nullptr; }));
+    ASSERT_TRUE(result->Ok());
+    auto stream = std::move(*result).TakeValue();
+
+    std::string data = Pattern(1'000'000);
+    stream->Write(data, nullptr);
+    // nobody reads, the sender stalls on the advertised window
+    RunUntil([] { return false; }, 300);
+    EXPECT_LT(accepted->GetStats().bytes_received, 200'000u);
+    EXPECT_GT(stream->WriteQueueSize(), 800'000u);
+
+    Sink sink;
+    sink.Attach(accepted.get());
+    ASSERT_TRUE(RunUntil([&] { return sink.received.size() == data.size(); }));
+    EXPECT_EQ(data, sink.received);
+
+    stream.reset();
+    accepted.reset();
+    bool closed = false;
+    small->Halt([&] { closed = true; });
+    ASSERT_TRUE(RunUntil([&] { return closed; }));
+}
+
+}  // namespace
@@ -0,0 +1,110 @@
+#include "write_queue.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <utility>
+
+#include "utils/uv_callbacks.h"
+
+namespace ryu::net {
+
+std::unique_ptr<BufferPool::Buffer> BufferPool::Acquire() {
+    if (free_.empty()) {
+        allocated_++;
+        auto buffer = std::make_unique<Buffer>();
+        buffer->data = std::make_unique<char[]>(buffer_size_);
+        return buffer;
+    }
+    auto buffer = std::move(free_.back());
+    free_.pop_back();
+    return buffer;
+}
+
+void BufferPool::Release(std::unique_ptr<Buffer> buffer) {
+    if (free_.size() >= max_free_) return;
+    buffer->size = 0;
+    free_.push_back(std::move(buffer));
+}
+
+WriteQueue::WriteQueue(uv_stream_t* stream, BufferPool* pool, Options options,
+                       std::function<void()> on_drain)
+    : stream_(stream), pool_(pool), options_(options), on_drain_(std::move(on_drain)) {}
+
+void WriteQueue::Write(std::string_view data) {
+    if (status_ != 0) return;
+    stats_.messages++;
+    queued_ += data.size();
+    while (!data.empty()) {
+        if (pending_.empty() || pending_.back()->size == pool_->buffer_size()) {
+            pending_.push_back(pool_->Acquire());
+        }
+        BufferPool::Buffer& buffer = *pending_.back();
+        size_t size = std::min(data.size(), pool_->buffer_size() - buffer.size);
+        memcpy(buffer.data.get() + buffer.size, data.data(), size);
+        buffer.size += size;
+        data.remove_prefix(size);
+    }
+    if (Backlog() > options_.high_water) congested_ = true;
+}
+
+int WriteQueue::Flush() {
+    if (status_ != 0 || pending_.empty()) return status_;
+    std::unique_ptr<Request> request;
+    if (free_requests_.empty()) {
+        request = std::make_unique<Request>();
+    } else {
+        request = std::move(free_requests_.back());
+        free_requests_.pop_back();
+    }
+    request->data = this;
+    request->size = queued_;
+    request->buffers.swap(pending_);
+    for (const auto& buffer : request->buffers) {
+        request->bufs.push_back(uv_buf_init(buffer->data.get(), buffer->size));
+    }
+    queued_ = 0;
+    int retcode = uv_write(request.get(), stream_, request->bufs.data(), request->bufs.size(),
+                           uv_callbacks::Write<&WriteQueue::Written>);
+    if (retcode) {
+        status_ = retcode;
+        Recycle(std::move(request));
+        return status_;
+    }
+    stats_.writes++;
+    stats_.bytes += request->size;
+    in_flight_ += request->size;
+    // owned by libuv until Written()
+    request.release();
+    if (Backlog() > options_.high_water) congested_ = true;
+    return 0;
+}
+
+void WriteQueue::Written(uv_write_t* req, int status) {
+    std::unique_ptr<Request> request(static_cast<Request*>(req));
+    in_flight_ -= request->size;
+    Recycle(std::move(request));
+    if (status != 0 && status_ == 0) {
+        status_ = status;
+        for (auto& buffer : pending_) pool_->Release(std::move(buffer));
+        pending_.clear();
+        queued_ = 0;
+    }
+    if (congested_ && Backlog() <= options_.low_water) {
+        congested_ = false;
+        if (on_drain_) on_drain_();
+    }
+}
+
+void WriteQueue::Recycle(std::unique_ptr<Request> request) {
+    for (auto& buffer : request->buffers) pool_->Release(std::move(buffer));
+    request->buffers.clear();
+    request->bufs.clear();
+    free_requests_.push_back(std::move(request));
+}
+
+size_t WriteQueue::Backlog() const {
+    return queued_ + uv_stream_get_write_queue_size(stream_);
+}
+
+}  // namespace ryu::net
@@ -0,0 +1,118 @@
+#ifndef RYU_WRITE_QUEUE_H
+#define RYU_WRITE_QUEUE_H
+
+#include <uv.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+namespace ryu {
+namespace net {
+
+// Fixed size buffers recycled between writes, so that steady traffic allocates nothing. Keeps
+// at most `max_free` idle buffers. One per loop, not thread safe.
+class BufferPool {
+  public:
+    struct Buffer {
+        std::unique_ptr<char[]> data;
+        // bytes used
+        size_t size = 0;
+    };
+
+    explicit BufferPool(size_t buffer_size = 16384, size_t max_free = 1024)
+        : buffer_size_(buffer_size), max_free_(max_free) {}
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    std::unique_ptr<Buffer> Acquire();
+    void Release(std::unique_ptr<Buffer> buffer);
+
+    [[nodiscard]] size_t buffer_size() const { return buffer_size_; }
+    // buffers allocated so far
+    [[nodiscard]] uint64_t Allocated() const { return allocated_; }
+    [[nodiscard]] size_t Idle() const { return free_.size(); }
+
+  private:
+    const size_t buffer_size_;
+    const size_t max_free_;
+    std::vector<std::unique_ptr<Buffer>> free_;
+    uint64_t allocated_ = 0;
+};
+
+// Coalescing write queue of a stream. Write() copies a message into pooled buffers, and Flush()
+// hands everything written since to a single uv_write() with one uv_buf_t per buffer. Owners
+// flush once per batch of work, e.g. at the end of a read callback, so a burst of small
+// messages costs one syscall.
+//
+// Once the bytes queued here and in libuv's write queue exceed `high_water` the queue is
+// Congested() and owners stop producing, typically by no longer reading requests. `on_drain`
+// runs when completed writes bring it under `low_water` again. After a write error everything
+// is dropped. The queue must outlive the stream's close callback since writes in flight point
+// back at it.
+class WriteQueue {
+  public:
+    struct Options {
+        size_t high_water = 1 << 20;
+        size_t low_water = 256 << 10;
+    };
+
+    struct Stats {
+        uint64_t messages = 0;
+        uint64_t writes = 0;
+        uint64_t bytes = 0;
+    };
+
+    // `stream` and `pool` must outlive the queue
+    WriteQueue(uv_stream_t* stream, BufferPool* pool, Options options,
+               std::function<void()> on_drain);
+    WriteQueue(const WriteQueue&) = delete;
+    WriteQueue& operator=(const WriteQueue&) = delete;
+
+    void Write(std::string_view data);
+    // Hand the queued bytes to libuv. Returns the uv error, also kept in status().
+    int Flush();
+
+    [[nodiscard]] bool Congested() const { return congested_; }
+    // Bytes not flushed yet
+    [[nodiscard]] size_t Queued() const { return queued_; }
+    [[nodiscard]] size_t InFlight() const { return in_flight_; }
+    // First write error, 0 if none
+    [[nodiscard]] int status() const { return status_; }
+    [[nodiscard]] const Stats& GetStats() const { return stats_; }
+
+    // UV callback
+    void Written(uv_write_t* req, int status);
+
+  private:
+    struct Request : public uv_write_t {
+        std::vector<std::unique_ptr<BufferPool::Buffer>> buffers;
+        std::vector<uv_buf_t> bufs;
+        size_t size = 0;
+    };
+
+    // Return the buffers of a finished request and keep it for the next flush
+    void Recycle(std::unique_ptr<Request> request);
+    [[nodiscard]] size_t Backlog() const;
+
+    uv_stream_t* const stream_;
+    BufferPool* const pool_;
+    const Options options_;
+    const std::function<void()> on_drain_;
+    // not flushed yet
+    std::vector<std::unique_ptr<BufferPool::Buffer>> pending_;
+    std::vector<std::unique_ptr<Request>> free_requests_;
+    size_t queued_ = 0;
+    size_t in_flight_ = 0;
+    bool congested_ = false;
+    int status_ = 0;
+    Stats stats_;
+};
+
+}  // namespace net
+}  // namespace ryu
+
+#endif  // RYU_WRITE_QUEUE_H
@@ -0,0 +1,144 @@
+#include "write_queue.h"
+
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+
+#include <memory>
+#include <string>
+
+#include "utils/uv_callbacks.h"
+
+using namespace ryu::net;
+
+namespace {
+
+class WriteQueueTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        uv_loop_init(&loop_);
+        int fds[2];
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        for (int i = 0; i < 2; i++) {
+            uv_pipe_init(&loop_, &ends_[i], 0);
+            uv_pipe_open(&ends_[i], fds[i]);
+            ends_[i].data = this;
+        }
+    }
+
+    void TearDown() override {
+        int closed = 0;
+        for (auto& end : ends_) {
+            end.data = &closed;
+            uv_close(reinterpret_cast<uv_handle_t*>(&end), [](uv_handle_t* handle) {
+                ++*static_cast<int*>(handle->data);
+            });
+        }
+        EXPECT_TRUE(RunUntil([&] { return closed == 2; }));
+        queue_.reset();
+        EXPECT_EQ(0, uv_loop_close(&loop_));
+    }
+
+    void MakeQueue(WriteQueue::Options options = {}) {
+        queue_ = std::make_unique<WriteQueue>(Stream(0), &pool_, options, [this] { drained_++; });
+    }
+
+    template <typename Pred>
+    bool RunUntil(Pred pred) {
+        for (int i = 0; i < 1000 && !pred(); i++) uv_run(&loop_, UV_RUN_ONCE);
+        return pred();
+    }
+
+    void StartReading() {
+        uv_read_start(Stream(1), ryu::uv_callbacks::Alloc<&WriteQueueTest::Alloc>,
+                      ryu::uv_callbacks::Read<&WriteQueueTest::Read>);
+    }
+    void Alloc(uv_handle_t* handle, size_t suggested, uv_buf_t* buf) {
+        buf->base = buffer_;
+        buf->len = sizeof(buffer_);
+    }
+    void Read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+        if (nread > 0) received_.append(buf->base, nread);
+    }
+
+    uv_stream_t* Stream(int i) { return reinterpret_cast<uv_stream_t*>(&ends_[i]); }
+
+    uv_loop_t loop_;
+    uv_pipe_t ends_[2];
+    char buffer_[65536];
+    BufferPool pool_{1024};
+    std::unique_ptr<WriteQueue> queue_;
+    std::string received_;
+    int drained_ = 0;
+};
+
+TEST_F(WriteQueueTest, CoalescesMessages) {
+    MakeQueue();
+    StartReading();
+    std::string expected;
+    for (int i = 0; i < 100; i++) {
+        std::string message(i * 7, static_cast<char>('a' + i % 26));
+        queue_->Write(message);
+        expected += message;
+    }
+    EXPECT_EQ(expected.size(), queue_->Queued());
+    EXPECT_EQ(0, queue_->Flush());
+    EXPECT_EQ(0u, queue_->Queued());
+    ASSERT_TRUE(RunUntil([&] { return received_.size() == expected.size(); }));
+    EXPECT_EQ(expected, received_);
+    EXPECT_EQ(0u, queue_->InFlight());
+    EXPECT_EQ(100u, queue_->GetStats().messages);
+    EXPECT_EQ(1u, queue_->GetStats().writes);
+
+    // the buffers are reused from now on
+    uint64_t allocated = pool_.Allocated();
+    EXPECT_EQ(allocated, pool_.Idle());
+    for (int round = 0; round < 10; round++) {
+        for (int i = 0; i < 100; i++) queue_->Write("ping");
+        queue_->Flush();
+        ASSERT_TRUE(RunUntil([&] { return queue_->InFlight() == 0; }));
+    }
+    EXPECT_EQ(allocated, pool_.Allocated());
+    EXPECT_EQ(11u, queue_->GetStats().writes);
+    EXPECT_EQ(0, drained_);
+}
+
+TEST_F(WriteQueueTest, Backpressure) {
+    MakeQueue({.high_water = 64 << 10, .low_water = 16 << 10});
+    // nobody reads, the socket buffer fills up
+    std::string chunk(16 << 10, 'x');
+    size_t written = 0;
+    for (int i = 0; i < 1000 && !queue_->Congested(); i++) {
+        queue_->Write(chunk);
+        queue_->Flush();
+        written += chunk.size();
+    }
+    ASSERT_TRUE(queue_->Congested());
+    EXPECT_EQ(0, drained_);
+
+    StartReading();
+    ASSERT_TRUE(RunUntil([&] { return received_.size() == written; }));
+    EXPECT_EQ(1, drained_);
+    EXPECT_FALSE(queue_->Congested());
+}
+
+TEST_F(WriteQueueTest, WriteError) {
+    MakeQueue();
+    uv_read_stop(Stream(0));
+    // libuv holds on to the request until its callback ran
+    bool shut = false;
+    uv_shutdown_t req;
+    req.data = &shut;
+    uv_shutdown(&req, Stream(0), [](uv_shutdown_t* req, int) {
+        *static_cast<bool*>(req->data) = true;
+    });
+    queue_->Write("late");
+    EXPECT_NE(0, queue_->Flush());
+    EXPECT_NE(0, queue_->status());
+    // dropped from now on
+    queue_->Write("later");
+    EXPECT_EQ(0u, queue_->Queued());
+    EXPECT_EQ(pool_.Allocated(), pool_.Idle());
+    EXPECT_TRUE(RunUntil([&] { return shut; }));
+}
+
+}  // namespace
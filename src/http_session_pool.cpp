@@ -0,0 +1,64 @@
+#include "http_session_pool.h"
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/strip.h"
+
+namespace ryu {
+
+HttpSessionPool& HttpSessionPool::Default() {
+    static HttpSessionPool* pool = new HttpSessionPool();
+    return *pool;
+}
+
+std::string HttpSessionPool::HostKey(absl::string_view url) {
+    size_t scheme_end = url.find("://");
+    if (scheme_end == absl::string_view::npos) return {};
+    std::string scheme = absl::AsciiStrToLower(url.substr(0, scheme_end));
+    absl::string_view authority = url.substr(scheme_end + 3);
+    authority = authority.substr(0, authority.find_first_of("/?#"));
+    // drop userinfo
+    size_t at = authority.rfind('@');
+    if (at != absl::string_view::npos) authority.remove_prefix(at + 1);
+    if (authority.empty()) return {};
+
+    // a port follows the last colon, unless that colon is inside an IPv6 literal
+    size_t colon = authority.rfind(':');
+    size_t bracket = authority.rfind(']');
+    bool has_port = colon != absl::string_view::npos &&
+                    (bracket == absl::string_view::npos || colon > bracket);
+    std::string host = absl::AsciiStrToLower(has_port ? authority.substr(0, colon) : authority);
+    if (has_port) return absl::StrCat(scheme, "://", host, authority.substr(colon));
+    if (scheme == "https") return absl::StrCat(scheme, "://", host, ":443");
+    return absl::StrCat(scheme, "://", host, ":80");
+}
+
+HttpSessionPool::Lease HttpSessionPool::Acquire(absl::string_view url) {
+    std::string key = HostKey(url);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto iter = idle_.find(key);
+        if (iter != idle_.end() && !iter->second.empty()) {
+            auto session = std::move(iter->second.back());
+            iter->second.pop_back();
+            return Lease(this, std::move(key), std::move(session));
+        }
+    }
+    return Lease(this, std::move(key), std::make_unique<cpr::Session>());
+}
+
+size_t HttpSessionPool::IdleCount(absl::string_view url) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = idle_.find(HostKey(url));
+    return iter == idle_.end() ? 0 : iter->second.size();
+}
+
+void HttpSessionPool::Release(const std::string& host_key, std::unique_ptr<cpr::Session> session) {
+    if (host_key.empty()) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& idle = idle_[host_key];
+    // most recently used sessions are handed out first, their connections are the warmest
+    if (idle.size() < max_idle_per_host_) idle.push_back(std::move(session));
+}
+
+}  // namespace ryu
@@ -0,0 +1,72 @@
+#ifndef RYU_HTTP_SESSION_POOL_H
+#define RYU_HTTP_SESSION_POOL_H
+
+#include <cpr/cpr.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+
+namespace ryu {
+
+// Idle cpr sessions grouped by scheme://host:port.
+// A session keeps its curl handle, so a request on a reused session rides the kept-alive
+// connection and resumes the TLS session of the previous one instead of handshaking again.
+// Concurrent requests to one host each lease their own session. Thread safe.
+class HttpSessionPool {
+  public:
+    static constexpr size_t kDefaultMaxIdlePerHost = 4;
+
+    // Returns the session to the pool when destroyed, unless Discard()ed.
+    class Lease {
+      public:
+        Lease(HttpSessionPool* pool, std::string host_key, std::unique_ptr<cpr::Session> session)
+            : pool_(pool), host_key_(std::move(host_key)), session_(std::move(session)) {}
+        ~Lease() {
+            if (session_) pool_->Release(host_key_, std::move(session_));
+        }
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        Lease(Lease&&) noexcept = default;
+
+        cpr::Session* operator->() { return session_.get(); }
+        cpr::Session& operator*() { return *session_; }
+        // Drop the session, e.g. after a transport error left its connection unusable
+        void Discard() { session_.reset(); }
+
+      private:
+        HttpSessionPool* pool_;
+        std::string host_key_;
+        std::unique_ptr<cpr::Session> session_;
+    };
+
+    // Shared by all tracker requests of the process
+    static HttpSessionPool& Default();
+
+    explicit HttpSessionPool(size_t max_idle_per_host = kDefaultMaxIdlePerHost)
+        : max_idle_per_host_(max_idle_per_host) {}
+    HttpSessionPool(const HttpSessionPool&) = delete;
+    HttpSessionPool& operator=(const HttpSessionPool&) = delete;
+
+    // Take an idle session for the host of `url`, or create one
+    Lease Acquire(absl::string_view url);
+    [[nodiscard]] size_t IdleCount(absl::string_view url);
+
+    // "scheme://host:port" with the default port filled in, empty if `url` can't be parsed
+    static std::string HostKey(absl::string_view url);
+
+  private:
+    void Release(const std::string& host_key, std::unique_ptr<cpr::Session> session);
+
+    const size_t max_idle_per_host_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::vector<std::unique_ptr<cpr::Session>>> idle_;
+};
+
+}  // namespace ryu
+
+#endif  // RYU_HTTP_SESSION_POOL_H
@@ -1,9 +1,36 @@
+#include <algorithm>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
 
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
 #include "ryu/app.h"
 #include <uv.h>
 
+ABSL_FLAG(std::vector<std::string>, rpc_listen, {"[::1]:8989"},
+          "Comma separated RPC addresses, host:port or unix:<path>");
+ABSL_FLAG(int, rpc_backlog, 512, "Pending connections queued per RPC listener");
+ABSL_FLAG(int, rpc_accept_batch, 64, "RPC connections accepted per loop iteration");
+ABSL_FLAG(std::string, metrics_listen, "",
+          "Address serving Prometheus metrics over HTTP, e.g. [::1]:9090, empty to disable");
+
 int main(int argc, char* argv[]) {
-    ryu::App app(uv_default_loop());
+    absl::ParseCommandLine(argc, argv);
+    int accept_batch = std::max(1, absl::GetFlag(FLAGS_rpc_accept_batch));
+    ryu::App::Options options{
+        // one shard per core, the main loop is mostly idle
+        .shards = std::thread::hardware_concurrency(),
+        // the resume journal and downloads live in the working directory
+        .data_dir = ".",
+        .rpc_listen = absl::GetFlag(FLAGS_rpc_listen),
+        .metrics_listen = absl::GetFlag(FLAGS_metrics_listen),
+        .rpc = {
+            .backlog = absl::GetFlag(FLAGS_rpc_backlog),
+            .accept_batch = static_cast<size_t>(accept_batch),
+        },
+    };
+    ryu::App app(uv_default_loop(), std::move(options));
     return app.Run().Expect("Application failure");
-}
\ No newline at end of file
+}
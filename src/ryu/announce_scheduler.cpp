@@ -0,0 +1,395 @@
+#include "announce_scheduler.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "common/metrics.h"
+#include "utils/uv_callbacks.h"
+
+namespace ryu {
+
+namespace {
+auto& registry = metrics::Registry::Global();
+metrics::Counter* const announces_total =
+    registry.GetCounter("ryu_tracker_announces_total", "Announces that got a reply or failed");
+metrics::Counter* const announce_failures_total = registry.GetCounter(
+    "ryu_tracker_announce_failures_total", "Announces that failed or got a failure reason");
+metrics::Histogram* const announce_seconds = registry.GetHistogram(
+    "ryu_tracker_announce_seconds", "Time from sending an announce to its outcome", 1e-9);
+}  // namespace
+
+AnnounceScheduler::AnnounceScheduler(uv_loop_t* loop, Options options, PeersCallback on_peers,
+                                     net::Resolver* resolver)
+    : loop_(loop),
+      options_(options),
+      on_peers_(std::move(on_peers)),
+      rng_(std::random_device()()),
+      resolver_(resolver),
+      timers_(loop, options.tick_ms) {
+    if (resolver_ == nullptr) {
+        own_resolver_ = std::make_unique<net::Resolver>(loop_);
+        resolver_ = own_resolver_.get();
+    }
+}
+
+Result<ResultVoid, std::string> AnnounceScheduler::Start() {
+    udp_client_ = std::make_unique<UdpTrackerClient>(loop_, options_.udp, resolver_);
+    VALUE_OR_RAISE(udp_client_->Start());
+    return timers_.Start();
+}
+
+void AnnounceScheduler::Halt(std::function<void()> on_closed) {
+    if (draining_) return;
+    draining_ = true;
+    on_closed_ = std::move(on_closed);
+
+    for (auto& [url, tracker] : trackers_) tracker->queue.clear();
+    torrents_.clear();
+    http_waiting_.clear();
+    for (auto iter = outgoing_.begin(); iter != outgoing_.end();) {
+        if (iter->second->queued) {
+            uv_cancel(reinterpret_cast<uv_req_t*>(iter->first));
+            ++iter;
+        } else {
+            resolver_->Cancel(iter->second->resolve_id);
+            iter = outgoing_.erase(iter);
+        }
+    }
+
+    // the timer goes last, so that the final callback never runs inside the udp client
+    auto close_timer = [this] {
+        udp_closed_ = true;
+        if (own_resolver_) {
+            own_resolver_->Halt([this] {
+                resolver_closed_ = true;
+                CheckHalted();
+            });
+        } else {
+            resolver_closed_ = true;
+        }
+        timers_.Halt([this] {
+            timer_closed_ = true;
+            CheckHalted();
+        });
+    };
+    if (udp_client_) {
+        udp_client_->Halt(close_timer);
+    } else {
+        close_timer();
+    }
+}
+
+void AnnounceScheduler::CheckHalted() {
+    if (!draining_) return;
+    if (!udp_closed_ || !resolver_closed_ || !timer_closed_ || !outgoing_.empty()) return;
+    auto cb = std::move(on_closed_);
+    on_closed_ = nullptr;
+    // may delete this
+    if (cb) cb();
+}
+
+AnnounceScheduler::TrackerState* AnnounceScheduler::GetTracker(const std::string& url) {
+    auto& tracker = trackers_[url];
+    if (!tracker) {
+        tracker = std::make_unique<TrackerState>();
+        tracker->url = url;
+        tracker->udp = absl::StartsWith(url, "udp://");
+    }
+    return tracker.get();
+}
+
+void AnnounceScheduler::AddTorrent(std::vector<std::vector<std::string>> tiers,
+                                   AnnounceParams params) {
+    if (draining_ || torrents_.count(params.info_hash) > 0) return;
+    auto t = std::make_unique<Torrent>();
+    std::unordered_set<std::string> known;
+    for (auto& urls : tiers) {
+        std::vector<TrackerState*> tier;
+        for (auto& url : urls) {
+            if (!absl::StartsWith(url, "http://") && !absl::StartsWith(url, "https://") &&
+                !absl::StartsWith(url, "udp://"))
+                continue;
+            if (!known.insert(url).second) continue;
+            tier.push_back(GetTracker(url));
+        }
+        if (tier.empty()) continue;
+        // BEP-0012: shuffle each tier once, when the torrent is added
+        std::shuffle(tier.begin(), tier.end(), rng_);
+        t->tiers.push_back(std::move(tier));
+    }
+    params.event = AnnounceEvent::STARTED;
+    t->params = std::move(params);
+    Torrent* ptr = t.get();
+    torrents_[ptr->params.info_hash] = std::move(t);
+    // on the next tick, torrents added together go out together
+    ScheduleAt(ptr, uv_now(loop_));
+}
+
+void AnnounceScheduler::UpdateStats(const std::string& info_hash, uint64_t uploaded,
+                                    uint64_t downloaded, uint64_t left) {
+    auto iter = torrents_.find(info_hash);
+    if (iter == torrents_.end()) return;
+    Torrent* t = iter->second.get();
+    bool completed = t->params.left > 0 && left == 0;
+    t->params.uploaded = uploaded;
+    t->params.downloaded = downloaded;
+    t->params.left = left;
+    if (!completed || t->stopping) return;
+    t->params.event = AnnounceEvent::COMPLETED;
+    // while announcing, the reply handler picks up the new event
+    if (!t->announcing) ScheduleAt(t, std::max<uint64_t>(uv_now(loop_), t->not_before_ms));
+}
+
+void AnnounceScheduler::RemoveTorrent(const std::string& info_hash) {
+    auto iter = torrents_.find(info_hash);
+    if (iter == torrents_.end()) return;
+    Torrent* t = iter->second.get();
+    if (t->stopping) return;
+    t->stopping = true;
+    t->params.event = AnnounceEvent::STOPPED;
+    t->timer.Cancel();
+    // otherwise the reply handler sends STOPPED once the current announce is answered
+    if (!t->announcing) TryNext(t);
+}
+
+std::optional<uint64_t> AnnounceScheduler::NextAnnounce(const std::string& info_hash) const {
+    auto iter = torrents_.find(info_hash);
+    if (iter == torrents_.end() || !iter->second->timer.Scheduled()) return {};
+    return iter->second->timer.Deadline();
+}
+
+void AnnounceScheduler::ScheduleAt(Torrent* t, uint64_t when_ms) {
+    timers_.ScheduleAt(&t->timer, when_ms, [this, t] { Announce(t); });
+}
+
+void AnnounceScheduler::Announce(Torrent* t) {
+    if (t->announcing) return;
+    t->tier = 0;
+    t->index = 0;
+    TryNext(t);
+}
+
+void AnnounceScheduler::TryNext(Torrent* t) {
+    uint64_t now = uv_now(loop_);
+    if (t->stopping) {
+        // a single attempt, only worth it if a tracker knows about us
+        TrackerState* tracker = t->last_working;
+        t->last_working = nullptr;
+        if (tracker == nullptr) return Forget(t);
+        t->announcing = true;
+        tracker->queue.push_back(t);
+        return Pump(tracker);
+    }
+
+    for (; t->tier < t->tiers.size(); t->tier++, t->index = 0) {
+        const auto& tier = t->tiers[t->tier];
+        for (; t->index < tier.size(); t->index++) {
+            TrackerState* tracker = tier[t->index];
+            if (tracker->retry_at_ms > now) continue;
+            t->announcing = true;
+            tracker->queue.push_back(t);
+            return Pump(tracker);
+        }
+    }
+
+    // every tracker failed or is backing off, no use coming back before one of them recovers
+    t->announcing = false;
+    t->retries++;
+    uint64_t earliest = UINT64_MAX;
+    for (const auto& tier : t->tiers)
+        for (const TrackerState* tracker : tier)
+            earliest = std::min(earliest, std::max(tracker->retry_at_ms, now));
+    if (earliest == UINT64_MAX) return;  // no trackers at all
+    ScheduleAt(t, std::max(now + Backoff(t->retries), earliest));
+}
+
+void AnnounceScheduler::Pump(TrackerState* tracker) {
+    // requests failing synchronously would otherwise recurse through the whole queue
+    if (tracker->pumping) return;
+    tracker->pumping = true;
+    while (!draining_ && tracker->in_flight < options_.max_in_flight_per_tracker &&
+           !tracker->queue.empty()) {
+        Torrent* t = tracker->queue.front();
+        tracker->queue.pop_front();
+        if (tracker->retry_at_ms > uv_now(loop_) && !t->stopping) {
+            // the tracker failed while `t` was queued, move on without asking it again
+            t->index++;
+            TryNext(t);
+            continue;
+        }
+        tracker->in_flight++;
+        Send(tracker, t);
+    }
+    tracker->pumping = false;
+}
+
+void AnnounceScheduler::Send(TrackerState* tracker, Torrent* t) {
+    t->in_flight_event = t->params.event;
+    t->sent_ns = uv_hrtime();
+    if (tracker->udp) {
+        udp_client_->Announce(tracker->url, t->params,
+                              [this, tracker, t](Result<TrackerReply, std::string> reply) {
+                                  HandleReply(tracker, t, std::move(reply));
+                              });
+        return;
+    }
+
+    auto req = std::make_unique<HttpRequest>();
+    req->data = this;
+    req->tracker = tracker;
+    req->torrent = t;
+    req->url = tracker->url;
+    req->params = t->params;
+    HttpRequest* ptr = req.get();
+    outgoing_[ptr] = std::move(req);
+
+    // TLS needs the host name, https trackers are left to curl
+    auto service = net::RemoteService::FromUrl(tracker->url);
+    if (!absl::StartsWith(tracker->url, "http://") || !service || service.Value().IsResolved()) {
+        return QueueHttpAnnounce(ptr);
+    }
+    net::Resolver::RequestId id = service.Value().Resolve(
+        resolver_, [this, ptr](Result<std::vector<net::Endpoint>, std::string> endpoints) {
+            if (!outgoing_.count(ptr)) return;
+            ptr->resolve_id = 0;
+            if (!endpoints) {
+                TrackerState* tracker = ptr->tracker;
+                Torrent* t = ptr->torrent;
+                outgoing_.erase(ptr);
+                return HandleReply(tracker, t, Err(endpoints.Error()));
+            }
+            ptr->resolved = endpoints.Value().front().Ip();
+            QueueHttpAnnounce(ptr);
+        });
+    // may have completed already
+    if (outgoing_.count(ptr) && !ptr->resolved) ptr->resolve_id = id;
+}
+
+void AnnounceScheduler::QueueHttpAnnounce(HttpRequest* req) {
+    if (http_running_ >= options_.max_http_running) {
+        http_waiting_.push_back(req);
+        return;
+    }
+    int retcode =
+        uv_queue_work(loop_, req, uv_callbacks::Work<&AnnounceScheduler::HttpAnnounceWork>,
+                      uv_callbacks::AfterWork<&AnnounceScheduler::HttpAnnounceDone>);
+    if (retcode != 0) {
+        TrackerState* tracker = req->tracker;
+        Torrent* t = req->torrent;
+        outgoing_.erase(req);
+        return HandleReply(tracker, t,
+                           Err(absl::StrCat("uv_queue_work() failed: ", uv_strerror(retcode))));
+    }
+    req->queued = true;
+    http_running_++;
+}
+
+void AnnounceScheduler::StartWaitingHttp() {
+    while (!http_waiting_.empty() && http_running_ < options_.max_http_running) {
+        HttpRequest* req = http_waiting_.front();
+        http_waiting_.pop_front();
+        QueueHttpAnnounce(req);
+    }
+}
+
+void AnnounceScheduler::HttpAnnounceWork(uv_work_t* req) {
+    auto* request = static_cast<HttpRequest*>(req);
+    request->reply = Trackers::Announce(request->url, request->params, request->resolved);
+}
+
+void AnnounceScheduler::HttpAnnounceDone(uv_work_t* req, int status) {
+    auto iter = outgoing_.find(static_cast<HttpRequest*>(req));
+    assert(iter != outgoing_.end());
+    std::unique_ptr<HttpRequest> request = std::move(iter->second);
+    outgoing_.erase(iter);
+    http_running_--;
+    // first come first served, before the reply sends more
+    if (!draining_) StartWaitingHttp();
+    if (status != 0 || !request->reply) {
+        HandleReply(request->tracker, request->torrent, Err("http announce cancelled"));
+    } else {
+        HandleReply(request->tracker, request->torrent, std::move(*request->reply));
+    }
+    CheckHalted();
+}
+
+void AnnounceScheduler::HandleReply(TrackerState* tracker, Torrent* t,
+                                    Result<TrackerReply, std::string> reply) {
+    tracker->in_flight--;
+    // torrents are gone
+    if (draining_) return;
+
+    uint64_t now = uv_now(loop_);
+    t->announcing = false;
+    if (reply.Ok()) {
+        tracker->failures = 0;
+        tracker->retry_at_ms = 0;
+    } else {
+        // unreachable, every torrent skips it for a while
+        tracker->failures++;
+        tracker->retry_at_ms = now + Backoff(tracker->failures);
+    }
+    bool success = reply.Ok() && reply.Value().failure_reason.empty();
+    announces_total->Add();
+    if (!success) announce_failures_total->Add();
+    announce_seconds->Record(uv_hrtime() - t->sent_ns);
+
+    if (t->stopping) {
+        if (t->in_flight_event == AnnounceEvent::STOPPED) {
+            Forget(t);
+        } else {
+            // removed while announcing, now tell the tracker we are gone
+            if (success) t->last_working = tracker;
+            TryNext(t);
+        }
+        return Pump(tracker);
+    }
+
+    if (!success) {
+        // a failure reason only rules out this tracker for this torrent
+        t->index++;
+        TryNext(t);
+        return Pump(tracker);
+    }
+
+    // BEP-0012: the tracker that answered goes to the front of its tier
+    auto& tier = t->tiers[t->tier];
+    std::rotate(tier.begin(), tier.begin() + t->index, tier.begin() + t->index + 1);
+    t->last_working = tracker;
+    t->retries = 0;
+
+    TrackerReply& r = reply.Value();
+    int64_t min_interval = std::max(r.min_interval, options_.min_interval_s);
+    int64_t interval =
+        std::max(r.interval > 0 ? r.interval : options_.default_interval_s, min_interval);
+    t->not_before_ms = now + min_interval * 1000;
+    if (t->params.event == t->in_flight_event) {
+        t->params.event = AnnounceEvent::NONE;
+        ScheduleAt(t, now + interval * 1000);
+    } else {
+        // the download finished while announcing
+        ScheduleAt(t, t->not_before_ms);
+    }
+
+    Trackers::DedupPeers(&r.peers, &t->seen);
+    Pump(tracker);
+    // last, the callback may remove the torrent
+    if (!r.peers.empty()) on_peers_(std::string(t->params.info_hash), std::move(r.peers));
+}
+
+void AnnounceScheduler::Forget(Torrent* t) {
+    t->timer.Cancel();
+    std::string info_hash = t->params.info_hash;
+    torrents_.erase(info_hash);
+}
+
+uint64_t AnnounceScheduler::Backoff(int failures) {
+    int shift = std::min(failures - 1, 30);
+    uint64_t delay = std::min(options_.retry_base_ms << std::max(shift, 0), options_.retry_max_ms);
+    std::uniform_real_distribution<double> jitter(1 - options_.jitter, 1 + options_.jitter);
+    return static_cast<uint64_t>(delay * jitter(rng_));
+}
+
+}  // namespace ryu
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <uv.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "result.h"
+#include "trackers.h"
+#include "udp_tracker.h"
+#include "utils/timer_service.h"
+
+namespace ryu {
+
+// Keeps every torrent announced to its trackers from one libuv loop.
+//
+// Trackers are tried in BEP-0012 order: tiers in order, trackers within a tier shuffled once and
+// the one that answers moved to the front of its tier. Announces follow the tracker `interval`,
+// never come sooner than `min interval`, and retry with jittered exponential backoff when every
+// tracker failed. Tracker state is shared by all torrents: a tracker that failed is skipped by
+// everyone until its backoff ends, and each tracker has a bounded number of requests in flight
+// with the rest queued behind them. Due times live in the scheduler's own TimerService.
+//
+// HTTP announces run on the libuv threadpool over pooled sessions with connect and total
+// timeouts, at most `max_http_running` at a time. UDP announces share one UdpTrackerClient.
+// Tracker host names are looked up through a Resolver on the loop, so worker threads never
+// block on DNS for plain http:// trackers.
+class AnnounceScheduler {
+  public:
+    // New peers of a torrent, never ones handed out before
+    using PeersCallback =
+        std::function<void(const std::string& info_hash, std::vector<PeerInfo> peers)>;
+
+    struct Options {
+        uint64_t tick_ms = 1000;
+        // used when the tracker reply has no usable interval
+        int64_t default_interval_s = 1800;
+        // lower bound of any interval, whatever the tracker says
+        int64_t min_interval_s = 60;
+        uint64_t retry_base_ms = 15000;
+        uint64_t retry_max_ms = 3600000;
+        // +- fraction applied to retry delays
+        double jitter = 0.25;
+        size_t max_in_flight_per_tracker = 8;
+        // HTTP announces each block a threadpool thread, which DNS lookups, file access and
+        // hashing share. The rest wait for one of these to finish.
+        size_t max_http_running = 2;
+        UdpTrackerClient::Options udp{};
+    };
+
+    // `resolver` must outlive the scheduler, a private one is used if it's null
+    AnnounceScheduler(uv_loop_t* loop, Options options, PeersCallback on_peers,
+                      net::Resolver* resolver = nullptr);
+    AnnounceScheduler(const AnnounceScheduler&) = delete;
+    AnnounceScheduler& operator=(const AnnounceScheduler&) = delete;
+
+    Result<ResultVoid, std::string> Start();
+    // Drop all torrents and release every handle, `on_closed` is called once the scheduler can
+    // be destroyed. Announces running on the threadpool are waited for.
+    void Halt(std::function<void()> on_closed);
+
+    // Announce `params.info_hash` with event STARTED now. `tiers` is the BEP-0012 announce-list,
+    // or just {{announce}}. Unsupported urls are ignored.
+    void AddTorrent(std::vector<std::vector<std::string>> tiers, AnnounceParams params);
+    // Update the transfer counters of the next announce. Finishing the download announces
+    // COMPLETED as soon as the min interval allows.
+    void UpdateStats(const std::string& info_hash, uint64_t uploaded, uint64_t downloaded,
+                     uint64_t left);
+    // Announce STOPPED to the tracker that last answered, then forget the torrent
+    void RemoveTorrent(const std::string& info_hash);
+
+    [[nodiscard]] size_t TorrentCount() const { return torrents_.size(); }
+    // Due time of the next announce of a torrent in uv_now() ms, nullopt while it is announcing
+    [[nodiscard]] std::optional<uint64_t> NextAnnounce(const std::string& info_hash) const;
+
+    // UV callbacks
+    // runs on a threadpool thread, only touches the request
+    void HttpAnnounceWork(uv_work_t* req);
+    void HttpAnnounceDone(uv_work_t* req, int status);
+
+  private:
+    struct Torrent;
+    struct TrackerState {
+        std::string url;
+        bool udp = false;
+        int failures = 0;
+        uint64_t retry_at_ms = 0;
+        size_t in_flight = 0;
+        std::deque<Torrent*> queue;
+        bool pumping = false;
+    };
+
+    struct Torrent {
+        AnnounceParams params;
+        std::vector<std::vector<TrackerState*>> tiers;
+        // tracker being tried, (tier, index) into `tiers`
+        size_t tier = 0;
+        size_t index = 0;
+        // queued at or in flight to a tracker
+        bool announcing = false;
+        bool stopping = false;
+        // event of the announce in flight
+        AnnounceEvent in_flight_event = AnnounceEvent::NONE;
+        // uv_hrtime() when it was sent
+        uint64_t sent_ns = 0;
+        int retries = 0;
+        uint64_t not_before_ms = 0;
+        TrackerState* last_working = nullptr;
+        TimerService::Timer timer;
+        std::unordered_set<net::Endpoint> seen;
+    };
+
+    struct HttpRequest : public uv_work_t {
+        TrackerState* tracker;
+        Torrent* torrent;
+        std::string url;
+        AnnounceParams params;
+        std::optional<net::IpAddress> resolved;
+        // pending lookup of the tracker host, the work is queued once it completes
+        net::Resolver::RequestId resolve_id{};
+        bool queued = false;
+        std::optional<Result<TrackerReply, std::string>> reply;
+    };
+
+    TrackerState* GetTracker(const std::string& url);
+    void ScheduleAt(Torrent* t, uint64_t when_ms);
+    // Start a round over the tiers
+    void Announce(Torrent* t);
+    // Queue `t` at the next tracker not backing off, or schedule a retry if none is left
+    void TryNext(Torrent* t);
+    void Pump(TrackerState* tracker);
+    void Send(TrackerState* tracker, Torrent* t);
+    // Run on the threadpool, or wait for a slot
+    void QueueHttpAnnounce(HttpRequest* req);
+    void StartWaitingHttp();
+    void HandleReply(TrackerState* tracker, Torrent* t, Result<TrackerReply, std::string> reply);
+    void Forget(Torrent* t);
+    uint64_t Backoff(int failures);
+    void CheckHalted();
+
+    uv_loop_t* const loop_;
+    const Options options_;
+    const PeersCallback on_peers_;
+    std::mt19937 rng_;
+
+    net::Resolver* resolver_;
+    std::unique_ptr<net::Resolver> own_resolver_;
+    std::unique_ptr<UdpTrackerClient> udp_client_;
+    TimerService timers_;
+
+    std::unordered_map<std::string, std::unique_ptr<TrackerState>> trackers_;
+    // keyed by info hash
+    std::unordered_map<std::string, std::unique_ptr<Torrent>> torrents_;
+    std::unordered_map<HttpRequest*, std::unique_ptr<HttpRequest>> outgoing_;
+    // of `outgoing_`, ready but over `max_http_running`
+    std::deque<HttpRequest*> http_waiting_;
+    size_t http_running_ = 0;
+
+    bool draining_ = false;
+    bool udp_closed_ = false;
+    bool resolver_closed_ = false;
+    bool timer_closed_ = false;
+    std::function<void()> on_closed_;
+};
+
+}  // namespace ryu
@@ -0,0 +1,182 @@
+#include "ryu/announce_scheduler.h"
+
+#include <endian.h>
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "utils/uv_callbacks.h"
+
+using namespace ryu;
+
+namespace {
+
+// BEP-0015 tracker answering connect and announce, or swallowing everything
+class MockUdpTracker {
+  public:
+    explicit MockUdpTracker(uv_loop_t* loop) {
+        uv_udp_init(loop, &socket_);
+        socket_.data = this;
+        sockaddr_in addr{};
+        uv_ip4_addr("127.0.0.1", 0, &addr);
+        EXPECT_EQ(0, uv_udp_bind(&socket_, reinterpret_cast<sockaddr*>(&addr), 0));
+        int len = sizeof(addr);
+        uv_udp_getsockname(&socket_, reinterpret_cast<sockaddr*>(&addr), &len);
+        url_ = absl::StrCat("udp://127.0.0.1:", be16toh(addr.sin_port), "/announce");
+        uv_udp_recv_start(&socket_, uv_callbacks::Alloc<&MockUdpTracker::Alloc>,
+                          uv_callbacks::UdpRecv<&MockUdpTracker::Received>);
+    }
+
+    void Close() { uv_close(reinterpret_cast<uv_handle_t*>(&socket_), nullptr); }
+    const std::string& url() const { return url_; }
+
+    void Alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+        buf->base = buf_;
+        buf->len = sizeof(buf_);
+    }
+
+    void Received(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf, const sockaddr* addr,
+                  unsigned flags) {
+        if (nread < 16 || addr == nullptr) return;
+        received++;
+        if (dead) return;
+        uint32_t action = Get32(buf->base + 8);
+        std::string reply;
+        Put32(&reply, action);
+        reply.append(buf->base + 12, 4);  // transaction id
+        if (action == 0) {
+            Put32(&reply, 0x11223344);
+            Put32(&reply, 0x55667788);
+        } else if (action == 1) {
+            announces++;
+            events.push_back(Get32(buf->base + 80));
+            Put32(&reply, interval);
+            Put32(&reply, 0);  // leechers
+            Put32(&reply, 0);  // seeders
+            reply += peers;
+        }
+        uv_buf_t b = uv_buf_init(const_cast<char*>(reply.data()), reply.size());
+        EXPECT_EQ(static_cast<int>(reply.size()), uv_udp_try_send(&socket_, &b, 1, addr));
+    }
+
+    bool dead = false;
+    uint32_t interval = 1800;
+    std::string peers = std::string("\x0a\x00\x00\x01\x1a\xe1", 6);
+
+    int received = 0;
+    int announces = 0;
+    std::vector<uint32_t> events;
+
+  private:
+    static uint32_t Get32(const char* p) { return be32toh(*reinterpret_cast<const uint32_t*>(p)); }
+    static void Put32(std::string* s, uint32_t v) {
+        v = htobe32(v);
+        s->append(reinterpret_cast<char*>(&v), 4);
+    }
+
+    uv_udp_t socket_;
+    std::string url_;
+    char buf_[2048];
+};
+
+class AnnounceSchedulerTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        uv_loop_init(&loop_);
+        options_.tick_ms = 5;
+        options_.min_interval_s = 0;
+        options_.udp.base_timeout_ms = 20;
+        options_.udp.max_retransmit = 1;
+    }
+    void TearDown() override { EXPECT_EQ(0, uv_loop_close(&loop_)); }
+
+    std::unique_ptr<AnnounceScheduler> MakeScheduler() {
+        auto scheduler = std::make_unique<AnnounceScheduler>(
+            &loop_, options_, [this](const std::string& info_hash, std::vector<PeerInfo> peers) {
+                found_peers_ += peers.size();
+            });
+        EXPECT_TRUE(scheduler->Start().Ok());
+        return scheduler;
+    }
+
+    static AnnounceParams Params(char c, uint64_t left = 100) {
+        return AnnounceParams{.info_hash = std::string(20, c), .left = left};
+    }
+
+    // Announced, and the next announce is at least `ms` away
+    bool WaitingFor(AnnounceScheduler* scheduler, char c, uint64_t ms) {
+        auto next = scheduler->NextAnnounce(std::string(20, c));
+        return next && *next >= uv_now(&loop_) + ms;
+    }
+
+    template <typename Pred>
+    bool RunUntil(Pred pred) {
+        for (int i = 0; i < 1000 && !pred(); i++) uv_run(&loop_, UV_RUN_ONCE);
+        return pred();
+    }
+
+    void Shutdown(std::unique_ptr<AnnounceScheduler> scheduler,
+                  std::initializer_list<MockUdpTracker*> trackers) {
+        bool closed = false;
+        scheduler->Halt([&] { closed = true; });
+        for (auto* tracker : trackers) tracker->Close();
+        ASSERT_TRUE(RunUntil([&] { return closed; }));
+        scheduler.reset();
+        uv_run(&loop_, UV_RUN_DEFAULT);
+    }
+
+    uv_loop_t loop_;
+    AnnounceScheduler::Options options_;
+    size_t found_peers_ = 0;
+};
+
+TEST_F(AnnounceSchedulerTest, FallsBackWithinTierAndHonoursInterval) {
+    MockUdpTracker dead(&loop_), good(&loop_);
+    dead.dead = true;
+    auto scheduler = MakeScheduler();
+    scheduler->AddTorrent({{dead.url(), good.url()}, {"ws://ignored"}}, Params('a'));
+    ASSERT_TRUE(RunUntil([&] { return WaitingFor(scheduler.get(), 'a', 1799 * 1000); }));
+    EXPECT_EQ(1u, found_peers_);
+    EXPECT_EQ(std::vector<uint32_t>{2}, good.events);  // STARTED
+    Shutdown(std::move(scheduler), {&dead, &good});
+}
+
+TEST_F(AnnounceSchedulerTest, FailedTrackerIsSkippedByQueuedTorrents) {
+    MockUdpTracker dead(&loop_);
+    dead.dead = true;
+    options_.max_in_flight_per_tracker = 1;
+    options_.retry_base_ms = 60000;
+    auto scheduler = MakeScheduler();
+    scheduler->AddTorrent({{dead.url()}}, Params('a'));
+    scheduler->AddTorrent({{dead.url()}}, Params('b'));
+    // retried after the jittered backoff
+    ASSERT_TRUE(RunUntil([&] {
+        return WaitingFor(scheduler.get(), 'a', 44000) && WaitingFor(scheduler.get(), 'b', 44000);
+    }));
+    // connect and one retransmit for the first torrent, nothing for the second
+    EXPECT_EQ(2, dead.received);
+    Shutdown(std::move(scheduler), {&dead});
+}
+
+TEST_F(AnnounceSchedulerTest, CompletedAndStopped) {
+    MockUdpTracker tracker(&loop_);
+    auto scheduler = MakeScheduler();
+    scheduler->AddTorrent({{tracker.url()}}, Params('a'));
+    ASSERT_TRUE(RunUntil([&] { return WaitingFor(scheduler.get(), 'a', 1000); }));
+
+    scheduler->UpdateStats(std::string(20, 'a'), 0, 100, 0);
+    ASSERT_TRUE(RunUntil([&] { return tracker.announces == 2; }));
+    ASSERT_TRUE(RunUntil([&] { return WaitingFor(scheduler.get(), 'a', 1000); }));
+    // same peer again, not reported twice
+    EXPECT_EQ(1u, found_peers_);
+
+    scheduler->RemoveTorrent(std::string(20, 'a'));
+    ASSERT_TRUE(RunUntil([&] { return scheduler->TorrentCount() == 0; }));
+    EXPECT_EQ((std::vector<uint32_t>{2, 1, 3}), tracker.events);
+    Shutdown(std::move(scheduler), {&tracker});
+}
+
+}  // namespace
@@ -2,27 +2,115 @@
 
 #include <memory>
 #include "result.h"
+#include <algorithm>
 #include <cassert>
+#include <functional>
 #include <iostream>
 
+#include "absl/strings/escaping.h"
+
 namespace ryu {
 
+namespace {
+// how often idle tasks are looked for
+constexpr uint64_t kIdleCheckMs = 30000;
+// how often status changes are pushed to subscribers
+constexpr uint64_t kStatusTickMs = 1000;
+
+const char* SlotName(TaskQueue::Slot slot) {
+    switch (slot) {
+        case TaskQueue::Slot::CHECKING:
+            return "checking";
+        case TaskQueue::Slot::DOWNLOADING:
+            return "downloading";
+        case TaskQueue::Slot::SEEDING:
+            return "seeding";
+    }
+    return "";
+}
+
+auto& registry = metrics::Registry::Global();
+metrics::Gauge* const rpc_clients =
+    registry.GetGauge("ryu_rpc_clients", "Connected RPC clients");
+metrics::Gauge* const tasks = registry.GetGauge("ryu_tasks", "Tasks known");
+metrics::Gauge* const tasks_checking =
+    registry.GetGauge("ryu_tasks_checking", "Tasks holding a checking slot");
+metrics::Gauge* const tasks_downloading =
+    registry.GetGauge("ryu_tasks_downloading", "Tasks holding a download slot");
+metrics::Gauge* const tasks_seeding =
+    registry.GetGauge("ryu_tasks_seeding", "Tasks holding a seed slot");
+metrics::Gauge* const tasks_queued =
+    registry.GetGauge("ryu_tasks_queued", "Tasks waiting for any slot");
+metrics::Counter* const tasks_demoted_total =
+    registry.GetCounter("ryu_tasks_demoted_total", "Idle tasks stopped to free their slot");
+}  // namespace
+
 Result<int, std::string> App::Run() {
-    rpc_manager_ = std::make_unique<RpcManager>(this);
-    VALUE_OR_RAISE(rpc_manager_->Listen("[::1]:8989", loop_));
-    std::cout << "Listening on [::1]:8989" << std::endl;
+    mailbox_ = std::make_unique<Mailbox>(loop_);
+    loop_monitor_ = std::make_unique<metrics::LoopMonitor>(loop_);
+    VALUE_OR_RAISE(loop_monitor_->Start());
+    for (size_t i = 0; i < std::max<size_t>(options_.shards, 1); i++) {
+        auto shard = std::make_unique<Shard>(this, i);
+        VALUE_OR_RAISE(shard->Start());
+        shards_.push_back(std::move(shard));
+    }
+    std::cout << "Running " << shards_.size() << " shards" << std::endl;
+    resolver_ = std::make_unique<net::Resolver>(loop_);
+    announce_scheduler_ = std::make_unique<AnnounceScheduler>(
+        loop_, AnnounceScheduler::Options{},
+        [this](const std::string& info_hash, std::vector<PeerInfo> peers) {
+            PeersDiscovered(info_hash, std::move(peers));
+        },
+        resolver_.get());
+    VALUE_OR_RAISE(announce_scheduler_->Start());
+    timers_ = std::make_unique<TimerService>(loop_, 1000);
+    VALUE_OR_RAISE(timers_->Start());
+    task_queue_ = std::make_unique<TaskQueue>(
+        TaskQueue::Options{},
+        [this](TaskQueue::Id id, TaskQueue::Slot slot) { StartTask(id, slot); },
+        [this](TaskQueue::Id id) { StopTask(id); });
+    timers_->Schedule<&App::DemoteIdleTasks>(&idle_timer_, kIdleCheckMs, this);
+    timers_->Schedule<&App::PublishStatus>(&status_timer_, kStatusTickMs, this);
+    resume_store_ = std::make_unique<ResumeStore>(loop_, options_.data_dir + "/ryu.resume");
+    coro::Spawn(RestoreTasks());
+    rpc_manager_ = std::make_unique<RpcManager>(this, options_.rpc);
+    for (const auto& addr : options_.rpc_listen) {
+        VALUE_OR_RAISE(rpc_manager_->Listen(addr, loop_));
+        std::cout << "Listening on " << addr << std::endl;
+    }
+    if (!options_.metrics_listen.empty()) {
+        metrics_manager_ = std::make_unique<RpcManager>(this, options_.rpc, true);
+        VALUE_OR_RAISE(metrics_manager_->Listen(options_.metrics_listen, loop_));
+        std::cout << "Serving metrics on " << options_.metrics_listen << std::endl;
+    }
     return uv_run(loop_, UV_RUN_DEFAULT);
 }
 
-void App::AcceptRpcClient(uv_stream_t* server) {
-    auto client = std::make_shared<RpcClient>(this);
+void App::AcceptRpcClient(uv_stream_t* server, bool metrics_only) {
+    auto client = std::make_shared<RpcClient>(this, &rpc_buffers_, metrics_only);
     client->Accept(server).Expect("Failed to accept client");
     rpc_clients_[client.get()] = client;
+    rpc_clients->Set(rpc_clients_.size());
 }
 
 void App::Halt() {
     draining_ = true;
     if (rpc_manager_) rpc_manager_->Halt();
+    if (metrics_manager_) metrics_manager_->Halt();
+    for (auto& shard : shards_) {
+        if (shard) shard->Halt();
+    }
+    // the resolver goes after its users
+    if (announce_scheduler_) {
+        announce_scheduler_->Halt([this]() { ReleaseAnnounceScheduler(); });
+    } else if (resolver_) {
+        resolver_->Halt([this]() { ReleaseResolver(); });
+    }
+    if (resume_store_) resume_store_->Halt([this]() { ReleaseResumeStore(); });
+    idle_timer_.Cancel();
+    status_timer_.Cancel();
+    if (timers_) timers_->Halt([this]() { ReleaseTimerService(); });
+    if (loop_monitor_) loop_monitor_->Halt([this]() { ReleaseLoopMonitor(); });
     for (auto& [client, ptr] : rpc_clients_) {
         client->Halt();
     }
@@ -31,18 +119,301 @@ void App::Halt() {
 void App::CheckDrainState() {
     if (!draining_) return;
     if (rpc_manager_) return;
+    if (metrics_manager_) return;
+    if (announce_scheduler_) return;
+    if (resolver_) return;
+    if (resume_store_) return;
+    if (timers_) return;
+    if (loop_monitor_) return;
+    for (auto& shard : shards_) {
+        if (shard) return;
+    }
     if (!rpc_clients_.empty()) return;
+    // the shards are done posting
+    if (mailbox_) {
+        mailbox_->Close([this]() {
+            mailbox_.reset();
+            CheckDrainState();
+        });
+        return;
+    }
     uv_stop(loop_);
 }
 
-void App::CreateTask(std::string torrent_file_name) {
-    auto task = std::make_shared<Task>(this, loop_, torrent_file_name);
-    tasks_[task.get()] = task;
+TaskQueue::Id App::CreateTask(std::string torrent_file_name) {
+    if (draining_) return 0;
+    TaskQueue::Id id = next_task_id_++;
+    AddTask(std::make_shared<Task>(this, loop_, id, torrent_file_name, options_.data_dir));
+    return id;
+}
+
+coro::Task<> App::RestoreTasks() {
+    auto saved = co_await resume_store_->Load();
+    if (draining_) co_return;
+    if (!saved) {
+        std::cout << "Failed to load resume data: " << saved.Error() << std::endl;
+        co_return;
+    }
+    for (auto& data : std::move(saved).TakeValue()) {
+        std::string torrent_file = data.torrent_file;
+        std::string save_path = data.save_path;
+        AddTask(std::make_shared<Task>(this, loop_, next_task_id_++, std::move(torrent_file),
+                                       std::move(save_path), std::move(data)));
+    }
+}
+
+void App::AddTask(std::shared_ptr<Task> task) {
+    TaskQueue::Id id = task->id();
+    tasks_[id] = std::move(task);
+    TaskStatusChanged(id);
+    task_queue_->Add(id, 0, uv_now(loop_));
+}
+
+void App::StartTask(TaskQueue::Id id, TaskQueue::Slot slot) {
+    if (draining_) return;
+    Task& task = *tasks_.at(id);
+    TaskStatusChanged(id);
+    if (slot == TaskQueue::Slot::CHECKING) {
+        task.Check();
+    } else {
+        StartAnnouncing(task);
+    }
+}
+
+void App::StopTask(TaskQueue::Id id) {
+    Task& task = *tasks_.at(id);
+    std::cout << "Task idle, going dormant: " << task.torrent_file_name() << std::endl;
+    StopAnnouncing(task);
+    task.Dormant();
+}
+
+void App::TaskChecked(TaskQueue::Id id, bool loaded) {
+    if (draining_) return;
+    TaskStatusChanged(id);
+    if (removing_.erase(id)) {
+        // the check saved the task again
+        if (loaded && resume_store_) resume_store_->Remove(tasks_.at(id)->info_hash());
+        ForgetTask(id);
+        return;
+    }
+    Task& task = *tasks_.at(id);
+    if (!loaded) {
+        // kept to be seen, without a slot
+        task_queue_->Remove(id, uv_now(loop_));
+        return;
+    }
+    auto [iter, inserted] = task_ids_.emplace(task.info_hash(), id);
+    if (!inserted && iter->second != id) {
+        std::cout << "Torrent already added: " << task.torrent_file_name() << std::endl;
+        ForgetTask(id);
+        return;
+    }
+    task_queue_->Checked(id, task.left() == 0, uv_now(loop_));
+}
+
+bool App::RemoveTask(const std::string& hex_info_hash) {
+    auto iter = task_ids_.find(absl::HexStringToBytes(hex_info_hash));
+    if (iter == task_ids_.end()) return false;
+    TaskQueue::Id id = iter->second;
+    Task& task = *tasks_.at(id);
+    if (resume_store_) resume_store_->Remove(task.info_hash());
+    auto slot = task_queue_->ActiveSlot(id);
+    if (slot == TaskQueue::Slot::CHECKING) {
+        // the check still refers to the task
+        task_ids_.erase(iter);
+        task_queue_->Remove(id, uv_now(loop_));
+        removing_.insert(id);
+        return true;
+    }
+    if (slot) StopAnnouncing(task);
+    ForgetTask(id);
+    return true;
+}
+
+bool App::SetTaskPriority(const std::string& hex_info_hash, int priority) {
+    auto iter = task_ids_.find(absl::HexStringToBytes(hex_info_hash));
+    if (iter == task_ids_.end()) return false;
+    task_queue_->SetPriority(iter->second, priority);
+    TaskStatusChanged(iter->second);
+    return true;
+}
+
+void App::ForgetTask(TaskQueue::Id id) {
+    auto iter = tasks_.find(id);
+    if (iter == tasks_.end()) return;
+    auto ids = task_ids_.find(iter->second->info_hash());
+    if (ids != task_ids_.end() && ids->second == id) task_ids_.erase(ids);
+    task_queue_->Remove(id, uv_now(loop_));
+    tasks_.erase(iter);
+    changed_status_.erase(id);
+    status_feed_.Remove(id);
+}
+
+void App::DemoteIdleTasks() {
+    tasks_demoted_total->Add(task_queue_->DemoteIdle(uv_now(loop_)));
+    timers_->Schedule<&App::DemoteIdleTasks>(&idle_timer_, kIdleCheckMs, this);
+}
+
+void App::PublishStatus() {
+    if (status_feed_.HasSubscribers()) {
+        RefreshStatus();
+        status_feed_.Publish();
+    }
+    timers_->Schedule<&App::PublishStatus>(&status_timer_, kStatusTickMs, this);
+}
+
+void App::RefreshStatus() {
+    for (TaskQueue::Id id : changed_status_) {
+        auto iter = tasks_.find(id);
+        if (iter == tasks_.end()) continue;
+        const Task* task = iter->second.get();
+        auto slot = task_queue_->ActiveSlot(id);
+        status_feed_.Set(id, {
+                                 {"name", task->torrent_file_name()},
+                                 {"info_hash", absl::BytesToHexString(task->info_hash())},
+                                 {"state", Task::StateName(task->state())},
+                                 {"slot", slot ? SlotName(*slot) : ""},
+                                 {"priority", task_queue_->Priority(id).value_or(0)},
+                                 {"left", static_cast<int64_t>(task->left())},
+                                 {"downloaded", static_cast<int64_t>(task->downloaded())},
+                             });
+    }
+    changed_status_.clear();
+}
+
+void App::UpdateMetrics() {
+    tasks->Set(tasks_.size());
+    if (!task_queue_) return;
+    TaskQueue::Stats stats = task_queue_->GetStats();
+    tasks_checking->Set(stats.active[static_cast<int>(TaskQueue::Slot::CHECKING)]);
+    tasks_downloading->Set(stats.active[static_cast<int>(TaskQueue::Slot::DOWNLOADING)]);
+    tasks_seeding->Set(stats.active[static_cast<int>(TaskQueue::Slot::SEEDING)]);
+    tasks_queued->Set(stats.queued[0] + stats.queued[1] + stats.queued[2]);
+}
+
+void App::SaveResumeData(ResumeData data) {
+    if (draining_ || !resume_store_) return;
+    resume_store_->Put(std::move(data));
+}
+
+Shard& App::ShardFor(const std::string& info_hash) {
+    // info hashes are SHA1 digests, any bytes spread evenly
+    return *shards_[std::hash<std::string>{}(info_hash) % shards_.size()];
+}
+
+void App::StartAnnouncing(const Task& task) {
+    if (draining_ || !announce_scheduler_) return;
+    const TorrentFile& torrent = *task.torrent();
+    AnnounceParams params{.info_hash = torrent.GetInfoHash(), .left = task.left()};
+    Shard& shard = ShardFor(torrent.GetInfoHash());
+    shard.Post([&shard, swarm = Swarm::Torrent{
+                            .info_hash = torrent.GetInfoHash(),
+                            .peer_id = params.peer_id,
+                            .piece_count = static_cast<uint32_t>(torrent.GetPieceCount()),
+                            .piece_length = torrent.GetPieceSize(),
+                            .total_size = torrent.GetTotalSize(),
+                            .piece_hashes = torrent.GetPieceHashes(),
+                            .have = task.have(),
+                        }]() mutable { shard.AddTorrent(std::move(swarm)); });
+    auto tiers = torrent.announce_list().value_or(
+        std::vector<std::vector<std::string>>{{torrent.announce()}});
+    announce_scheduler_->AddTorrent(std::move(tiers), std::move(params));
+}
+
+void App::StopAnnouncing(const Task& task) {
+    if (draining_ || !announce_scheduler_) return;
+    announce_scheduler_->RemoveTorrent(task.info_hash());
+    Shard& shard = ShardFor(task.info_hash());
+    shard.Post([&shard, info_hash = task.info_hash()]() { shard.RemoveTorrent(info_hash); });
+}
+
+void App::PeersDiscovered(const std::string& info_hash, std::vector<PeerInfo> peers) {
+    if (draining_) return;
+    auto iter = task_ids_.find(info_hash);
+    if (iter != task_ids_.end()) task_queue_->Touch(iter->second, uv_now(loop_));
+    Shard& shard = ShardFor(info_hash);
+    shard.Post([&shard, info_hash, peers = std::move(peers)]() mutable {
+        shard.PeersDiscovered(info_hash, std::move(peers));
+    });
+}
+
+void App::PieceVerified(const std::string& info_hash, uint32_t index, std::string data) {
+    if (draining_) return;
+    auto ids = task_ids_.find(info_hash);
+    if (ids == task_ids_.end()) return;
+    task_queue_->Touch(ids->second, uv_now(loop_));
+    auto iter = tasks_.find(ids->second);
+    if (iter != tasks_.end()) Task::PieceDownloaded(iter->second, index, std::move(data));
+}
+
+void App::PieceLost(const std::string& info_hash, uint32_t index) {
+    if (draining_) return;
+    Shard& shard = ShardFor(info_hash);
+    shard.Post([&shard, info_hash, index]() { shard.PieceLost(info_hash, index); });
+}
+
+void App::TorrentActive(const std::string& info_hash) {
+    if (draining_) return;
+    auto iter = task_ids_.find(info_hash);
+    if (iter != task_ids_.end()) task_queue_->Touch(iter->second, uv_now(loop_));
+}
+
+void App::TaskCompleted(TaskQueue::Id id) {
+    if (draining_) return;
+    auto iter = tasks_.find(id);
+    if (iter == tasks_.end()) return;
+    Task& task = *iter->second;
+    std::cout << "Download complete: " << task.torrent_file_name() << std::endl;
+    // announced as COMPLETED
+    if (announce_scheduler_) {
+        announce_scheduler_->UpdateStats(task.info_hash(), 0, task.downloaded(), task.left());
+    }
+    task_queue_->Completed(id, uv_now(loop_));
+    TaskStatusChanged(id);
+    // waiting for a seed slot, out of the swarm and off the trackers until then
+    auto slot = task_queue_->ActiveSlot(id);
+    if (!slot && task.torrent()) StopAnnouncing(task);
 }
 
 void App::ReleaseRpcManager(RpcManager& rpc_manager) {
-    assert(&rpc_manager == rpc_manager_.get());
-    rpc_manager_.reset();
+    if (&rpc_manager == metrics_manager_.get()) {
+        metrics_manager_.reset();
+    } else {
+        assert(&rpc_manager == rpc_manager_.get());
+        rpc_manager_.reset();
+    }
+    CheckDrainState();
+}
+
+void App::ReleaseAnnounceScheduler() {
+    announce_scheduler_.reset();
+    if (resolver_) resolver_->Halt([this]() { ReleaseResolver(); });
+    CheckDrainState();
+}
+
+void App::ReleaseResolver() {
+    resolver_.reset();
+    CheckDrainState();
+}
+
+void App::ReleaseShard(size_t index) {
+    shards_[index]->Join();
+    shards_[index].reset();
+    CheckDrainState();
+}
+
+void App::ReleaseResumeStore() {
+    resume_store_.reset();
+    CheckDrainState();
+}
+
+void App::ReleaseTimerService() {
+    timers_.reset();
+    CheckDrainState();
+}
+
+void App::ReleaseLoopMonitor() {
+    loop_monitor_.reset();
     CheckDrainState();
 }
 
@@ -50,6 +421,7 @@ void App::ReleaseRpcClient(RpcClient& rpc_client) {
     auto iter = rpc_clients_.find(&rpc_client);
     assert(iter != rpc_clients_.end());
     rpc_clients_.erase(iter);
+    rpc_clients->Set(rpc_clients_.size());
     std::cout << "RPC client released, remaining: " << rpc_clients_.size() << std::endl;
     CheckDrainState();
 }
@@ -5,38 +5,150 @@
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "common/metrics.h"
+#include "common/resolver.h"
+#include "common/write_queue.h"
 #include "result.h"
+#include "ryu/announce_scheduler.h"
+#include "ryu/resume.h"
 #include "ryu/rpc_client.h"
 #include "ryu/rpc_manager.h"
+#include "ryu/shard.h"
+#include "ryu/status_feed.h"
 #include "ryu/task.h"
+#include "ryu/task_queue.h"
+#include "torrent_file.h"
+#include "utils/coro.h"
+#include "utils/mailbox.h"
+#include "utils/timer_service.h"
 
 namespace ryu {
 
+// RPC, trackers, name lookups and torrent file loading run on the main loop. Torrents are
+// sharded by info hash over worker threads, each with its own loop, see Shard. A TaskQueue
+// bounds how many tasks check, download and seed at once. Metrics are served over RPC, and to
+// Prometheus if enabled.
 class App {
   public:
-    explicit App(uv_loop_t* loop) : loop_(loop) {}
-    // Start libuv event loop
+    struct Options {
+        // worker threads, at least one runs
+        size_t shards = 1;
+        // holds the resume journal and is where downloads are saved
+        std::string data_dir = ".";
+        // "host:port" or "unix:<path>", see RpcManager
+        std::vector<std::string> rpc_listen = {"[::1]:8989"};
+        // Prometheus over HTTP, disabled if empty
+        std::string metrics_listen;
+        RpcManager::Options rpc;
+    };
+
+    App(uv_loop_t* loop, Options options) : loop_(loop), options_(std::move(options)) {}
+    // Start the shards and the main libuv event loop
     Result<int, std::string> Run();
+    // Any thread. Runs `job` on the main loop.
+    void Post(Mailbox::Job job) { mailbox_->Post(std::move(job)); }
     // Called by rpc manager
-    void AcceptRpcClient(uv_stream_t* server);
+    void AcceptRpcClient(uv_stream_t* server, bool metrics_only);
     // Cleanup resources. Causes Run() to return.
     void Halt();
     // Check draining state and stop the loop if drained. Caused by Halt() and Release*() calls
     void CheckDrainState();
 
-    void CreateTask(std::string torrent_file_name);
+    // Returns the id of the new task, 0 while halting
+    TaskQueue::Id CreateTask(std::string torrent_file_name);
+    // Stop and forget a task and its resume state, by hex info hash. False if there is no such
+    // checked task.
+    bool RemoveTask(const std::string& hex_info_hash);
+    bool SetTaskPriority(const std::string& hex_info_hash, int priority);
+    // Called by Task when Task::Check() is done, the task may be freed
+    void TaskChecked(TaskQueue::Id id, bool loaded);
+    // Called by Task whenever its state changes
+    void SaveResumeData(ResumeData data);
+    // Refresh the gauges sampled from the app's state, before reading the metrics
+    void UpdateMetrics();
+    // Task status for RPC subscribers, published every tick
+    StatusFeed& status_feed() { return status_feed_; }
+    // Bring the status feed up to date with the tasks changed since, before reading it
+    void RefreshStatus();
+    // Called by Task when a field of its status changed, and by the app on queue changes
+    void TaskStatusChanged(TaskQueue::Id id) { changed_status_.insert(id); }
+    // Called by AnnounceScheduler
+    void PeersDiscovered(const std::string& info_hash, std::vector<PeerInfo> peers);
+    // Called by Shard::PieceVerified()
+    void PieceVerified(const std::string& info_hash, uint32_t index, std::string data);
+    // Called by Task when a verified piece could not be written, the swarm downloads it again
+    void PieceLost(const std::string& info_hash, uint32_t index);
+    // Called by Shard::SwarmActive(), keeps the task from being demoted as idle
+    void TorrentActive(const std::string& info_hash);
+    // Called by Task once its last piece is written
+    void TaskCompleted(TaskQueue::Id id);
 
     // Call caused by RpcManager::Halt()
     void ReleaseRpcManager(RpcManager& rpc_manager);
     // Called by RpcClient::SocketClosed()/Halt()
     void ReleaseRpcClient(RpcClient& rpc_client);
+    // Called when AnnounceScheduler::Halt() completes
+    void ReleaseAnnounceScheduler();
+    // Called when Resolver::Halt() completes
+    void ReleaseResolver();
+    // Called once a shard's loop ran out after Shard::Halt()
+    void ReleaseShard(size_t index);
+    // Called when ResumeStore::Halt() completes
+    void ReleaseResumeStore();
+    // Called when TimerService::Halt() completes
+    void ReleaseTimerService();
+    // Called when LoopMonitor::Halt() completes
+    void ReleaseLoopMonitor();
 
   private:
+    Shard& ShardFor(const std::string& info_hash);
+    // bring back the tasks of the last run
+    coro::Task<> RestoreTasks();
+    void AddTask(std::shared_ptr<Task> task);
+    // TaskQueue callbacks
+    void StartTask(TaskQueue::Id id, TaskQueue::Slot slot);
+    void StopTask(TaskQueue::Id id);
+    void DemoteIdleTasks();
+    void PublishStatus();
+    // Announce a checked task and hand it to its shard
+    void StartAnnouncing(const Task& task);
+    void StopAnnouncing(const Task& task);
+    void ForgetTask(TaskQueue::Id id);
+
     uv_loop_t* const loop_;
+    const Options options_;
+    // jobs from the shards
+    std::unique_ptr<Mailbox> mailbox_;
+    // reset once released
+    std::vector<std::unique_ptr<Shard>> shards_;
+    // name lookups of every component on the loop
+    std::unique_ptr<net::Resolver> resolver_;
     std::unique_ptr<RpcManager> rpc_manager_;
+    // the Prometheus listener, if any
+    std::unique_ptr<RpcManager> metrics_manager_;
+    std::unique_ptr<metrics::LoopMonitor> loop_monitor_;
+    std::unique_ptr<AnnounceScheduler> announce_scheduler_;
+    std::unique_ptr<ResumeStore> resume_store_;
+    std::unique_ptr<TimerService> timers_;
+    TimerService::Timer idle_timer_;
+    TimerService::Timer status_timer_;
+    // outlives the rpc clients subscribed to it
+    StatusFeed status_feed_;
+    // tasks whose status the feed doesn't have yet
+    std::unordered_set<TaskQueue::Id> changed_status_;
+    // write buffers of the rpc clients
+    net::BufferPool rpc_buffers_;
     std::unordered_map<RpcClient*, std::shared_ptr<RpcClient>> rpc_clients_;
-    std::unordered_map<Task*, std::shared_ptr<Task>> tasks_;
+    std::unordered_map<TaskQueue::Id, std::shared_ptr<Task>> tasks_;
+    TaskQueue::Id next_task_id_ = 1;
+    std::unique_ptr<TaskQueue> task_queue_;
+    // checked tasks by info hash
+    std::unordered_map<std::string, TaskQueue::Id> task_ids_;
+    // removed while checking, forgotten once the check is over
+    std::unordered_set<TaskQueue::Id> removing_;
     bool draining_ = false;
 };
 
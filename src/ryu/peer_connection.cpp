@@ -0,0 +1,259 @@
+#include "peer_connection.h"
+
+#include <algorithm>
+#include <iostream>
+#include <utility>
+
+#include "absl/strings/str_cat.h"
+#include "common/metrics.h"
+#include "ryu/swarm.h"
+#include "utils/uv_callbacks.h"
+
+namespace ryu {
+
+namespace {
+
+auto& registry = metrics::Registry::Global();
+metrics::Gauge* const peers_connected =
+    registry.GetGauge("ryu_peers_connected", "Peer connections past the handshake");
+metrics::Counter* const peer_received_bytes_total =
+    registry.GetCounter("ryu_peer_received_bytes_total", "Bytes read from peers");
+metrics::Counter* const peer_blocks_total =
+    registry.GetCounter("ryu_peer_blocks_total", "Requested blocks received from peers");
+metrics::Counter* const peer_protocol_errors_total =
+    registry.GetCounter("ryu_peer_protocol_errors_total", "Peers dropped for breaking BEP 3");
+
+}  // namespace
+
+PeerConnection::PeerConnection(Swarm* swarm, Options options, std::unique_ptr<uv_tcp_t> tcp,
+                               net::Endpoint endpoint)
+    : swarm_(swarm),
+      options_(options),
+      endpoint_(std::move(endpoint)),
+      tcp_(std::move(tcp)),
+      // the largest message is our block, or a bitfield of a huge torrent
+      reader_(std::max<size_t>(9 + net::kBlockSize, 1 + swarm->torrent().have.size()),
+              [this](uint32_t index, uint32_t begin, uint32_t length) {
+                  return BlockBuffer(index, begin, length);
+              }),
+      bitfield_(swarm->torrent().have.size(), '\0') {}
+
+Result<ResultVoid, std::string> PeerConnection::Start() {
+    tcp_->data = this;
+    auto* stream = reinterpret_cast<uv_stream_t*>(tcp_.get());
+    writes_ = std::make_unique<net::WriteQueue>(stream, swarm_->buffers(),
+                                                net::WriteQueue::Options{}, nullptr);
+    download_ = std::make_unique<net::TokenBucket>(swarm_->bandwidth(), swarm_->download_bucket());
+    throttle_ = std::make_unique<net::ReadThrottle>(
+        download_.get(), stream, uv_callbacks::Alloc<&PeerConnection::AllocBuffer>,
+        uv_callbacks::Read<&PeerConnection::IncomingData>);
+
+    const Swarm::Torrent& torrent = swarm_->torrent();
+    writes_->Write(net::EncodeHandshake({
+        .info_hash = torrent.info_hash,
+        .peer_id = torrent.peer_id,
+    }));
+    const std::string& have = swarm_->have();
+    if (std::any_of(have.begin(), have.end(), [](char c) { return c != 0; })) {
+        Send({.type = net::PeerMessageType::BITFIELD, .payload = have});
+    }
+    int retcode = writes_->Flush();
+    if (retcode) return Err(absl::StrCat("handshake write failed: ", uv_strerror(retcode)));
+    retcode = throttle_->Start();
+    if (retcode) return Err(absl::StrCat("uv_read_start() failed: ", uv_strerror(retcode)));
+    TimerService* timers = swarm_->timers();
+    timers->Schedule<&PeerConnection::TimedOut>(&timeout_, options_.handshake_timeout_ms, this);
+    timers->Schedule<&PeerConnection::KeepaliveDue>(&keepalive_, options_.keepalive_ms, this);
+    return {};
+}
+
+void PeerConnection::Halt() {
+    if (closing_) return;
+    closing_ = true;
+    if (handshaked_) peers_connected->Add(-1);
+    timeout_.Cancel();
+    keepalive_.Cancel();
+    if (throttle_) throttle_->Stop();
+    uv_close(reinterpret_cast<uv_handle_t*>(tcp_.get()),
+             uv_callbacks::Close<&PeerConnection::SocketClosed>);
+}
+
+void PeerConnection::SocketClosed(uv_handle_t* handle) {
+    // may delete this
+    swarm_->ReleasePeer(*this);
+}
+
+void PeerConnection::Fail(const std::string& error) {
+    std::cout << "Dropping peer " << endpoint_.ToString() << ": " << error << std::endl;
+    Halt();
+}
+
+void PeerConnection::SetInterested(bool interested) {
+    if (closing_ || interested == am_interested_) return;
+    am_interested_ = interested;
+    Send({.type = interested ? net::PeerMessageType::INTERESTED
+                             : net::PeerMessageType::NOT_INTERESTED});
+}
+
+void PeerConnection::RequestBlock(uint32_t index, uint32_t begin, uint32_t length, char* block) {
+    requests_.push_back({.index = index, .begin = begin, .length = length, .block = block});
+    Send({.type = net::PeerMessageType::REQUEST, .index = index, .begin = begin,
+          .length = length});
+}
+
+std::vector<PeerConnection::Request> PeerConnection::TakeRequests(bool all) {
+    std::vector<Request> taken;
+    std::vector<Request> kept;
+    for (const Request& request : requests_) {
+        (request.receiving && !all ? kept : taken).push_back(request);
+    }
+    requests_ = std::move(kept);
+    return taken;
+}
+
+void PeerConnection::Flush() {
+    if (closing_) return;
+    if (writes_->Flush() != 0) Fail(absl::StrCat("write failed: ", uv_strerror(writes_->status())));
+}
+
+void PeerConnection::Send(const net::PeerMessage& message) {
+    if (closing_) return;
+    writes_->Write(net::EncodeMessage(message).View());
+    if (message.type == net::PeerMessageType::BITFIELD) writes_->Write(message.payload);
+    swarm_->timers()->Schedule<&PeerConnection::KeepaliveDue>(&keepalive_, options_.keepalive_ms,
+                                                              this);
+}
+
+void PeerConnection::TimedOut() {
+    Fail(handshaked_ ? "idle for too long" : "handshake timed out");
+}
+
+void PeerConnection::KeepaliveDue() {
+    Send({});
+    Flush();
+}
+
+void PeerConnection::AllocBuffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    reader_.Prepare(buf);
+    buf->len = std::min(buf->len, throttle_->BufferSize(buf->len));
+}
+
+void PeerConnection::IncomingData(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+    if (closing_) return;
+    if (nread < 0) {
+        // UV_ENOBUFS when a message doesn't fit the receive buffer
+        Fail(nread == UV_EOF ? "closed by the peer" : uv_strerror(static_cast<int>(nread)));
+        return;
+    }
+    if (nread == 0) return;
+    reader_.Commit(nread);
+    throttle_->Consumed(nread);
+    peer_received_bytes_total->Add(nread);
+
+    auto result = ReadHandshake();
+    if (handshaked_) {
+        swarm_->timers()->Schedule<&PeerConnection::TimedOut>(&timeout_,
+                                                              options_.idle_timeout_ms, this);
+    }
+    while (result && handshaked_ && !closing_) {
+        auto message = reader_.Next();
+        if (!message) {
+            result = Err(message.Error());
+            break;
+        }
+        if (!message.Value()) break;
+        result = HandleMessage(*message.Value());
+        first_message_ = false;
+    }
+    if (!result) {
+        peer_protocol_errors_total->Add();
+        Fail(result.Error());
+        return;
+    }
+    Flush();
+}
+
+Result<ResultVoid, std::string> PeerConnection::ReadHandshake() {
+    if (handshaked_) return {};
+    auto handshake = VALUE_OR_RAISE(reader_.ReadHandshake());
+    if (!handshake) return {};
+    const Swarm::Torrent& torrent = swarm_->torrent();
+    if (handshake->info_hash != torrent.info_hash) return Err("handshake for another torrent");
+    if (handshake->peer_id == torrent.peer_id) return Err("connected to ourselves");
+    handshaked_ = true;
+    peers_connected->Add(1);
+    swarm_->PeerHandshaked(*this);
+    return {};
+}
+
+Result<ResultVoid, std::string> PeerConnection::HandleMessage(const net::PeerMessage& message) {
+    uint32_t piece_count = swarm_->torrent().piece_count;
+    switch (message.type) {
+        case net::PeerMessageType::KEEPALIVE:
+            break;
+        case net::PeerMessageType::CHOKE:
+            if (peer_choking_) break;
+            peer_choking_ = true;
+            // BEP 3 drops the requests, but for a block already on the way
+            swarm_->ReturnRequests(TakeRequests(false));
+            break;
+        case net::PeerMessageType::UNCHOKE:
+            if (!peer_choking_) break;
+            peer_choking_ = false;
+            swarm_->PeerUnchoked(*this);
+            break;
+        case net::PeerMessageType::INTERESTED:
+            peer_interested_ = true;
+            break;
+        case net::PeerMessageType::NOT_INTERESTED:
+            peer_interested_ = false;
+            break;
+        case net::PeerMessageType::HAVE:
+            if (message.index >= piece_count) return Err("have of a piece out of range");
+            if (net::HasPiece(bitfield_, message.index)) break;
+            net::SetPiece(&bitfield_, message.index);
+            swarm_->PeerHas(*this, message.index);
+            break;
+        case net::PeerMessageType::BITFIELD: {
+            if (!first_message_) return Err("bitfield after other messages");
+            if (message.payload.size() != bitfield_.size()) return Err("bitfield of wrong size");
+            // spare bits past the last piece must be clear
+            if (piece_count % 8 != 0 &&
+                (static_cast<uint8_t>(message.payload.back()) & (0xff >> (piece_count % 8)))) {
+                return Err("bitfield has spare bits set");
+            }
+            bitfield_.assign(message.payload);
+            swarm_->PeerHas(*this, std::nullopt);
+            break;
+        }
+        case net::PeerMessageType::REQUEST:
+        case net::PeerMessageType::CANCEL:
+            // the peer is choked, its requests are dropped
+            break;
+        case net::PeerMessageType::PIECE: {
+            auto iter = std::find_if(requests_.begin(), requests_.end(), [&](const Request& r) {
+                return r.receiving && r.index == message.index && r.begin == message.begin;
+            });
+            if (iter == requests_.end()) break;
+            requests_.erase(iter);
+            peer_blocks_total->Add();
+            swarm_->BlockReceived(*this, message.index, message.begin, message.length);
+            break;
+        }
+    }
+    return {};
+}
+
+char* PeerConnection::BlockBuffer(uint32_t index, uint32_t begin, uint32_t length) {
+    for (Request& request : requests_) {
+        if (request.index == index && request.begin == begin && request.length == length &&
+            !request.receiving) {
+            request.receiving = true;
+            return request.block;
+        }
+    }
+    // unrequested, or taken back after a choke
+    return nullptr;
+}
+
+}  // namespace ryu
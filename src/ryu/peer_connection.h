@@ -0,0 +1,113 @@
+#pragma once
+
+#include <uv.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common/bandwidth.h"
+#include "common/network.h"
+#include "common/peer_wire.h"
+#include "common/write_queue.h"
+#include "result.h"
+#include "utils/timer_service.h"
+
+namespace ryu {
+
+class Swarm;
+
+// An outgoing connection to a peer of a torrent, BEP 3 over TCP.
+//
+// Handshakes go both ways first, then our bitfield. The swarm decides what to request, and each
+// block is read straight into the buffer given with its request, see net::PeerWireReader. Reads
+// go through the connection's download bucket, below the torrent's. Messages queued while
+// handling a read are flushed together at the end of it. The peer is kept choked, nothing is
+// uploaded. Peers silent for `idle_timeout_ms` are dropped, and a keepalive goes out after
+// `keepalive_ms` without sending anything.
+class PeerConnection {
+  public:
+    struct Options {
+        uint64_t handshake_timeout_ms = 20000;
+        uint64_t idle_timeout_ms = 180000;
+        uint64_t keepalive_ms = 120000;
+    };
+
+    struct Request {
+        uint32_t index = 0;
+        uint32_t begin = 0;
+        uint32_t length = 0;
+        // where the block goes, owned by the swarm
+        char* block = nullptr;
+        // its payload is being read into `block`
+        bool receiving = false;
+    };
+
+    // `tcp` comes connected from the net::Connector. `swarm` must outlive the connection.
+    PeerConnection(Swarm* swarm, Options options, std::unique_ptr<uv_tcp_t> tcp,
+                   net::Endpoint endpoint);
+    PeerConnection(const PeerConnection&) = delete;
+    PeerConnection& operator=(const PeerConnection&) = delete;
+
+    // Send the handshake and start reading
+    Result<ResultVoid, std::string> Start();
+    // Drop the connection, Swarm::ReleasePeer() is called once its socket is closed
+    void Halt();
+
+    void SetInterested(bool interested);
+    // Ask for a block, `block` must have room for `length` bytes until the piece arrives or
+    // TakeRequests() hands the request back
+    void RequestBlock(uint32_t index, uint32_t begin, uint32_t length, char* block);
+    // Hand the outstanding requests back, but for a block already being read when `all` is false
+    std::vector<Request> TakeRequests(bool all);
+    // Hand queued messages to libuv, only needed outside the read callback
+    void Flush();
+
+    [[nodiscard]] const net::Endpoint& endpoint() const { return endpoint_; }
+    [[nodiscard]] bool handshaked() const { return handshaked_; }
+    [[nodiscard]] bool closing() const { return closing_; }
+    [[nodiscard]] bool peer_choking() const { return peer_choking_; }
+    [[nodiscard]] bool am_interested() const { return am_interested_; }
+    // the pieces the peer has, all zero until it tells
+    [[nodiscard]] const std::string& bitfield() const { return bitfield_; }
+    [[nodiscard]] size_t Outstanding() const { return requests_.size(); }
+
+    // UV callbacks
+    void AllocBuffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+    void IncomingData(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
+    void SocketClosed(uv_handle_t* handle);
+
+  private:
+    Result<ResultVoid, std::string> ReadHandshake();
+    Result<ResultVoid, std::string> HandleMessage(const net::PeerMessage& message);
+    // The reader's sink, the block of an outstanding request
+    char* BlockBuffer(uint32_t index, uint32_t begin, uint32_t length);
+    void Send(const net::PeerMessage& message);
+    void TimedOut();
+    void KeepaliveDue();
+    void Fail(const std::string& error);
+
+    Swarm* const swarm_;
+    const Options options_;
+    const net::Endpoint endpoint_;
+    std::unique_ptr<uv_tcp_t> tcp_;
+    net::PeerWireReader reader_;
+    std::unique_ptr<net::WriteQueue> writes_;
+    std::unique_ptr<net::TokenBucket> download_;
+    std::unique_ptr<net::ReadThrottle> throttle_;
+    TimerService::Timer timeout_;
+    TimerService::Timer keepalive_;
+
+    std::string bitfield_;
+    std::vector<Request> requests_;
+    bool handshaked_ = false;
+    // a bitfield may only come right after the handshake
+    bool first_message_ = true;
+    bool peer_choking_ = true;
+    bool peer_interested_ = false;
+    bool am_interested_ = false;
+    bool closing_ = false;
+};
+
+}  // namespace ryu
@@ -0,0 +1,127 @@
+#include "ryu/peer_pool.h"
+
+#include <algorithm>
+
+namespace ryu {
+
+bool PeerPool::Add(const net::Endpoint& endpoint) {
+    if (entries_.count(endpoint)) return false;
+    if (entries_.size() >= options_.max_candidates && !Evict()) return false;
+    Entry& entry = entries_[endpoint];
+    entry.ready_it = ready_.insert(ready_.end(), endpoint);
+    return true;
+}
+
+size_t PeerPool::Add(const std::vector<PeerInfo>& peers) {
+    size_t added = 0;
+    for (const auto& peer : peers) {
+        if (Add(peer.endpoint)) added++;
+    }
+    return added;
+}
+
+std::optional<net::Endpoint> PeerPool::NextCandidate(uint64_t now_ms) {
+    // backoff over, back to the end of the queue
+    while (!waiting_.empty() && waiting_.begin()->first <= now_ms) {
+        net::Endpoint endpoint = waiting_.begin()->second;
+        waiting_.erase(waiting_.begin());
+        Entry& entry = entries_[endpoint];
+        entry.state = State::READY;
+        entry.ready_it = ready_.insert(ready_.end(), endpoint);
+    }
+    if (ready_.empty()) return std::nullopt;
+    net::Endpoint endpoint = ready_.front();
+    ready_.pop_front();
+    entries_[endpoint].state = State::ACTIVE;
+    return endpoint;
+}
+
+void PeerPool::Connected(const net::Endpoint& endpoint) {
+    auto iter = entries_.find(endpoint);
+    if (iter == entries_.end()) return;
+    iter->second.failures = 0;
+}
+
+void PeerPool::Failed(const net::Endpoint& endpoint, uint64_t now_ms) {
+    auto iter = entries_.find(endpoint);
+    if (iter == entries_.end()) return;
+    Entry& entry = iter->second;
+    if (++entry.failures >= options_.max_failures) {
+        Unlink(entry);
+        entries_.erase(iter);
+        dropped_++;
+        return;
+    }
+    uint32_t shift = std::min<uint32_t>(entry.failures - 1, 31);
+    uint64_t delay = std::min(options_.retry_max_ms, options_.retry_base_ms << shift);
+    Wait(endpoint, entry, now_ms + delay);
+}
+
+void PeerPool::Disconnected(const net::Endpoint& endpoint, uint64_t now_ms) {
+    auto iter = entries_.find(endpoint);
+    if (iter == entries_.end()) return;
+    Wait(endpoint, iter->second, now_ms + options_.retry_base_ms);
+}
+
+void PeerPool::Remove(const net::Endpoint& endpoint) {
+    auto iter = entries_.find(endpoint);
+    if (iter == entries_.end()) return;
+    Unlink(iter->second);
+    entries_.erase(iter);
+}
+
+uint32_t PeerPool::Failures(const net::Endpoint& endpoint) const {
+    auto iter = entries_.find(endpoint);
+    return iter == entries_.end() ? 0 : iter->second.failures;
+}
+
+std::optional<uint64_t> PeerPool::NextRetry() const {
+    if (waiting_.empty()) return std::nullopt;
+    return waiting_.begin()->first;
+}
+
+PeerPool::Stats PeerPool::GetStats() const {
+    return Stats{
+        .ready = ready_.size(),
+        .waiting = waiting_.size(),
+        .active = entries_.size() - ready_.size() - waiting_.size(),
+        .evicted = evicted_,
+        .dropped = dropped_,
+    };
+}
+
+void PeerPool::Unlink(Entry& entry) {
+    switch (entry.state) {
+        case State::READY:
+            ready_.erase(entry.ready_it);
+            break;
+        case State::WAITING:
+            waiting_.erase(entry.waiting_it);
+            break;
+        case State::ACTIVE:
+            break;
+    }
+}
+
+void PeerPool::Wait(const net::Endpoint& endpoint, Entry& entry, uint64_t retry_at_ms) {
+    Unlink(entry);
+    entry.state = State::WAITING;
+    entry.waiting_it = waiting_.emplace(retry_at_ms, endpoint);
+}
+
+bool PeerPool::Evict() {
+    net::Endpoint victim;
+    if (!waiting_.empty()) {
+        // furthest from being retried, usually the one that failed the most
+        victim = std::prev(waiting_.end())->second;
+    } else if (!ready_.empty()) {
+        victim = ready_.front();
+    } else {
+        return false;
+    }
+    Remove(victim);
+    evicted_++;
+    return true;
+}
+
+}  // namespace ryu
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "common/network.h"
+#include "trackers.h"
+
+namespace ryu {
+
+// Peers of one torrent that may be connected to, keyed by endpoint.
+//
+// A candidate is READY (queued for a connection attempt), WAITING (failed before, retried after
+// an exponential backoff), or ACTIVE (handed out by NextCandidate() and not given back yet).
+// Insert and dedup are O(1). The pool holds at most `max_candidates` endpoints. When it is full,
+// the waiting candidate with the latest retry time makes room, then the oldest ready one. Active
+// candidates are never evicted.
+class PeerPool {
+  public:
+    struct Options {
+        size_t max_candidates = 2000;
+        uint64_t retry_base_ms = 30000;
+        uint64_t retry_max_ms = 1800000;
+        // candidates are forgotten after failing this many times in a row
+        uint32_t max_failures = 5;
+    };
+
+    struct Stats {
+        size_t ready = 0;
+        size_t waiting = 0;
+        size_t active = 0;
+        uint64_t evicted = 0;
+        uint64_t dropped = 0;
+    };
+
+    explicit PeerPool(Options options) : options_(options) {}
+    PeerPool() : PeerPool(Options{}) {}
+
+    // Queue a new candidate. False if it is already known, or the pool is full of active
+    // candidates.
+    bool Add(const net::Endpoint& endpoint);
+    // Add every peer, returns the number of new candidates
+    size_t Add(const std::vector<PeerInfo>& peers);
+
+    // Take the oldest candidate that may be tried at `now_ms`, it stays ACTIVE until one of
+    // Connected(), Failed(), Disconnected() or Remove() is called
+    std::optional<net::Endpoint> NextCandidate(uint64_t now_ms);
+    // The connection attempt succeeded, clears the failure counter
+    void Connected(const net::Endpoint& endpoint);
+    // Connection attempt or handshake failed, retry after the backoff or forget the candidate
+    void Failed(const net::Endpoint& endpoint, uint64_t now_ms);
+    // An established connection was closed, try it again after `retry_base_ms`
+    void Disconnected(const net::Endpoint& endpoint, uint64_t now_ms);
+    void Remove(const net::Endpoint& endpoint);
+
+    [[nodiscard]] bool Contains(const net::Endpoint& endpoint) const {
+        return entries_.count(endpoint) > 0;
+    }
+    [[nodiscard]] size_t Size() const { return entries_.size(); }
+    [[nodiscard]] uint32_t Failures(const net::Endpoint& endpoint) const;
+    // Earliest retry time of a waiting candidate, nullopt if none is waiting
+    [[nodiscard]] std::optional<uint64_t> NextRetry() const;
+    [[nodiscard]] Stats GetStats() const;
+
+  private:
+    enum class State { READY, WAITING, ACTIVE };
+    using ReadyList = std::list<net::Endpoint>;
+    using WaitingMap = std::multimap<uint64_t, net::Endpoint>;
+
+    struct Entry {
+        State state = State::READY;
+        uint32_t failures = 0;
+        // valid in the matching state
+        ReadyList::iterator ready_it{};
+        WaitingMap::iterator waiting_it{};
+    };
+
+    // Take the entry out of the ready list or the waiting map
+    void Unlink(Entry& entry);
+    void Wait(const net::Endpoint& endpoint, Entry& entry, uint64_t retry_at_ms);
+    // Drop one READY or WAITING candidate, false if every candidate is active
+    bool Evict();
+
+    const Options options_;
+    std::unordered_map<net::Endpoint, Entry> entries_;
+    ReadyList ready_;
+    WaitingMap waiting_;
+    uint64_t evicted_ = 0;
+    uint64_t dropped_ = 0;
+};
+
+}  // namespace ryu
@@ -0,0 +1,104 @@
+#include "ryu/peer_pool.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+using namespace ryu;
+using ryu::net::Endpoint;
+using ryu::net::IpAddress;
+
+namespace {
+
+Endpoint Peer(uint32_t n) { return Endpoint(IpAddress::FromBe32(htobe32(0x0a000000u + n)), 6881); }
+
+TEST(PeerPoolTest, DedupAndOrder) {
+    PeerPool pool;
+    EXPECT_TRUE(pool.Add(Peer(1)));
+    EXPECT_TRUE(pool.Add(Peer(2)));
+    EXPECT_FALSE(pool.Add(Peer(1)));
+    EXPECT_EQ(1u, pool.Add({PeerInfo{.endpoint = Peer(2)}, PeerInfo{.endpoint = Peer(3)}}));
+    EXPECT_EQ(3u, pool.Size());
+
+    EXPECT_EQ(Peer(1), pool.NextCandidate(0));
+    EXPECT_EQ(Peer(2), pool.NextCandidate(0));
+    // active candidates are still known
+    EXPECT_FALSE(pool.Add(Peer(1)));
+    EXPECT_EQ(Peer(3), pool.NextCandidate(0));
+    EXPECT_EQ(std::nullopt, pool.NextCandidate(0));
+    EXPECT_EQ(3u, pool.GetStats().active);
+}
+
+TEST(PeerPoolTest, FailureBackoff) {
+    PeerPool pool({.retry_base_ms = 100, .retry_max_ms = 300, .max_failures = 4});
+    pool.Add(Peer(1));
+    ASSERT_EQ(Peer(1), pool.NextCandidate(0));
+    pool.Failed(Peer(1), 0);
+    EXPECT_EQ(100u, pool.NextRetry());
+    EXPECT_EQ(std::nullopt, pool.NextCandidate(99));
+
+    ASSERT_EQ(Peer(1), pool.NextCandidate(100));
+    pool.Failed(Peer(1), 100);
+    EXPECT_EQ(300u, pool.NextRetry());
+    ASSERT_EQ(Peer(1), pool.NextCandidate(300));
+    pool.Failed(Peer(1), 300);
+    // capped
+    EXPECT_EQ(600u, pool.NextRetry());
+    EXPECT_EQ(3u, pool.Failures(Peer(1)));
+
+    ASSERT_EQ(Peer(1), pool.NextCandidate(600));
+    pool.Failed(Peer(1), 600);
+    EXPECT_FALSE(pool.Contains(Peer(1)));
+    EXPECT_EQ(1u, pool.GetStats().dropped);
+
+    // a working connection resets the counter
+    pool.Add(Peer(2));
+    ASSERT_EQ(Peer(2), pool.NextCandidate(0));
+    pool.Failed(Peer(2), 0);
+    ASSERT_EQ(Peer(2), pool.NextCandidate(100));
+    pool.Connected(Peer(2));
+    EXPECT_EQ(0u, pool.Failures(Peer(2)));
+    pool.Disconnected(Peer(2), 1000);
+    EXPECT_EQ(1100u, pool.NextRetry());
+}
+
+TEST(PeerPoolTest, EvictsWaitingThenOldestReady) {
+    PeerPool pool({.max_candidates = 3, .retry_base_ms = 100});
+    pool.Add(Peer(1));
+    pool.Add(Peer(2));
+    pool.Add(Peer(3));
+    ASSERT_EQ(Peer(1), pool.NextCandidate(0));
+    ASSERT_EQ(Peer(2), pool.NextCandidate(0));
+    pool.Failed(Peer(2), 0);
+
+    // Peer(2) is waiting
+    EXPECT_TRUE(pool.Add(Peer(4)));
+    EXPECT_FALSE(pool.Contains(Peer(2)));
+    // then the oldest ready one, Peer(3)
+    EXPECT_TRUE(pool.Add(Peer(5)));
+    EXPECT_FALSE(pool.Contains(Peer(3)));
+    EXPECT_EQ(2u, pool.GetStats().evicted);
+
+    ASSERT_EQ(Peer(4), pool.NextCandidate(0));
+    ASSERT_EQ(Peer(5), pool.NextCandidate(0));
+    // everything active, nothing to evict
+    EXPECT_FALSE(pool.Add(Peer(6)));
+    EXPECT_EQ(3u, pool.Size());
+
+    pool.Remove(Peer(1));
+    EXPECT_TRUE(pool.Add(Peer(6)));
+}
+
+TEST(PeerPoolTest, BoundedUnderLargeReplies) {
+    PeerPool pool({.max_candidates = 100});
+    std::vector<PeerInfo> peers;
+    for (uint32_t i = 0; i < 5000; i++) peers.push_back(PeerInfo{.endpoint = Peer(i)});
+    pool.Add(peers);
+    EXPECT_EQ(100u, pool.Size());
+    EXPECT_EQ(4900u, pool.GetStats().evicted);
+    // the newest survive
+    EXPECT_TRUE(pool.Contains(Peer(4999)));
+    EXPECT_FALSE(pool.Contains(Peer(0)));
+}
+
+}  // namespace
@@ -0,0 +1,406 @@
+#include "resume.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "common/bencode.h"
+#include "os.h"
+
+namespace ryu {
+
+namespace {
+
+using bencode::BencodeInteger;
+using bencode::BencodeList;
+using bencode::BencodeMap;
+using bencode::BencodeObject;
+using bencode::BencodeString;
+
+// a compacted log is at least this large before it is worth rewriting
+constexpr uint64_t kCompactMinBytes = 1 << 20;
+// and rewritten once it is this many times what it would be after compaction
+constexpr uint64_t kCompactRatio = 4;
+constexpr size_t kHeaderSize = 8;
+// a failed write is retried after a backoff doubling from the min to the max
+constexpr uint64_t kRetryMinMs = 1000;
+constexpr uint64_t kRetryMaxMs = 60000;
+// while halting, the pending records are given up after this many failures in a row
+constexpr int kHaltAttempts = 3;
+
+uint32_t Crc32(const std::string& data) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint8_t b : data) crc = table[(crc ^ b) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+void PutU32(std::string* out, uint32_t v) {
+    for (int i = 0; i < 4; i++) out->push_back(static_cast<char>((v >> (8 * i)) & 0xFF));
+}
+
+uint32_t GetU32(const char* in) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) v |= uint32_t{static_cast<uint8_t>(in[i])} << (8 * i);
+    return v;
+}
+
+std::unique_ptr<BencodeString> Str(const std::string& s) {
+    return std::make_unique<BencodeString>(s);
+}
+
+std::unique_ptr<BencodeInteger> Int(int64_t i) { return std::make_unique<BencodeInteger>(i); }
+
+std::string EncodeRecord(const ResumeJournal::Record& record) {
+    if (!record.removed) return record.data.Encode();
+    BencodeMap map;
+    map.Set("info hash", Str(record.data.info_hash));
+    map.Set("removed", Int(1));
+    return map.Encode().Expect("bencode of plain values");
+}
+
+std::string Frame(const std::string& payload) {
+    std::string out;
+    out.reserve(kHeaderSize + payload.size());
+    PutU32(&out, payload.size());
+    PutU32(&out, Crc32(payload));
+    out += payload;
+    return out;
+}
+
+Result<ResultVoid, std::string> WriteAll(int fd, const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) RAISE_ERRNO("failed to write resume journal");
+        done += n;
+    }
+    return {};
+}
+
+Result<std::string, std::string> ReadAll(int fd) {
+    std::string content;
+    char buf[65536];
+    while (true) {
+        ssize_t n = ::read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) RAISE_ERRNO("failed to read resume journal");
+        if (n == 0) return content;
+        content.append(buf, n);
+    }
+}
+
+Result<os::AutoFd, std::string> OpenForAppend(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) RAISE_ERRNO("failed to open resume journal: " + path);
+    return os::AutoFd{fd};
+}
+
+}  // namespace
+
+std::string ResumeData::Encode() const {
+    BencodeMap map;
+    map.Set("info hash", Str(info_hash));
+    map.Set("torrent file", Str(torrent_file));
+    map.Set("save path", Str(save_path));
+    map.Set("have", Str(have));
+    auto file_list = std::make_unique<BencodeList>();
+    for (const auto& file : files) {
+        auto entry = std::make_unique<BencodeMap>();
+        entry->Set("path", Str(file.path));
+        entry->Set("size", Int(file.size));
+        entry->Set("mtime ns", Int(file.mtime_ns));
+        file_list->Add(std::move(entry));
+    }
+    map.Set("files", std::move(file_list));
+    return map.Encode().Expect("bencode of plain values");
+}
+
+Result<ResumeData, std::string> ResumeData::Decode(const std::string& bytes) {
+    size_t idx = 0;
+    ASSIGN_OR_RAISE(auto obj, BencodeObject::Parse(bytes, &idx));
+    const BencodeObject& map = *obj;
+    ResumeData data;
+    data.info_hash = OPTIONAL_OR_RAISE(map["info hash"].GetString(), "resume data missing hash");
+    data.torrent_file =
+        OPTIONAL_OR_RAISE(map["torrent file"].GetString(), "resume data missing torrent file");
+    data.save_path =
+        OPTIONAL_OR_RAISE(map["save path"].GetString(), "resume data missing save path");
+    data.have = OPTIONAL_OR_RAISE(map["have"].GetString(), "resume data missing have");
+    const auto& files = map["files"];
+    if (!files.IsList()) return Err("resume data missing files");
+    for (size_t i = 0; i < files.Size(); i++) {
+        FileFingerprint file;
+        file.path = OPTIONAL_OR_RAISE(files[i]["path"].GetString(), "resume file missing path");
+        file.size = OPTIONAL_OR_RAISE(files[i]["size"].GetInt(), "resume file missing size");
+        file.mtime_ns =
+            OPTIONAL_OR_RAISE(files[i]["mtime ns"].GetInt(), "resume file missing mtime");
+        data.files.push_back(std::move(file));
+    }
+    // "partial pieces" of older journals are ignored
+    return data;
+}
+
+std::vector<std::string> ResumeData::FilePaths(const TorrentFile& torrent,
+                                               const std::string& save_path) {
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < torrent.GetFileCount(); i++) {
+        const auto& path = torrent.GetFileInfo(i).path;
+        paths.push_back(absl::StrCat(save_path, "/", absl::StrJoin(path, "/")));
+    }
+    return paths;
+}
+
+Result<ResumeData::FileFingerprint, std::string> ResumeData::Fingerprint(
+    const std::string& path) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) RAISE_ERRNO("failed to stat " + path);
+    int64_t mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1'000'000'000;
+    return FileFingerprint{
+        .path = path,
+        .size = static_cast<uint64_t>(st.st_size),
+        .mtime_ns = mtime_ns + st.st_mtim.tv_nsec,
+    };
+}
+
+bool ResumeData::FingerprintsMatch() const {
+    for (const auto& file : files) {
+        auto current = Fingerprint(file.path);
+        if (!current || current.Value() != file) return false;
+    }
+    return true;
+}
+
+Result<std::unique_ptr<ResumeJournal>, std::string> ResumeJournal::Open(const std::string& path,
+                                                                          State* state) {
+    ASSIGN_OR_RAISE(auto fd, OpenForAppend(path));
+    ASSIGN_OR_RAISE(auto content, ReadAll(fd.get()));
+    std::unique_ptr<ResumeJournal> journal(new ResumeJournal(path, std::move(fd)));
+
+    size_t offset = 0;
+    while (content.size() - offset >= kHeaderSize) {
+        uint32_t length = GetU32(&content[offset]);
+        uint32_t crc = GetU32(&content[offset + 4]);
+        if (content.size() - offset - kHeaderSize < length) break;
+        std::string payload = content.substr(offset + kHeaderSize, length);
+        if (Crc32(payload) != crc) break;
+        size_t idx = 0;
+        auto parsed = BencodeObject::Parse(payload, &idx);
+        if (!parsed) break;
+        const BencodeObject& map = *parsed.Value();
+        Record record;
+        if (map.Contains("removed")) {
+            auto info_hash = map["info hash"].GetString();
+            if (!info_hash) break;
+            record.data.info_hash = *info_hash;
+            record.removed = true;
+        } else {
+            auto data = ResumeData::Decode(payload);
+            if (!data) break;
+            record.data = std::move(data).TakeValue();
+        }
+        journal->Apply(record, kHeaderSize + length);
+        offset += kHeaderSize + length;
+    }
+    if (offset != content.size()) {
+        // the torn or corrupt tail of the last run
+        std::cout << "Resume journal " << path << ": dropping " << content.size() - offset
+                  << " bytes after the last good record" << std::endl;
+        if (::ftruncate(journal->fd_.get(), offset) != 0) {
+            RAISE_ERRNO("failed to truncate " + path);
+        }
+    }
+    journal->bytes_ = offset;
+    *state = journal->state_;
+    return journal;
+}
+
+Result<ResultVoid, std::string> ResumeJournal::Append(const std::vector<Record>& records) {
+    std::string batch;
+    std::vector<uint64_t> sizes;
+    for (const auto& record : records) {
+        std::string frame = Frame(EncodeRecord(record));
+        sizes.push_back(frame.size());
+        batch += frame;
+    }
+    auto written = WriteAll(fd_.get(), batch);
+    if (!written) {
+        // a torn batch in the middle would hide every record after it on replay
+        if (::ftruncate(fd_.get(), bytes_) != 0) RAISE_ERRNO("failed to truncate resume journal");
+        return written;
+    }
+    if (::fdatasync(fd_.get()) != 0) {
+        // the batch is written again on retry
+        int error = errno;
+        if (::ftruncate(fd_.get(), bytes_) != 0) RAISE_ERRNO("failed to truncate resume journal");
+        errno = error;
+        RAISE_ERRNO("failed to sync resume journal");
+    }
+    bytes_ += batch.size();
+    for (size_t i = 0; i < records.size(); i++) Apply(records[i], sizes[i]);
+    if (bytes_ > kCompactMinBytes && bytes_ > kCompactRatio * live_bytes_) {
+        VALUE_OR_RAISE(Compact());
+    }
+    return {};
+}
+
+void ResumeJournal::Apply(const Record& record, uint64_t frame_size) {
+    const std::string& info_hash = record.data.info_hash;
+    auto iter = live_.find(info_hash);
+    if (iter != live_.end()) {
+        live_bytes_ -= iter->second;
+        live_.erase(iter);
+    }
+    if (record.removed) {
+        state_.erase(info_hash);
+        return;
+    }
+    live_[info_hash] = frame_size;
+    live_bytes_ += frame_size;
+    state_[info_hash] = record.data;
+}
+
+Result<ResultVoid, std::string> ResumeJournal::Compact() {
+    std::string content;
+    for (const auto& [info_hash, data] : state_) content += Frame(data.Encode());
+
+    std::string tmp_path = path_ + ".tmp";
+    int tmp = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tmp < 0) RAISE_ERRNO("failed to create " + tmp_path);
+    {
+        os::AutoFd tmp_fd{tmp};
+        VALUE_OR_RAISE(WriteAll(tmp, content));
+        if (::fsync(tmp) != 0) RAISE_ERRNO("failed to sync " + tmp_path);
+    }
+    if (::rename(tmp_path.c_str(), path_.c_str()) != 0) RAISE_ERRNO("failed to rename journal");
+    // the rename itself must survive a crash
+    std::string dir = path_.substr(0, path_.find_last_of('/') + 1);
+    int dir_fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        os::AutoFd dir_autofd{dir_fd};
+        ::fsync(dir_fd);
+    }
+
+    ASSIGN_OR_RAISE(fd_, OpenForAppend(path_));
+    bytes_ = content.size();
+    return {};
+}
+
+coro::Task<Result<std::vector<ResumeData>, std::string>> ResumeStore::Load() {
+    loading_ = true;
+    auto open = [path = path_]() {
+        ResumeJournal::State state;
+        auto journal = ResumeJournal::Open(path, &state);
+        return std::make_pair(std::move(journal), std::move(state));
+    };
+    auto opened = co_await coro::OnThreadpool(loop_, std::move(open));
+    loading_ = false;
+    if (opened && opened.Value().first) journal_ = std::move(opened.Value().first).TakeValue();
+    if (draining_) {
+        // may delete this
+        CheckHalted();
+        co_return Err("resume store halted while loading");
+    }
+    if (!opened) co_return Err(std::move(opened).TakeError());
+    if (!opened.Value().first) co_return Err(std::move(opened.Value().first).TakeError());
+    std::vector<ResumeData> saved;
+    for (auto& [info_hash, data] : opened.Value().second) saved.push_back(std::move(data));
+    // updates made while loading
+    if (!pending_.empty() && !flushing_) coro::Spawn(Flush());
+    co_return saved;
+}
+
+void ResumeStore::Put(ResumeData data) {
+    if (draining_) return;
+    std::string info_hash = data.info_hash;
+    pending_[info_hash] = ResumeJournal::Record{.data = std::move(data)};
+    if (journal_ && !flushing_) coro::Spawn(Flush());
+}
+
+void ResumeStore::Remove(const std::string& info_hash) {
+    if (draining_) return;
+    ResumeJournal::Record record;
+    record.data.info_hash = info_hash;
+    record.removed = true;
+    pending_[info_hash] = std::move(record);
+    if (journal_ && !flushing_) coro::Spawn(Flush());
+}
+
+coro::Task<> ResumeStore::Flush() {
+    flushing_ = true;
+    uint64_t backoff_ms = kRetryMinMs;
+    int failures = 0;
+    while (!pending_.empty()) {
+        // everything that came in during the last write goes out as one batch
+        std::vector<ResumeJournal::Record> batch;
+        for (auto& [info_hash, record] : pending_) batch.push_back(std::move(record));
+        pending_.clear();
+        auto append = [journal = journal_.get(), batch = &batch]() {
+            return journal->Append(*batch);
+        };
+        auto written = co_await coro::OnThreadpool(loop_, std::move(append));
+        if (written) {
+            backoff_ms = kRetryMinMs;
+            failures = 0;
+            continue;
+        }
+        // back in line, behind whatever newer state of the same torrents came in meanwhile
+        for (auto& record : batch) {
+            std::string info_hash = record.data.info_hash;
+            pending_.try_emplace(std::move(info_hash), std::move(record));
+        }
+        if (draining_ && ++failures >= kHaltAttempts) {
+            std::cout << "Failed to save resume data, dropping " << pending_.size()
+                      << " records: " << written.Error() << std::endl;
+            pending_.clear();
+            break;
+        }
+        std::cout << "Failed to save resume data, retrying in " << backoff_ms
+                  << " ms: " << written.Error() << std::endl;
+        co_await coro::Sleep(loop_, draining_ ? kRetryMinMs : backoff_ms);
+        backoff_ms = std::min(backoff_ms * 2, kRetryMaxMs);
+    }
+    flushing_ = false;
+    CheckHalted();
+}
+
+void ResumeStore::Halt(std::function<void()> on_closed) {
+    if (draining_) return;
+    draining_ = true;
+    on_closed_ = std::move(on_closed);
+    CheckHalted();
+}
+
+void ResumeStore::CheckHalted() {
+    if (!draining_ || loading_ || flushing_) return;
+    // a journal that never opened has nothing to write to
+    if (!journal_) pending_.clear();
+    if (!pending_.empty()) {
+        coro::Spawn(Flush());
+        return;
+    }
+    journal_.reset();
+    auto cb = std::move(on_closed_);
+    on_closed_ = nullptr;
+    // may delete this
+    if (cb) cb();
+}
+
+}  // namespace ryu
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <uv.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "os.h"
+#include "result.h"
+#include "torrent_file.h"
+#include "utils/coro.h"
+
+namespace ryu {
+
+// Everything needed to bring a task back after a restart without hashing its data again
+struct ResumeData {
+    // what the files on disk looked like when the state was saved
+    struct FileFingerprint {
+        std::string path;
+        uint64_t size = 0;
+        int64_t mtime_ns = 0;
+        bool operator==(const FileFingerprint&) const = default;
+    };
+
+    std::string info_hash;
+    // the .torrent file the task was created from
+    std::string torrent_file;
+    std::string save_path;
+    // one bit per verified piece, high bit first as in the BitTorrent bitfield message. Blocks
+    // are only written once their piece is verified, partial pieces have nothing to save.
+    std::string have;
+    std::vector<FileFingerprint> files;
+
+    bool operator==(const ResumeData&) const = default;
+
+    [[nodiscard]] std::string Encode() const;
+    static Result<ResumeData, std::string> Decode(const std::string& bytes);
+
+    // Where the files of `torrent` are below `save_path`, in torrent order
+    static std::vector<std::string> FilePaths(const TorrentFile& torrent,
+                                              const std::string& save_path);
+    // Blocking. Size and modification time of `path`.
+    static Result<FileFingerprint, std::string> Fingerprint(const std::string& path);
+    // Blocking. Whether every file still has the recorded size and modification time.
+    [[nodiscard]] bool FingerprintsMatch() const;
+};
+
+// Append-only log of ResumeData updates and removals, one fsync per batch.
+//
+// Each record is a little endian u32 payload length, the CRC-32 of the payload and the payload.
+// A crash can only tear the last record, replaying stops at the first record that is short or
+// fails its checksum and the file is cut back to what was replayed. Once the log is mostly
+// superseded records it is rewritten to a temporary file, synced and renamed over the old one.
+//
+// Blocking, meant to run on the threadpool. Not thread safe.
+class ResumeJournal {
+  public:
+    // an update, or the removal of `data.info_hash` if `removed`
+    struct Record {
+        ResumeData data;
+        bool removed = false;
+    };
+    using State = std::unordered_map<std::string, ResumeData>;
+
+    // Replay `path` into `state`, creating the file if needed
+    static Result<std::unique_ptr<ResumeJournal>, std::string> Open(const std::string& path,
+                                                                      State* state);
+    ResumeJournal(const ResumeJournal&) = delete;
+    ResumeJournal& operator=(const ResumeJournal&) = delete;
+
+    // Durable once it returns. May compact the log.
+    Result<ResultVoid, std::string> Append(const std::vector<Record>& records);
+
+    [[nodiscard]] uint64_t Bytes() const { return bytes_; }
+
+  private:
+    ResumeJournal(std::string path, os::AutoFd fd)
+        : path_(std::move(path)), fd_(std::move(fd)) {}
+    // account for a record once it is on disk
+    void Apply(const Record& record, uint64_t frame_size);
+    Result<ResultVoid, std::string> Compact();
+
+    const std::string path_;
+    os::AutoFd fd_;
+    uint64_t bytes_ = 0;
+    // encoded size of the latest record of each torrent, what a compacted log would hold
+    std::unordered_map<std::string, uint64_t> live_;
+    uint64_t live_bytes_ = 0;
+    // the latest records, for compaction
+    State state_;
+};
+
+// The loop's side of the journal. Updates are kept in memory and written in batches on the
+// threadpool, one batch at a time, so the loop never waits on the disk.
+class ResumeStore {
+  public:
+    ResumeStore(uv_loop_t* loop, std::string path) : loop_(loop), path_(std::move(path)) {}
+    ResumeStore(const ResumeStore&) = delete;
+    ResumeStore& operator=(const ResumeStore&) = delete;
+
+    // Open and replay the journal, returns the saved tasks
+    coro::Task<Result<std::vector<ResumeData>, std::string>> Load();
+    // Save `data` over the previous state of its torrent
+    void Put(ResumeData data);
+    void Remove(const std::string& info_hash);
+    // Write what is pending, then call `on_closed`. Nothing is saved after it.
+    void Halt(std::function<void()> on_closed);
+
+  private:
+    coro::Task<> Flush();
+    void CheckHalted();
+
+    uv_loop_t* const loop_;
+    const std::string path_;
+    std::unique_ptr<ResumeJournal> journal_;
+    // by info hash, the latest wins
+    std::unordered_map<std::string, ResumeJournal::Record> pending_;
+    bool loading_ = false;
+    bool flushing_ = false;
+
+    bool draining_ = false;
+    std::function<void()> on_closed_;
+};
+
+}  // namespace ryu
@@ -0,0 +1,161 @@
+#include "ryu/resume.h"
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace ryu;
+
+namespace {
+
+ResumeData Sample(const std::string& info_hash, size_t have_bytes = 4) {
+    return ResumeData{
+        .info_hash = info_hash,
+        .torrent_file = "/tmp/" + info_hash + ".torrent",
+        .save_path = "/tmp",
+        .have = std::string(have_bytes, '\xf0'),
+        .files = {{.path = "/tmp/a", .size = 100, .mtime_ns = 1'700'000'000'123'456'789}},
+    };
+}
+
+class ResumeTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        path_ = testing::TempDir() + "resume_test_" + std::to_string(getpid());
+        std::remove(path_.c_str());
+    }
+    void TearDown() override { std::remove(path_.c_str()); }
+
+    ResumeJournal::State Replay() {
+        ResumeJournal::State state;
+        ResumeJournal::Open(path_, &state).Expect("open journal");
+        return state;
+    }
+
+    void AppendRaw(const std::string& bytes) {
+        std::ofstream(path_, std::ios::binary | std::ios::app) << bytes;
+    }
+
+    std::string path_;
+};
+
+TEST_F(ResumeTest, EncodeDecode) {
+    ResumeData data = Sample(std::string(20, 'h'));
+    data.have[1] = '\0';
+    auto decoded = ResumeData::Decode(data.Encode());
+    ASSERT_TRUE(decoded);
+    EXPECT_EQ(data, decoded.Value());
+    EXPECT_FALSE(ResumeData::Decode("d4:have0:e"));
+}
+
+TEST_F(ResumeTest, ReplaysLatestAndDropsTornTail) {
+    {
+        ResumeJournal::State state;
+        auto journal = ResumeJournal::Open(path_, &state).Expect("open journal");
+        EXPECT_TRUE(state.empty());
+        ResumeData a = Sample("a");
+        ASSERT_TRUE(journal->Append({{Sample("a")}, {Sample("b")}}));
+        a.have = "\xff\xff\xff\xff";
+        ResumeJournal::Record removal;
+        removal.data.info_hash = "b";
+        removal.removed = true;
+        ASSERT_TRUE(journal->Append({{a}, removal}));
+    }
+    uint64_t good_size = 0;
+    {
+        auto state = Replay();
+        ASSERT_EQ(1u, state.size());
+        EXPECT_EQ("\xff\xff\xff\xff", state["a"].have);
+        std::ifstream file(path_, std::ios::binary | std::ios::ate);
+        good_size = file.tellg();
+    }
+
+    // a record cut short by a crash
+    AppendRaw(std::string("\x40\x00\x00\x00\x12\x34\x56\x78" "d4:have", 15));
+    EXPECT_EQ(1u, Replay().size());
+    std::ifstream file(path_, std::ios::binary | std::ios::ate);
+    EXPECT_EQ(good_size, static_cast<uint64_t>(file.tellg()));
+
+    // a complete record with a bad checksum
+    std::string payload = Sample("c").Encode();
+    std::string header(8, '\0');
+    header[0] = static_cast<char>(payload.size() & 0xff);
+    header[1] = static_cast<char>(payload.size() >> 8);
+    AppendRaw(header + payload);
+    EXPECT_EQ(0u, Replay().count("c"));
+}
+
+TEST_F(ResumeTest, CompactsSupersededRecords) {
+    ResumeJournal::State state;
+    auto journal = ResumeJournal::Open(path_, &state).Expect("open journal");
+    ResumeData big = Sample("big", 64 * 1024);
+    for (int i = 0; i < 40; i++) {
+        big.have[0] = static_cast<char>(i);
+        ASSERT_TRUE(journal->Append({{big}, {Sample("small")}}));
+    }
+    // 40 generations of a 64 KiB record would be 2.5 MiB
+    EXPECT_LT(journal->Bytes(), 1u << 20);
+    journal.reset();
+    state = Replay();
+    ASSERT_EQ(2u, state.size());
+    EXPECT_EQ(big, state["big"]);
+}
+
+TEST_F(ResumeTest, Fingerprints) {
+    std::string data_path = path_ + ".data";
+    std::ofstream(data_path) << "piece data";
+    ResumeData data = Sample("f");
+    data.files = {ResumeData::Fingerprint(data_path).Expect("stat")};
+    EXPECT_EQ(10u, data.files[0].size);
+    EXPECT_TRUE(data.FingerprintsMatch());
+
+    std::ofstream(data_path, std::ios::app) << "more";
+    EXPECT_FALSE(data.FingerprintsMatch());
+    std::remove(data_path.c_str());
+    EXPECT_FALSE(data.FingerprintsMatch());
+}
+
+TEST_F(ResumeTest, StoreWritesOffTheLoop) {
+    uv_loop_t loop;
+    uv_loop_init(&loop);
+    auto load = [&](std::vector<ResumeData>* out) {
+        auto store = std::make_unique<ResumeStore>(&loop, path_);
+        // the closure must outlive the coroutine, it holds the captures
+        auto body = [&]() -> coro::Task<> {
+            auto saved = co_await store->Load();
+            EXPECT_TRUE(saved);
+            if (saved) *out = std::move(saved).TakeValue();
+        };
+        coro::Spawn(body());
+        // saved once the journal is open, the latest of each torrent wins
+        store->Put(Sample("x"));
+        store->Put(Sample("y"));
+        store->Put(Sample("x", 8));
+        store->Remove("y");
+        uv_run(&loop, UV_RUN_DEFAULT);
+        store->Put(Sample("z"));
+        bool closed = false;
+        store->Halt([&] { closed = true; });
+        uv_run(&loop, UV_RUN_DEFAULT);
+        EXPECT_TRUE(closed);
+    };
+
+    std::vector<ResumeData> first, second;
+    load(&first);
+    EXPECT_TRUE(first.empty());
+    load(&second);
+    ASSERT_EQ(2u, second.size());
+    std::sort(second.begin(), second.end(),
+              [](const auto& a, const auto& b) { return a.info_hash < b.info_hash; });
+    EXPECT_EQ(Sample("x", 8), second[0]);
+    EXPECT_EQ(Sample("z"), second[1]);
+    EXPECT_EQ(0, uv_loop_close(&loop));
+}
+
+}  // namespace
@@ -1,44 +1,124 @@
 #include "rpc_client.h"
 
 #include "app.h"
+#include "common/metrics.h"
 #include "utils/uv_callbacks.h"
+#include <climits>
 #include <iostream>
 #include <cassert>
 #include <cstring>
 #include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
 
 namespace ryu {
 
+namespace {
+
+auto& registry = metrics::Registry::Global();
+metrics::Counter* const requests_total =
+    registry.GetCounter("ryu_rpc_requests_total", "RPC commands and requests handled");
+metrics::Counter* const errors_total =
+    registry.GetCounter("ryu_rpc_errors_total", "RPC requests answered with an error");
+metrics::Histogram* const request_seconds = registry.GetHistogram(
+    "ryu_rpc_request_seconds", "Time spent handling a framed RPC request", 1e-9);
+metrics::Counter* const received_bytes_total =
+    registry.GetCounter("ryu_rpc_received_bytes_total", "Bytes read from RPC clients");
+metrics::Counter* const sent_bytes_total =
+    registry.GetCounter("ryu_rpc_sent_bytes_total", "Bytes queued to RPC clients");
+
+// Counters and gauges by name, histograms as {count, sum, p50, p90, p99, p999} in the unit they
+// record, nanoseconds for durations
+std::unique_ptr<bencode::BencodeMap> MetricsMap() {
+    auto ret = std::make_unique<bencode::BencodeMap>();
+    auto integer = [](uint64_t v) {
+        return std::make_unique<bencode::BencodeInteger>(static_cast<int64_t>(v));
+    };
+    metrics::Registry::Global().ForEach([&](const metrics::Registry::Family& family) {
+        switch (family.type) {
+            case metrics::Registry::Type::COUNTER:
+                ret->Set(family.name, integer(family.counter->Value()));
+                break;
+            case metrics::Registry::Type::GAUGE:
+                ret->Set(family.name,
+                         std::make_unique<bencode::BencodeInteger>(family.gauge->Value()));
+                break;
+            case metrics::Registry::Type::HISTOGRAM: {
+                auto snapshot = family.histogram->Snap();
+                auto map = std::make_unique<bencode::BencodeMap>();
+                map->Set("count", integer(snapshot.count));
+                map->Set("sum", integer(snapshot.sum));
+                map->Set("p50", integer(snapshot.Quantile(0.5)));
+                map->Set("p90", integer(snapshot.Quantile(0.9)));
+                map->Set("p99", integer(snapshot.Quantile(0.99)));
+                map->Set("p999", integer(snapshot.Quantile(0.999)));
+                ret->Set(family.name, std::move(map));
+                break;
+            }
+        }
+    });
+    return ret;
+}
+
+std::unique_ptr<bencode::BencodeObject> ToBencode(const StatusFeed::Value& value) {
+    if (auto* integer = std::get_if<int64_t>(&value)) {
+        return std::make_unique<bencode::BencodeInteger>(*integer);
+    }
+    return std::make_unique<bencode::BencodeString>(std::get<std::string>(value));
+}
+
+}  // namespace
+
 Result<ResultVoid, std::string> RpcClient::Accept(uv_stream_t* server) {
     int retcode = 0;
 
-    buf_capacity_ = 1024;
-    buf_size_ = 0;
-    data_buf_ = std::make_unique<char[]>(buf_capacity_);
-    socket_ = std::make_unique<uv_tcp_t>();
-    retcode = uv_tcp_init(server->loop, socket_.get());
-    if (retcode) return Err("uv_tcp_init() failed");
-    socket_->data = this;
+    socket_ = std::make_unique<Socket>();
+    if (server->type == UV_NAMED_PIPE) {
+        retcode = uv_pipe_init(server->loop, &socket_->pipe, 0);
+        if (retcode) return Err("uv_pipe_init() failed");
+    } else {
+        retcode = uv_tcp_init(server->loop, &socket_->tcp);
+        if (retcode) return Err("uv_tcp_init() failed");
+    }
+    socket_->handle.data = this;
 
     retcode = uv_accept(server, reinterpret_cast<uv_stream_t*>(socket_.get()));
     if (retcode) return Err("uv_accept() failed");
+    writes_ = std::make_unique<net::WriteQueue>(reinterpret_cast<uv_stream_t*>(socket_.get()),
+                                                buffers_, net::WriteQueue::Options{},
+                                                [this]() { ResumeReading(); });
     retcode = uv_read_start(
         (uv_stream_t*) socket_.get(),
         uv_callbacks::Alloc<&RpcClient::BufferSelection>,
         uv_callbacks::Read<&RpcClient::IncomingData>
     );
     if (retcode) return Err("uv_read_start() failed");
+    reading_ = true;
     return {};
 }
 
+void RpcClient::ResumeReading() {
+    if (reading_ || socket_eof_) return;
+    int retcode = uv_read_start((uv_stream_t*)socket_.get(),
+                                uv_callbacks::Alloc<&RpcClient::BufferSelection>,
+                                uv_callbacks::Read<&RpcClient::IncomingData>);
+    if (retcode == 0) reading_ = true;
+}
+
 void RpcClient::Halt() {
     // finishes all write
     // shutdown write end
     // read until eof
     // close socket
     // notify app
+    if (draining_) return;
     std::cout << "Halting RpcClient" << std::endl;
     draining_ = true;
+    Unsubscribe();
+    writes_->Flush();
+    // the eof is needed to close
+    ResumeReading();
 
     shutdown_req_.data = this;
     uv_shutdown(&shutdown_req_, (uv_stream_t*)socket_.get(), uv_callbacks::Shutdown<&RpcClient::SocketShutdownComplete>);
@@ -66,30 +146,215 @@ void RpcClient::SocketClosed(uv_handle_t* handle) {
     app_->ReleaseRpcClient(*this);
 }
 
-void RpcClient::IncomingCommand(std::string str) {
+void RpcClient::IncomingCommand(std::string_view str) {
+    if (mode_ == Mode::HTTP) {
+        // the headers end with an empty line
+        if (str.empty() || str == "\r") ServeHttp();
+        return;
+    }
+    if (absl::StartsWith(str, "GET ")) {
+        // GET <path> HTTP/1.x
+        std::vector<std::string> parts = absl::StrSplit(str, ' ');
+        mode_ = Mode::HTTP;
+        http_path_ = parts[1];
+        return;
+    }
+    if (metrics_only_) {
+        Halt();
+        return;
+    }
+    requests_total->Add();
     std::cout << "Received RPC command: " << str << std::endl;
     if (str == "bye") {
         Halt();
     } else if (str == "stop") {
         app_->Halt();
     } else if (str == "ping") {
-        auto buf = std::make_unique<UvWriteBuf>(5);
-        buf->buffer()[0] = 'p';
-        buf->buffer()[1] = 'o';
-        buf->buffer()[2] = 'n';
-        buf->buffer()[3] = 'g';
-        buf->buffer()[4] = '\n';
-        buf->write(5, (uv_stream_t*)socket_.get(), this, uv_callbacks::Write<&RpcClient::WriteFinishes>);
-        outgoing_[buf.get()] = std::move(buf);
+        Send("pong\n");
+    } else if (str == "status") {
+        SendStatus();
+    } else if (str == "metrics") {
+        app_->UpdateMetrics();
+        Send(metrics::Registry::Global().Prometheus());
     } else if (absl::StartsWithIgnoreCase(str, "CreateTask ")) {
-        app_->CreateTask(str.substr(11));
+        app_->CreateTask(std::string(str.substr(11)));
+    } else if (absl::StartsWithIgnoreCase(str, "RemoveTask ")) {
+        app_->RemoveTask(std::string(str.substr(11)));
+    } else if (absl::StartsWithIgnoreCase(str, "SetPriority ")) {
+        // SetPriority <info hash> <priority>
+        std::vector<std::string> args = absl::StrSplit(str.substr(12), ' ', absl::SkipEmpty());
+        int priority;
+        if (args.size() == 2 && absl::SimpleAtoi(args[1], &priority)) {
+            app_->SetTaskPriority(args[0], priority);
+        }
+    }
+}
+
+void RpcClient::ServeHttp() {
+    std::string status = "200 OK";
+    std::string body;
+    if (http_path_ == "/metrics") {
+        app_->UpdateMetrics();
+        body = metrics::Registry::Global().Prometheus();
+    } else {
+        status = "404 Not Found";
+    }
+    Send(absl::StrCat("HTTP/1.0 ", status,
+                      "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ",
+                      body.size(), "\r\nConnection: close\r\n\r\n", body));
+    Halt();
+}
+
+void RpcClient::IncomingFrame(std::string_view body) {
+    auto parsed = rpc::ParseRequests(body);
+    if (!parsed) {
+        SendFrame(*rpc::ErrorReply({}, parsed.Error()));
+        return;
+    }
+    auto requests = std::move(parsed).TakeValue();
+    auto replies = std::make_unique<bencode::BencodeList>();
+    for (const auto& request : requests.requests) {
+        uint64_t start = uv_hrtime();
+        auto result = Call(request);
+        requests_total->Add();
+        if (result) {
+            replies->Add(rpc::Reply(request.id, std::move(result).TakeValue()));
+        } else {
+            errors_total->Add();
+            replies->Add(rpc::ErrorReply(request.id, result.Error()));
+        }
+        request_seconds->Record(uv_hrtime() - start);
+    }
+    if (requests.batch) {
+        SendFrame(*replies);
+    } else {
+        SendFrame((*replies)[0]);
+    }
+    // the replies go out before the shutdown
+    if (stop_after_reply_) {
+        app_->Halt();
+    } else if (halt_after_reply_) {
+        Halt();
     }
 }
 
+Result<std::unique_ptr<bencode::BencodeObject>, std::string> RpcClient::Call(
+    const rpc::Request& request) {
+    const bencode::BencodeObject& args = *request.args;
+    const std::string& method = request.method;
+    if (method == "ping") return std::make_unique<bencode::BencodeString>("pong");
+    if (method == "Metrics") {
+        app_->UpdateMetrics();
+        return MetricsMap();
+    }
+    if (method == "bye") {
+        halt_after_reply_ = true;
+    } else if (method == "stop") {
+        stop_after_reply_ = true;
+    } else if (method == "CreateTask") {
+        auto torrent = OPTIONAL_OR_RAISE(args["torrent"].GetString(), "missing torrent");
+        auto id = app_->CreateTask(std::move(torrent));
+        if (id == 0) return Err("halting");
+        auto ret = std::make_unique<bencode::BencodeMap>();
+        ret->Set("id", std::make_unique<bencode::BencodeInteger>(static_cast<int64_t>(id)));
+        return ret;
+    } else if (method == "Subscribe") {
+        VALUE_OR_RAISE(Subscribe(args));
+    } else if (method == "Unsubscribe") {
+        Unsubscribe();
+    } else if (method == "RemoveTask") {
+        auto info_hash = OPTIONAL_OR_RAISE(args["info_hash"].GetString(), "missing info_hash");
+        if (!app_->RemoveTask(info_hash)) return Err("no such task");
+    } else if (method == "SetPriority") {
+        auto info_hash = OPTIONAL_OR_RAISE(args["info_hash"].GetString(), "missing info_hash");
+        auto priority = OPTIONAL_OR_RAISE(args["priority"].GetInt(), "missing priority");
+        if (priority < INT_MIN || priority > INT_MAX) return Err("priority out of range");
+        if (!app_->SetTaskPriority(info_hash, static_cast<int>(priority))) {
+            return Err("no such task");
+        }
+    } else {
+        return Err("unknown method: " + method);
+    }
+    return std::make_unique<bencode::BencodeMap>();
+}
+
+Result<ResultVoid, std::string> RpcClient::Subscribe(const bencode::BencodeObject& args) {
+    StatusFeed::Filter filter;
+    const bencode::BencodeObject& tasks = args["tasks"];
+    if (args.Contains("tasks") && !tasks.IsList()) return Err("tasks must be a list");
+    for (size_t i = 0; tasks.IsList() && i < tasks.Size(); i++) {
+        auto id = OPTIONAL_OR_RAISE(tasks[i].GetInt(), "task ids must be integers");
+        filter.tasks.insert(static_cast<StatusFeed::TaskId>(id));
+    }
+    const bencode::BencodeObject& fields = args["fields"];
+    if (args.Contains("fields") && !fields.IsList()) return Err("fields must be a list");
+    for (size_t i = 0; fields.IsList() && i < fields.Size(); i++) {
+        filter.fields.insert(OPTIONAL_OR_RAISE(fields[i].GetString(), "fields must be strings"));
+    }
+    Unsubscribe();
+    // a congested client misses ticks, and later gets the latest state only
+    subscription_ = app_->status_feed().Subscribe(
+        std::move(filter), [this]() { return !draining_ && !writes_->Congested(); },
+        [this](const StatusFeed::Delta& delta) { PushStatus(delta); });
+    return {};
+}
+
+void RpcClient::Unsubscribe() {
+    if (!subscription_) return;
+    app_->status_feed().Unsubscribe(*subscription_);
+    subscription_.reset();
+}
+
+void RpcClient::PushStatus(const StatusFeed::Delta& delta) {
+    auto tasks = std::make_unique<bencode::BencodeList>();
+    for (const auto& [id, fields] : delta.changed) {
+        auto task = std::make_unique<bencode::BencodeMap>();
+        task->Set("id", std::make_unique<bencode::BencodeInteger>(static_cast<int64_t>(id)));
+        for (const auto& [name, value] : fields) task->Set(name, ToBencode(value));
+        tasks->Add(std::move(task));
+    }
+    auto removed = std::make_unique<bencode::BencodeList>();
+    for (auto id : delta.removed) {
+        removed->Add(std::make_unique<bencode::BencodeInteger>(static_cast<int64_t>(id)));
+    }
+    bencode::BencodeMap event;
+    event.Set("event", std::make_unique<bencode::BencodeString>("status"));
+    event.Set("tasks", std::move(tasks));
+    event.Set("removed", std::move(removed));
+    SendFrame(event);
+    writes_->Flush();
+}
+
+void RpcClient::SendStatus() {
+    app_->RefreshStatus();
+    std::string out;
+    app_->status_feed().ForEach([&out](StatusFeed::TaskId id, const StatusFeed::Fields& fields) {
+        absl::StrAppend(&out, id);
+        for (const auto& [name, value] : fields) {
+            absl::StrAppend(&out, " ", name, "=");
+            std::visit([&out](const auto& v) { absl::StrAppend(&out, v); }, value);
+        }
+        out += "\n";
+    });
+    Send(out);
+}
+
+void RpcClient::SendFrame(const bencode::BencodeObject& message) {
+    auto frame = rpc::EncodeFrame(message);
+    if (!frame) {
+        std::cout << "Failed to encode RPC reply: " << frame.Error() << std::endl;
+        return;
+    }
+    Send(frame.Value());
+}
+
+void RpcClient::Send(std::string_view data) {
+    sent_bytes_total->Add(data.size());
+    writes_->Write(data);
+}
+
 void RpcClient::BufferSelection(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
-    assert(buf_size_ < buf_capacity_);
-    buf->base = data_buf_.get() + buf_size_;
-    buf->len = buf_capacity_  - buf_size_;
+    recv_.Prepare(buf);
 }
 
 void RpcClient::IncomingData(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
@@ -98,32 +363,48 @@ void RpcClient::IncomingData(uv_stream_t* stream, ssize_t nread, const uv_buf_t*
         CheckSocketReadyToClose();
         return;
     } else if (nread < 0) {
-        Halt();
+        if (nread == UV_ENOBUFS) std::cout << "RPC message too long" << std::endl;
+        // nothing more to read, libuv only stops by itself at eof and would keep asking for a
+        // buffer the full receive buffer can not give
+        uv_read_stop((uv_stream_t*)socket_.get());
+        reading_ = false;
+        socket_eof_ = true;
+        CheckSocketReadyToClose();
         return;
     } else if (nread == 0) {
         return;
     }
 
-    size_t st = 0;
-    for (size_t idx = buf_size_; idx < buf_size_ + nread; idx++) {
-        if (data_buf_[idx] == '\n') {
-            size_t cnt = idx - st;
-            IncomingCommand(std::string(data_buf_.get() + st, cnt));
-            st = idx+1;
-        }
+    recv_.Commit(nread);
+    received_bytes_total->Add(nread);
+    // ignore what comes after "bye"
+    if (draining_) {
+        recv_.Consume(recv_.size());
+        return;
     }
-    if (st < buf_size_+nread) {
-        size_t new_size = buf_size_ + nread - st;
-        memmove(data_buf_.get(), data_buf_.get() + st, new_size);
-        buf_size_ = new_size;
+    if (mode_ == Mode::UNKNOWN) mode_ = recv_.Data()[0] == '\0' ? Mode::FRAMED : Mode::TEXT;
+    if (mode_ == Mode::FRAMED && metrics_only_) {
+        Halt();
+        return;
+    }
+    if (mode_ != Mode::FRAMED) {
+        recv_.ForEachLine([this](std::string_view line) {
+            IncomingCommand(line);
+            return !draining_;
+        });
+    } else if (!recv_.ForEachFrame(rpc::kMaxFrameSize, [this](std::string_view body) {
+                   IncomingFrame(body);
+                   return !draining_;
+               })) {
+        SendFrame(*rpc::ErrorReply({}, "frame too large"));
+        Halt();
+    }
+    // one write for all the replies to this read
+    writes_->Flush();
+    if (writes_->Congested() && !draining_ && reading_) {
+        uv_read_stop((uv_stream_t*)socket_.get());
+        reading_ = false;
     }
-}
-
-void RpcClient::WriteFinishes(uv_write_t* write_req, int status) {
-    auto iter = outgoing_.find((UvWriteBuf*)write_req);
-    assert(iter != outgoing_.end());
-    assert(status == 0);
-    outgoing_.erase(iter);
 }
 
 }  // namespace ryu
\ No newline at end of file
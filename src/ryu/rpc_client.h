@@ -1,16 +1,27 @@
 #pragma once
 
 #include <uv.h>
-#include "utils/uv_write_buf.h"
+#include "utils/recv_buffer.h"
 
+#include <memory>
+#include <optional>
+#include <string_view>
+
+#include "common/bencode.h"
+#include "common/write_queue.h"
 #include "result.h"
+#include "ryu/rpc_protocol.h"
+#include "ryu/status_feed.h"
 
 namespace ryu {
 
 class App;
 class RpcClient {
   public:
-    explicit RpcClient(App* app) : app_(app) {}
+    // Replies are written from `buffers`, which must outlive the client. A `metrics_only` client
+    // serves nothing but HTTP GET /metrics.
+    RpcClient(App* app, net::BufferPool* buffers, bool metrics_only = false)
+        : app_(app), buffers_(buffers), metrics_only_(metrics_only) {}
     Result<ResultVoid, std::string> Accept(uv_stream_t* server);
 
     // Forcefully close both send and recv side
@@ -23,29 +34,66 @@ class RpcClient {
     void SocketClosed(uv_handle_t* handle);
 
     // called when a command arrives
-    void IncomingCommand(std::string str);
+    void IncomingCommand(std::string_view str);
+    // called when a frame arrives, see rpc_protocol.h
+    void IncomingFrame(std::string_view body);
 
     // UV callback when data income
     void BufferSelection(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
     void IncomingData(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
-    // UV callback on write finish.
-    void WriteFinishes(uv_write_t* write_req, int status);
 
   private:
+    // Decided by the first byte received, HTTP by the first line. HTTP only serves the metrics
+    // for Prometheus, one request per connection.
+    enum class Mode { UNKNOWN, TEXT, FRAMED, HTTP };
+
+    // run a framed request
+    Result<std::unique_ptr<bencode::BencodeObject>, std::string> Call(const rpc::Request& request);
+    // replaces the current subscription, if any
+    Result<ResultVoid, std::string> Subscribe(const bencode::BencodeObject& args);
+    void Unsubscribe();
+    // a status event frame
+    void PushStatus(const StatusFeed::Delta& delta);
+    // the text "status" command
+    void SendStatus();
+    void SendFrame(const bencode::BencodeObject& message);
+    void Send(std::string_view data);
+    // once the request headers are read
+    void ServeHttp();
+    // stop reading requests while the replies pile up
+    void ResumeReading();
+
     App* const app_;
+    net::BufferPool* const buffers_;
+    const bool metrics_only_;
+    Mode mode_ = Mode::UNKNOWN;
+    // path of the HTTP request
+    std::string http_path_;
 
-    // stores incoming data
-    size_t buf_capacity_;
-    size_t buf_size_;
-    std::unique_ptr<char[]> data_buf_;
+    // stores incoming data, up to a whole frame
+    RecvBuffer recv_{4096, rpc::kFrameHeaderSize + rpc::kMaxFrameSize};
 
-    std::unique_ptr<uv_tcp_t> socket_;
-    std::unordered_map<UvWriteBuf*, std::unique_ptr<UvWriteBuf>> outgoing_;
+    // TCP or Unix socket, like the listener it was accepted from
+    union Socket {
+        uv_handle_t handle;
+        uv_stream_t stream;
+        uv_tcp_t tcp;
+        uv_pipe_t pipe;
+    };
+    std::unique_ptr<Socket> socket_;
+    // replies queued since the last read are flushed together
+    std::unique_ptr<net::WriteQueue> writes_;
+    bool reading_ = false;
+    // to the app's status feed, framed clients only
+    std::optional<StatusFeed::SubscriberId> subscription_;
 
     uv_shutdown_t shutdown_req_;
     bool draining_ = false;
     bool socket_eof_ = false;
     bool socket_shutdown_ = false;
+    // set by framed "bye" and "stop", acted upon once their replies are queued
+    bool halt_after_reply_ = false;
+    bool stop_after_reply_ = false;
 };
 
 }  // namespace ryu
\ No newline at end of file
@@ -4,50 +4,168 @@
 #include "common/network.h"
 #include <uv.h>
 #include "utils/uv_callbacks.h"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 #include <cassert>
+#include <cstring>
 #include <iostream>
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
 
 namespace ryu {
 
-Result<ResultVoid, std::string> RpcManager::Listen(std::string listen_addr, uv_loop_t* loop) {
-    int retcode = 0;
-    sockaddr_storage addr = {};
+namespace {
+
+// Whether a server is accepting on the socket file at `path`
+bool UnixSocketInUse(const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    bool in_use = connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+    close(fd);
+    return in_use;
+}
 
-    VALUE_OR_RAISE(net::ParseAddrPort(listen_addr, &addr, 8989));
+}  // namespace
 
-    socket_ = std::make_unique<uv_tcp_t>();
-    retcode = uv_tcp_init(loop, socket_.get());
-    if (retcode) return Err("RpcManager::Listen uv_tcp_init() failed");
-    socket_->data = this;
+Result<ResultVoid, std::string> RpcManager::Listen(std::string listen_addr, uv_loop_t* loop) {
+    VALUE_OR_RAISE(InitHandles(loop));
+    bool unix_socket = absl::StartsWith(listen_addr, "unix:");
+    auto listener = std::make_unique<Listener>();
+    Listener* ptr = listener.get();
+    int retcode = unix_socket ? uv_pipe_init(loop, &ptr->pipe, 0) : uv_tcp_init(loop, &ptr->tcp);
+    if (retcode) {
+        return Err(unix_socket ? "RpcManager::Listen uv_pipe_init() failed"
+                               : "RpcManager::Listen uv_tcp_init() failed");
+    }
+    ptr->handle.data = this;
+    open_handles_++;
+    // Halt() closes it from now on
+    listeners_.push_back(std::move(listener));
 
-    retcode = uv_tcp_bind(socket_.get(), reinterpret_cast<sockaddr*>(&addr), UV_TCP_IPV6ONLY);
-    if (retcode) return Err("uv_tcp_bind() failed");
-    retcode = uv_listen(reinterpret_cast<uv_stream_t*>(socket_.get()), 512, 
+    if (unix_socket) {
+        VALUE_OR_RAISE(BindUnix(ptr, listen_addr.substr(5)));
+    } else {
+        VALUE_OR_RAISE(BindTcp(ptr, listen_addr));
+    }
+    retcode = uv_listen(&ptr->stream, options_.backlog,
         uv_callbacks::Connection<&RpcManager::NewConnection>);
-    if (retcode) return Err("uv_listen() failed");
+    if (retcode) {
+        return Err(absl::StrCat("uv_listen() failed on ", listen_addr, ": ",
+                                uv_strerror(retcode)));
+    }
+    return {};
+}
+
+Result<ResultVoid, std::string> RpcManager::InitHandles(uv_loop_t* loop) {
+    if (handles_init_) return {};
+    int retcode = uv_idle_init(loop, &idle_);
+    if (retcode) return Err("RpcManager::Listen uv_idle_init() failed");
+    idle_.data = this;
+    open_handles_++;
+    retcode = uv_check_init(loop, &check_);
+    if (retcode) return Err("RpcManager::Listen uv_check_init() failed");
+    check_.data = this;
+    open_handles_++;
+    handles_init_ = true;
+    return {};
+}
+
+Result<ResultVoid, std::string> RpcManager::BindTcp(Listener* listener, const std::string& addr) {
+    sockaddr_storage storage = {};
+    VALUE_OR_RAISE(net::ParseAddrPort(addr, &storage, 8989));
+    unsigned int flags = storage.ss_family == AF_INET6 ? UV_TCP_IPV6ONLY : 0;
+    int retcode = uv_tcp_bind(&listener->tcp, reinterpret_cast<sockaddr*>(&storage), flags);
+    if (retcode) {
+        return Err(absl::StrCat("uv_tcp_bind() failed on ", addr, ": ", uv_strerror(retcode)));
+    }
+    return {};
+}
+
+Result<ResultVoid, std::string> RpcManager::BindUnix(Listener* listener, const std::string& path) {
+    if (path.empty() || path.size() >= sizeof(sockaddr_un::sun_path)) {
+        return Err(absl::StrCat("bad unix socket path: ", path));
+    }
+    // left behind by a process that didn't exit cleanly
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (UnixSocketInUse(path)) return Err(absl::StrCat("already in use: ", path));
+        unlink(path.c_str());
+    }
+    // bind() creates the file with 0777 minus the umask, chmod() after it would leave a window
+    // where anyone may connect. The umask is process wide, files other threads create meanwhile
+    // only end up stricter.
+    mode_t old_umask = umask(~static_cast<mode_t>(options_.unix_mode) & 0777);
+    int retcode = uv_pipe_bind(&listener->pipe, path.c_str());
+    umask(old_umask);
+    if (retcode) {
+        return Err(absl::StrCat("uv_pipe_bind() failed on ", path, ": ", uv_strerror(retcode)));
+    }
+    listener->path = path;
     return {};
 }
 
 void RpcManager::Halt() {
     draining_ = true;
-    if (socket_) {
-        uv_close((uv_handle_t*)socket_.get(), uv_callbacks::Close<&RpcManager::SocketClosed>);
-    } else {
+    deferred_.clear();
+    if (open_handles_ == 0) {
         app_->ReleaseRpcManager(*this);
+        return;
+    }
+    for (auto& listener : listeners_) {
+        uv_close(&listener->handle, uv_callbacks::Close<&RpcManager::SocketClosed>);
+    }
+    if (handles_init_) {
+        uv_close((uv_handle_t*)&idle_, uv_callbacks::Close<&RpcManager::SocketClosed>);
+        uv_close((uv_handle_t*)&check_, uv_callbacks::Close<&RpcManager::SocketClosed>);
     }
 }
 
 void RpcManager::NewConnection(uv_stream_t* server, int status) {
-    assert(server == (uv_stream_t*)socket_.get());
-    assert(status == 0);
+    if (status != 0) {
+        // e.g. out of file descriptors, libuv retries on the next connection
+        std::cout << "Failed to accept RPC connection: " << uv_strerror(status) << std::endl;
+        return;
+    }
     if (draining_) return;
-    std::cout << "Received incoming connection" << std::endl;
-    app_->AcceptRpcClient(server);
+    if (batch_accepted_ >= options_.accept_batch) {
+        // libuv stops polling the listener until the connection is accepted
+        deferred_.push_back(server);
+        uv_idle_start(&idle_, uv_callbacks::Idle<&RpcManager::AcceptDeferred>);
+        return;
+    }
+    app_->AcceptRpcClient(server, metrics_only_);
+    batch_accepted_++;
+    if (!uv_is_active((uv_handle_t*)&check_)) {
+        uv_check_start(&check_, uv_callbacks::Check<&RpcManager::BatchDone>);
+    }
+}
+
+void RpcManager::AcceptDeferred(uv_idle_t* handle) {
+    uv_idle_stop(&idle_);
+    batch_accepted_ = 0;
+    std::vector<uv_stream_t*> deferred;
+    deferred.swap(deferred_);
+    for (uv_stream_t* server : deferred) NewConnection(server, 0);
+}
+
+void RpcManager::BatchDone(uv_check_t* handle) {
+    batch_accepted_ = 0;
+    uv_check_stop(&check_);
 }
 
 void RpcManager::SocketClosed(uv_handle_t* handle) {
-    assert(handle == (uv_handle_t*)socket_.get());
+    for (auto& listener : listeners_) {
+        if (&listener->handle == handle && !listener->path.empty()) {
+            unlink(listener->path.c_str());
+        }
+    }
+    if (--open_handles_ > 0) return;
     app_->ReleaseRpcManager(*this);
 }
 
-}
\ No newline at end of file
+}
@@ -2,28 +2,73 @@
 
 #include <uv.h>
 #include "result.h"
+#include <cstddef>
+#include <memory>
 #include <string>
+#include <vector>
 
 namespace ryu {
 
 class App;
+// Listens on any number of addresses. An address is "host:port" for TCP, or "unix:<path>" for
+// a Unix domain socket, whose file is replaced if stale and removed on Halt().
 class RpcManager {
     public:
-        explicit RpcManager(App* app) : app_(app) { }
-        // Bind to a port before uv loop starts.
+        struct Options {
+            // pending connections the kernel queues per listener
+            int backlog = 512;
+            // connections accepted per loop iteration across all listeners, the rest wait for
+            // the next iteration so that a connection storm doesn't starve the other clients
+            size_t accept_batch = 64;
+            // permissions of Unix socket files, set as they are created
+            int unix_mode = 0600;
+        };
+
+        // A `metrics_only` manager accepts clients that only serve the metrics over HTTP
+        explicit RpcManager(App* app, Options options, bool metrics_only = false)
+            : app_(app), options_(options), metrics_only_(metrics_only) { }
+        // Bind one more address, before uv loop starts.
         Result<ResultVoid, std::string> Listen(std::string listen_addr, uv_loop_t* loop);
-        // Stop listening and call App::RpcManagerClosed
+        // Stop listening and call App::ReleaseRpcManager once every handle is closed
         void Halt();
 
         // UV callback when new incoming connection
         void NewConnection(uv_stream_t* server, int status);
+        // UV callback, the connections deferred by the last batch
+        void AcceptDeferred(uv_idle_t* handle);
+        // UV callback after polling, the next batch starts
+        void BatchDone(uv_check_t* handle);
 
         // UV callback
         void SocketClosed(uv_handle_t* handle);
     private:
+        struct Listener {
+            union {
+                uv_handle_t handle;
+                uv_stream_t stream;
+                uv_tcp_t tcp;
+                uv_pipe_t pipe;
+            };
+            // the socket file, empty for TCP
+            std::string path;
+        };
+
+        Result<ResultVoid, std::string> InitHandles(uv_loop_t* loop);
+        Result<ResultVoid, std::string> BindTcp(Listener* listener, const std::string& addr);
+        Result<ResultVoid, std::string> BindUnix(Listener* listener, const std::string& path);
+
         App* const app_;
-        std::unique_ptr<uv_tcp_t> socket_;
+        const Options options_;
+        const bool metrics_only_;
+        std::vector<std::unique_ptr<Listener>> listeners_;
+        uv_idle_t idle_;
+        uv_check_t check_;
+        bool handles_init_ = false;
+        // listeners holding a connection that was not accepted yet
+        std::vector<uv_stream_t*> deferred_;
+        size_t batch_accepted_ = 0;
+        int open_handles_ = 0;
         bool draining_ = false;
 };
 
-}
\ No newline at end of file
+}
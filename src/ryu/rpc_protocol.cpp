@@ -0,0 +1,78 @@
+#include "rpc_protocol.h"
+
+#include <utility>
+
+#include "absl/strings/str_cat.h"
+
+namespace ryu {
+namespace rpc {
+
+namespace {
+
+using bencode::BencodeInteger;
+using bencode::BencodeMap;
+using bencode::BencodeObject;
+using bencode::BencodeString;
+
+Result<Request, std::string> ParseRequest(BencodeObject& obj) {
+    if (!obj.IsMap()) return Err("request is not a map");
+    Request request;
+    request.id = OPTIONAL_OR_RAISE(obj["id"].GetInt(), "request without an integer id");
+    auto method = obj["method"].GetString();
+    if (!method) return Err(absl::StrCat("request ", request.id, " has no method"));
+    request.method = std::move(*method);
+    request.args = obj.Del("args");
+    if (!request.args) request.args = std::make_unique<BencodeMap>();
+    if (!request.args->IsMap()) return Err(absl::StrCat("args of ", request.id, " not a map"));
+    return request;
+}
+
+}  // namespace
+
+Result<std::string, std::string> EncodeFrame(const BencodeObject& message) {
+    ASSIGN_OR_RAISE(std::string body, message.Encode());
+    if (body.size() > kMaxFrameSize) return Err("reply too large");
+    std::string frame(kFrameHeaderSize, '\0');
+    for (size_t i = 0; i < kFrameHeaderSize; i++) {
+        frame[i] = static_cast<char>(body.size() >> (8 * (kFrameHeaderSize - 1 - i)) & 0xFF);
+    }
+    frame += body;
+    return frame;
+}
+
+Result<Requests, std::string> ParseRequests(std::string_view body) {
+    size_t idx = 0;
+    ASSIGN_OR_RAISE(auto message, BencodeObject::Parse(body, &idx));
+    if (idx != body.size()) return Err("trailing bytes after the request");
+    Requests ret;
+    if (!message->IsList()) {
+        ASSIGN_OR_RAISE(auto request, ParseRequest(*message));
+        ret.requests.push_back(std::move(request));
+        return ret;
+    }
+    ret.batch = true;
+    ret.requests.reserve(message->Size());
+    while (message->Size() > 0) {
+        auto item = message->Del(size_t{0});
+        ASSIGN_OR_RAISE(auto request, ParseRequest(*item));
+        ret.requests.push_back(std::move(request));
+    }
+    return ret;
+}
+
+std::unique_ptr<BencodeMap> Reply(int64_t id, std::unique_ptr<BencodeObject> result) {
+    auto reply = std::make_unique<BencodeMap>();
+    reply->Set("id", std::make_unique<BencodeInteger>(id));
+    reply->Set("result", std::move(result));
+    return reply;
+}
+
+std::unique_ptr<BencodeMap> ErrorReply(std::optional<int64_t> id, const std::string& error) {
+    auto reply = std::make_unique<BencodeMap>();
+    if (id) reply->Set("id", std::make_unique<BencodeInteger>(*id));
+    reply->Set("error", std::make_unique<BencodeString>(error));
+    return reply;
+}
+
+}  // namespace rpc
+}  // namespace ryu
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "common/bencode.h"
+#include "result.h"
+
+namespace ryu {
+namespace rpc {
+
+// Framed RPC. Every frame is a 4 byte big endian length followed by that many bytes of bencode.
+// A connection whose first byte is zero speaks frames, since no text command starts with it
+// and frames are far below 16 MiB.
+//
+// A request is a map {"id": int, "method": str, "args": map}, "args" may be left out. The
+// reply is {"id": int, "result": any} or {"id": int, "error": str}. Replies may come in any
+// order, clients pipeline requests and match replies by id. A frame holding a list of requests
+// is a batch, answered by a single frame holding the list of their replies in the same order.
+//
+// The server also pushes events, {"event": str, ...}, between replies. After "Subscribe" with
+// args {"tasks": [int], "fields": [str]}, both optional and matching everything when left out,
+// a "status" event {"event": "status", "tasks": [map], "removed": [int]} comes every tick
+// something changed. Each map of "tasks" holds the "id" of a task and the fields that changed
+// since the previous event, the first event holds them all. A client that doesn't keep up
+// misses events, the next one brings it up to date.
+constexpr size_t kFrameHeaderSize = 4;
+constexpr size_t kMaxFrameSize = 1 << 20;
+
+struct Request {
+    int64_t id = 0;
+    std::string method;
+    // never null, an empty map when the request has no args
+    std::unique_ptr<bencode::BencodeObject> args;
+};
+
+// Header and body of a frame
+Result<std::string, std::string> EncodeFrame(const bencode::BencodeObject& message);
+
+// A frame body holding one request, or a batch of them
+struct Requests {
+    std::vector<Request> requests;
+    bool batch = false;
+};
+Result<Requests, std::string> ParseRequests(std::string_view body);
+
+std::unique_ptr<bencode::BencodeMap> Reply(int64_t id,
+                                           std::unique_ptr<bencode::BencodeObject> result);
+std::unique_ptr<bencode::BencodeMap> ErrorReply(std::optional<int64_t> id,
+                                                const std::string& error);
+
+}  // namespace rpc
+}  // namespace ryu
@@ -0,0 +1,78 @@
+#include "ryu/rpc_protocol.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+using namespace ryu;
+using namespace ryu::bencode;
+
+namespace {
+
+std::string Frame(const std::string& body) {
+    std::string header(rpc::kFrameHeaderSize, '\0');
+    header[2] = static_cast<char>(body.size() >> 8);
+    header[3] = static_cast<char>(body.size() & 0xFF);
+    return header + body;
+}
+
+TEST(RpcProtocolTest, EncodeFrame) {
+    BencodeString message(std::string(1000, 'y'));
+    auto frame = rpc::EncodeFrame(message);
+    ASSERT_TRUE(frame);
+    EXPECT_EQ(Frame("1000:" + std::string(1000, 'y')), frame.Value());
+
+    BencodeString large(std::string(rpc::kMaxFrameSize, 'z'));
+    EXPECT_FALSE(rpc::EncodeFrame(large));
+}
+
+TEST(RpcProtocolTest, ParseRequest) {
+    auto ret = rpc::ParseRequests("d2:idi7e6:method4:pinge");
+    ASSERT_TRUE(ret) << ret.Error();
+    const auto& parsed = ret.Value();
+    EXPECT_FALSE(parsed.batch);
+    ASSERT_EQ(1u, parsed.requests.size());
+    EXPECT_EQ(7, parsed.requests[0].id);
+    EXPECT_EQ("ping", parsed.requests[0].method);
+    ASSERT_TRUE(parsed.requests[0].args->IsMap());
+    EXPECT_EQ(0u, parsed.requests[0].args->Size());
+}
+
+TEST(RpcProtocolTest, ParseBatch) {
+    auto ret = rpc::ParseRequests(
+        "ld2:idi1e6:method10:RemoveTask4:argsd9:info_hash2:abee"
+        "d2:idi2e6:method11:SetPriority4:argsd9:info_hash2:ab8:priorityi-3eeee");
+    ASSERT_TRUE(ret) << ret.Error();
+    const auto& parsed = ret.Value();
+    EXPECT_TRUE(parsed.batch);
+    ASSERT_EQ(2u, parsed.requests.size());
+    EXPECT_EQ(1, parsed.requests[0].id);
+    EXPECT_EQ("RemoveTask", parsed.requests[0].method);
+    EXPECT_EQ("ab", (*parsed.requests[0].args)["info_hash"].GetString());
+    EXPECT_EQ(2, parsed.requests[1].id);
+    EXPECT_EQ(-3, (*parsed.requests[1].args)["priority"].GetInt());
+
+    auto empty = rpc::ParseRequests("le");
+    ASSERT_TRUE(empty);
+    EXPECT_TRUE(empty.Value().batch);
+    EXPECT_TRUE(empty.Value().requests.empty());
+}
+
+TEST(RpcProtocolTest, BadRequests) {
+    EXPECT_FALSE(rpc::ParseRequests("i1e"));
+    EXPECT_FALSE(rpc::ParseRequests("d6:method4:pinge"));
+    EXPECT_FALSE(rpc::ParseRequests("d2:idi1ee"));
+    EXPECT_FALSE(rpc::ParseRequests("d2:idi1e6:method4:ping4:argsi0ee"));
+    EXPECT_FALSE(rpc::ParseRequests("d2:idi1e6:method4:pingee"));
+    EXPECT_FALSE(rpc::ParseRequests("ld2:idi1e6:method4:pingei0ee"));
+    EXPECT_FALSE(rpc::ParseRequests("d2:idi1e6:method4:pin"));
+}
+
+TEST(RpcProtocolTest, Replies) {
+    auto reply = rpc::Reply(3, std::make_unique<BencodeString>("pong"));
+    EXPECT_EQ("d2:idi3e6:result4:ponge", reply->Encode());
+    EXPECT_EQ("d2:idi4e5:error7:no suche", rpc::ErrorReply(4, "no such")->Encode());
+    EXPECT_EQ("d5:error3:bade", rpc::ErrorReply({}, "bad")->Encode());
+}
+
+}  // namespace
@@ -0,0 +1,136 @@
+#include "shard.h"
+
+#include <cassert>
+#include <iostream>
+
+#include "absl/strings/escaping.h"
+#include "absl/strings/str_cat.h"
+#include "app.h"
+
+namespace ryu {
+
+Shard::~Shard() {
+    assert(!thread_.joinable());
+    if (loop_open_) uv_loop_close(&loop_);
+}
+
+Result<ResultVoid, std::string> Shard::Start() {
+    int retcode = uv_loop_init(&loop_);
+    if (retcode) return Err(absl::StrCat("uv_loop_init() failed: ", uv_strerror(retcode)));
+    loop_open_ = true;
+    mailbox_ = std::make_unique<Mailbox>(&loop_);
+    loop_monitor_ = std::make_unique<metrics::LoopMonitor>(&loop_);
+    VALUE_OR_RAISE(loop_monitor_->Start());
+    timers_ = std::make_unique<TimerService>(&loop_);
+    VALUE_OR_RAISE(timers_->Start());
+    connector_ = std::make_unique<net::Connector>(&loop_, net::Connector::Options{}, nullptr);
+    VALUE_OR_RAISE(connector_->Start());
+    bandwidth_ = std::make_unique<net::BandwidthManager>(&loop_);
+    VALUE_OR_RAISE(bandwidth_->Start());
+    shard_buckets_.upload = std::make_unique<net::TokenBucket>(bandwidth_.get(), nullptr);
+    shard_buckets_.download = std::make_unique<net::TokenBucket>(bandwidth_.get(), nullptr);
+    // the mailbox keeps the loop alive until Halt()
+    thread_ = std::thread([this]() { uv_run(&loop_, UV_RUN_DEFAULT); });
+    return {};
+}
+
+void Shard::Halt() {
+    Post([this]() { Drain(); });
+}
+
+void Shard::Join() {
+    thread_.join();
+    // main may have been posting until now
+    mailbox_.reset();
+    int retcode = uv_loop_close(&loop_);
+    assert(retcode == 0);
+    loop_open_ = false;
+}
+
+void Shard::Drain() {
+    draining_ = true;
+    std::vector<Swarm*> swarms;
+    for (auto& [info_hash, swarm] : swarms_) {
+        swarms.push_back(swarm.get());
+        halting_[swarm.get()] = std::move(swarm);
+    }
+    swarms_.clear();
+    if (halting_.empty()) {
+        HaltServices();
+        return;
+    }
+    // the last one to close halts the services, maybe right away, or one removed before
+    for (Swarm* swarm : swarms) swarm->Halt([this, swarm]() { ReleaseSwarm(swarm); });
+}
+
+void Shard::ReleaseSwarm(Swarm* swarm) {
+    halting_.erase(swarm);
+    if (draining_ && halting_.empty()) HaltServices();
+}
+
+void Shard::HaltServices() {
+    connector_->Halt([this]() {
+        loop_monitor_->Halt([this]() {
+            timers_->Halt(
+                [this]() { bandwidth_->Halt([this]() { ReleaseBandwidthManager(); }); });
+        });
+    });
+}
+
+void Shard::ReleaseBandwidthManager() {
+    // children before parents
+    shard_buckets_ = {};
+    bandwidth_.reset();
+    connector_.reset();
+    timers_.reset();
+    loop_monitor_.reset();
+    // the last handle, uv_run() returns once it is closed
+    mailbox_->Close([this]() {
+        App* app = app_;
+        size_t index = index_;
+        app->Post([app, index]() { app->ReleaseShard(index); });
+    });
+}
+
+void Shard::AddTorrent(Swarm::Torrent torrent) {
+    if (draining_ || !bandwidth_) return;
+    auto& swarm = swarms_[torrent.info_hash];
+    if (!swarm) swarm = std::make_unique<Swarm>(this, std::move(torrent), Swarm::Options{});
+}
+
+void Shard::RemoveTorrent(const std::string& info_hash) {
+    auto iter = swarms_.find(info_hash);
+    if (iter == swarms_.end()) return;
+    Swarm* swarm = iter->second.get();
+    halting_[swarm] = std::move(iter->second);
+    swarms_.erase(iter);
+    swarm->Halt([this, swarm]() { ReleaseSwarm(swarm); });
+}
+
+void Shard::PeersDiscovered(const std::string& info_hash, std::vector<PeerInfo> peers) {
+    auto iter = swarms_.find(info_hash);
+    if (iter == swarms_.end()) return;
+    size_t added = iter->second->AddPeers(peers);
+    std::cout << "Tracker returned " << peers.size() << " peers, " << added
+              << " new candidates for: " << absl::BytesToHexString(info_hash) << " on shard "
+              << index_ << std::endl;
+}
+
+void Shard::PieceLost(const std::string& info_hash, uint32_t index) {
+    auto iter = swarms_.find(info_hash);
+    if (iter != swarms_.end()) iter->second->PieceLost(index);
+}
+
+void Shard::PieceVerified(const std::string& info_hash, uint32_t index, std::string data) {
+    App* app = app_;
+    app->Post([app, info_hash, index, data = std::move(data)]() mutable {
+        app->PieceVerified(info_hash, index, std::move(data));
+    });
+}
+
+void Shard::SwarmActive(const std::string& info_hash) {
+    App* app = app_;
+    app->Post([app, info_hash]() { app->TorrentActive(info_hash); });
+}
+
+}  // namespace ryu
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <uv.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "common/bandwidth.h"
+#include "common/connector.h"
+#include "common/metrics.h"
+#include "common/write_queue.h"
+#include "result.h"
+#include "ryu/swarm.h"
+#include "trackers.h"
+#include "utils/mailbox.h"
+#include "utils/timer_service.h"
+
+namespace ryu {
+
+class App;
+
+// A worker thread running its own loop. Owns the torrents whose info hash maps to it and their
+// swarms of peer connections. Everything but Start(), Post(), Halt() and Join() runs on
+// the shard's thread, reached through Post().
+class Shard {
+  public:
+    Shard(App* app, size_t index) : app_(app), index_(index) {}
+    ~Shard();
+    Shard(const Shard&) = delete;
+    Shard& operator=(const Shard&) = delete;
+
+    // Main thread. Sets up the loop and starts the thread.
+    Result<ResultVoid, std::string> Start();
+    // Any thread. Runs `job` on the shard's loop.
+    void Post(Mailbox::Job job) { mailbox_->Post(std::move(job)); }
+    // Main thread, once. Frees every torrent and lets the loop run out, App::ReleaseShard() is
+    // called on the main loop afterwards. Nothing may be posted after it.
+    void Halt();
+    // Main thread, after App::ReleaseShard(). Waits for the thread to exit.
+    void Join();
+
+    size_t index() const { return index_; }
+    uv_loop_t* loop() { return &loop_; }
+    // timeouts and keepalives of the shard's connections
+    TimerService* timers() { return timers_.get(); }
+    // peers are dialed by address, there are no names to resolve
+    net::Connector* connector() { return connector_.get(); }
+    // for the small messages of the peer connections
+    net::BufferPool* write_buffers() { return &write_buffers_; }
+    net::BandwidthManager* bandwidth() { return bandwidth_.get(); }
+    net::TokenBucket* upload_bucket() { return shard_buckets_.upload.get(); }
+    net::TokenBucket* download_bucket() { return shard_buckets_.download.get(); }
+
+    // Torrents
+    void AddTorrent(Swarm::Torrent torrent);
+    void RemoveTorrent(const std::string& info_hash);
+    void PeersDiscovered(const std::string& info_hash, std::vector<PeerInfo> peers);
+    // See App::PieceLost()
+    void PieceLost(const std::string& info_hash, uint32_t index);
+    // Called by Swarm, hands the piece to App::PieceVerified()
+    void PieceVerified(const std::string& info_hash, uint32_t index, std::string data);
+    // Called by Swarm while its peers send data, see App::TorrentActive()
+    void SwarmActive(const std::string& info_hash);
+
+    // Called when BandwidthManager::Halt() completes
+    void ReleaseBandwidthManager();
+
+  private:
+    void Drain();
+    // Called when Swarm::Halt() completes
+    void ReleaseSwarm(Swarm* swarm);
+    // Once every swarm is gone, the services they used
+    void HaltServices();
+
+    App* const app_;
+    const size_t index_;
+    uv_loop_t loop_;
+    bool loop_open_ = false;
+    std::thread thread_;
+    // jobs from other threads
+    std::unique_ptr<Mailbox> mailbox_;
+    std::unique_ptr<metrics::LoopMonitor> loop_monitor_;
+    std::unique_ptr<TimerService> timers_;
+    std::unique_ptr<net::Connector> connector_;
+    net::BufferPool write_buffers_{4096, 256};
+    // rate limits and measured rates of the shard. Swarms hang the torrent's buckets below
+    // these, and connections their own below the torrent's.
+    struct Buckets {
+        std::unique_ptr<net::TokenBucket> upload;
+        std::unique_ptr<net::TokenBucket> download;
+    };
+    std::unique_ptr<net::BandwidthManager> bandwidth_;
+    Buckets shard_buckets_;
+    // by info hash
+    std::unordered_map<std::string, std::unique_ptr<Swarm>> swarms_;
+    // removed, until their connections are closed
+    std::unordered_map<Swarm*, std::unique_ptr<Swarm>> halting_;
+    bool draining_ = false;
+};
+
+}  // namespace ryu
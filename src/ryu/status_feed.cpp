@@ -0,0 +1,117 @@
+#include "status_feed.h"
+
+#include <algorithm>
+
+namespace ryu {
+
+void StatusFeed::Set(TaskId id, const Fields& fields) {
+    Entry& entry = entries_[id];
+    if (entry.removed) {
+        // the id is reused, start over
+        removed_.erase(entry.version);
+        by_version_.erase(entry.version);
+        entry = Entry();
+    }
+    uint64_t version = version_ + 1;
+    bool changed = false;
+    for (const auto& [name, value] : fields) {
+        auto iter = entry.fields.find(name);
+        if (iter != entry.fields.end() && iter->second == value) continue;
+        entry.fields[name] = value;
+        entry.versions[name] = version;
+        changed = true;
+    }
+    if (!changed) return;
+    version_ = version;
+    Bump(id, entry);
+}
+
+void StatusFeed::Remove(TaskId id) {
+    auto iter = entries_.find(id);
+    if (iter == entries_.end() || iter->second.removed) return;
+    Entry& entry = iter->second;
+    entry.removed = true;
+    entry.fields.clear();
+    entry.versions.clear();
+    version_++;
+    Bump(id, entry);
+    removed_[entry.version] = id;
+    if (subscribers_.empty()) Collect();
+}
+
+StatusFeed::SubscriberId StatusFeed::Subscribe(Filter filter, ReadyCallback ready,
+                                               PushCallback push) {
+    SubscriberId id = next_subscriber_++;
+    subscribers_[id] = Subscriber{
+        .filter = std::move(filter),
+        .ready = std::move(ready),
+        .push = std::move(push),
+    };
+    return id;
+}
+
+void StatusFeed::Unsubscribe(SubscriberId id) {
+    subscribers_.erase(id);
+    Collect();
+}
+
+void StatusFeed::Publish() {
+    for (auto& [id, subscriber] : subscribers_) {
+        if (subscriber.sent == version_) continue;
+        if (!subscriber.ready()) continue;
+        Delta delta = DeltaFor(subscriber);
+        subscriber.sent = version_;
+        if (!delta.changed.empty() || !delta.removed.empty()) subscriber.push(delta);
+    }
+    Collect();
+}
+
+void StatusFeed::ForEach(const std::function<void(TaskId id, const Fields& fields)>& visit) const {
+    for (const auto& [version, id] : by_version_) {
+        const Entry& entry = entries_.at(id);
+        if (!entry.removed) visit(id, entry.fields);
+    }
+}
+
+void StatusFeed::Bump(TaskId id, Entry& entry) {
+    if (entry.version) by_version_.erase(entry.version);
+    entry.version = version_;
+    by_version_[entry.version] = id;
+}
+
+StatusFeed::Delta StatusFeed::DeltaFor(const Subscriber& subscriber) const {
+    const Filter& filter = subscriber.filter;
+    Delta delta;
+    for (auto iter = by_version_.upper_bound(subscriber.sent); iter != by_version_.end();
+         ++iter) {
+        TaskId id = iter->second;
+        if (!filter.tasks.empty() && !filter.tasks.count(id)) continue;
+        const Entry& entry = entries_.at(id);
+        if (entry.removed) {
+            // a new subscriber never heard of it
+            if (subscriber.sent > 0) delta.removed.push_back(id);
+            continue;
+        }
+        Fields fields;
+        for (const auto& [name, value] : entry.fields) {
+            if (entry.versions.at(name) <= subscriber.sent) continue;
+            if (!filter.fields.empty() && !filter.fields.count(name)) continue;
+            fields.emplace(name, value);
+        }
+        if (!fields.empty()) delta.changed.emplace_back(id, std::move(fields));
+    }
+    return delta;
+}
+
+void StatusFeed::Collect() {
+    uint64_t sent = version_;
+    for (const auto& [id, subscriber] : subscribers_) sent = std::min(sent, subscriber.sent);
+    while (!removed_.empty() && removed_.begin()->first <= sent) {
+        auto iter = removed_.begin();
+        by_version_.erase(iter->first);
+        entries_.erase(iter->second);
+        removed_.erase(iter);
+    }
+}
+
+}  // namespace ryu
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace ryu {
+
+// Status of the tasks, pushed to subscribers as deltas. The owner sets the fields of a task
+// when they may have changed, the feed keeps the version at which each field last changed and
+// drops sets that change nothing. Publish(), once per tick, sends each subscriber the fields
+// that changed since what it was last sent, so a field changing many times within a tick goes
+// out once.
+//
+// A subscriber that is not ready, e.g. its socket is congested, is skipped. It keeps the version
+// it was last sent, and once ready gets the latest value of everything changed since: the
+// intermediate states are dropped, and nothing piles up for it but that version.
+class StatusFeed {
+  public:
+    using TaskId = uint64_t;
+    using SubscriberId = uint64_t;
+    using Value = std::variant<int64_t, std::string>;
+    // by field name
+    using Fields = std::map<std::string, Value>;
+
+    struct Delta {
+        // only the changed fields of each task, in the order they changed
+        std::vector<std::pair<TaskId, Fields>> changed;
+        std::vector<TaskId> removed;
+    };
+
+    // An empty set matches everything
+    struct Filter {
+        std::unordered_set<TaskId> tasks;
+        std::unordered_set<std::string> fields;
+    };
+
+    // `ready` is asked before building a delta, `push` gets it unless it is empty
+    using ReadyCallback = std::function<bool()>;
+    using PushCallback = std::function<void(const Delta& delta)>;
+
+    StatusFeed() = default;
+    StatusFeed(const StatusFeed&) = delete;
+    StatusFeed& operator=(const StatusFeed&) = delete;
+
+    // Fields missing from `fields` keep their value
+    void Set(TaskId id, const Fields& fields);
+    void Remove(TaskId id);
+
+    // The first delta holds everything the filter matches. The callbacks must not subscribe or
+    // unsubscribe.
+    SubscriberId Subscribe(Filter filter, ReadyCallback ready, PushCallback push);
+    void Unsubscribe(SubscriberId id);
+    [[nodiscard]] bool HasSubscribers() const { return !subscribers_.empty(); }
+
+    // Push the changes to every ready subscriber
+    void Publish();
+
+    // Calls `visit` with the fields of every task, the least recently changed first
+    void ForEach(const std::function<void(TaskId id, const Fields& fields)>& visit) const;
+
+  private:
+    struct Entry {
+        Fields fields;
+        std::unordered_map<std::string, uint64_t> versions;
+        // of the latest change, its key in `by_version_`
+        uint64_t version = 0;
+        bool removed = false;
+    };
+
+    struct Subscriber {
+        Filter filter;
+        ReadyCallback ready;
+        PushCallback push;
+        // everything up to it was pushed, 0 for nothing yet
+        uint64_t sent = 0;
+    };
+
+    // Move `entry` to the end of `by_version_`
+    void Bump(TaskId id, Entry& entry);
+    [[nodiscard]] Delta DeltaFor(const Subscriber& subscriber) const;
+    // Drop the removed entries every subscriber was told about
+    void Collect();
+
+    uint64_t version_ = 0;
+    std::unordered_map<TaskId, Entry> entries_;
+    // tasks by the version of their latest change
+    std::map<uint64_t, TaskId> by_version_;
+    // removed tasks by version, kept until every subscriber was told
+    std::map<uint64_t, TaskId> removed_;
+    std::map<SubscriberId, Subscriber> subscribers_;
+    SubscriberId next_subscriber_ = 1;
+};
+
+}  // namespace ryu
@@ -0,0 +1,124 @@
+#include "ryu/status_feed.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+using namespace ryu;
+using Fields = StatusFeed::Fields;
+
+namespace {
+
+class StatusFeedTest : public ::testing::Test {
+  protected:
+    StatusFeed::SubscriberId Subscribe(StatusFeed::Filter filter = {}) {
+        return feed_.Subscribe(
+            std::move(filter), [this] { return ready_; },
+            [this](const StatusFeed::Delta& delta) { deltas_.push_back(delta); });
+    }
+
+    StatusFeed feed_;
+    bool ready_ = true;
+    std::vector<StatusFeed::Delta> deltas_;
+};
+
+TEST_F(StatusFeedTest, PushesChangedFields) {
+    feed_.Set(1, {{"state", "queued"}, {"left", int64_t{100}}});
+    feed_.Set(2, {{"state", "queued"}, {"left", int64_t{200}}});
+    Subscribe();
+    feed_.Publish();
+    ASSERT_EQ(1u, deltas_.size());
+    ASSERT_EQ(2u, deltas_[0].changed.size());
+    EXPECT_EQ(1u, deltas_[0].changed[0].first);
+    EXPECT_EQ((Fields{{"state", "queued"}, {"left", int64_t{100}}}), deltas_[0].changed[0].second);
+
+    // nothing changed, nothing pushed
+    feed_.Set(1, {{"state", "queued"}});
+    feed_.Publish();
+    EXPECT_EQ(1u, deltas_.size());
+
+    // changes within a tick go out once
+    feed_.Set(2, {{"state", "opening"}, {"left", int64_t{200}}});
+    feed_.Set(2, {{"state", "reading"}});
+    feed_.Publish();
+    ASSERT_EQ(2u, deltas_.size());
+    ASSERT_EQ(1u, deltas_[1].changed.size());
+    EXPECT_EQ(2u, deltas_[1].changed[0].first);
+    EXPECT_EQ((Fields{{"state", "reading"}}), deltas_[1].changed[0].second);
+
+    feed_.Remove(1);
+    feed_.Publish();
+    ASSERT_EQ(3u, deltas_.size());
+    EXPECT_TRUE(deltas_[2].changed.empty());
+    EXPECT_EQ(std::vector<StatusFeed::TaskId>{1}, deltas_[2].removed);
+
+    // a late subscriber gets the current state only
+    deltas_.clear();
+    Subscribe();
+    feed_.Publish();
+    ASSERT_EQ(1u, deltas_.size());
+    ASSERT_EQ(1u, deltas_[0].changed.size());
+    EXPECT_EQ((Fields{{"state", "reading"}, {"left", int64_t{200}}}),
+              deltas_[0].changed[0].second);
+    EXPECT_TRUE(deltas_[0].removed.empty());
+}
+
+TEST_F(StatusFeedTest, Filters) {
+    feed_.Set(1, {{"state", "queued"}, {"left", int64_t{100}}});
+    feed_.Set(2, {{"state", "queued"}, {"left", int64_t{200}}});
+    Subscribe({.tasks = {2}, .fields = {"left"}});
+    feed_.Publish();
+    ASSERT_EQ(1u, deltas_.size());
+    ASSERT_EQ(1u, deltas_[0].changed.size());
+    EXPECT_EQ(2u, deltas_[0].changed[0].first);
+    EXPECT_EQ((Fields{{"left", int64_t{200}}}), deltas_[0].changed[0].second);
+
+    // changes the subscriber doesn't care about
+    feed_.Set(1, {{"left", int64_t{50}}});
+    feed_.Set(2, {{"state", "opening"}});
+    feed_.Remove(1);
+    feed_.Publish();
+    EXPECT_EQ(1u, deltas_.size());
+}
+
+TEST_F(StatusFeedTest, SlowSubscriberSkipsIntermediateStates) {
+    feed_.Set(1, {{"left", int64_t{100}}});
+    StatusFeed::SubscriberId id = Subscribe();
+    feed_.Publish();
+    ASSERT_EQ(1u, deltas_.size());
+
+    ready_ = false;
+    for (int64_t left = 90; left >= 0; left -= 10) {
+        feed_.Set(1, {{"left", left}});
+        feed_.Set(2, {{"left", left}});
+        feed_.Publish();
+    }
+    feed_.Remove(2);
+    feed_.Set(3, {{"left", int64_t{7}}});
+    feed_.Publish();
+    EXPECT_EQ(1u, deltas_.size());
+
+    ready_ = true;
+    feed_.Publish();
+    ASSERT_EQ(2u, deltas_.size());
+    ASSERT_EQ(2u, deltas_[1].changed.size());
+    EXPECT_EQ(1u, deltas_[1].changed[0].first);
+    EXPECT_EQ((Fields{{"left", int64_t{0}}}), deltas_[1].changed[0].second);
+    EXPECT_EQ(3u, deltas_[1].changed[1].first);
+    // created and removed while it was away
+    EXPECT_EQ(std::vector<StatusFeed::TaskId>{2}, deltas_[1].removed);
+
+    // the removal is dropped once everyone was told
+    feed_.Unsubscribe(id);
+    deltas_.clear();
+    Subscribe();
+    feed_.Publish();
+    ASSERT_EQ(1u, deltas_.size());
+    EXPECT_EQ(2u, deltas_[0].changed.size());
+    std::vector<StatusFeed::TaskId> ids;
+    feed_.ForEach([&](StatusFeed::TaskId id, const Fields&) { ids.push_back(id); });
+    EXPECT_EQ((std::vector<StatusFeed::TaskId>{1, 3}), ids);
+}
+
+}  // namespace
@@ -0,0 +1,101 @@
+#include "storage.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <system_error>
+
+#include "os.h"
+#include "ryu/resume.h"
+
+namespace ryu {
+
+namespace {
+
+// Calls `fn(file, file_offset, offset, length)` for each file the `size` bytes from torrent
+// offset `begin` fall in, `offset` counting from `begin`
+template <typename Fn>
+Result<ResultVoid, std::string> ForEachSpan(const PieceLayout& layout, uint64_t begin,
+                                            uint64_t size, Fn fn) {
+    uint64_t file_begin = 0;
+    uint64_t done = 0;
+    for (size_t file = 0; file < layout.lengths.size() && done < size; file++) {
+        uint64_t file_end = file_begin + layout.lengths[file];
+        if (begin + done < file_end) {
+            uint64_t file_offset = begin + done - file_begin;
+            uint64_t length = std::min(size - done, file_end - (begin + done));
+            VALUE_OR_RAISE(fn(file, file_offset, done, length));
+            done += length;
+        }
+        file_begin = file_end;
+    }
+    if (done < size) return Err("piece past the end of the torrent");
+    return {};
+}
+
+}  // namespace
+
+PieceLayout PieceLayout::Of(const TorrentFile& torrent, const std::string& save_path) {
+    PieceLayout layout{
+        .paths = ResumeData::FilePaths(torrent, save_path),
+        .lengths = {},
+        .piece_length = torrent.GetPieceSize(),
+    };
+    for (size_t i = 0; i < torrent.GetFileCount(); i++) {
+        layout.lengths.push_back(torrent.GetFileInfo(i).length);
+    }
+    return layout;
+}
+
+Result<std::vector<size_t>, std::string> WritePiece(const PieceLayout& layout, uint32_t index,
+                                                    std::string_view data) {
+    std::vector<size_t> written;
+    auto write = [&](size_t file, uint64_t file_offset, uint64_t offset,
+                     uint64_t length) -> Result<ResultVoid, std::string> {
+        const std::string& path = layout.paths[file];
+        std::error_code error;
+        std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+        if (error) return Err("failed to create directory for " + path + ": " + error.message());
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) RAISE_ERRNO("failed to open " + path);
+        os::AutoFd closer(fd);
+        while (length > 0) {
+            ssize_t n = ::pwrite(fd, data.data() + offset, length, file_offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) RAISE_ERRNO("failed to write " + path);
+            offset += n;
+            file_offset += n;
+            length -= n;
+        }
+        written.push_back(file);
+        return {};
+    };
+    VALUE_OR_RAISE(ForEachSpan(layout, uint64_t{index} * layout.piece_length, data.size(), write));
+    return written;
+}
+
+Result<std::string, std::string> ReadPiece(const PieceLayout& layout, uint32_t index,
+                                           uint64_t size) {
+    std::string data(size, '\0');
+    auto read = [&](size_t file, uint64_t file_offset, uint64_t offset,
+                    uint64_t length) -> Result<ResultVoid, std::string> {
+        const std::string& path = layout.paths[file];
+        ASSIGN_OR_RAISE(auto fd, os::AutoFd::open(path, O_RDONLY | O_CLOEXEC));
+        while (length > 0) {
+            ssize_t n = ::pread(fd.get(), data.data() + offset, length, file_offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) RAISE_ERRNO("failed to read " + path);
+            if (n == 0) return Err(path + " is too short");
+            offset += n;
+            file_offset += n;
+            length -= n;
+        }
+        return {};
+    };
+    VALUE_OR_RAISE(ForEachSpan(layout, uint64_t{index} * layout.piece_length, size, read));
+    return data;
+}
+
+}  // namespace ryu
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "result.h"
+#include "torrent_file.h"
+
+namespace ryu {
+
+// Where the pieces of a torrent are on disk: its files one after the other, cut into pieces of
+// `piece_length` bytes. A piece may span several files.
+struct PieceLayout {
+    std::vector<std::string> paths;
+    std::vector<uint64_t> lengths;
+    uint64_t piece_length = 0;
+
+    // The files of `torrent` below `save_path`, see ResumeData::FilePaths()
+    static PieceLayout Of(const TorrentFile& torrent, const std::string& save_path);
+};
+
+// Blocking. Write piece `index`, creating the files and their directories as needed. Returns
+// the indices of the files written to.
+Result<std::vector<size_t>, std::string> WritePiece(const PieceLayout& layout, uint32_t index,
+                                                    std::string_view data);
+// Blocking. The `size` bytes of piece `index`, an error if a file is missing or too short.
+Result<std::string, std::string> ReadPiece(const PieceLayout& layout, uint32_t index,
+                                           uint64_t size);
+
+}  // namespace ryu
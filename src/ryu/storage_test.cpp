@@ -0,0 +1,62 @@
+#include "ryu/storage.h"
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+using namespace ryu;
+
+namespace {
+
+class StorageTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        dir_ = testing::TempDir() + "storage_test_" + std::to_string(getpid());
+        std::filesystem::remove_all(dir_);
+        // pieces of 10 bytes over files of 4, 0, 19 and 3 bytes
+        layout_ = PieceLayout{
+            .paths = {dir_ + "/a", dir_ + "/sub/empty", dir_ + "/sub/b", dir_ + "/c"},
+            .lengths = {4, 0, 19, 3},
+            .piece_length = 10,
+        };
+    }
+    void TearDown() override { std::filesystem::remove_all(dir_); }
+
+    std::string dir_;
+    PieceLayout layout_;
+};
+
+TEST_F(StorageTest, PiecesSpanFiles) {
+    auto written = WritePiece(layout_, 1, "0123456789");
+    ASSERT_TRUE(written.Ok()) << written.Error();
+    EXPECT_EQ(std::vector<size_t>{2}, written.Value());
+    EXPECT_FALSE(ReadPiece(layout_, 0, 10).Ok());
+
+    written = WritePiece(layout_, 0, "abcdefghij");
+    ASSERT_TRUE(written.Ok()) << written.Error();
+    EXPECT_EQ((std::vector<size_t>{0, 2}), written.Value());
+    // the last piece is shorter
+    written = WritePiece(layout_, 2, "KLMNOP");
+    ASSERT_TRUE(written.Ok()) << written.Error();
+    EXPECT_EQ((std::vector<size_t>{2, 3}), written.Value());
+
+    EXPECT_EQ("abcdefghij", ReadPiece(layout_, 0, 10));
+    EXPECT_EQ("0123456789", ReadPiece(layout_, 1, 10));
+    EXPECT_EQ("KLMNOP", ReadPiece(layout_, 2, 6));
+    EXPECT_EQ(4u, std::filesystem::file_size(dir_ + "/a"));
+    EXPECT_EQ(19u, std::filesystem::file_size(dir_ + "/sub/b"));
+}
+
+TEST_F(StorageTest, ShortOrMissingFiles) {
+    ASSERT_TRUE(WritePiece(layout_, 0, "abcdefghij").Ok());
+    // the rest of sub/b was never written
+    EXPECT_FALSE(ReadPiece(layout_, 1, 10).Ok());
+    // c does not exist
+    EXPECT_FALSE(ReadPiece(layout_, 2, 6).Ok());
+    EXPECT_FALSE(WritePiece(layout_, 3, "x").Ok());
+}
+
+}  // namespace
@@ -0,0 +1,317 @@
+#include "swarm.h"
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <string_view>
+#include <utility>
+
+#include "common/metrics.h"
+#include "common/peer_wire.h"
+#include "ryu/shard.h"
+#include "sha1.h"
+
+namespace ryu {
+
+namespace {
+
+auto& registry = metrics::Registry::Global();
+metrics::Counter* const pieces_verified_total = registry.GetCounter(
+    "ryu_pieces_verified_total", "Downloaded pieces that passed their hash check");
+metrics::Counter* const pieces_failed_total = registry.GetCounter(
+    "ryu_pieces_failed_total", "Downloaded pieces that failed their hash check");
+metrics::Histogram* const piece_verify_seconds = registry.GetHistogram(
+    "ryu_piece_verify_seconds", "Time to hash a downloaded piece on the threadpool", 1e-9);
+
+// well below TaskQueue's idle timeout, a message to the app thread each
+constexpr uint64_t kActivityIntervalMs = 10000;
+
+}  // namespace
+
+Swarm::Swarm(Shard* shard, Torrent torrent, Options options)
+    : shard_(shard),
+      torrent_(std::move(torrent)),
+      options_(options),
+      upload_(std::make_unique<net::TokenBucket>(shard->bandwidth(), shard->upload_bucket())),
+      download_(std::make_unique<net::TokenBucket>(shard->bandwidth(), shard->download_bucket())),
+      have_(torrent_.have),
+      availability_(torrent_.piece_count, 0) {}
+
+TimerService* Swarm::timers() { return shard_->timers(); }
+
+net::BufferPool* Swarm::buffers() { return shard_->write_buffers(); }
+
+net::BandwidthManager* Swarm::bandwidth() { return shard_->bandwidth(); }
+
+size_t Swarm::AddPeers(const std::vector<PeerInfo>& peers) {
+    if (draining_) return 0;
+    size_t added = pool_.Add(peers);
+    ConnectMore();
+    return added;
+}
+
+void Swarm::PieceLost(uint32_t index) {
+    if (draining_ || index >= torrent_.piece_count || !net::HasPiece(have_, index)) return;
+    net::SetPiece(&have_, index, false);
+    RequestFromAll();
+}
+
+void Swarm::Halt(std::function<void()> on_closed) {
+    if (draining_) return;
+    draining_ = true;
+    on_closed_ = std::move(on_closed);
+    retry_timer_.Cancel();
+    for (const auto& [endpoint, id] : connecting_) shard_->connector()->Cancel(id);
+    connecting_.clear();
+    for (const auto& [ptr, peer] : peers_) peer->Halt();
+    // may delete this
+    CheckHalted();
+}
+
+void Swarm::CheckHalted() {
+    if (!draining_ || !peers_.empty() || verifying_ > 0 || !on_closed_) return;
+    auto cb = std::move(on_closed_);
+    on_closed_ = nullptr;
+    // may delete this
+    cb();
+}
+
+void Swarm::ConnectMore() {
+    if (draining_) return;
+    uint64_t now_ms = timers()->NowMs();
+    while (peers_.size() + connecting_.size() < options_.max_peers) {
+        std::optional<net::Endpoint> endpoint = pool_.NextCandidate(now_ms);
+        if (!endpoint) break;
+        connecting_[*endpoint] = 0;
+        auto id = shard_->connector()->Connect(
+            std::vector<net::Endpoint>{*endpoint},
+            [this, endpoint = *endpoint](Result<std::unique_ptr<uv_tcp_t>, std::string> result) {
+                Connected(endpoint, std::move(result));
+            });
+        // unless it failed right away
+        auto iter = connecting_.find(*endpoint);
+        if (iter != connecting_.end()) iter->second = id;
+    }
+    // candidates backing off are tried once due
+    std::optional<uint64_t> retry_ms = pool_.NextRetry();
+    if (retry_ms && peers_.size() + connecting_.size() < options_.max_peers) {
+        timers()->ScheduleAt(&retry_timer_, *retry_ms, [this]() { ConnectMore(); });
+    }
+}
+
+void Swarm::Connected(const net::Endpoint& endpoint,
+                      Result<std::unique_ptr<uv_tcp_t>, std::string> result) {
+    connecting_.erase(endpoint);
+    if (!result) {
+        pool_.Failed(endpoint, timers()->NowMs());
+        ConnectMore();
+        return;
+    }
+    auto peer = std::make_unique<PeerConnection>(this, options_.peer, std::move(result).TakeValue(),
+                                                 endpoint);
+    PeerConnection* ptr = peer.get();
+    peers_[ptr] = std::move(peer);
+    auto started = ptr->Start();
+    if (!started) {
+        std::cout << "Failed to start peer " << endpoint.ToString() << ": " << started.Error()
+                  << std::endl;
+        ptr->Halt();
+    }
+}
+
+void Swarm::PeerHandshaked(PeerConnection& peer) {
+    pool_.Connected(peer.endpoint());
+    ReportActivity();
+}
+
+void Swarm::ReportActivity() {
+    uint64_t now_ms = timers()->NowMs();
+    if (last_activity_ms_ != 0 && now_ms - last_activity_ms_ < kActivityIntervalMs) return;
+    last_activity_ms_ = now_ms;
+    shard_->SwarmActive(torrent_.info_hash);
+}
+
+void Swarm::PeerHas(PeerConnection& peer, std::optional<uint32_t> index) {
+    if (index) {
+        availability_[*index]++;
+    } else {
+        for (uint32_t i = 0; i < torrent_.piece_count; i++) {
+            if (net::HasPiece(peer.bitfield(), i)) availability_[i]++;
+        }
+    }
+    if (!peer.am_interested() && Wants(peer)) peer.SetInterested(true);
+    FillRequests(peer);
+}
+
+void Swarm::PeerUnchoked(PeerConnection& peer) { FillRequests(peer); }
+
+bool Swarm::Wants(const PeerConnection& peer) const {
+    const std::string& has = peer.bitfield();
+    for (size_t i = 0; i < has.size(); i++) {
+        if (has[i] & ~have_[i]) return true;
+    }
+    return false;
+}
+
+uint64_t Swarm::PieceSize(uint32_t index) const {
+    if (index + 1 < torrent_.piece_count) return torrent_.piece_length;
+    return torrent_.total_size - uint64_t{index} * torrent_.piece_length;
+}
+
+std::optional<uint32_t> Swarm::PickPiece(const PeerConnection& peer) const {
+    const std::string& has = peer.bitfield();
+    std::optional<uint32_t> best;
+    uint32_t best_peers = std::numeric_limits<uint32_t>::max();
+    for (size_t byte = 0; byte < has.size(); byte++) {
+        // a whole byte at a time, most of them hold nothing new
+        if ((has[byte] & ~have_[byte]) == 0) continue;
+        for (uint32_t index = byte * 8; index < byte * 8 + 8; index++) {
+            if (!net::HasPiece(has, index) || net::HasPiece(have_, index)) continue;
+            if (availability_[index] >= best_peers || partial_.count(index)) continue;
+            best = index;
+            best_peers = availability_[index];
+        }
+        // nobody else has it
+        if (best_peers <= 1) break;
+    }
+    return best;
+}
+
+void Swarm::FillRequests(PeerConnection& peer) {
+    if (draining_ || peer.closing() || !peer.handshaked() || peer.peer_choking()) return;
+    while (peer.Outstanding() < options_.max_requests) {
+        // finish what was started before starting more
+        Piece* piece = nullptr;
+        uint32_t index = 0;
+        for (auto& [partial_index, partial] : partial_) {
+            if (partial.free > 0 && net::HasPiece(peer.bitfield(), partial_index)) {
+                piece = &partial;
+                index = partial_index;
+                break;
+            }
+        }
+        if (!piece) {
+            std::optional<uint32_t> picked;
+            if (partial_.size() < options_.max_partial) picked = PickPiece(peer);
+            if (!picked) break;
+            index = *picked;
+            piece = &partial_[index];
+            piece->data.resize(PieceSize(index));
+            size_t blocks = (piece->data.size() + net::kBlockSize - 1) / net::kBlockSize;
+            piece->blocks.assign(blocks, BlockState::FREE);
+            piece->free = blocks;
+        }
+        size_t block = std::find(piece->blocks.begin(), piece->blocks.end(), BlockState::FREE) -
+                       piece->blocks.begin();
+        piece->blocks[block] = BlockState::REQUESTED;
+        piece->free--;
+        uint32_t begin = block * net::kBlockSize;
+        uint32_t length = std::min<uint64_t>(net::kBlockSize, piece->data.size() - begin);
+        peer.RequestBlock(index, begin, length, piece->data.data() + begin);
+    }
+    // nothing left to get from this peer
+    if (peer.Outstanding() == 0 && !Wants(peer)) peer.SetInterested(false);
+}
+
+void Swarm::RequestFromAll() {
+    for (const auto& [ptr, peer] : peers_) {
+        if (!peer->am_interested() && Wants(*peer)) peer->SetInterested(true);
+        FillRequests(*peer);
+        peer->Flush();
+    }
+}
+
+void Swarm::ReturnRequests(std::vector<PeerConnection::Request> requests) {
+    if (requests.empty()) return;
+    for (const auto& request : requests) {
+        auto iter = partial_.find(request.index);
+        if (iter == partial_.end()) continue;
+        Piece& piece = iter->second;
+        size_t block = request.begin / net::kBlockSize;
+        if (piece.blocks[block] != BlockState::REQUESTED) continue;
+        piece.blocks[block] = BlockState::FREE;
+        piece.free++;
+    }
+    RequestFromAll();
+}
+
+void Swarm::BlockReceived(PeerConnection& peer, uint32_t index, uint32_t begin, uint32_t length) {
+    auto iter = partial_.find(index);
+    if (iter != partial_.end()) {
+        Piece& piece = iter->second;
+        size_t block = begin / net::kBlockSize;
+        if (piece.blocks[block] == BlockState::REQUESTED) {
+            piece.blocks[block] = BlockState::DONE;
+            piece.done++;
+            ReportActivity();
+        }
+        if (piece.done == piece.blocks.size()) {
+            std::string data = std::move(piece.data);
+            partial_.erase(iter);
+            net::SetPiece(&have_, index);
+            verifying_++;
+            coro::Spawn(VerifyPiece(index, std::move(data)));
+        }
+    }
+    FillRequests(peer);
+}
+
+coro::Task<> Swarm::VerifyPiece(uint32_t index, std::string data) {
+    auto hash = [data = &data]() {
+        uint64_t start_ns = uv_hrtime();
+        unsigned char digest[SHA1::HashBytes];
+        SHA1 hasher{};
+        hasher.add(data->data(), data->size());
+        hasher.getHash(digest);
+        piece_verify_seconds->Record(uv_hrtime() - start_ns);
+        return std::string(reinterpret_cast<char*>(digest), SHA1::HashBytes);
+    };
+    auto digest = co_await coro::OnThreadpool(shard_->loop(), std::move(hash));
+    verifying_--;
+    if (draining_) {
+        // may delete this
+        CheckHalted();
+        co_return;
+    }
+    std::string_view expected =
+        std::string_view(torrent_.piece_hashes).substr(index * SHA1::HashBytes, SHA1::HashBytes);
+    if (!digest || digest.Value() != expected) {
+        if (digest) {
+            pieces_failed_total->Add();
+            std::cout << "Piece " << index << " failed its hash check, downloading it again"
+                      << std::endl;
+        } else {
+            std::cout << "Failed to verify piece " << index << ", downloading it again: "
+                      << digest.Error() << std::endl;
+        }
+        net::SetPiece(&have_, index, false);
+        RequestFromAll();
+        co_return;
+    }
+    pieces_verified_total->Add();
+    shard_->PieceVerified(torrent_.info_hash, index, std::move(data));
+}
+
+void Swarm::ReleasePeer(PeerConnection& peer) {
+    auto iter = peers_.find(&peer);
+    std::unique_ptr<PeerConnection> owned = std::move(iter->second);
+    peers_.erase(iter);
+    if (!draining_) {
+        uint64_t now_ms = timers()->NowMs();
+        if (peer.handshaked()) {
+            pool_.Disconnected(peer.endpoint(), now_ms);
+        } else {
+            pool_.Failed(peer.endpoint(), now_ms);
+        }
+        for (uint32_t i = 0; i < torrent_.piece_count; i++) {
+            if (net::HasPiece(peer.bitfield(), i)) availability_[i]--;
+        }
+        ReturnRequests(peer.TakeRequests(true));
+        ConnectMore();
+    }
+    owned.reset();
+    // may delete this
+    CheckHalted();
+}
+
+}  // namespace ryu
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <uv.h>
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common/bandwidth.h"
+#include "common/connector.h"
+#include "common/network.h"
+#include "common/write_queue.h"
+#include "result.h"
+#include "ryu/peer_connection.h"
+#include "ryu/peer_pool.h"
+#include "trackers.h"
+#include "utils/coro.h"
+#include "utils/timer_service.h"
+
+namespace ryu {
+
+class Shard;
+
+// The peers of one torrent on a shard: the candidates found by the trackers, the connections to
+// them, and the pieces being downloaded.
+//
+// Candidates from the PeerPool are connected to while fewer than `max_peers` connections are
+// open or being made. Unchoked peers get up to `max_requests` blocks requested each. Partial
+// pieces are finished first, otherwise the rarest piece the peer has is started, while fewer
+// than `max_partial` pieces are partial since each holds a whole piece in memory. A block is
+// requested from one peer at a time and goes back to the picker when the peer chokes or goes
+// away. Complete pieces are checked against their hash on the threadpool and handed to
+// Shard::PieceVerified(), a piece failing the check or failing to be written is downloaded
+// again. Lives on the shard's thread.
+class Swarm {
+  public:
+    struct Options {
+        size_t max_peers = 50;
+        size_t max_requests = 32;
+        size_t max_partial = 64;
+        PeerConnection::Options peer;
+    };
+
+    // What the swarm needs of a checked torrent
+    struct Torrent {
+        std::string info_hash;
+        // ours, as announced to the trackers
+        std::string peer_id;
+        uint32_t piece_count = 0;
+        uint64_t piece_length = 0;
+        uint64_t total_size = 0;
+        // SHA1 digests of every piece, one after the other
+        std::string piece_hashes;
+        // bitfield of the pieces already had
+        std::string have;
+    };
+
+    // `shard` must outlive the swarm
+    Swarm(Shard* shard, Torrent torrent, Options options);
+    Swarm(const Swarm&) = delete;
+    Swarm& operator=(const Swarm&) = delete;
+
+    // New candidates, connected to right away if there is room. Returns how many were new.
+    size_t AddPeers(const std::vector<PeerInfo>& peers);
+    // A verified piece that did not make it to disk, downloaded again
+    void PieceLost(uint32_t index);
+    // Drop every peer, `on_closed` is called once the swarm can be destroyed
+    void Halt(std::function<void()> on_closed);
+
+    [[nodiscard]] const Torrent& torrent() const { return torrent_; }
+    [[nodiscard]] const std::string& have() const { return have_; }
+    [[nodiscard]] size_t Peers() const { return peers_.size(); }
+    [[nodiscard]] const PeerPool& pool() const { return pool_; }
+    // for the connections
+    [[nodiscard]] TimerService* timers();
+    [[nodiscard]] net::BufferPool* buffers();
+    [[nodiscard]] net::BandwidthManager* bandwidth();
+    [[nodiscard]] net::TokenBucket* download_bucket() { return download_.get(); }
+
+    // Called by PeerConnection
+    void PeerHandshaked(PeerConnection& peer);
+    // The peer's bitfield or a have changed what it has, `index` is nullopt for a bitfield
+    void PeerHas(PeerConnection& peer, std::optional<uint32_t> index);
+    void PeerUnchoked(PeerConnection& peer);
+    // Requests the peer won't serve anymore, e.g. after a choke
+    void ReturnRequests(std::vector<PeerConnection::Request> requests);
+    void BlockReceived(PeerConnection& peer, uint32_t index, uint32_t begin, uint32_t length);
+    // Called once the peer's socket is closed, frees it
+    void ReleasePeer(PeerConnection& peer);
+
+  private:
+    enum class BlockState : uint8_t { FREE, REQUESTED, DONE };
+
+    struct Piece {
+        std::string data;
+        std::vector<BlockState> blocks;
+        size_t free = 0;
+        size_t done = 0;
+    };
+
+    void ConnectMore();
+    void Connected(const net::Endpoint& endpoint,
+                   Result<std::unique_ptr<uv_tcp_t>, std::string> result);
+    // Request blocks from the peer until its pipeline is full
+    void FillRequests(PeerConnection& peer);
+    // After blocks came back, from every unchoked peer
+    void RequestFromAll();
+    // The rarest piece the peer has that is neither had nor partial
+    [[nodiscard]] std::optional<uint32_t> PickPiece(const PeerConnection& peer) const;
+    [[nodiscard]] uint64_t PieceSize(uint32_t index) const;
+    [[nodiscard]] bool Wants(const PeerConnection& peer) const;
+    coro::Task<> VerifyPiece(uint32_t index, std::string data);
+    void CheckHalted();
+    // Tell the shard the torrent is alive, at most every kActivityIntervalMs
+    void ReportActivity();
+
+    Shard* const shard_;
+    const Torrent torrent_;
+    const Options options_;
+    PeerPool pool_;
+    // below the shard's, the connections hang their own below these
+    std::unique_ptr<net::TokenBucket> upload_;
+    std::unique_ptr<net::TokenBucket> download_;
+    std::unordered_map<PeerConnection*, std::unique_ptr<PeerConnection>> peers_;
+    // connects in progress, the id is 0 until Connect() returned
+    std::unordered_map<net::Endpoint, net::Connector::ConnectId> connecting_;
+    TimerService::Timer retry_timer_;
+
+    // complete or being verified
+    std::string have_;
+    std::map<uint32_t, Piece> partial_;
+    // peers having each piece
+    std::vector<uint32_t> availability_;
+    // pieces on the threadpool
+    size_t verifying_ = 0;
+    uint64_t last_activity_ms_ = 0;
+
+    bool draining_ = false;
+    std::function<void()> on_closed_;
+};
+
+}  // namespace ryu
@@ -1,76 +1,266 @@
 #include "task.h"
 
-#include <cassert>
+#include <algorithm>
 #include <iostream>
+#include <string_view>
+#include <tuple>
+#include <utility>
 
 #include "app.h"
+#include "common/metrics.h"
+#include "common/peer_wire.h"
+#include "sha1.h"
 #include "torrent_file.h"
-#include "utils/uv_callbacks.h"
 namespace ryu {
 
-Task::Task(App* app, uv_loop_t* loop, std::string torrent_file_name)
-    : app_(app), loop_(loop), state_(State::OPENING), torrent_file_name_(torrent_file_name) {
-    int retcode;
-    torrent_file_.data = this;
-    retcode = uv_fs_open(loop_, &torrent_file_, torrent_file_name_.c_str(), UV_FS_O_RDONLY, 0755,
-                         uv_callbacks::Fs<&Task::TorrentFileOpenCb>);
-    assert(retcode == 0);
+namespace {
+auto& registry = metrics::Registry::Global();
+metrics::Counter* const checks_total =
+    registry.GetCounter("ryu_task_checks_total", "Torrent files loaded and checked");
+metrics::Counter* const check_failures_total =
+    registry.GetCounter("ryu_task_check_failures_total", "Checks that failed");
+metrics::Histogram* const parse_seconds = registry.GetHistogram(
+    "ryu_torrent_parse_seconds", "Time to decode and hash a torrent file", 1e-9);
+}  // namespace
+
+Task::Task(App* app, uv_loop_t* loop, uint64_t id, std::string torrent_file_name,
+           std::string save_path, std::optional<ResumeData> resume)
+    : app_(app),
+      loop_(loop),
+      id_(id),
+      state_(State::QUEUED),
+      torrent_file_name_(std::move(torrent_file_name)),
+      save_path_(std::move(save_path)),
+      resume_(std::move(resume)) {}
+
+const char* Task::StateName(State state) {
+    switch (state) {
+        case State::QUEUED:
+            return "queued";
+        case State::OPENING:
+            return "opening";
+        case State::READING:
+            return "reading";
+        case State::READED:
+            return "read";
+        case State::PARSED:
+            return "parsed";
+        case State::RESTORED:
+            return "restored";
+        case State::DORMANT:
+            return "dormant";
+        case State::ERROR:
+            return "error";
+    }
+    return "unknown";
+}
+
+void Task::SetState(State state) {
+    state_ = state;
+    app_->TaskStatusChanged(id_);
+}
+
+void Task::Check() {
+    SetState(State::OPENING);
+    // App keeps the task until it is told the check is over
+    coro::Spawn(RunCheck());
+}
+
+coro::Task<> Task::RunCheck() {
+    bool loaded = co_await Load();
+    checks_total->Add();
+    if (!loaded) {
+        check_failures_total->Add();
+        SetState(State::ERROR);
+    }
+    // may delete this
+    app_->TaskChecked(id_, loaded);
+}
+
+void Task::Dormant() {
+    resume_ = ResumeState();
+    torrent_.reset();
+    SetState(State::DORMANT);
 }
 
-void Task::TorrentFileOpenCb(uv_fs_t* req) {
-    assert(state_ == State::OPENING);
-    assert(req == &torrent_file_);
-    if (req->result < 0) {
+coro::Task<bool> Task::Load() {
+    ssize_t fd = co_await coro::FsOpen(loop_, torrent_file_name_, UV_FS_O_RDONLY);
+    if (fd < 0) {
         std::cout << "Failed to open: " << torrent_file_name_ << std::endl;
-        state_ = State::ERROR;
-        return;
+        co_return false;
     }
-    torrent_file_fd_ = req->result;
-    state_ = State::READING;
+    SetState(State::READING);
 
-    uv_buf_t iovec{
-        .base = torrent_read_buf_.data(),
-        .len = torrent_read_buf_.size(),
+    // the whole file in one read, unless it grows under us
+    uv_stat_t stat;
+    size_t chunk = 4096;
+    if (co_await coro::FsFstat(loop_, fd, &stat) == 0) {
+        chunk = std::max<size_t>(chunk, stat.st_size);
+    }
+    std::string content;
+    ssize_t nread;
+    do {
+        size_t offset = content.size();
+        content.resize(offset + chunk);
+        nread = co_await coro::FsRead(loop_, fd, content.data() + offset, chunk, offset);
+        content.resize(offset + std::max<ssize_t>(nread, 0));
+    } while (nread > 0);
+    co_await coro::FsClose(loop_, fd);
+    if (nread < 0) {
+        std::cout << "Failed to read: " << torrent_file_name_ << std::endl;
+        co_return false;
+    }
+    SetState(State::READED);
+    std::cout << "Read " << content.size() << " bytes from file: " << torrent_file_name_
+              << std::endl;
+
+    // decoding and hashing the info dict of a large torrent takes a while
+    auto parse = [content = std::move(content)]() {
+        uint64_t start_ns = uv_hrtime();
+        auto t = TorrentFile::Load(content);
+        parse_seconds->Record(uv_hrtime() - start_ns);
+        if (t) t.Value().Dump();
+        return t;
     };
-    int64_t offset = torrent_file_content_.size();
-    int retcode = uv_fs_read(loop_, &torrent_file_, torrent_file_fd_, &iovec, 1, offset,
-                             uv_callbacks::Fs<&Task::TorrentFileReadCb>);
-    assert(retcode == 0);
+    auto torrent = co_await coro::OnThreadpool(loop_, std::move(parse));
+    if (!torrent) {
+        std::cout << "Failed to parse torrent file: " << torrent_file_name_ << std::endl;
+        co_return false;
+    }
+    SetState(State::PARSED);
+    torrent_ = std::make_unique<TorrentFile>(std::move(torrent).TakeValue());
+    if (!co_await Restore(*torrent_)) co_return false;
+    left_ = Left(*torrent_);
+    app_->SaveResumeData(ResumeState());
+    co_return true;
 }
 
-void Task::TorrentFileReadCb(uv_fs_t* req) {
-    int retcode;
+coro::Task<bool> Task::Restore(const TorrentFile& torrent) {
+    info_hash_ = torrent.GetInfoHash();
+    size_t bitfield_size = (torrent.GetPieceCount() + 7) / 8;
+    std::optional<ResumeData> resume = std::move(resume_);
+    resume_.reset();
+    if (resume && (resume->info_hash != info_hash_ || resume->have.size() != bitfield_size)) {
+        std::cout << "Resume data does not fit torrent: " << torrent_file_name_ << std::endl;
+        resume.reset();
+    }
+    if (resume) {
+        // a stat per file, on the threadpool like any other disk access
+        auto check = [resume = &*resume]() { return resume->FingerprintsMatch(); };
+        auto match = co_await coro::OnThreadpool(loop_, std::move(check));
+        if (match && match.Value()) {
+            have_ = std::move(resume->have);
+            files_ = std::move(resume->files);
+            SetState(State::RESTORED);
+            std::cout << "Restored without hashing: " << torrent_file_name_ << std::endl;
+            co_return true;
+        }
+        std::cout << "Files changed since the last run, checking them again: "
+                  << torrent_file_name_ << std::endl;
+    }
+    // hash whatever is on disk, pieces of missing or short files fail to read right away
+    auto recheck = [torrent = &torrent, layout = PieceLayout::Of(torrent, save_path_),
+                    bitfield_size]() {
+        std::vector<ResumeData::FileFingerprint> files;
+        bool any = false;
+        for (const auto& path : layout.paths) {
+            // a missing file never matches, there is nothing to restore from it anyway
+            auto file = ResumeData::Fingerprint(path);
+            any = any || (file && file.Value().size > 0);
+            files.push_back(file ? file.Value() : ResumeData::FileFingerprint{.path = path});
+        }
+        std::string have(bitfield_size, '\0');
+        for (size_t i = 0; any && i < torrent->GetPieceCount(); i++) {
+            auto data = ReadPiece(layout, i, torrent->GetPieceSize(i));
+            if (!data) continue;
+            unsigned char digest[SHA1::HashBytes];
+            SHA1 hasher{};
+            hasher.add(data.Value().data(), data.Value().size());
+            hasher.getHash(digest);
+            if (torrent->GetPieceHash(i) == std::string_view(reinterpret_cast<char*>(digest),
+                                                             SHA1::HashBytes)) {
+                net::SetPiece(&have, i);
+            }
+        }
+        return std::make_pair(std::move(have), std::move(files));
+    };
+    auto rechecked = co_await coro::OnThreadpool(loop_, std::move(recheck));
+    if (!rechecked) {
+        std::cout << "Failed to check files of " << torrent_file_name_ << ": "
+                  << rechecked.Error() << std::endl;
+        co_return false;
+    }
+    std::tie(have_, files_) = std::move(rechecked).TakeValue();
+    co_return true;
+}
 
-    assert(state_ == State::READING);
-    assert(req == &torrent_file_);
-    if (req->result < 0) {
-        std::cout << "Failed to read: " << torrent_file_name_ << std::endl;
-        state_ = State::ERROR;
-    } else if (req->result > 0) {
-        // append and continue reading
-        torrent_file_content_.append(torrent_read_buf_.data(), req->result);
-        uv_buf_t iovec{
-            .base = torrent_read_buf_.data(),
-            .len = torrent_read_buf_.size(),
+uint64_t Task::Left(const TorrentFile& torrent) const {
+    uint64_t left = 0;
+    for (size_t i = 0; i < torrent.GetPieceCount(); i++) {
+        if (!net::HasPiece(have_, i)) left += torrent.GetPieceSize(i);
+    }
+    return left;
+}
+
+void Task::PieceDownloaded(std::shared_ptr<Task> task, uint32_t index, std::string data) {
+    // the swarm may still be finishing pieces of a task gone dormant
+    if (!task->torrent_ || index >= task->torrent_->GetPieceCount()) return;
+    task->unwritten_.emplace_back(index, std::move(data));
+    if (task->writing_) return;
+    task->writing_ = true;
+    coro::Spawn(WritePieces(std::move(task)));
+}
+
+coro::Task<> Task::WritePieces(std::shared_ptr<Task> task) {
+    PieceLayout layout = PieceLayout::Of(*task->torrent_, task->save_path_);
+    // one piece at a time, the fingerprints of a file shared by two pieces are taken in order
+    while (!task->unwritten_.empty() && task->torrent_) {
+        auto [index, data] = std::move(task->unwritten_.front());
+        task->unwritten_.pop_front();
+        uint64_t size = data.size();
+        auto write = [layout = &layout, index, data = std::move(data)]()
+            -> Result<std::vector<std::pair<size_t, ResumeData::FileFingerprint>>, std::string> {
+            ASSIGN_OR_RAISE(auto files, WritePiece(*layout, index, data));
+            std::vector<std::pair<size_t, ResumeData::FileFingerprint>> fingerprints;
+            for (size_t file : files) {
+                ASSIGN_OR_RAISE(auto fingerprint, ResumeData::Fingerprint(layout->paths[file]));
+                fingerprints.emplace_back(file, std::move(fingerprint));
+            }
+            return fingerprints;
         };
-        int64_t offset = torrent_file_content_.size();
-        retcode = uv_fs_read(loop_, &torrent_file_, torrent_file_fd_, &iovec, 1, offset,
-                             uv_callbacks::Fs<&Task::TorrentFileReadCb>);
-        assert(retcode == 0);
-    } else {
-        // read complete
-        retcode = uv_fs_close(loop_, &torrent_file_, torrent_file_fd_, nullptr);
-        assert(retcode == 0);
-        state_ = State::READED;
-        std::cout << "Read " << torrent_file_content_.size()
-                  << " bytes from file: " << torrent_file_name_ << std::endl;
-        auto t = TorrentFile::Load(torrent_file_content_);
-        if (!t) {
-            std::cout << "Failed to parse torrent file" << std::endl;
-        } else {
-            t.Value().Dump();
+        auto written = co_await coro::OnThreadpool(task->loop_, std::move(write));
+        if (!written) {
+            // the swarm counts the piece as had since it passed the hash check
+            std::cout << "Failed to write piece " << index << " of " << task->torrent_file_name_
+                      << ", downloading it again: " << written.Error() << std::endl;
+            task->app_->PieceLost(task->info_hash_, index);
+            continue;
         }
+        for (auto& [file, fingerprint] : written.Value()) {
+            if (file < task->files_.size()) task->files_[file] = std::move(fingerprint);
+        }
+        if (net::HasPiece(task->have_, index)) continue;
+        net::SetPiece(&task->have_, index);
+        task->left_ -= std::min(task->left_, size);
+        task->downloaded_ += size;
+        // Check() brings a dormant task back from `resume_`
+        if (task->state_ == State::DORMANT) task->resume_ = task->ResumeState();
+        task->app_->SaveResumeData(task->ResumeState());
+        task->app_->TaskStatusChanged(task->id_);
+        if (task->left_ == 0) task->app_->TaskCompleted(task->id_);
     }
+    task->unwritten_.clear();
+    task->writing_ = false;
+}
+
+ResumeData Task::ResumeState() const {
+    return ResumeData{
+        .info_hash = info_hash_,
+        .torrent_file = torrent_file_name_,
+        .save_path = save_path_,
+        .have = have_,
+        .files = files_,
+    };
 }
 
 }  // namespace ryu
\ No newline at end of file
@@ -2,8 +2,17 @@
 
 #include <uv.h>
 
-#include <array>
+#include <deque>
+#include <memory>
+#include <optional>
 #include <string>
+#include <utility>
+#include <vector>
+
+#include "ryu/resume.h"
+#include "ryu/storage.h"
+#include "torrent_file.h"
+#include "utils/coro.h"
 
 namespace ryu {
 
@@ -11,27 +20,86 @@ class App;
 class Task {
   public:
     enum class State {
+        // waiting for a checking slot
+        QUEUED,
         OPENING,
         READING,
         READED,
+        PARSED,
+        // have bitfield from the resume journal, without hashing
+        RESTORED,
+        // stopped by the task queue, only the resume state is kept
+        DORMANT,
 
         ERROR,
     };
 
-    Task(App* app, uv_loop_t* loop, std::string torrent_file_name);
-    void TorrentFileOpenCb(uv_fs_t* req);
-    void TorrentFileReadCb(uv_fs_t* req);
+    // Files go below `save_path`. `resume` is the state saved by a previous run, used if the
+    // files on disk did not change since. Nothing happens until Check().
+    Task(App* app, uv_loop_t* loop, uint64_t id, std::string torrent_file_name,
+         std::string save_path, std::optional<ResumeData> resume = {});
+
+    // Lower case name, as reported over RPC
+    static const char* StateName(State state);
+
+    // Load the torrent file and restore or verify the data, App::TaskChecked() is called once
+    // done. Also brings a dormant task back.
+    void Check();
+    // Drop the parsed torrent, keeping what Check() needs to restore the task without hashing
+    void Dormant();
+
+    // What to save in the resume journal
+    [[nodiscard]] ResumeData ResumeState() const;
+
+    // A piece downloaded by the task's swarm that passed its hash check. Pieces are written in
+    // the order they come, then recorded in the resume journal. `task` is kept alive until its
+    // pieces are on disk.
+    static void PieceDownloaded(std::shared_ptr<Task> task, uint32_t index, std::string data);
+
+    [[nodiscard]] uint64_t id() const { return id_; }
+    [[nodiscard]] State state() const { return state_; }
+    [[nodiscard]] const std::string& torrent_file_name() const { return torrent_file_name_; }
+    // valid once checked
+    [[nodiscard]] const std::string& info_hash() const { return info_hash_; }
+    [[nodiscard]] uint64_t left() const { return left_; }
+    // bitfield of the pieces on disk
+    [[nodiscard]] const std::string& have() const { return have_; }
+    // bytes of pieces downloaded and written since the task was created
+    [[nodiscard]] uint64_t downloaded() const { return downloaded_; }
+    // null unless checked and not dormant
+    [[nodiscard]] const TorrentFile* torrent() const { return torrent_.get(); }
 
   private:
+    // and have the app publish it
+    void SetState(State state);
+    coro::Task<> RunCheck();
+    // open, stat, read and close the torrent file, then parse and hash it on the threadpool
+    coro::Task<bool> Load();
+    // take over the saved state, or fingerprint the files for a fresh one. False if the files
+    // could not be checked.
+    coro::Task<bool> Restore(const TorrentFile& torrent);
+    // bytes of the pieces not in `have_`
+    [[nodiscard]] uint64_t Left(const TorrentFile& torrent) const;
+    // write `unwritten_` on the threadpool until it is empty or the task goes dormant
+    static coro::Task<> WritePieces(std::shared_ptr<Task> task);
+
     App* app_;
     uv_loop_t* loop_;
+    const uint64_t id_;
     State state_;
 
     std::string torrent_file_name_;
-    uv_fs_t torrent_file_;
-    uv_file torrent_file_fd_;
-    std::string torrent_file_content_;
-    std::array<char, 4096> torrent_read_buf_;
+    std::string save_path_;
+    std::optional<ResumeData> resume_;
+    std::unique_ptr<TorrentFile> torrent_;
+    std::string info_hash_;
+    uint64_t left_ = 0;
+    uint64_t downloaded_ = 0;
+    std::string have_;
+    std::vector<ResumeData::FileFingerprint> files_;
+    // verified pieces waiting for WritePieces()
+    std::deque<std::pair<uint32_t, std::string>> unwritten_;
+    bool writing_ = false;
 };
 
 }  // namespace ryu
\ No newline at end of file
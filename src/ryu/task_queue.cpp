@@ -0,0 +1,175 @@
+#include "task_queue.h"
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+#include <vector>
+
+namespace ryu {
+
+namespace {
+size_t Index(TaskQueue::Slot slot) { return static_cast<size_t>(slot); }
+}  // namespace
+
+void TaskQueue::Add(Id id, int priority, uint64_t now_ms) {
+    if (entries_.count(id)) return;
+    Entry& entry = entries_[id];
+    entry.priority = priority;
+    entry.last_active_ms = now_ms;
+    Enqueue(id, entry, Slot::CHECKING);
+    Promote(Slot::CHECKING, now_ms);
+}
+
+void TaskQueue::Checked(Id id, bool complete, uint64_t now_ms) {
+    auto iter = entries_.find(id);
+    if (iter == entries_.end() || !iter->second.active || iter->second.slot != Slot::CHECKING) {
+        return;
+    }
+    Slot next = complete ? Slot::SEEDING : Slot::DOWNLOADING;
+    Release(iter->second);
+    Enqueue(id, iter->second, next);
+    Promote(Slot::CHECKING, now_ms);
+    Promote(next, now_ms);
+}
+
+void TaskQueue::Completed(Id id, uint64_t now_ms) {
+    auto iter = entries_.find(id);
+    if (iter == entries_.end() || iter->second.slot != Slot::DOWNLOADING) return;
+    if (iter->second.active) {
+        Release(iter->second);
+    } else {
+        Dequeue(id, iter->second);
+    }
+    Enqueue(id, iter->second, Slot::SEEDING);
+    Promote(Slot::DOWNLOADING, now_ms);
+    Promote(Slot::SEEDING, now_ms);
+}
+
+void TaskQueue::Touch(Id id, uint64_t now_ms) {
+    auto iter = entries_.find(id);
+    if (iter != entries_.end()) iter->second.last_active_ms = now_ms;
+}
+
+void TaskQueue::SetPriority(Id id, int priority) {
+    auto iter = entries_.find(id);
+    if (iter == entries_.end()) return;
+    Entry& entry = iter->second;
+    if (entry.active) {
+        entry.priority = priority;
+        return;
+    }
+    Dequeue(id, entry);
+    entry.priority = priority;
+    Enqueue(id, entry, entry.slot);
+}
+
+void TaskQueue::Remove(Id id, uint64_t now_ms) {
+    auto iter = entries_.find(id);
+    if (iter == entries_.end()) return;
+    Slot slot = iter->second.slot;
+    bool active = iter->second.active;
+    if (active) {
+        Release(iter->second);
+    } else {
+        Dequeue(id, iter->second);
+    }
+    entries_.erase(iter);
+    if (active) Promote(slot, now_ms);
+}
+
+size_t TaskQueue::DemoteIdle(uint64_t now_ms) {
+    std::vector<std::pair<uint64_t, Id>> idle[3];
+    for (const auto& [id, entry] : entries_) {
+        if (!entry.active || entry.slot == Slot::CHECKING) continue;
+        if (now_ms - entry.last_active_ms < options_.idle_ms) continue;
+        idle[Index(entry.slot)].emplace_back(entry.last_active_ms, id);
+    }
+    std::vector<Id> demoted;
+    for (Slot slot : {Slot::DOWNLOADING, Slot::SEEDING}) {
+        auto& candidates = idle[Index(slot)];
+        // no more than there are tasks to take the slots, the longest idle first
+        size_t count = std::min(candidates.size(), queues_[Index(slot)].size());
+        std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end());
+        for (size_t i = 0; i < count; i++) {
+            Id id = candidates[i].second;
+            Entry& entry = entries_[id];
+            Release(entry);
+            entry.last_active_ms = now_ms;
+            Enqueue(id, entry, Slot::CHECKING);
+            demoted.push_back(id);
+        }
+    }
+    demoted_ += demoted.size();
+    for (Id id : demoted) on_stop_(id);
+    Promote(Slot::DOWNLOADING, now_ms);
+    Promote(Slot::SEEDING, now_ms);
+    Promote(Slot::CHECKING, now_ms);
+    return demoted.size();
+}
+
+std::optional<TaskQueue::Slot> TaskQueue::ActiveSlot(Id id) const {
+    auto iter = entries_.find(id);
+    if (iter == entries_.end() || !iter->second.active) return {};
+    return iter->second.slot;
+}
+
+std::optional<int> TaskQueue::Priority(Id id) const {
+    auto iter = entries_.find(id);
+    if (iter == entries_.end()) return {};
+    return iter->second.priority;
+}
+
+TaskQueue::Stats TaskQueue::GetStats() const {
+    Stats stats;
+    for (size_t i = 0; i < 3; i++) {
+        stats.active[i] = active_[i];
+        stats.queued[i] = queues_[i].size();
+    }
+    stats.demoted = demoted_;
+    return stats;
+}
+
+size_t TaskQueue::Limit(Slot slot) const {
+    switch (slot) {
+        case Slot::CHECKING:
+            return options_.checking_slots;
+        case Slot::DOWNLOADING:
+            return options_.downloading_slots;
+        case Slot::SEEDING:
+            return options_.seeding_slots;
+    }
+    return 0;
+}
+
+void TaskQueue::Enqueue(Id id, Entry& entry, Slot slot) {
+    entry.slot = slot;
+    entry.active = false;
+    entry.sequence = next_sequence_++;
+    queues_[Index(slot)].emplace(-entry.priority, entry.sequence, id);
+}
+
+void TaskQueue::Dequeue(Id id, const Entry& entry) {
+    queues_[Index(entry.slot)].erase({-entry.priority, entry.sequence, id});
+}
+
+void TaskQueue::Release(Entry& entry) {
+    assert(entry.active && active_[Index(entry.slot)] > 0);
+    entry.active = false;
+    active_[Index(entry.slot)]--;
+}
+
+void TaskQueue::Promote(Slot slot, uint64_t now_ms) {
+    auto& queue = queues_[Index(slot)];
+    while (active_[Index(slot)] < Limit(slot) && !queue.empty()) {
+        Id id = std::get<2>(*queue.begin());
+        queue.erase(queue.begin());
+        Entry& entry = entries_[id];
+        entry.active = true;
+        entry.last_active_ms = now_ms;
+        active_[Index(slot)]++;
+        // may call back into the queue
+        on_start_(id, slot);
+    }
+}
+
+}  // namespace ryu
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+
+namespace ryu {
+
+// Decides which tasks run. A task first waits for a CHECKING slot, where its torrent is loaded
+// and its data verified, then for a DOWNLOADING or SEEDING slot depending on whether it is
+// complete. Each kind of slot has its own limit, and a slot that frees up goes to the queued
+// task with the highest priority, the earliest queued first among equals.
+//
+// An active task that saw no activity for `idle_ms` is stopped when another task waits for its
+// kind of slot, and queued again for checking behind the tasks of its priority. Stopped tasks
+// are dormant: they keep their resume state and drop everything else until they run again.
+class TaskQueue {
+  public:
+    using Id = uint64_t;
+    enum class Slot { CHECKING, DOWNLOADING, SEEDING };
+
+    struct Options {
+        size_t checking_slots = 2;
+        size_t downloading_slots = 4;
+        size_t seeding_slots = 8;
+        uint64_t idle_ms = 300000;
+    };
+
+    struct Stats {
+        size_t active[3] = {};
+        size_t queued[3] = {};
+        uint64_t demoted = 0;
+    };
+
+    // Called when a task gets a slot, and when an active task is demoted
+    using StartCallback = std::function<void(Id id, Slot slot)>;
+    using StopCallback = std::function<void(Id id)>;
+
+    TaskQueue(Options options, StartCallback on_start, StopCallback on_stop)
+        : options_(options), on_start_(std::move(on_start)), on_stop_(std::move(on_stop)) {}
+    TaskQueue(const TaskQueue&) = delete;
+    TaskQueue& operator=(const TaskQueue&) = delete;
+
+    // Queue a new task for checking. Higher priorities run first.
+    void Add(Id id, int priority, uint64_t now_ms);
+    // Checking is done, queue for a download or seed slot
+    void Checked(Id id, bool complete, uint64_t now_ms);
+    // A download finished, move to a seed slot
+    void Completed(Id id, uint64_t now_ms);
+    // The task made progress: traffic, new peers
+    void Touch(Id id, uint64_t now_ms);
+    // Requeues a waiting task, an active one keeps its slot
+    void SetPriority(Id id, int priority);
+    // Forget the task, its slot goes to the next one. The stop callback is not called.
+    void Remove(Id id, uint64_t now_ms);
+    // Stop the active tasks idle for `idle_ms` whose slot someone waits for, returns how many
+    size_t DemoteIdle(uint64_t now_ms);
+
+    [[nodiscard]] bool Contains(Id id) const { return entries_.count(id) > 0; }
+    // Slot of an active task, nullopt while it is queued
+    [[nodiscard]] std::optional<Slot> ActiveSlot(Id id) const;
+    // nullopt unless the task is known
+    [[nodiscard]] std::optional<int> Priority(Id id) const;
+    [[nodiscard]] Stats GetStats() const;
+
+  private:
+    // (-priority, sequence, id), so that begin() runs next
+    using QueueKey = std::tuple<int, uint64_t, Id>;
+
+    struct Entry {
+        int priority = 0;
+        Slot slot = Slot::CHECKING;
+        bool active = false;
+        // valid while queued
+        uint64_t sequence = 0;
+        uint64_t last_active_ms = 0;
+    };
+
+    [[nodiscard]] size_t Limit(Slot slot) const;
+    void Enqueue(Id id, Entry& entry, Slot slot);
+    void Dequeue(Id id, const Entry& entry);
+    // Give up the slot of an active task
+    void Release(Entry& entry);
+    // Hand free slots of that kind to the queued tasks
+    void Promote(Slot slot, uint64_t now_ms);
+
+    const Options options_;
+    const StartCallback on_start_;
+    const StopCallback on_stop_;
+    std::unordered_map<Id, Entry> entries_;
+    std::set<QueueKey> queues_[3];
+    size_t active_[3] = {};
+    uint64_t next_sequence_ = 0;
+    uint64_t demoted_ = 0;
+};
+
+}  // namespace ryu
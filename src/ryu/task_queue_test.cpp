@@ -0,0 +1,124 @@
+#include "ryu/task_queue.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+using namespace ryu;
+using Slot = TaskQueue::Slot;
+
+namespace {
+
+class TaskQueueTest : public ::testing::Test {
+  protected:
+    void Make(TaskQueue::Options options) {
+        queue_ = std::make_unique<TaskQueue>(
+            options, [this](TaskQueue::Id id, Slot slot) { started_.emplace_back(id, slot); },
+            [this](TaskQueue::Id id) { stopped_.push_back(id); });
+    }
+
+    std::vector<TaskQueue::Id> Started(Slot slot) {
+        std::vector<TaskQueue::Id> ids;
+        for (auto [id, s] : started_) {
+            if (s == slot) ids.push_back(id);
+        }
+        return ids;
+    }
+
+    std::unique_ptr<TaskQueue> queue_;
+    std::vector<std::pair<TaskQueue::Id, Slot>> started_;
+    std::vector<TaskQueue::Id> stopped_;
+};
+
+TEST_F(TaskQueueTest, SlotsAndPriorities) {
+    Make({.checking_slots = 1, .downloading_slots = 2, .seeding_slots = 1});
+    queue_->Add(1, 0, 0);
+    queue_->Add(2, 0, 0);
+    queue_->Add(3, 5, 0);
+    queue_->Add(4, 0, 0);
+    // 1 got the only checking slot before 3 came, then priority beats arrival order
+    EXPECT_EQ((std::vector<TaskQueue::Id>{1}), Started(Slot::CHECKING));
+    queue_->Checked(1, false, 1);
+    queue_->SetPriority(4, 1);
+    queue_->Checked(3, false, 2);
+    queue_->Checked(4, true, 3);
+    EXPECT_EQ((std::vector<TaskQueue::Id>{1, 3, 4, 2}), Started(Slot::CHECKING));
+    EXPECT_EQ((std::vector<TaskQueue::Id>{1, 3}), Started(Slot::DOWNLOADING));
+    EXPECT_EQ((std::vector<TaskQueue::Id>{4}), Started(Slot::SEEDING));
+
+    // 2 waits for a download slot
+    queue_->Checked(2, false, 4);
+    auto stats = queue_->GetStats();
+    EXPECT_EQ(2u, stats.active[static_cast<int>(Slot::DOWNLOADING)]);
+    EXPECT_EQ(1u, stats.queued[static_cast<int>(Slot::DOWNLOADING)]);
+    EXPECT_EQ(std::nullopt, queue_->ActiveSlot(2));
+
+    // a finished download seeds, or waits for a seed slot
+    queue_->Completed(1, 5);
+    EXPECT_EQ((std::vector<TaskQueue::Id>{1, 3, 2}), Started(Slot::DOWNLOADING));
+    EXPECT_EQ(std::nullopt, queue_->ActiveSlot(1));
+    queue_->Remove(4, 6);
+    EXPECT_EQ(Slot::SEEDING, queue_->ActiveSlot(1));
+    EXPECT_FALSE(queue_->Contains(4));
+    EXPECT_TRUE(stopped_.empty());
+}
+
+TEST_F(TaskQueueTest, IdleTasksMakeRoomForQueuedOnes) {
+    Make({.checking_slots = 4, .downloading_slots = 2, .seeding_slots = 4, .idle_ms = 1000});
+    for (TaskQueue::Id id = 1; id <= 3; id++) {
+        queue_->Add(id, 0, 0);
+        queue_->Checked(id, false, 0);
+    }
+    EXPECT_EQ((std::vector<TaskQueue::Id>{1, 2}), Started(Slot::DOWNLOADING));
+
+    // busy tasks keep their slots
+    queue_->Touch(1, 900);
+    queue_->Touch(2, 900);
+    EXPECT_EQ(0u, queue_->DemoteIdle(1500));
+    // the longest idle goes dormant and is checked again later, 3 takes the slot
+    queue_->Touch(1, 1200);
+    EXPECT_EQ(1u, queue_->DemoteIdle(2000));
+    EXPECT_EQ((std::vector<TaskQueue::Id>{2}), stopped_);
+    EXPECT_EQ((std::vector<TaskQueue::Id>{1, 2, 3}), Started(Slot::DOWNLOADING));
+    EXPECT_EQ(Slot::CHECKING, queue_->ActiveSlot(2));
+
+    // idle slots rotate among the waiting tasks
+    queue_->Checked(2, false, 2100);
+    EXPECT_EQ(1u, queue_->DemoteIdle(3150));
+    EXPECT_EQ((std::vector<TaskQueue::Id>{2, 1}), stopped_);
+    EXPECT_EQ(Slot::DOWNLOADING, queue_->ActiveSlot(2));
+
+    // nobody waits, idle tasks stay
+    queue_->Remove(1, 3200);
+    EXPECT_EQ(0u, queue_->DemoteIdle(100000));
+    EXPECT_EQ(2u, queue_->GetStats().demoted);
+}
+
+TEST_F(TaskQueueTest, CallbacksMayReenter) {
+    TaskQueue* queue = nullptr;
+    std::vector<TaskQueue::Id> checked;
+    queue_ = std::make_unique<TaskQueue>(
+        TaskQueue::Options{.checking_slots = 1, .downloading_slots = 1},
+        [&](TaskQueue::Id id, Slot slot) {
+            // checks that finish right away, and a task that fails
+            if (slot != Slot::CHECKING) return;
+            checked.push_back(id);
+            if (id == 2) {
+                queue->Remove(id, 0);
+            } else {
+                queue->Checked(id, false, 0);
+            }
+        },
+        [](TaskQueue::Id) {});
+    queue = queue_.get();
+    for (TaskQueue::Id id = 1; id <= 4; id++) queue_->Add(id, 0, 0);
+    EXPECT_EQ((std::vector<TaskQueue::Id>{1, 2, 3, 4}), checked);
+    auto stats = queue_->GetStats();
+    EXPECT_EQ(1u, stats.active[static_cast<int>(Slot::DOWNLOADING)]);
+    EXPECT_EQ(2u, stats.queued[static_cast<int>(Slot::DOWNLOADING)]);
+    EXPECT_EQ(0u, stats.active[static_cast<int>(Slot::CHECKING)]);
+}
+
+}  // namespace
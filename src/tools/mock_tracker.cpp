@@ -0,0 +1,82 @@
+#include <uv.h>
+
+#include <csignal>
+#include <iostream>
+#include <string>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+#include "absl/strings/str_format.h"
+#include "tools/mock_tracker_server.h"
+
+using namespace std;
+using namespace ryu;
+
+ABSL_FLAG(string, bind, "127.0.0.1", "Address to listen on");
+ABSL_FLAG(int, http_port, 6969, "HTTP tracker port, 0 for any free port, -1 to disable");
+ABSL_FLAG(int, udp_port, 6969, "UDP tracker port, 0 for any free port, -1 to disable");
+ABSL_FLAG(int, latency_ms, 0, "Delay of every reply");
+ABSL_FLAG(double, failure_rate, 0, "Fraction of announces answered with a failure");
+ABSL_FLAG(double, drop_rate, 0, "Fraction of requests never answered");
+ABSL_FLAG(int, peers, 50, "IPv4 swarm size of every torrent");
+ABSL_FLAG(int, peers6, 0, "IPv6 swarm size of every torrent");
+ABSL_FLAG(int, interval, 1800, "Announce interval in seconds");
+ABSL_FLAG(int, min_interval, 0, "Announce min interval in seconds, 0 to omit");
+
+namespace {
+MockTrackerServer* server = nullptr;
+
+void PrintStats() {
+    const auto& stats = server->GetStats();
+    cout << absl::StrFormat(
+                "http_requests=%d connects=%d announces=%d scrapes=%d failures=%d dropped=%d "
+                "bad_requests=%d",
+                stats.http_requests, stats.connects, stats.announces, stats.scrapes,
+                stats.failures, stats.dropped, stats.bad_requests)
+         << endl;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    absl::SetProgramUsageMessage("[--http_port N] [--udp_port N] [--latency_ms N] ...");
+    absl::ParseCommandLine(argc, argv);
+
+    uv_loop_t* loop = uv_default_loop();
+    MockTrackerServer tracker(loop, MockTrackerServer::Options{
+                                        .bind_ip = absl::GetFlag(FLAGS_bind),
+                                        .http_port = absl::GetFlag(FLAGS_http_port),
+                                        .udp_port = absl::GetFlag(FLAGS_udp_port),
+                                        .latency_ms = static_cast<uint64_t>(
+                                            max(0, absl::GetFlag(FLAGS_latency_ms))),
+                                        .failure_rate = absl::GetFlag(FLAGS_failure_rate),
+                                        .drop_rate = absl::GetFlag(FLAGS_drop_rate),
+                                        .peers = static_cast<size_t>(
+                                            max(0, absl::GetFlag(FLAGS_peers))),
+                                        .peers6 = static_cast<size_t>(
+                                            max(0, absl::GetFlag(FLAGS_peers6))),
+                                        .interval = absl::GetFlag(FLAGS_interval),
+                                        .min_interval = absl::GetFlag(FLAGS_min_interval),
+                                    });
+    server = &tracker;
+    tracker.Start().Expect("failed to start mock tracker");
+    if (absl::GetFlag(FLAGS_http_port) >= 0) {
+        cout << "Serving " << tracker.HttpAnnounceUrl() << endl;
+    }
+    if (absl::GetFlag(FLAGS_udp_port) >= 0) {
+        cout << "Serving " << tracker.UdpAnnounceUrl() << endl;
+    }
+
+    // Ctrl-C prints the counters and exits
+    uv_signal_t sigint;
+    uv_signal_init(loop, &sigint);
+    uv_signal_start_oneshot(
+        &sigint,
+        [](uv_signal_t* handle, int signum) {
+            PrintStats();
+            server->Halt([] {});
+            uv_close(reinterpret_cast<uv_handle_t*>(handle), nullptr);
+        },
+        SIGINT);
+    return uv_run(loop, UV_RUN_DEFAULT);
+}
@@ -0,0 +1,543 @@
+#include "tools/mock_tracker_server.h"
+
+#include <endian.h>
+
+#include <cassert>
+#include <cstring>
+#include <string_view>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "common/bencode.h"
+#include "utils/uv_callbacks.h"
+
+namespace ryu {
+using namespace ::ryu::bencode;
+
+namespace {
+constexpr size_t kMaxHeaderSize = 8192;
+constexpr uint64_t kUdpProtocolId = 0x41727101980ULL;
+constexpr int64_t kDefaultNumWant = 50;
+// a BEP-0015 announce reply has to fit in one datagram
+constexpr size_t kMaxUdpPeers = (65507 - 20) / 18;
+
+uint32_t GetU32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return be32toh(v);
+}
+
+uint64_t GetU64(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return be64toh(v);
+}
+
+void PutU32(std::string* s, uint32_t v) {
+    v = htobe32(v);
+    s->append(reinterpret_cast<const char*>(&v), 4);
+}
+
+void PutU64(std::string* s, uint64_t v) {
+    v = htobe64(v);
+    s->append(reinterpret_cast<const char*>(&v), 8);
+}
+
+uint64_t HashOf(absl::string_view str) {
+    return std::hash<std::string_view>()(std::string_view(str.data(), str.size()));
+}
+
+uint64_t Mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+int HexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+std::string UrlDecode(absl::string_view str) {
+    std::string ret;
+    ret.reserve(str.size());
+    for (size_t i = 0; i < str.size(); i++) {
+        if (str[i] == '%' && i + 2 < str.size() && HexValue(str[i + 1]) >= 0 &&
+            HexValue(str[i + 2]) >= 0) {
+            ret.push_back(static_cast<char>(HexValue(str[i + 1]) << 4 | HexValue(str[i + 2])));
+            i += 2;
+        } else if (str[i] == '+') {
+            ret.push_back(' ');
+        } else {
+            ret.push_back(str[i]);
+        }
+    }
+    return ret;
+}
+
+Result<ResultVoid, std::string> MakeAddr(const std::string& ip, int port, sockaddr_storage* out) {
+    int ret = ip.find(':') != std::string::npos
+                  ? uv_ip6_addr(ip.c_str(), port, reinterpret_cast<sockaddr_in6*>(out))
+                  : uv_ip4_addr(ip.c_str(), port, reinterpret_cast<sockaddr_in*>(out));
+    if (ret != 0) return Err(absl::StrCat("invalid bind address ", ip, ": ", uv_strerror(ret)));
+    return {};
+}
+
+uint16_t PortOf(const sockaddr_storage& addr) {
+    return addr.ss_family == AF_INET6
+               ? be16toh(reinterpret_cast<const sockaddr_in6*>(&addr)->sin6_port)
+               : be16toh(reinterpret_cast<const sockaddr_in*>(&addr)->sin_port);
+}
+}  // namespace
+
+MockTrackerServer::MockTrackerServer(uv_loop_t* loop, Options options)
+    : loop_(loop), options_(std::move(options)), rng_(options_.seed) {}
+
+Result<ResultVoid, std::string> MockTrackerServer::Start() {
+    int retcode;
+    if (options_.http_port >= 0) {
+        sockaddr_storage addr{};
+        VALUE_OR_RAISE(MakeAddr(options_.bind_ip, options_.http_port, &addr));
+        http_ = std::make_unique<uv_tcp_t>();
+        retcode = uv_tcp_init(loop_, http_.get());
+        if (retcode) return Err("MockTrackerServer::Start uv_tcp_init() failed");
+        http_->data = this;
+        open_handles_++;
+        retcode = uv_tcp_bind(http_.get(), reinterpret_cast<sockaddr*>(&addr), 0);
+        if (retcode) return Err(absl::StrCat("uv_tcp_bind() failed: ", uv_strerror(retcode)));
+        retcode = uv_listen(reinterpret_cast<uv_stream_t*>(http_.get()), 1024,
+                            uv_callbacks::Connection<&MockTrackerServer::NewConnection>);
+        if (retcode) return Err(absl::StrCat("uv_listen() failed: ", uv_strerror(retcode)));
+        int len = sizeof(addr);
+        uv_tcp_getsockname(http_.get(), reinterpret_cast<sockaddr*>(&addr), &len);
+        http_port_ = PortOf(addr);
+    }
+    if (options_.udp_port >= 0) {
+        sockaddr_storage addr{};
+        VALUE_OR_RAISE(MakeAddr(options_.bind_ip, options_.udp_port, &addr));
+        udp_ = std::make_unique<uv_udp_t>();
+        retcode = uv_udp_init(loop_, udp_.get());
+        if (retcode) return Err("MockTrackerServer::Start uv_udp_init() failed");
+        udp_->data = this;
+        open_handles_++;
+        retcode = uv_udp_bind(udp_.get(), reinterpret_cast<sockaddr*>(&addr), 0);
+        if (retcode) return Err(absl::StrCat("uv_udp_bind() failed: ", uv_strerror(retcode)));
+        retcode = uv_udp_recv_start(udp_.get(),
+                                    uv_callbacks::Alloc<&MockTrackerServer::AllocUdpBuffer>,
+                                    uv_callbacks::UdpRecv<&MockTrackerServer::DatagramReceived>);
+        if (retcode) return Err(absl::StrCat("uv_udp_recv_start() failed: ", uv_strerror(retcode)));
+        int len = sizeof(addr);
+        uv_udp_getsockname(udp_.get(), reinterpret_cast<sockaddr*>(&addr), &len);
+        udp_port_ = PortOf(addr);
+    }
+    timer_ = std::make_unique<uv_timer_t>();
+    retcode = uv_timer_init(loop_, timer_.get());
+    if (retcode) return Err("MockTrackerServer::Start uv_timer_init() failed");
+    timer_->data = this;
+    open_handles_++;
+    return {};
+}
+
+void MockTrackerServer::Halt(std::function<void()> on_closed) {
+    if (draining_) return;
+    draining_ = true;
+    on_closed_ = std::move(on_closed);
+    delayed_.clear();
+    for (uv_handle_t* handle : {reinterpret_cast<uv_handle_t*>(http_.get()),
+                                reinterpret_cast<uv_handle_t*>(udp_.get()),
+                                reinterpret_cast<uv_handle_t*>(timer_.get())}) {
+        if (handle != nullptr && !uv_is_closing(handle))
+            uv_close(handle, uv_callbacks::Close<&MockTrackerServer::HandleClosed>);
+    }
+    for (auto& [ptr, conn] : connections_) {
+        conn->pending = 0;
+        CloseConnection(ptr);
+    }
+    CheckHalted();
+}
+
+void MockTrackerServer::CheckHalted() {
+    if (!draining_) return;
+    if (open_handles_ > 0 || !connections_.empty() || !outgoing_.empty()) return;
+    auto cb = std::move(on_closed_);
+    on_closed_ = nullptr;
+    // may delete this
+    if (cb) cb();
+}
+
+void MockTrackerServer::HandleClosed(uv_handle_t* handle) {
+    open_handles_--;
+    if (handle != reinterpret_cast<uv_handle_t*>(http_.get()) &&
+        handle != reinterpret_cast<uv_handle_t*>(udp_.get()) &&
+        handle != reinterpret_cast<uv_handle_t*>(timer_.get())) {
+        auto* conn = static_cast<HttpConnection*>(reinterpret_cast<uv_tcp_t*>(handle));
+        conn->closed = true;
+        // otherwise released by the last delayed reply
+        if (conn->pending == 0) connections_.erase(conn);
+    }
+    CheckHalted();
+}
+
+std::string MockTrackerServer::HttpAnnounceUrl() const {
+    std::string host = absl::StrContains(options_.bind_ip, ':')
+                           ? absl::StrCat("[", options_.bind_ip, "]")
+                           : options_.bind_ip;
+    return absl::StrCat("http://", host, ":", http_port_, "/announce");
+}
+
+std::string MockTrackerServer::UdpAnnounceUrl() const {
+    std::string host = absl::StrContains(options_.bind_ip, ':')
+                           ? absl::StrCat("[", options_.bind_ip, "]")
+                           : options_.bind_ip;
+    return absl::StrCat("udp://", host, ":", udp_port_, "/announce");
+}
+
+bool MockTrackerServer::Roll(double rate) {
+    if (rate <= 0) return false;
+    return std::uniform_real_distribution<double>(0, 1)(rng_) < rate;
+}
+
+void MockTrackerServer::Delay(std::function<void()> send) {
+    if (options_.latency_ms == 0) return send();
+    bool idle = delayed_.empty();
+    delayed_.emplace_back(uv_now(loop_) + options_.latency_ms, std::move(send));
+    if (idle) {
+        uv_timer_start(timer_.get(), uv_callbacks::Timer<&MockTrackerServer::DelayTimer>,
+                       options_.latency_ms, 0);
+    }
+}
+
+void MockTrackerServer::DelayTimer(uv_timer_t* handle) {
+    uint64_t now = uv_now(loop_);
+    while (!delayed_.empty() && delayed_.front().first <= now) {
+        auto send = std::move(delayed_.front().second);
+        delayed_.pop_front();
+        send();
+    }
+    if (!delayed_.empty()) {
+        uv_timer_start(timer_.get(), uv_callbacks::Timer<&MockTrackerServer::DelayTimer>,
+                       delayed_.front().first - now, 0);
+    }
+}
+
+std::string MockTrackerServer::CompactPeers(absl::string_view info_hash, size_t count,
+                                            bool ipv6) {
+    uint64_t base = Mix(HashOf(info_hash));
+    std::string ret;
+    ret.reserve(count * (ipv6 ? 18 : 6));
+    for (size_t i = 0; i < count; i++) {
+        uint64_t x = Mix(base + i);
+        if (ipv6) {
+            // fd00::/8 unique local, the index keeps addresses of one swarm distinct
+            ret.push_back('\xfd');
+            for (int b = 0; b < 11; b++) ret.push_back(static_cast<char>(x >> (b * 8)));
+            PutU32(&ret, static_cast<uint32_t>(i));
+        } else {
+            ret.push_back(10);
+            ret.push_back(static_cast<char>(i >> 16));
+            ret.push_back(static_cast<char>(i >> 8));
+            ret.push_back(static_cast<char>(i));
+        }
+        uint16_t port = htobe16(static_cast<uint16_t>(1024 + x % 64000));
+        ret.append(reinterpret_cast<const char*>(&port), 2);
+    }
+    return ret;
+}
+
+std::string MockTrackerServer::AnnounceBody(absl::string_view info_hash, int64_t num_want) {
+    size_t want = num_want < 0 ? kDefaultNumWant : num_want;
+    BencodeMap reply;
+    reply.Set("complete", std::make_unique<BencodeInteger>(options_.peers / 4));
+    reply.Set("incomplete",
+              std::make_unique<BencodeInteger>(options_.peers - options_.peers / 4));
+    reply.Set("interval", std::make_unique<BencodeInteger>(options_.interval));
+    if (options_.min_interval > 0)
+        reply.Set("min interval", std::make_unique<BencodeInteger>(options_.min_interval));
+    reply.Set("peers", std::make_unique<BencodeString>(
+                           CompactPeers(info_hash, std::min(want, options_.peers), false)));
+    if (options_.peers6 > 0) {
+        reply.Set("peers6", std::make_unique<BencodeString>(
+                                CompactPeers(info_hash, std::min(want, options_.peers6), true)));
+    }
+    return reply.Encode().Expect("failed to encode announce reply");
+}
+
+std::string MockTrackerServer::ScrapeBody(const std::vector<std::string>& info_hashes) {
+    auto files = std::make_unique<BencodeMap>();
+    for (const auto& info_hash : info_hashes) {
+        auto file = std::make_unique<BencodeMap>();
+        file->Set("complete", std::make_unique<BencodeInteger>(options_.peers / 4));
+        file->Set("downloaded", std::make_unique<BencodeInteger>(
+                                    Mix(HashOf(info_hash)) % 10000));
+        file->Set("incomplete",
+                  std::make_unique<BencodeInteger>(options_.peers - options_.peers / 4));
+        files->Set(info_hash, std::move(file));
+    }
+    BencodeMap reply;
+    reply.Set("files", std::move(files));
+    return reply.Encode().Expect("failed to encode scrape reply");
+}
+
+//
+// HTTP
+//
+
+void MockTrackerServer::NewConnection(uv_stream_t* server, int status) {
+    if (status < 0 || draining_) return;
+    auto conn = std::make_unique<HttpConnection>();
+    uv_tcp_init(loop_, conn.get());
+    conn->data = this;
+    open_handles_++;
+    HttpConnection* ptr = conn.get();
+    connections_[ptr] = std::move(conn);
+    if (uv_accept(server, reinterpret_cast<uv_stream_t*>(ptr)) != 0 ||
+        uv_read_start(reinterpret_cast<uv_stream_t*>(ptr),
+                      uv_callbacks::Alloc<&MockTrackerServer::AllocHttpBuffer>,
+                      uv_callbacks::Read<&MockTrackerServer::HttpDataReceived>) != 0) {
+        CloseConnection(ptr);
+    }
+}
+
+void MockTrackerServer::AllocHttpBuffer(uv_handle_t* handle, size_t suggested_size,
+                                        uv_buf_t* buf) {
+    auto* conn = static_cast<HttpConnection*>(reinterpret_cast<uv_tcp_t*>(handle));
+    buf->base = conn->read_buf.data();
+    buf->len = conn->read_buf.size();
+}
+
+void MockTrackerServer::HttpDataReceived(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+    auto* conn = static_cast<HttpConnection*>(reinterpret_cast<uv_tcp_t*>(stream));
+    if (nread < 0) return CloseConnection(conn);
+    conn->buffer.append(buf->base, nread);
+    while (!conn->closing) {
+        auto request = ParseHttpRequest(&conn->buffer);
+        if (!request) {
+            stats_.bad_requests++;
+            SendHttp(conn, 400, request.Error(), false);
+            return;
+        }
+        if (!request.Value()) return;
+        HandleHttpRequest(conn, *request.Value());
+    }
+}
+
+Result<std::optional<MockTrackerServer::Request>, std::string> MockTrackerServer::ParseHttpRequest(
+    std::string* buffer) {
+    size_t end = buffer->find("\r\n\r\n");
+    if (end == std::string::npos) {
+        if (buffer->size() > kMaxHeaderSize) return Err("request header too large");
+        return std::optional<Request>();
+    }
+    std::string head = buffer->substr(0, end);
+    buffer->erase(0, end + 4);
+
+    std::vector<absl::string_view> lines = absl::StrSplit(head, "\r\n");
+    std::vector<absl::string_view> request_line = absl::StrSplit(lines[0], ' ');
+    if (request_line.size() != 3 || request_line[0] != "GET")
+        return Err("only GET requests are served");
+    Request request;
+    request.keep_alive = request_line[2] != "HTTP/1.0";
+    for (size_t i = 1; i < lines.size(); i++) {
+        std::pair<absl::string_view, absl::string_view> header =
+            absl::StrSplit(lines[i], absl::MaxSplits(':', 1));
+        std::string name = absl::AsciiStrToLower(header.first);
+        std::string value = absl::AsciiStrToLower(absl::StripAsciiWhitespace(header.second));
+        if (name == "connection") request.keep_alive = value != "close";
+        if (name == "content-length" && value != "0") return Err("request body not supported");
+    }
+
+    absl::string_view target = request_line[1];
+    size_t question = target.find('?');
+    request.path = std::string(target.substr(0, question));
+    if (question != absl::string_view::npos) {
+        for (absl::string_view pair : absl::StrSplit(target.substr(question + 1), '&')) {
+            if (pair.empty()) continue;
+            std::pair<absl::string_view, absl::string_view> kv =
+                absl::StrSplit(pair, absl::MaxSplits('=', 1));
+            request.query.emplace(UrlDecode(kv.first), UrlDecode(kv.second));
+        }
+    }
+    return std::optional<Request>(std::move(request));
+}
+
+void MockTrackerServer::HandleHttpRequest(HttpConnection* conn, const Request& request) {
+    stats_.http_requests++;
+    if (Roll(options_.drop_rate)) {
+        stats_.dropped++;
+        return CloseConnection(conn);
+    }
+
+    int code = 200;
+    std::string body;
+    if (absl::EndsWith(request.path, "/announce")) {
+        stats_.announces++;
+        auto info_hash = request.query.find("info_hash");
+        int64_t num_want = -1;
+        auto iter = request.query.find("numwant");
+        if (iter != request.query.end() && !absl::SimpleAtoi(iter->second, &num_want))
+            num_want = -1;
+        if (info_hash == request.query.end() || info_hash->second.size() != 20) {
+            body = "d14:failure reason16:invalid info_hashe";
+        } else if (Roll(options_.failure_rate)) {
+            stats_.failures++;
+            body = "d14:failure reason20:mock tracker failuree";
+        } else {
+            body = AnnounceBody(info_hash->second, num_want);
+        }
+    } else if (absl::EndsWith(request.path, "/scrape")) {
+        stats_.scrapes++;
+        std::vector<std::string> info_hashes;
+        auto range = request.query.equal_range("info_hash");
+        for (auto iter = range.first; iter != range.second; ++iter) {
+            if (iter->second.size() == 20) info_hashes.push_back(iter->second);
+        }
+        body = ScrapeBody(info_hashes);
+    } else {
+        code = 404;
+        body = "not found";
+    }
+
+    conn->pending++;
+    bool keep_alive = request.keep_alive;
+    Delay([this, conn, code, body = std::move(body), keep_alive] {
+        conn->pending--;
+        if (!conn->closing) SendHttp(conn, code, body, keep_alive);
+        if (conn->closed && conn->pending == 0) {
+            connections_.erase(conn);
+            CheckHalted();
+        }
+    });
+}
+
+void MockTrackerServer::SendHttp(HttpConnection* conn, int code, const std::string& body,
+                                 bool keep_alive) {
+    const char* reason = code == 200 ? "OK" : code == 404 ? "Not Found" : "Bad Request";
+    std::string response =
+        absl::StrCat("HTTP/1.1 ", code, " ", reason, "\r\nContent-Type: text/plain\r\n",
+                     "Content-Length: ", body.size(), "\r\n",
+                     keep_alive ? "" : "Connection: close\r\n", "\r\n", body);
+    auto buf = std::make_unique<UvWriteBuf>(response.size());
+    memcpy(buf->buffer(), response.data(), response.size());
+    int retcode = buf->write(response.size(), reinterpret_cast<uv_stream_t*>(conn), this,
+                             uv_callbacks::Write<&MockTrackerServer::HttpWriteFinished>);
+    if (retcode != 0) return CloseConnection(conn);
+    outgoing_[buf.get()] = std::move(buf);
+    conn->writes++;
+    if (!keep_alive) conn->close_after_write = true;
+}
+
+void MockTrackerServer::HttpWriteFinished(uv_write_t* req, int status) {
+    auto iter = outgoing_.find(static_cast<UvWriteBuf*>(req));
+    assert(iter != outgoing_.end());
+    auto* conn = static_cast<HttpConnection*>(reinterpret_cast<uv_tcp_t*>(req->handle));
+    outgoing_.erase(iter);
+    conn->writes--;
+    if (status != 0 || (conn->close_after_write && conn->writes == 0)) CloseConnection(conn);
+    CheckHalted();
+}
+
+void MockTrackerServer::CloseConnection(HttpConnection* conn) {
+    if (conn->closing) return;
+    conn->closing = true;
+    uv_close(reinterpret_cast<uv_handle_t*>(conn),
+             uv_callbacks::Close<&MockTrackerServer::HandleClosed>);
+}
+
+//
+// UDP
+//
+
+void MockTrackerServer::AllocUdpBuffer(uv_handle_t* handle, size_t suggested_size,
+                                       uv_buf_t* buf) {
+    buf->base = udp_buf_.data();
+    buf->len = udp_buf_.size();
+}
+
+void MockTrackerServer::DatagramReceived(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf,
+                                         const sockaddr* addr, unsigned flags) {
+    if (nread <= 0 || addr == nullptr || draining_) return;
+    HandleUdpRequest(absl::string_view(buf->base, nread), addr);
+}
+
+void MockTrackerServer::HandleUdpRequest(absl::string_view payload, const sockaddr* addr) {
+    if (payload.size() < 16) {
+        stats_.bad_requests++;
+        return;
+    }
+    if (Roll(options_.drop_rate)) {
+        stats_.dropped++;
+        return;
+    }
+    uint32_t action = GetU32(payload.data() + 8);
+    uint32_t transaction_id = GetU32(payload.data() + 12);
+    std::string reply;
+    auto error = [&](absl::string_view message) {
+        reply.clear();
+        PutU32(&reply, 3);
+        PutU32(&reply, transaction_id);
+        absl::StrAppend(&reply, message);
+    };
+
+    if (action == 0) {
+        stats_.connects++;
+        PutU32(&reply, 0);
+        PutU32(&reply, transaction_id);
+        if (GetU64(payload.data()) != kUdpProtocolId) {
+            error("bad protocol id");
+        } else {
+            PutU64(&reply, rng_());
+        }
+    } else if (action == 1) {
+        stats_.announces++;
+        if (payload.size() < 98) {
+            error("announce too short");
+        } else if (Roll(options_.failure_rate)) {
+            stats_.failures++;
+            error("mock tracker failure");
+        } else {
+            absl::string_view info_hash = payload.substr(16, 20);
+            int32_t num_want = static_cast<int32_t>(GetU32(payload.data() + 92));
+            bool ipv6 = addr->sa_family == AF_INET6;
+            size_t swarm = ipv6 ? options_.peers6 : options_.peers;
+            size_t want = std::min({num_want < 0 ? size_t{kDefaultNumWant} : size_t(num_want),
+                                    swarm, kMaxUdpPeers});
+            PutU32(&reply, 1);
+            PutU32(&reply, transaction_id);
+            PutU32(&reply, options_.interval);
+            PutU32(&reply, swarm - swarm / 4);  // leechers
+            PutU32(&reply, swarm / 4);          // seeders
+            reply += CompactPeers(info_hash, want, ipv6);
+        }
+    } else if (action == 2) {
+        stats_.scrapes++;
+        PutU32(&reply, 2);
+        PutU32(&reply, transaction_id);
+        for (size_t offset = 16; offset + 20 <= payload.size(); offset += 20) {
+            PutU32(&reply, options_.peers / 4);
+            PutU32(&reply, Mix(HashOf(payload.substr(offset, 20))) % 10000);
+            PutU32(&reply, options_.peers - options_.peers / 4);
+        }
+    } else {
+        stats_.bad_requests++;
+        error("unknown action");
+    }
+
+    sockaddr_storage to{};
+    memcpy(&to, addr, addr->sa_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in));
+    Delay([this, reply = std::move(reply), to] { SendUdp(reply, to); });
+}
+
+void MockTrackerServer::SendUdp(std::string payload, const sockaddr_storage& addr) {
+    uv_buf_t buf = uv_buf_init(payload.data(), payload.size());
+    // a full send buffer is just another dropped packet
+    if (uv_udp_try_send(udp_.get(), &buf, 1, reinterpret_cast<const sockaddr*>(&addr)) < 0)
+        stats_.dropped++;
+}
+
+}  // namespace ryu
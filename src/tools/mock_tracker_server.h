@@ -0,0 +1,143 @@
+#ifndef RYU_TOOLS_MOCK_TRACKER_SERVER_H
+#define RYU_TOOLS_MOCK_TRACKER_SERVER_H
+
+#include <uv.h>
+
+#include <array>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "result.h"
+#include "utils/uv_write_buf.h"
+
+namespace ryu {
+
+// Tracker answering HTTP (BEP-0003/0023/0048) and UDP (BEP-0015) announces and scrapes with
+// made up swarms, for tests and benchmarks without the network.
+// Peer lists are derived from the info hash, so repeated announces of a torrent see the same
+// swarm. Every reply can be delayed, turned into a failure, or dropped.
+class MockTrackerServer {
+  public:
+    struct Options {
+        std::string bind_ip = "127.0.0.1";
+        // 0 picks a free port, -1 disables the protocol
+        int http_port = 0;
+        int udp_port = 0;
+        // every reply is held back this long
+        uint64_t latency_ms = 0;
+        // fraction of announces answered with a failure reason / BEP-0015 error
+        double failure_rate = 0;
+        // fraction of requests never answered, HTTP connections get closed instead
+        double drop_rate = 0;
+        // swarm size of every torrent, replies hold at most numwant of them
+        size_t peers = 50;
+        // also hand out IPv6 peers, as peers6 over HTTP
+        size_t peers6 = 0;
+        int64_t interval = 1800;
+        int64_t min_interval = 0;
+        uint32_t seed = 1;
+    };
+
+    struct Stats {
+        uint64_t http_requests = 0;
+        uint64_t connects = 0;
+        uint64_t announces = 0;
+        uint64_t scrapes = 0;
+        uint64_t failures = 0;
+        uint64_t dropped = 0;
+        uint64_t bad_requests = 0;
+    };
+
+    MockTrackerServer(uv_loop_t* loop, Options options);
+    MockTrackerServer(const MockTrackerServer&) = delete;
+    MockTrackerServer& operator=(const MockTrackerServer&) = delete;
+
+    Result<ResultVoid, std::string> Start();
+    // Close every socket and drop pending replies, `on_closed` is called once the server can be
+    // destroyed
+    void Halt(std::function<void()> on_closed);
+
+    // Valid after Start()
+    [[nodiscard]] std::string HttpAnnounceUrl() const;
+    [[nodiscard]] std::string UdpAnnounceUrl() const;
+    [[nodiscard]] const Stats& GetStats() const { return stats_; }
+
+    // UV callbacks
+    void NewConnection(uv_stream_t* server, int status);
+    void AllocHttpBuffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+    void HttpDataReceived(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
+    void HttpWriteFinished(uv_write_t* req, int status);
+    void AllocUdpBuffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+    void DatagramReceived(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf,
+                          const sockaddr* addr, unsigned flags);
+    void DelayTimer(uv_timer_t* handle);
+    void HandleClosed(uv_handle_t* handle);
+
+  private:
+    struct HttpConnection : public uv_tcp_t {
+        std::string buffer;
+        std::array<char, 4096> read_buf;
+        // replies waiting in the delay queue
+        int pending = 0;
+        int writes = 0;
+        bool close_after_write = false;
+        bool closing = false;
+        bool closed = false;
+    };
+
+    struct Request {
+        std::string path;
+        std::unordered_multimap<std::string, std::string> query;
+        bool keep_alive = true;
+    };
+
+    // Parse one request off the front of `buffer`. nullopt if it is incomplete, an error if
+    // it is malformed.
+    static Result<std::optional<Request>, std::string> ParseHttpRequest(std::string* buffer);
+    void HandleHttpRequest(HttpConnection* conn, const Request& request);
+    std::string AnnounceBody(absl::string_view info_hash, int64_t num_want);
+    std::string ScrapeBody(const std::vector<std::string>& info_hashes);
+    void SendHttp(HttpConnection* conn, int code, const std::string& body, bool keep_alive);
+    void CloseConnection(HttpConnection* conn);
+
+    void HandleUdpRequest(absl::string_view payload, const sockaddr* addr);
+    void SendUdp(std::string payload, const sockaddr_storage& addr);
+
+    // Run `send` after the configured latency. Latency is constant, so the queue stays sorted.
+    void Delay(std::function<void()> send);
+    bool Roll(double rate);
+    // `count` peers of the torrent, compact form
+    std::string CompactPeers(absl::string_view info_hash, size_t count, bool ipv6);
+    void CheckHalted();
+
+    uv_loop_t* const loop_;
+    const Options options_;
+    std::mt19937 rng_;
+    Stats stats_;
+
+    std::unique_ptr<uv_tcp_t> http_;
+    std::unique_ptr<uv_udp_t> udp_;
+    std::unique_ptr<uv_timer_t> timer_;
+    uint16_t http_port_ = 0;
+    uint16_t udp_port_ = 0;
+    std::array<char, 65536> udp_buf_;
+
+    std::unordered_map<HttpConnection*, std::unique_ptr<HttpConnection>> connections_;
+    std::unordered_map<UvWriteBuf*, std::unique_ptr<UvWriteBuf>> outgoing_;
+    std::deque<std::pair<uint64_t, std::function<void()>>> delayed_;
+
+    bool draining_ = false;
+    int open_handles_ = 0;
+    std::function<void()> on_closed_;
+};
+
+}  // namespace ryu
+
+#endif  // RYU_TOOLS_MOCK_TRACKER_SERVER_H
@@ -0,0 +1,161 @@
+#include "tools/mock_tracker_server.h"
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "trackers.h"
+#include "udp_tracker.h"
+
+using namespace ryu;
+
+namespace {
+
+class MockTrackerServerTest : public ::testing::Test {
+  protected:
+    void SetUp() override { uv_loop_init(&loop_); }
+    void TearDown() override { EXPECT_EQ(0, uv_loop_close(&loop_)); }
+
+    template <typename Pred>
+    bool RunUntil(Pred pred) {
+        for (int i = 0; i < 1000 && !pred(); i++) uv_run(&loop_, UV_RUN_ONCE);
+        return pred();
+    }
+
+    void Shutdown(MockTrackerServer* server, UdpTrackerClient* client) {
+        bool server_closed = false, client_closed = false;
+        server->Halt([&] { server_closed = true; });
+        if (client) {
+            client->Halt([&] { client_closed = true; });
+        } else {
+            client_closed = true;
+        }
+        ASSERT_TRUE(RunUntil([&] { return server_closed && client_closed; }));
+        uv_run(&loop_, UV_RUN_DEFAULT);
+    }
+
+    uv_loop_t loop_;
+};
+
+// Blocking GET, returns the response body
+std::string HttpGet(uint16_t port, const std::string& target) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return "";
+    }
+    std::string request =
+        absl::StrCat("GET ", target, " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    send(fd, request.data(), request.size(), 0);
+    std::string response;
+    char buf[4096];
+    for (ssize_t n; (n = recv(fd, buf, sizeof(buf), 0)) > 0;) response.append(buf, n);
+    close(fd);
+    size_t body = response.find("\r\n\r\n");
+    return body == std::string::npos ? "" : response.substr(body + 4);
+}
+
+TEST_F(MockTrackerServerTest, UdpAnnounceAndScrape) {
+    MockTrackerServer server(&loop_, {.http_port = -1, .peers = 30, .interval = 900});
+    ASSERT_TRUE(server.Start().Ok());
+    UdpTrackerClient client(&loop_);
+    ASSERT_TRUE(client.Start().Ok());
+
+    std::optional<Result<TrackerReply, std::string>> first, second;
+    AnnounceParams params{.info_hash = std::string(20, 'a'), .num_want = 20};
+    client.Announce(server.UdpAnnounceUrl(), params, [&](auto reply) { first = reply; });
+    ASSERT_TRUE(RunUntil([&] { return first.has_value(); }));
+    ASSERT_TRUE(first->Ok()) << first->Error();
+    EXPECT_EQ(900, first->Value().interval);
+    ASSERT_EQ(20u, first->Value().peers.size());
+
+    // same torrent, same swarm
+    client.Announce(server.UdpAnnounceUrl(), params, [&](auto reply) { second = reply; });
+    ASSERT_TRUE(RunUntil([&] { return second.has_value(); }));
+    ASSERT_TRUE(second->Ok());
+    EXPECT_EQ(first->Value().peers[0].endpoint, second->Value().peers[0].endpoint);
+
+    std::optional<Result<ScrapeReply, std::string>> scrape;
+    client.Scrape(server.UdpAnnounceUrl(), {std::string(20, 'a'), std::string(20, 'b')},
+                  [&](auto reply) { scrape = reply; });
+    ASSERT_TRUE(RunUntil([&] { return scrape.has_value(); }));
+    ASSERT_TRUE(scrape->Ok());
+    EXPECT_EQ(2u, scrape->Value().files.size());
+
+    EXPECT_EQ(1u, server.GetStats().connects);
+    EXPECT_EQ(2u, server.GetStats().announces);
+    EXPECT_EQ(1u, server.GetStats().scrapes);
+    Shutdown(&server, &client);
+}
+
+TEST_F(MockTrackerServerTest, UdpFailureAndDrop) {
+    MockTrackerServer failing(&loop_, {.http_port = -1, .failure_rate = 1});
+    MockTrackerServer dropping(&loop_, {.http_port = -1, .drop_rate = 1});
+    ASSERT_TRUE(failing.Start().Ok());
+    ASSERT_TRUE(dropping.Start().Ok());
+    UdpTrackerClient client(&loop_, {.base_timeout_ms = 10, .max_retransmit = 1});
+    ASSERT_TRUE(client.Start().Ok());
+
+    std::optional<Result<TrackerReply, std::string>> failed, dropped;
+    AnnounceParams params{.info_hash = std::string(20, 'a')};
+    client.Announce(failing.UdpAnnounceUrl(), params, [&](auto reply) { failed = reply; });
+    client.Announce(dropping.UdpAnnounceUrl(), params, [&](auto reply) { dropped = reply; });
+    ASSERT_TRUE(RunUntil([&] { return failed.has_value() && dropped.has_value(); }));
+    EXPECT_FALSE(failed->Ok() && failed->Value().failure_reason.empty());
+    EXPECT_FALSE(dropped->Ok());
+    EXPECT_EQ(1u, failing.GetStats().failures);
+    EXPECT_EQ(2u, dropping.GetStats().dropped);
+
+    bool failing_closed = false;
+    failing.Halt([&] { failing_closed = true; });
+    Shutdown(&dropping, &client);
+    EXPECT_TRUE(failing_closed);
+}
+
+TEST_F(MockTrackerServerTest, HttpAnnounceWithLatency) {
+    MockTrackerServer server(&loop_, {.udp_port = -1, .latency_ms = 20, .peers = 5, .peers6 = 3});
+    ASSERT_TRUE(server.Start().Ok());
+    std::string url = server.HttpAnnounceUrl();
+    std::vector<std::string> parts = absl::StrSplit(url, absl::MaxSplits(':', 2));
+    ASSERT_EQ(3u, parts.size());
+    uint32_t port = 0;
+    ASSERT_TRUE(absl::SimpleAtoi(parts[2].substr(0, parts[2].find('/')), &port));
+
+    std::string body;
+    std::atomic<bool> done{false};
+    uint64_t start = uv_now(&loop_);
+    std::thread client([&] {
+        body = HttpGet(port, "/announce?info_hash=%61aaaaaaaaaaaaaaaaaaa&port=6881&compact=1");
+        done = true;
+    });
+    // the client blocks outside the loop, poll instead of waiting on loop events
+    while (!done) {
+        uv_run(&loop_, UV_RUN_NOWAIT);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    client.join();
+    uv_update_time(&loop_);
+    EXPECT_GE(uv_now(&loop_) - start, 20u);
+
+    auto reply = Trackers::ParseAnnounceReply(body);
+    ASSERT_TRUE(reply.Ok()) << reply.Error();
+    EXPECT_EQ(8u, reply.Value().peers.size());
+    EXPECT_EQ(1u, server.GetStats().announces);
+    Shutdown(&server, nullptr);
+}
+
+}  // namespace
@@ -0,0 +1,506 @@
+#include <uv.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "common/bencode.h"
+#include "common/metrics.h"
+#include "common/network.h"
+#include "common/write_queue.h"
+#include "utils/recv_buffer.h"
+#include "utils/uv_callbacks.h"
+
+using namespace std;
+using namespace ryu;
+
+ABSL_FLAG(string, addr, "[::1]:8989", "Daemon RPC address, host:port or unix:<path>");
+ABSL_FLAG(string, protocol, "framed", "framed or text, text only sends pings");
+ABSL_FLAG(int, connections, 1000, "Concurrent connections");
+ABSL_FLAG(int, pipeline, 8, "Requests in flight per connection");
+ABSL_FLAG(int, rate, 0,
+          "Target requests per second over all connections, 0 to send as fast as replies come");
+ABSL_FLAG(vector<string>, methods, {"ping"},
+          "Framed methods sent in turn, without args, e.g. ping,Metrics,SetPriority");
+ABSL_FLAG(int, churn, 0,
+          "Connections replaced per second, half say bye and wait for the daemon to hang up, "
+          "half are closed abruptly");
+ABSL_FLAG(int, duration_s, 10, "How long requests are sent");
+ABSL_FLAG(int, drain_s, 5, "How long to wait for the replies still in flight");
+
+namespace {
+
+// how often requests and churn are paced
+constexpr uint64_t kTickMs = 1;
+constexpr size_t kMaxFrameSize = 1 << 20;
+
+struct Stats {
+    uint64_t connects = 0;
+    uint64_t connect_failures = 0;
+    // by the daemon, including after bye
+    uint64_t hangups = 0;
+    uint64_t byes = 0;
+    uint64_t resets = 0;
+    uint64_t sent = 0;
+    uint64_t replies = 0;
+    uint64_t errors = 0;
+    // in flight on connections closed before their reply
+    uint64_t abandoned = 0;
+    metrics::Histogram latency;
+    metrics::Histogram connect_latency;
+};
+
+// {"id": id, "method": method} as a frame, see rpc_protocol.h
+string Frame(int64_t id, const string& method) {
+    string body = absl::StrCat("d2:idi", id, "e6:method", method.size(), ":", method, "e");
+    uint32_t size = body.size();
+    string frame(4, '\0');
+    for (int i = 0; i < 4; i++) frame[i] = static_cast<char>(size >> (24 - 8 * i));
+    return frame + body;
+}
+
+class Bench;
+
+// One connection to the daemon, owned by Bench
+class Connection {
+  public:
+    Connection(Bench* bench, uv_loop_t* loop, net::BufferPool* pool, bool framed)
+        : bench_(bench), loop_(loop), pool_(pool), framed_(framed) {}
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    void Connect(const string& addr, const sockaddr_storage& storage);
+    // Queue the next request, false if the pipeline is full or the connection not ready
+    bool Issue(size_t pipeline, const string& method);
+    void Flush() { writes_->Flush(); }
+    // Ask the daemon to hang up, through its Halt() and drain paths
+    void Bye();
+    // Close without a word, what is in flight is abandoned
+    void Close();
+
+    [[nodiscard]] bool Ready() const { return state_ == State::READY; }
+    [[nodiscard]] bool WasConnected() const { return was_connected_; }
+    [[nodiscard]] size_t InFlight() const {
+        return framed_in_flight_.size() + text_in_flight_.size();
+    }
+
+    // UV callbacks
+    void Connected(uv_connect_t* req, int status);
+    void Alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+    void Read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
+    void Closed(uv_handle_t* handle);
+
+  private:
+    enum class State { CONNECTING, READY, BYE, CLOSED };
+
+    void Reply(string_view body);
+
+    Bench* const bench_;
+    uv_loop_t* const loop_;
+    net::BufferPool* const pool_;
+    const bool framed_;
+    union {
+        uv_handle_t handle_;
+        uv_stream_t stream_;
+        uv_tcp_t tcp_;
+        uv_pipe_t pipe_;
+    };
+    uv_connect_t connect_req_;
+    uint64_t connect_start_ns_ = 0;
+    State state_ = State::CONNECTING;
+    bool was_connected_ = false;
+    RecvBuffer recv_{4096, 4 + kMaxFrameSize};
+    unique_ptr<net::WriteQueue> writes_;
+    int64_t next_id_ = 1;
+    // send time by request id
+    unordered_map<int64_t, uint64_t> framed_in_flight_;
+    // send time of each ping, answered in order
+    deque<uint64_t> text_in_flight_;
+};
+
+// Keeps `connections` open and requests flowing through them, closed loop or paced at `rate`
+class Bench {
+  public:
+    explicit Bench(uv_loop_t* loop) : loop_(loop) {}
+
+    Result<ResultVoid, string> Start();
+    void Report(double seconds);
+
+    // Called by Connection
+    void Connected(Connection* conn, bool ok);
+    void Replied(Connection* conn);
+    void Released(Connection* conn);
+    Stats& stats() { return stats_; }
+
+    // UV callback
+    void Tick(uv_timer_t* handle);
+
+  private:
+    void Open();
+    void Pace(uint64_t elapsed_ms);
+    void Churn(uint64_t elapsed_ms);
+    void Unready(Connection* conn);
+    // Close every connection, uv_run() returns once they are gone
+    void CloseAll();
+    const string& NextMethod();
+    [[nodiscard]] uint64_t InFlight() const {
+        return stats_.sent - stats_.replies - stats_.abandoned;
+    }
+
+    uv_loop_t* const loop_;
+    string addr_;
+    sockaddr_storage storage_ = {};
+    bool framed_ = true;
+    size_t target_connections_ = 0;
+    size_t pipeline_ = 0;
+    uint64_t rate_ = 0;
+    uint64_t churn_ = 0;
+    vector<string> methods_;
+    size_t next_method_ = 0;
+
+    net::BufferPool pool_;
+    unordered_map<Connection*, unique_ptr<Connection>> connections_;
+    // connected, requests are paced over them in turn
+    vector<Connection*> ready_;
+    size_t next_ready_ = 0;
+    uv_timer_t timer_;
+    uint64_t start_ms_ = 0;
+    uint64_t last_tick_ms_ = 0;
+    uint64_t drain_deadline_ms_ = 0;
+    double request_budget_ = 0;
+    double churn_budget_ = 0;
+    uint64_t churned_ = 0;
+    bool sending_ = true;
+    bool closing_ = false;
+    mt19937 rng_{random_device()()};
+    Stats stats_;
+};
+
+void Connection::Connect(const string& addr, const sockaddr_storage& storage) {
+    connect_req_.data = this;
+    connect_start_ns_ = uv_hrtime();
+    int retcode = 0;
+    if (absl::StartsWith(addr, "unix:")) {
+        uv_pipe_init(loop_, &pipe_, 0);
+        uv_pipe_connect(&connect_req_, &pipe_, addr.substr(5).c_str(),
+                        uv_callbacks::Connect<&Connection::Connected>);
+    } else {
+        uv_tcp_init(loop_, &tcp_);
+        uv_tcp_nodelay(&tcp_, 1);
+        retcode = uv_tcp_connect(&connect_req_, &tcp_, reinterpret_cast<const sockaddr*>(&storage),
+                                 uv_callbacks::Connect<&Connection::Connected>);
+    }
+    handle_.data = this;
+    writes_ = make_unique<net::WriteQueue>(&stream_, pool_, net::WriteQueue::Options{}, nullptr);
+    if (retcode) Connected(&connect_req_, retcode);
+}
+
+void Connection::Connected(uv_connect_t* req, int status) {
+    // cancelled by Close()
+    if (state_ == State::CLOSED) return;
+    if (status != 0) {
+        state_ = State::CLOSED;
+        bench_->Connected(this, false);
+        uv_close(&handle_, uv_callbacks::Close<&Connection::Closed>);
+        return;
+    }
+    bench_->stats().connect_latency.Record(uv_hrtime() - connect_start_ns_);
+    uv_read_start(&stream_, uv_callbacks::Alloc<&Connection::Alloc>,
+                  uv_callbacks::Read<&Connection::Read>);
+    state_ = State::READY;
+    was_connected_ = true;
+    bench_->Connected(this, true);
+}
+
+bool Connection::Issue(size_t pipeline, const string& method) {
+    if (!Ready() || InFlight() >= pipeline) return false;
+    uint64_t now = uv_hrtime();
+    if (framed_) {
+        int64_t id = next_id_++;
+        framed_in_flight_[id] = now;
+        writes_->Write(Frame(id, method));
+    } else {
+        text_in_flight_.push_back(now);
+        writes_->Write("ping\n");
+    }
+    bench_->stats().sent++;
+    return true;
+}
+
+void Connection::Bye() {
+    if (!Ready()) return;
+    state_ = State::BYE;
+    // answered, then the daemon shuts down its side and we read EOF
+    writes_->Write(framed_ ? Frame(0, "bye") : "bye\n");
+    writes_->Flush();
+}
+
+void Connection::Close() {
+    if (state_ == State::CLOSED) return;
+    state_ = State::CLOSED;
+    bench_->stats().abandoned += InFlight();
+    framed_in_flight_.clear();
+    text_in_flight_.clear();
+    uv_close(&handle_, uv_callbacks::Close<&Connection::Closed>);
+}
+
+void Connection::Alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    recv_.Prepare(buf);
+}
+
+void Connection::Read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+    if (nread < 0) {
+        bench_->stats().hangups++;
+        Close();
+        return;
+    }
+    recv_.Commit(nread);
+    if (framed_) {
+        recv_.ForEachFrame(kMaxFrameSize, [this](string_view body) {
+            Reply(body);
+            return state_ != State::CLOSED;
+        });
+    } else {
+        recv_.ForEachLine([this](string_view line) {
+            Reply(line);
+            return state_ != State::CLOSED;
+        });
+    }
+    // the requests issued by the replies go out together
+    if (state_ != State::CLOSED) writes_->Flush();
+}
+
+void Connection::Reply(string_view body) {
+    Stats& stats = bench_->stats();
+    uint64_t sent_ns;
+    if (framed_) {
+        size_t idx = 0;
+        auto reply = bencode::BencodeObject::Parse(body, &idx);
+        if (!reply) {
+            stats.errors++;
+            return;
+        }
+        auto id = (*reply.Value())["id"].GetInt();
+        auto iter = id ? framed_in_flight_.find(*id) : framed_in_flight_.end();
+        // the reply to bye
+        if (iter == framed_in_flight_.end()) return;
+        sent_ns = iter->second;
+        framed_in_flight_.erase(iter);
+        if (reply.Value()->Contains("error")) stats.errors++;
+    } else {
+        if (text_in_flight_.empty()) return;
+        sent_ns = text_in_flight_.front();
+        text_in_flight_.pop_front();
+        if (body != "pong") stats.errors++;
+    }
+    stats.replies++;
+    stats.latency.Record(uv_hrtime() - sent_ns);
+    bench_->Replied(this);
+}
+
+void Connection::Closed(uv_handle_t* handle) {
+    // deletes this
+    bench_->Released(this);
+}
+
+Result<ResultVoid, string> Bench::Start() {
+    addr_ = absl::GetFlag(FLAGS_addr);
+    if (!absl::StartsWith(addr_, "unix:")) {
+        VALUE_OR_RAISE(net::ParseAddrPort(addr_, &storage_, 8989));
+    }
+    framed_ = absl::GetFlag(FLAGS_protocol) != "text";
+    target_connections_ = max(1, absl::GetFlag(FLAGS_connections));
+    pipeline_ = max(1, absl::GetFlag(FLAGS_pipeline));
+    rate_ = max(0, absl::GetFlag(FLAGS_rate));
+    churn_ = max(0, absl::GetFlag(FLAGS_churn));
+    methods_ = absl::GetFlag(FLAGS_methods);
+    if (methods_.empty()) methods_ = {"ping"};
+
+    uv_timer_init(loop_, &timer_);
+    timer_.data = this;
+    start_ms_ = last_tick_ms_ = uv_now(loop_);
+    uv_timer_start(&timer_, uv_callbacks::Timer<&Bench::Tick>, kTickMs, kTickMs);
+    for (size_t i = 0; i < target_connections_; i++) Open();
+    return {};
+}
+
+void Bench::Open() {
+    auto conn = make_unique<Connection>(this, loop_, &pool_, framed_);
+    Connection* ptr = conn.get();
+    connections_[ptr] = std::move(conn);
+    ptr->Connect(addr_, storage_);
+}
+
+const string& Bench::NextMethod() {
+    const string& method = methods_[next_method_];
+    next_method_ = (next_method_ + 1) % methods_.size();
+    return method;
+}
+
+void Bench::Connected(Connection* conn, bool ok) {
+    if (!ok) {
+        stats_.connect_failures++;
+        return;
+    }
+    stats_.connects++;
+    if (closing_) {
+        conn->Close();
+        return;
+    }
+    ready_.push_back(conn);
+    if (rate_ > 0 || !sending_) return;
+    // closed loop, every reply sends the next request
+    while (conn->Issue(pipeline_, NextMethod())) {
+    }
+    conn->Flush();
+}
+
+void Bench::Replied(Connection* conn) {
+    if (rate_ == 0 && sending_) conn->Issue(pipeline_, NextMethod());
+}
+
+void Bench::Released(Connection* conn) {
+    Unready(conn);
+    bool replace = conn->WasConnected() && sending_ && !closing_;
+    connections_.erase(conn);
+    if (replace) Open();
+    if (closing_ && connections_.empty()) {
+        uv_close(reinterpret_cast<uv_handle_t*>(&timer_), nullptr);
+    }
+}
+
+void Bench::Unready(Connection* conn) {
+    auto iter = find(ready_.begin(), ready_.end(), conn);
+    if (iter == ready_.end()) return;
+    *iter = ready_.back();
+    ready_.pop_back();
+}
+
+void Bench::Tick(uv_timer_t* handle) {
+    uint64_t now = uv_now(loop_);
+    uint64_t elapsed = now - last_tick_ms_;
+    last_tick_ms_ = now;
+    if (closing_) return;
+    uint64_t duration_ms = max(0, absl::GetFlag(FLAGS_duration_s)) * 1000;
+    if (sending_ && now - start_ms_ >= duration_ms) {
+        sending_ = false;
+        drain_deadline_ms_ = now + max(0, absl::GetFlag(FLAGS_drain_s)) * 1000;
+    }
+    if (!sending_) {
+        if (InFlight() == 0 || now >= drain_deadline_ms_) CloseAll();
+        return;
+    }
+    if (rate_ > 0) Pace(elapsed);
+    if (churn_ > 0) Churn(elapsed);
+}
+
+void Bench::Pace(uint64_t elapsed_ms) {
+    // a stalled loop catches up by at most a tenth of a second
+    request_budget_ = min(request_budget_ + rate_ * elapsed_ms / 1000.0,
+                          max(1.0, rate_ / 10.0));
+    vector<Connection*> touched;
+    size_t misses = 0;
+    while (request_budget_ >= 1 && !ready_.empty() && misses < ready_.size()) {
+        next_ready_ = (next_ready_ + 1) % ready_.size();
+        Connection* conn = ready_[next_ready_];
+        if (!conn->Issue(pipeline_, NextMethod())) {
+            misses++;
+            continue;
+        }
+        misses = 0;
+        request_budget_--;
+        touched.push_back(conn);
+    }
+    // every connection's requests of this tick in one write
+    sort(touched.begin(), touched.end());
+    touched.erase(unique(touched.begin(), touched.end()), touched.end());
+    for (Connection* conn : touched) conn->Flush();
+}
+
+void Bench::Churn(uint64_t elapsed_ms) {
+    churn_budget_ = min(churn_budget_ + churn_ * elapsed_ms / 1000.0, max(1.0, churn_ / 10.0));
+    while (churn_budget_ >= 1 && !ready_.empty()) {
+        churn_budget_--;
+        Connection* conn = ready_[uniform_int_distribution<size_t>(0, ready_.size() - 1)(rng_)];
+        // replaced once closed
+        Unready(conn);
+        if (churned_++ % 2 == 0) {
+            stats_.byes++;
+            conn->Bye();
+        } else {
+            stats_.resets++;
+            conn->Close();
+        }
+    }
+}
+
+void Bench::CloseAll() {
+    closing_ = true;
+    uv_timer_stop(&timer_);
+    if (connections_.empty()) {
+        uv_close(reinterpret_cast<uv_handle_t*>(&timer_), nullptr);
+        return;
+    }
+    vector<Connection*> all;
+    for (auto& [conn, ptr] : connections_) all.push_back(conn);
+    // connects in progress are cancelled
+    for (Connection* conn : all) conn->Close();
+}
+
+void Bench::Report(double seconds) {
+    auto ms = [](const metrics::Histogram& histogram, double q) {
+        return histogram.Snap().Quantile(q) / 1e6;
+    };
+    cout << absl::StrFormat("connections: %d opened, %d failed, %d hung up by the daemon",
+                            stats_.connects, stats_.connect_failures, stats_.hangups)
+         << endl;
+    cout << absl::StrFormat("churn: %d byes, %d resets", stats_.byes, stats_.resets) << endl;
+    cout << absl::StrFormat("requests: %d sent, %d replies, %d errors, %d abandoned in %.3fs",
+                            stats_.sent, stats_.replies, stats_.errors, stats_.abandoned, seconds)
+         << endl;
+    cout << absl::StrFormat("throughput: %.1f replies/s", stats_.replies / seconds) << endl;
+    // bucket upper bounds, within 12.5%
+    cout << absl::StrFormat("latency ms: p50=%.3f p99=%.3f p99.9=%.3f max=%.3f",
+                            ms(stats_.latency, 0.5), ms(stats_.latency, 0.99),
+                            ms(stats_.latency, 0.999), ms(stats_.latency, 1))
+         << endl;
+    cout << absl::StrFormat("connect ms: p50=%.3f p99=%.3f p99.9=%.3f",
+                            ms(stats_.connect_latency, 0.5), ms(stats_.connect_latency, 0.99),
+                            ms(stats_.connect_latency, 0.999))
+         << endl;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    absl::SetProgramUsageMessage(
+        "[--addr host:port|unix:path] [--connections N] [--pipeline N] [--rate N] [--churn N] "
+        "[--methods ping,Metrics]");
+    absl::ParseCommandLine(argc, argv);
+
+    uv_loop_t* loop = uv_default_loop();
+    Bench bench(loop);
+    bench.Start().Expect("failed to start");
+    cout << absl::StrFormat("Benchmarking %s with %d connections, %d in flight each",
+                            absl::GetFlag(FLAGS_addr), absl::GetFlag(FLAGS_connections),
+                            absl::GetFlag(FLAGS_pipeline))
+         << endl;
+
+    auto start = chrono::steady_clock::now();
+    uv_run(loop, UV_RUN_DEFAULT);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    bench.Report(seconds);
+    return 0;
+}
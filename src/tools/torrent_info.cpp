@@ -26,6 +26,7 @@ ABSL_FLAG(bool, dump_json, false, "Only dump json of the torrent file");
 ABSL_FLAG(bool, show_piece_hash, false, "Display hash for all pieces");
 ABSL_FLAG(string, verify, "", "File or folder to verify against the torrent");
 ABSL_FLAG(int, query_peers, -1, "Query Nth tracker for peer list");
+ABSL_FLAG(int, scrape, -1, "Scrape Nth tracker for seeder and leecher counts");
 
 void work(string path) {
     if (absl::GetFlag(FLAGS_dump_json)) {
@@ -92,14 +93,31 @@ void work(string path) {
                     string pid = tracker_reply.peers[i].peer_id.empty()
                                      ? string("(----no-peer-id----)")
                                      : tracker_reply.peers[i].peer_id;
-                    cout << absl::StrFormat("Peer #%03u %s port=% 5u %s", i + 1, pid,
-                                            tracker_reply.peers[i].port, tracker_reply.peers[i].ip)
+                    cout << absl::StrFormat("Peer #%03u %s %s", i + 1, pid,
+                                            tracker_reply.peers[i].endpoint.ToString())
                          << endl;
                 }
             } else {
                 cout << "Tracker failure: " << tracker_reply.failure_reason << endl;
             }
         }
+        if (absl::GetFlag(FLAGS_scrape) >= 0) {
+            int idx = absl::GetFlag(FLAGS_scrape);
+            string announce = (idx == 0) ? torrent.announce() : torrent.announce_list()->at(idx-1)[0];
+            cout << "Scraping: " << announce << endl;
+            ScrapeCache cache;
+            auto files = Trackers::Scrape(announce, {torrent.GetInfoHash()}, &cache)
+                             .Expect("unable to scrape tracker");
+            auto iter = files.find(torrent.GetInfoHash());
+            if (iter == files.end()) {
+                cout << "Torrent unknown to tracker" << endl;
+            } else {
+                cout << absl::StrFormat("Seeders: %d Leechers: %d Completed: %d",
+                                        iter->second.seeders, iter->second.leechers,
+                                        iter->second.completed)
+                     << endl;
+            }
+        }
     }
 }
 
@@ -0,0 +1,192 @@
+#include <uv.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_format.h"
+#include "tools/mock_tracker_server.h"
+#include "trackers.h"
+#include "udp_tracker.h"
+
+using namespace std;
+using namespace ryu;
+
+ABSL_FLAG(string, url, "", "Tracker announce url, empty to benchmark an in-process mock tracker");
+ABSL_FLAG(string, protocol, "udp", "udp or http, protocol of the in-process mock tracker");
+ABSL_FLAG(int, announces, 10000, "Total number of announces");
+ABSL_FLAG(int, concurrency, 64, "Announces in flight");
+ABSL_FLAG(int, torrents, 1000, "Number of distinct info hashes");
+ABSL_FLAG(int, udp_timeout_ms, 1000, "First UDP retransmit timeout");
+ABSL_FLAG(int, latency_ms, 0, "In-process mock tracker reply delay");
+ABSL_FLAG(double, failure_rate, 0, "In-process mock tracker failure rate");
+ABSL_FLAG(double, drop_rate, 0, "In-process mock tracker drop rate");
+ABSL_FLAG(int, peers, 50, "In-process mock tracker swarm size");
+
+namespace {
+
+struct Sample {
+    uint64_t latency_ns;
+    bool ok;
+};
+
+AnnounceParams MakeParams(int i) {
+    int torrents = max(1, absl::GetFlag(FLAGS_torrents));
+    string info_hash(20, '\0');
+    uint64_t n = static_cast<uint64_t>(i % torrents) * 0x9E3779B97F4A7C15ULL;
+    memcpy(info_hash.data(), &n, sizeof(n));
+    return AnnounceParams{.info_hash = info_hash, .left = 1 << 20, .event = AnnounceEvent::NONE};
+}
+
+// Announces over UdpTrackerClient on one loop, `concurrency` in flight
+vector<Sample> RunUdp(const string& url, int total, int concurrency) {
+    uv_loop_t loop;
+    uv_loop_init(&loop);
+    UdpTrackerClient client(
+        &loop, UdpTrackerClient::Options{
+                   .base_timeout_ms = static_cast<uint64_t>(absl::GetFlag(FLAGS_udp_timeout_ms)),
+                   .max_retransmit = 2,
+               });
+    client.Start().Expect("failed to start udp tracker client");
+
+    vector<Sample> samples;
+    samples.reserve(total);
+    int issued = 0;
+    function<void()> issue = [&] {
+        int i = issued++;
+        uint64_t start = uv_hrtime();
+        client.Announce(url, MakeParams(i), [&, start](Result<TrackerReply, string> reply) {
+            samples.push_back(
+                Sample{uv_hrtime() - start, reply.Ok() && reply.Value().failure_reason.empty()});
+            if (issued < total) {
+                issue();
+            } else if (static_cast<int>(samples.size()) == total) {
+                client.Halt([] {});
+            }
+        });
+    };
+    for (int i = 0; i < min(concurrency, total); i++) issue();
+    uv_run(&loop, UV_RUN_DEFAULT);
+    uv_loop_close(&loop);
+    return samples;
+}
+
+// Blocking announces over pooled HTTP sessions, one thread per request in flight
+vector<Sample> RunHttp(const string& url, int total, int concurrency) {
+    atomic<int> next{0};
+    vector<vector<Sample>> per_thread(concurrency);
+    vector<thread> threads;
+    for (int t = 0; t < concurrency; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = next++; i < total; i = next++) {
+                auto start = chrono::steady_clock::now();
+                auto reply = Trackers::Announce(url, MakeParams(i));
+                uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(
+                                  chrono::steady_clock::now() - start)
+                                  .count();
+                per_thread[t].push_back(
+                    Sample{ns, reply.Ok() && reply.Value().failure_reason.empty()});
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    vector<Sample> samples;
+    for (auto& s : per_thread) samples.insert(samples.end(), s.begin(), s.end());
+    return samples;
+}
+
+// Mock tracker on a loop of its own, stopped through an async handle
+class BackgroundTracker {
+  public:
+    explicit BackgroundTracker(MockTrackerServer::Options options) {
+        uv_loop_init(&loop_);
+        server_ = make_unique<MockTrackerServer>(&loop_, options);
+        server_->Start().Expect("failed to start mock tracker");
+        stop_.data = this;
+        uv_async_init(&loop_, &stop_, [](uv_async_t* handle) {
+            auto* self = static_cast<BackgroundTracker*>(handle->data);
+            self->server_->Halt([] {});
+            uv_close(reinterpret_cast<uv_handle_t*>(handle), nullptr);
+        });
+        thread_ = thread([this] { uv_run(&loop_, UV_RUN_DEFAULT); });
+    }
+    ~BackgroundTracker() {
+        uv_async_send(&stop_);
+        thread_.join();
+        uv_loop_close(&loop_);
+    }
+    MockTrackerServer& server() { return *server_; }
+
+  private:
+    uv_loop_t loop_;
+    uv_async_t stop_;
+    unique_ptr<MockTrackerServer> server_;
+    thread thread_;
+};
+
+void Report(vector<Sample> samples, double seconds) {
+    size_t ok = count_if(samples.begin(), samples.end(), [](const Sample& s) { return s.ok; });
+    vector<uint64_t> latency;
+    latency.reserve(samples.size());
+    for (const auto& s : samples) latency.push_back(s.latency_ns);
+    sort(latency.begin(), latency.end());
+    auto percentile = [&](double p) {
+        if (latency.empty()) return 0.0;
+        size_t idx = min(latency.size() - 1, static_cast<size_t>(p / 100 * latency.size()));
+        return latency[idx] / 1e6;
+    };
+    cout << absl::StrFormat("announces: %d ok, %d failed in %.3fs", ok, samples.size() - ok,
+                            seconds)
+         << endl;
+    cout << absl::StrFormat("throughput: %.1f announces/s", samples.size() / seconds) << endl;
+    cout << absl::StrFormat("latency ms: p50=%.3f p90=%.3f p99=%.3f p99.9=%.3f max=%.3f",
+                            percentile(50), percentile(90), percentile(99), percentile(99.9),
+                            latency.empty() ? 0.0 : latency.back() / 1e6)
+         << endl;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    absl::SetProgramUsageMessage(
+        "[--url udp://host:port/announce | --protocol udp|http] [--announces N] "
+        "[--concurrency N]");
+    absl::ParseCommandLine(argc, argv);
+    int total = absl::GetFlag(FLAGS_announces);
+    int concurrency = max(1, absl::GetFlag(FLAGS_concurrency));
+    string url = absl::GetFlag(FLAGS_url);
+
+    unique_ptr<BackgroundTracker> mock;
+    if (url.empty()) {
+        bool udp = absl::GetFlag(FLAGS_protocol) == "udp";
+        mock = make_unique<BackgroundTracker>(MockTrackerServer::Options{
+            .http_port = udp ? -1 : 0,
+            .udp_port = udp ? 0 : -1,
+            .latency_ms = static_cast<uint64_t>(max(0, absl::GetFlag(FLAGS_latency_ms))),
+            .failure_rate = absl::GetFlag(FLAGS_failure_rate),
+            .drop_rate = absl::GetFlag(FLAGS_drop_rate),
+            .peers = static_cast<size_t>(max(0, absl::GetFlag(FLAGS_peers))),
+        });
+        url = udp ? mock->server().UdpAnnounceUrl() : mock->server().HttpAnnounceUrl();
+    }
+    cout << absl::StrFormat("Announcing %d times to %s, %d in flight", total, url, concurrency)
+         << endl;
+
+    auto start = chrono::steady_clock::now();
+    vector<Sample> samples = absl::StartsWith(url, "udp://") ? RunUdp(url, total, concurrency)
+                                                             : RunHttp(url, total, concurrency);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    Report(std::move(samples), seconds);
+    return 0;
+}
@@ -70,6 +70,8 @@ class TorrentFile {
                 absl::StrFormat("hash index %u out of bound, max %u", index, GetPieceCount()));
         return hash_pool_.substr(index * HASH_LENGTH, HASH_LENGTH);
     }
+    // every piece hash, one after the other
+    [[nodiscard]] const std::string& GetPieceHashes() const { return hash_pool_; }
     [[nodiscard]] std::string GetPieceHexHash(size_t index) const {
         return ToHex(GetPieceHash(index));
     }
@@ -1,39 +1,98 @@
 #include "trackers.h"
 
+#include <algorithm>
+#include <unordered_set>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
+#include "absl/time/clock.h"
 #include "common/bencode.h"
 #include "common/network.h"
+#include "http_session_pool.h"
+#include "udp_tracker.h"
 
 namespace ryu {
 using namespace ::ryu::bencode;
 
 namespace {
-using net::IpAddress;
-struct CompactIpv4Peer {
-    uint32_t be_ipv4;
-    uint16_t be_port;
-    [[nodiscard]] PeerInfo ToPeerInfo() const {
-        return {
-            .ip = net::IpAddress::FromBe32(be_ipv4).ToString().Expect("Failed to convert IPv4"),
-            .port = be16toh(be_port),
-        };
+// requests run on shared threadpool threads, a hung tracker must not hold one for long
+constexpr long kHttpConnectTimeoutMs = 10000;
+constexpr long kHttpTimeoutMs = 30000;
+
+std::string UrlEncode(absl::string_view str) {
+    static constexpr char kHex[] = "0123456789ABCDEF";
+    std::string ret;
+    ret.reserve(str.size() * 3);
+    for (unsigned char c : str) {
+        if (absl::ascii_isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            ret.push_back(c);
+        } else {
+            ret.push_back('%');
+            ret.push_back(kHex[c >> 4]);
+            ret.push_back(kHex[c & 0xF]);
+        }
     }
-} __attribute__((packed));
-static_assert(sizeof(CompactIpv4Peer) == 6);
+    return ret;
+}
 
-struct CompactIpv6Peer {
-    uint8_t be_ipv6[16];
-    uint16_t be_port;
-    [[nodiscard]] PeerInfo ToPeerInfo() const {
-        return {
-            .ip = net::IpAddress::FromBe128(be_ipv6).ToString().Expect("Failed to convert IPv6"),
-            .port = be16toh(be_port),
-        };
+// Point an http:// url at `ip`, keeping the port. The original host:port is returned in
+// `host_header`, since virtual hosted trackers still need it.
+std::string PinHttpHost(const std::string& url, const net::IpAddress& ip,
+                        std::string* host_header) {
+    constexpr absl::string_view kScheme = "http://";
+    size_t start = kScheme.size();
+    size_t end = std::min(url.size(), url.find_first_of("/?#", start));
+    absl::string_view authority = absl::string_view(url).substr(start, end - start);
+    if (size_t at = authority.rfind('@'); at != absl::string_view::npos) {
+        start += at + 1;
+        authority.remove_prefix(at + 1);
     }
-} __attribute__((packed));
-static_assert(sizeof(CompactIpv6Peer) == 18);
+    // port follows the last colon, unless it's inside an IPv6 literal
+    uint16_t port = 80;
+    size_t colon = authority.rfind(':');
+    if (colon != absl::string_view::npos && authority.find(']', colon) == absl::string_view::npos) {
+        uint32_t parsed;
+        if (absl::SimpleAtoi(authority.substr(colon + 1), &parsed) && parsed <= 65535)
+            port = parsed;
+    }
+    *host_header = std::string(authority);
+    return absl::StrCat(url.substr(0, start), net::Endpoint(ip, port).ToString(), url.substr(end));
+}
+
+void SetTimeouts(cpr::Session& session) {
+    session.SetConnectTimeout(cpr::ConnectTimeout{kHttpConnectTimeoutMs});
+    session.SetTimeout(cpr::Timeout{kHttpTimeoutMs});
+}
 }  // namespace
 
+std::optional<ScrapeInfo> ScrapeCache::Get(const std::string& tracker,
+                                           const std::string& info_hash, absl::Time now) const {
+    auto t = trackers_.find(tracker);
+    if (t == trackers_.end()) return {};
+    auto f = t->second.files.find(info_hash);
+    if (f == t->second.files.end() || f->second.expires <= now) return {};
+    return f->second.info;
+}
+
+void ScrapeCache::Put(const std::string& tracker, const ScrapeReply& reply, absl::Time now) {
+    absl::Time expires =
+        now + (reply.interval > 0 ? absl::Seconds(reply.interval) : kDefaultInterval);
+    auto& files = trackers_[tracker].files;
+    for (const auto& [info_hash, info] : reply.files) files[info_hash] = Entry{info, expires};
+}
+
+size_t ScrapeCache::BatchLimit(const std::string& tracker) const {
+    auto t = trackers_.find(tracker);
+    return t == trackers_.end() ? kDefaultBatchLimit : t->second.batch_limit;
+}
+
+void ScrapeCache::SetBatchLimit(const std::string& tracker, size_t limit) {
+    trackers_[tracker].batch_limit = std::max<size_t>(limit, 1);
+}
+
 Result<PeerInfo, std::string> PeerInfo::FromTrackerReply(const BencodeMap* map_ptr) {
     const BencodeMap& map = *map_ptr;
 
@@ -48,10 +107,10 @@ Result<PeerInfo, std::string> PeerInfo::FromTrackerReply(const BencodeMap* map_p
         absl::StrCat("tracker replied peer dict missing port: ", map.Json().Expect("")));
     if (port < 0 || port >= 65536)
         return Err(absl::StrCat("tracker replied peer port out of range: ", port));
+    auto addr = VALUE_OR_RAISE(net::IpAddress::FromString(ip));
     return PeerInfo{
         .peer_id = peer_id,
-        .ip = ip,
-        .port = static_cast<uint16_t>(port),
+        .endpoint = net::Endpoint(addr, static_cast<uint16_t>(port)),
     };
 }
 
@@ -60,23 +119,19 @@ Result<std::vector<PeerInfo>, std::string> Trackers::ParsePeerInfoList(const Ben
 
     // peers
     if (!reply.Contains("peers")) return Err("tracker reply missing peers");
+    const std::optional<std::string> peers6 = reply["peers6"].GetString();
     if (reply["peers"].IsString()) {
         // BEP-0023 compact IPv4 peer list
-        std::string peer_list = reply["peers"].GetString().value();
-
-        if (peer_list.size() % sizeof(CompactIpv4Peer) != 0)
-            return Err(absl::StrFormat(
-                "tracker replied compact list size incorrect: %u is not a multiple of %u",
-                peer_list.size(), sizeof(CompactIpv4Peer)));
-        size_t length = peer_list.size() / sizeof(CompactIpv4Peer);
-        const auto* arr = reinterpret_cast<const CompactIpv4Peer*>(peer_list.data());
-        for (size_t i = 0; i < length; i++) ret.push_back(arr[i].ToPeerInfo());
+        const std::string& peers = reply["peers"].GetString().value();
+        ret.reserve(peers.size() / net::Endpoint::COMPACT_IPV4_SIZE +
+                    (peers6 ? peers6->size() / net::Endpoint::COMPACT_IPV6_SIZE : 0));
+        VALUE_OR_RAISE(ParseCompactPeers(peers, net::AddressType::IPv4, &ret));
     } else if (reply["peers"].IsList()) {
         // BEP-0003
         const BencodeList* list = dynamic_cast<const BencodeList*>(&reply["peers"]);
         if (list == nullptr) return Err("tracker replied peers is neither string nor list");
         for (size_t i = 0; i < list->Size(); i++) {
-            const auto& map = list[i];
+            const auto& map = (*list)[i];
             if (!map.IsMap()) {
                 return Err("tracker replied peer list contains non-map: " +
                            VALUE_OR_RAISE(map.Json()));
@@ -90,33 +145,100 @@ Result<std::vector<PeerInfo>, std::string> Trackers::ParsePeerInfoList(const Ben
     }
 
     // peers6, compact only, BEP-0007
-    const std::optional<std::string> peers6 = reply["peers6"].GetString();
-    if (peers6) {
-        if (peers6->size() % sizeof(CompactIpv6Peer) != 0)
-            return Err(absl::StrFormat(
-                "tracker replied peers6 compact list size incorrect: %u is not a multiple of %u",
-                peers6->size(), sizeof(CompactIpv6Peer)));
-        size_t length = peers6->size() / sizeof(CompactIpv4Peer);
-        const auto* arr = reinterpret_cast<const CompactIpv4Peer*>(peers6->data());
-        for (size_t i = 0; i < length; i++) ret.push_back(arr[i].ToPeerInfo());
-    }
+    if (peers6) VALUE_OR_RAISE(ParseCompactPeers(*peers6, net::AddressType::IPv6, &ret));
 
+    // trackers may list a peer twice, e.g. once in peers and once as a v4-mapped peers6 entry
+    std::unordered_set<net::Endpoint> seen;
+    DedupPeers(&ret, &seen);
     return ret;
 }
+
+Result<ResultVoid, std::string> Trackers::ParseCompactPeers(absl::string_view data,
+                                                           net::AddressType type,
+                                                           std::vector<PeerInfo>* out) {
+    const bool v4 = type == net::AddressType::IPv4;
+    const size_t entry_size =
+        v4 ? net::Endpoint::COMPACT_IPV4_SIZE : net::Endpoint::COMPACT_IPV6_SIZE;
+    if (data.size() % entry_size != 0)
+        return Err(absl::StrFormat(
+            "tracker replied %s compact list size incorrect: %u is not a multiple of %u",
+            v4 ? "peers" : "peers6", data.size(), entry_size));
+    size_t count = data.size() / entry_size;
+    out->reserve(out->size() + count);
+    const char* p = data.data();
+    for (size_t i = 0; i < count; i++, p += entry_size) {
+        out->push_back(PeerInfo{
+            .endpoint = v4 ? net::Endpoint::FromCompactIpv4(p) : net::Endpoint::FromCompactIpv6(p),
+        });
+    }
+    return {};
+}
+
+void Trackers::DedupPeers(std::vector<PeerInfo>* peers, std::unordered_set<net::Endpoint>* seen) {
+    auto new_end = std::remove_if(peers->begin(), peers->end(), [seen](const PeerInfo& peer) {
+        return !seen->insert(peer.endpoint).second;
+    });
+    peers->erase(new_end, peers->end());
+}
+
 Result<TrackerReply, std::string> Trackers::GetPeers(const std::string& announce,
                                                      const std::string& info_hash,
                                                      uint64_t left_bytes) {
     if (info_hash.size() != 20) return Err("invalid info_hash");
-    cpr::Response rsp =
-        cpr::Get(cpr::Url{announce}, cpr::Parameters{{"info_hash", info_hash},
-                                                     {"peer_id", "-RY0000-0123456789ab"},
-                                                     {"port", "6881"},
-                                                     {"uploaded", "0"},
-                                                     {"downloaded", "0"},
-                                                     {"left", absl::StrCat(left_bytes)},
-                                                     {"event", "started"}});
+    AnnounceParams params{.info_hash = info_hash, .left = left_bytes};
+    auto ret = Announce(announce, params);
+    // cleanup tracker, over the same pooled connection
+    params.event = AnnounceEvent::STOPPED;
+    Announce(announce, params);
+    return ret;
+}
+
+Result<TrackerReply, std::string> Trackers::Announce(
+    const std::string& announce, const AnnounceParams& params,
+    const std::optional<net::IpAddress>& resolved) {
+    if (params.info_hash.size() != 20) return Err("invalid info_hash");
+    if (absl::StartsWith(announce, "udp://")) {
+        return UdpTrackerClient::AnnounceOnce(announce, params);
+    }
+
+    // built by hand instead of cpr::Parameters so the request url is complete and pooled
+    // sessions carry no state over from the previous request
+    std::string host_header;
+    std::string url = resolved && absl::StartsWith(announce, "http://")
+                          ? PinHttpHost(announce, *resolved, &host_header)
+                          : announce;
+    absl::StrAppend(&url, announce.find('?') == std::string::npos ? "?" : "&",
+                    "info_hash=", UrlEncode(params.info_hash),
+                    "&peer_id=", UrlEncode(params.peer_id), "&port=", params.port,
+                    "&uploaded=", params.uploaded, "&downloaded=", params.downloaded,
+                    "&left=", params.left, "&compact=1");
+    switch (params.event) {
+        case AnnounceEvent::STARTED:
+            url += "&event=started";
+            break;
+        case AnnounceEvent::COMPLETED:
+            url += "&event=completed";
+            break;
+        case AnnounceEvent::STOPPED:
+            url += "&event=stopped";
+            break;
+        case AnnounceEvent::NONE:
+            break;
+    }
+    if (params.num_want >= 0) absl::StrAppend(&url, "&numwant=", params.num_want);
+
+    auto session = HttpSessionPool::Default().Acquire(announce);
+    session->SetUrl(cpr::Url{url});
+    SetTimeouts(*session);
+    if (host_header.empty()) {
+        session->SetHeader(cpr::Header{});
+    } else {
+        session->SetHeader(cpr::Header{{"Host", host_header}});
+    }
+    cpr::Response rsp = session->Get();
     // check http result
     if (rsp.error.code != cpr::ErrorCode::OK) {
+        session.Discard();
         return Err(
             absl::StrCat("GET request failed tracker=", announce, " msg=", rsp.error.message));
     }
@@ -124,9 +246,13 @@ Result<TrackerReply, std::string> Trackers::GetPeers(const std::string& announce
         return Err(absl::StrCat("GET request failed tracker=", announce,
                                 " status_code=", rsp.status_code));
     }
+    return ParseAnnounceReply(rsp.text);
+}
+
+Result<TrackerReply, std::string> Trackers::ParseAnnounceReply(const std::string& body) {
     // parse return payload
     size_t idx = 0;
-    ASSIGN_OR_RAISE(auto reply_obj, BencodeObject::Parse(rsp.text, &idx));
+    ASSIGN_OR_RAISE(auto reply_obj, BencodeObject::Parse(body, &idx));
     if (!reply_obj->IsMap()) {
         return Err("tracker reply is not an map: " + VALUE_OR_RAISE(reply_obj->Json()));
     }
@@ -144,20 +270,128 @@ Result<TrackerReply, std::string> Trackers::GetPeers(const std::string& announce
         ret = {
             .interval = OPTIONAL_OR_RAISE(reply["interval"].GetInt(),
                                           "tracker reply doesn't contain valid interval"),
+            .min_interval = reply["min interval"].GetInt().value_or(0),
+            .seeders = reply["complete"].GetInt().value_or(0),
+            .leechers = reply["incomplete"].GetInt().value_or(0),
             .peers = VALUE_OR_RAISE(ParsePeerInfoList(dynamic_cast<const BencodeMap&>(reply))),
         };
     }
+    return ret;
+}
+
+Result<std::string, std::string> Trackers::ScrapeUrl(const std::string& announce) {
+    // by convention the scrape url replaces the last "announce" path segment with "scrape"
+    size_t slash = announce.rfind('/');
+    if (slash == std::string::npos || announce.compare(slash + 1, 8, "announce") != 0)
+        return Err(absl::StrCat("tracker doesn't support scrape: ", announce));
+    return absl::StrCat(announce.substr(0, slash + 1), "scrape", announce.substr(slash + 9));
+}
+
+Result<ScrapeReply, std::string> Trackers::ParseScrapeReply(const std::string& body) {
+    size_t idx = 0;
+    ASSIGN_OR_RAISE(auto reply_obj, BencodeObject::Parse(body, &idx));
+    if (!reply_obj->IsMap()) {
+        return Err("tracker scrape reply is not an map: " + VALUE_OR_RAISE(reply_obj->Json()));
+    }
+    const auto& reply = *reply_obj.get();
+
+    ScrapeReply ret;
+    if (reply.Contains("failure reason")) {
+        ret.failure_reason =
+            OPTIONAL_OR_RAISE(reply["failure reason"].GetString(),
+                              "tracker replied failure reason is not string: " +
+                                  VALUE_OR_RAISE(reply["failure reason"].Json()));
+        return ret;
+    }
+    ret.interval = reply["flags"]["min_request_interval"].GetInt().value_or(0);
+    if (!reply["files"].IsMap()) return Err("tracker scrape reply missing files");
+    const auto& files = dynamic_cast<const BencodeMap&>(reply["files"]);
+    for (const std::string& info_hash : files.Keys()) {
+        const auto& file = files[info_hash];
+        if (info_hash.size() != 20 || !file.IsMap())
+            return Err("tracker scrape reply contains invalid file entry: " +
+                       VALUE_OR_RAISE(file.Json()));
+        ret.files[info_hash] = ScrapeInfo{
+            .seeders = file["complete"].GetInt().value_or(0),
+            .completed = file["downloaded"].GetInt().value_or(0),
+            .leechers = file["incomplete"].GetInt().value_or(0),
+        };
+    }
+    return ret;
+}
 
-    // cleanup tracker
-    rsp = cpr::Get(cpr::Url{announce}, cpr::Parameters{{"info_hash", info_hash},
-                                                       {"peer_id", "-RY0000-0123456789ab"},
-                                                       {"port", "6881"},
-                                                       {"uplaoded", "0"},
-                                                       {"downloaded", "0"},
-                                                       {"left", absl::StrCat(left_bytes)},
-                                                       {"event", "stopped"}});
+Result<std::unordered_map<std::string, ScrapeInfo>, std::string> Trackers::Scrape(
+    const std::string& announce, const std::vector<std::string>& info_hashes,
+    ScrapeCache* cache) {
+    absl::Time now = absl::Now();
+    std::unordered_map<std::string, ScrapeInfo> ret;
+    std::vector<std::string> pending;
+    std::unordered_set<std::string> seen;
+    for (const auto& info_hash : info_hashes) {
+        if (info_hash.size() != 20) return Err("invalid info_hash");
+        if (!seen.insert(info_hash).second) continue;
+        auto cached = cache->Get(announce, info_hash, now);
+        if (cached) {
+            ret[info_hash] = *cached;
+        } else {
+            pending.push_back(info_hash);
+        }
+    }
+    if (pending.empty()) return ret;
+
+    auto merge = [&](const ScrapeReply& reply) {
+        cache->Put(announce, reply, now);
+        for (const auto& [info_hash, info] : reply.files) {
+            if (seen.count(info_hash)) ret[info_hash] = info;
+        }
+    };
 
-    // return
+    if (absl::StartsWith(announce, "udp://")) {
+        // UdpTrackerClient batches by packet size on its own
+        ASSIGN_OR_RAISE(auto reply, UdpTrackerClient::ScrapeOnce(announce, pending));
+        if (!reply.failure_reason.empty())
+            return Err(absl::StrCat("scrape failed tracker=", announce,
+                                    " reason=", reply.failure_reason));
+        merge(reply);
+        return ret;
+    }
+
+    ASSIGN_OR_RAISE(auto url, ScrapeUrl(announce));
+    char separator = url.find('?') == std::string::npos ? '?' : '&';
+    size_t offset = 0;
+    while (offset < pending.size()) {
+        size_t count = std::min(cache->BatchLimit(announce), pending.size() - offset);
+        std::string query = url;
+        for (size_t i = 0; i < count; i++) {
+            absl::StrAppend(&query, std::string(1, i == 0 ? separator : '&'), "info_hash=",
+                            UrlEncode(pending[offset + i]));
+        }
+        auto session = HttpSessionPool::Default().Acquire(url);
+        session->SetUrl(cpr::Url{query});
+        SetTimeouts(*session);
+        cpr::Response rsp = session->Get();
+        if (rsp.error.code != cpr::ErrorCode::OK) {
+            session.Discard();
+            return Err(
+                absl::StrCat("scrape request failed tracker=", announce, " msg=", rsp.error.message));
+        }
+        if (rsp.status_code == 414 && count > 1) {
+            // request uri too long, the tracker takes fewer hashes per request
+            cache->SetBatchLimit(announce, count / 2);
+            continue;
+        }
+        if (rsp.status_code != 200) {
+            return Err(absl::StrCat("scrape request failed tracker=", announce,
+                                    " status_code=", rsp.status_code));
+        }
+        ASSIGN_OR_RAISE(auto reply, ParseScrapeReply(rsp.text));
+        if (!reply.failure_reason.empty())
+            return Err(absl::StrCat("scrape failed tracker=", announce,
+                                    " reason=", reply.failure_reason));
+        merge(reply);
+        offset += count;
+    }
     return ret;
 }
-}  // namespace ryu
\ No newline at end of file
+
+}  // namespace ryu
@@ -4,32 +4,128 @@
 #include <cpr/cpr.h>
 
 #include <cinttypes>
+#include <optional>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
 #include "common/bencode.h"
+#include "common/network.h"
 #include "result.h"
 
 namespace ryu {
 
 struct PeerInfo {
+    // empty for compact peer lists
     std::string peer_id{};
-    std::string ip{};
-    uint16_t port{};
+    net::Endpoint endpoint{};
     static Result<PeerInfo, std::string> FromTrackerReply(const bencode::BencodeMap* map);
 };
 
 struct TrackerReply {
     std::string failure_reason{};
     int64_t interval{};
+    // 0 if the tracker didn't set one
+    int64_t min_interval{};
+    int64_t seeders{};
+    int64_t leechers{};
     std::vector<PeerInfo> peers{};
 };
 
+// Values match the BEP-0015 wire encoding
+enum class AnnounceEvent : uint32_t {
+    NONE = 0,
+    COMPLETED = 1,
+    STARTED = 2,
+    STOPPED = 3,
+};
+
+struct AnnounceParams {
+    std::string info_hash{};
+    std::string peer_id = "-RY0000-0123456789ab";
+    uint16_t port = 6881;
+    uint64_t uploaded{};
+    uint64_t downloaded{};
+    uint64_t left{};
+    AnnounceEvent event = AnnounceEvent::STARTED;
+    int32_t num_want = -1;
+};
+
+struct ScrapeInfo {
+    int64_t seeders{};
+    int64_t completed{};
+    int64_t leechers{};
+};
+
+struct ScrapeReply {
+    std::string failure_reason{};
+    // min_request_interval in seconds, 0 if the tracker didn't ask for one
+    int64_t interval{};
+    // keyed by info hash
+    std::unordered_map<std::string, ScrapeInfo> files{};
+};
+
+// Scrape results grouped by tracker. Entries stay fresh for the interval the tracker asked for.
+// Also remembers how many info hashes each tracker accepts in one request. Not thread safe.
+class ScrapeCache {
+  public:
+    static constexpr size_t kDefaultBatchLimit = 64;
+    static constexpr absl::Duration kDefaultInterval = absl::Minutes(30);
+
+    [[nodiscard]] std::optional<ScrapeInfo> Get(const std::string& tracker,
+                                                const std::string& info_hash,
+                                                absl::Time now) const;
+    void Put(const std::string& tracker, const ScrapeReply& reply, absl::Time now);
+    [[nodiscard]] size_t BatchLimit(const std::string& tracker) const;
+    void SetBatchLimit(const std::string& tracker, size_t limit);
+
+  private:
+    struct Entry {
+        ScrapeInfo info;
+        absl::Time expires;
+    };
+    struct TrackerEntries {
+        size_t batch_limit = kDefaultBatchLimit;
+        std::unordered_map<std::string, Entry> files;
+    };
+    std::unordered_map<std::string, TrackerEntries> trackers_;
+};
+
 class Trackers {
   public:
+    // Peers of an announce reply, each endpoint listed once
     static Result<std::vector<PeerInfo>, std::string> ParsePeerInfoList(const bencode::BencodeMap& reply);
+    // BEP-0023/BEP-0007 compact peer list, 6 bytes per IPv4 peer or 18 bytes per IPv6 peer.
+    // Decoded peers are appended to `out`.
+    static Result<ResultVoid, std::string> ParseCompactPeers(absl::string_view data,
+                                                            net::AddressType type,
+                                                            std::vector<PeerInfo>* out);
+    // Drop peers whose endpoint is in `seen` and add the rest to it, order is kept. Keep `seen`
+    // across announces to get only the peers not handed out before.
+    static void DedupPeers(std::vector<PeerInfo>* peers, std::unordered_set<net::Endpoint>* seen);
+    // Both http(s):// and udp:// announce urls are accepted
     static Result<TrackerReply, std::string> GetPeers(const std::string& announce, const std::string& info_hash,
                                          uint64_t left_bytes);
+    // A single blocking announce. HTTP requests reuse pooled connections to the tracker.
+    // `resolved` is the address of a plain http:// tracker looked up beforehand, the request
+    // goes there without another name lookup.
+    static Result<TrackerReply, std::string> Announce(
+        const std::string& announce, const AnnounceParams& params,
+        const std::optional<net::IpAddress>& resolved = std::nullopt);
+    static Result<TrackerReply, std::string> ParseAnnounceReply(const std::string& body);
+    // Seeder and leecher counts of many torrents from one tracker. Fresh entries in `cache` are
+    // used as is, the rest are requested in as few batches as the tracker accepts. Torrents the
+    // tracker doesn't know are missing from the result.
+    static Result<std::unordered_map<std::string, ScrapeInfo>, std::string> Scrape(
+        const std::string& announce, const std::vector<std::string>& info_hashes,
+        ScrapeCache* cache);
+    // BEP-0048 scrape reply
+    static Result<ScrapeReply, std::string> ParseScrapeReply(const std::string& body);
+    // Derive the scrape url from an http announce url, fails if the tracker doesn't support it
+    static Result<std::string, std::string> ScrapeUrl(const std::string& announce);
 };
 }  // namespace ryu
 
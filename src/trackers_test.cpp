@@ -0,0 +1,175 @@
+#include "trackers.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <unordered_set>
+
+#include "absl/strings/str_cat.h"
+
+#include "http_session_pool.h"
+
+using namespace ryu;
+
+TEST(TrackersTest, ScrapeUrl) {
+    EXPECT_EQ("http://example.com/scrape",
+              Trackers::ScrapeUrl("http://example.com/announce").Expect(""));
+    EXPECT_EQ("http://example.com/x/scrape.php",
+              Trackers::ScrapeUrl("http://example.com/x/announce.php").Expect(""));
+    EXPECT_EQ("http://example.com/scrape?passkey=1",
+              Trackers::ScrapeUrl("http://example.com/announce?passkey=1").Expect(""));
+    EXPECT_FALSE(Trackers::ScrapeUrl("http://example.com/a").Ok());
+    EXPECT_FALSE(Trackers::ScrapeUrl("http://example.com/x/announce/y").Ok());
+}
+
+TEST(TrackersTest, ParseScrapeReply) {
+    std::string hash1(20, 'a'), hash2(20, 'b');
+    std::string body = "d5:filesd20:" + hash1 +
+                       "d8:completei5e10:downloadedi50e10:incompletei10ee20:" + hash2 +
+                       "d8:completei1e10:downloadedi2e10:incompletei3eee"
+                       "5:flagsd20:min_request_intervali900eee";
+    auto reply = Trackers::ParseScrapeReply(body);
+    ASSERT_TRUE(reply.Ok()) << reply.Error();
+    EXPECT_EQ(900, reply.Value().interval);
+    ASSERT_EQ(2u, reply.Value().files.size());
+    EXPECT_EQ(5, reply.Value().files.at(hash1).seeders);
+    EXPECT_EQ(50, reply.Value().files.at(hash1).completed);
+    EXPECT_EQ(10, reply.Value().files.at(hash1).leechers);
+    EXPECT_EQ(3, reply.Value().files.at(hash2).leechers);
+
+    reply = Trackers::ParseScrapeReply("d14:failure reason6:deniede");
+    ASSERT_TRUE(reply.Ok());
+    EXPECT_EQ("denied", reply.Value().failure_reason);
+
+    EXPECT_FALSE(Trackers::ParseScrapeReply("d5:filesd3:abcd8:completei1eeee").Ok());
+    EXPECT_FALSE(Trackers::ParseScrapeReply("le").Ok());
+}
+
+TEST(TrackersTest, ScrapeCache) {
+    ScrapeCache cache;
+    std::string hash(20, 'a');
+    absl::Time now = absl::FromUnixSeconds(1000);
+    EXPECT_FALSE(cache.Get("t", hash, now));
+
+    ScrapeReply reply{.interval = 60};
+    reply.files[hash] = ScrapeInfo{.seeders = 1, .completed = 2, .leechers = 3};
+    cache.Put("t", reply, now);
+    ASSERT_TRUE(cache.Get("t", hash, now + absl::Seconds(59)));
+    EXPECT_EQ(3, cache.Get("t", hash, now)->leechers);
+    EXPECT_FALSE(cache.Get("t", hash, now + absl::Seconds(60)));
+    EXPECT_FALSE(cache.Get("other", hash, now));
+
+    // no interval from the tracker
+    cache.Put("t", ScrapeReply{.files = reply.files}, now);
+    EXPECT_TRUE(cache.Get("t", hash, now + ScrapeCache::kDefaultInterval - absl::Seconds(1)));
+
+    EXPECT_EQ(ScrapeCache::kDefaultBatchLimit, cache.BatchLimit("t"));
+    cache.SetBatchLimit("t", 0);
+    EXPECT_EQ(1u, cache.BatchLimit("t"));
+}
+
+TEST(TrackersTest, ParseAnnounceReply) {
+    auto reply = Trackers::ParseAnnounceReply(
+        "d8:completei4e10:incompletei2e8:intervali1800e5:peers6:" +
+        std::string("\x0a\x00\x00\x01\x1a\xe1", 6) + "e");
+    ASSERT_TRUE(reply.Ok()) << reply.Error();
+    EXPECT_EQ(1800, reply.Value().interval);
+    EXPECT_EQ(4, reply.Value().seeders);
+    EXPECT_EQ(2, reply.Value().leechers);
+    ASSERT_EQ(1u, reply.Value().peers.size());
+    EXPECT_EQ("10.0.0.1:6881", reply.Value().peers[0].endpoint.ToString());
+
+    reply = Trackers::ParseAnnounceReply("d14:failure reason6:deniede");
+    ASSERT_TRUE(reply.Ok());
+    EXPECT_EQ("denied", reply.Value().failure_reason);
+}
+
+TEST(TrackersTest, CompactPeers6AndDedup) {
+    const std::string v4("\x0a\x00\x00\x01\x1a\xe1"
+                         "\x0a\x00\x00\x02\x1a\xe2",
+                         12);
+    // 2001:db8::1 port 6883, then 10.0.0.1:6881 again as a v4-mapped address
+    const std::string v6("\x20\x01\x0d\xb8\x00\x00\x00\x00"
+                         "\x00\x00\x00\x00\x00\x00\x00\x01\x1a\xe3"
+                         "\x00\x00\x00\x00\x00\x00\x00\x00"
+                         "\x00\x00\xff\xff\x0a\x00\x00\x01\x1a\xe1",
+                         36);
+    auto reply = Trackers::ParseAnnounceReply(absl::StrCat("d8:intervali60e5:peers12:", v4,
+                                                           "6:peers636:", v6, "e"));
+    ASSERT_TRUE(reply.Ok()) << reply.Error();
+    const auto& peers = reply.Value().peers;
+    ASSERT_EQ(3u, peers.size());
+    EXPECT_EQ("10.0.0.1:6881", peers[0].endpoint.ToString());
+    EXPECT_EQ("10.0.0.2:6882", peers[1].endpoint.ToString());
+    EXPECT_EQ("[2001:db8::1]:6883", peers[2].endpoint.ToString());
+    EXPECT_EQ(net::AddressType::IPv6, peers[2].endpoint.Type());
+
+    std::vector<PeerInfo> out;
+    EXPECT_FALSE(Trackers::ParseCompactPeers(v6.substr(0, 17), net::AddressType::IPv6, &out).Ok());
+
+    // a later announce only contributes peers not seen before
+    std::unordered_set<net::Endpoint> seen;
+    auto first = peers;
+    Trackers::DedupPeers(&first, &seen);
+    EXPECT_EQ(3u, first.size());
+    const std::string more = v4 + std::string("\x0a\x00\x00\x03\x1a\xe1", 6);
+    ASSERT_TRUE(Trackers::ParseCompactPeers(more, net::AddressType::IPv4, &out).Ok());
+    Trackers::DedupPeers(&out, &seen);
+    ASSERT_EQ(1u, out.size());
+    EXPECT_EQ("10.0.0.3:6881", out[0].endpoint.ToString());
+}
+
+TEST(TrackersTest, DictPeers) {
+    auto reply = Trackers::ParseAnnounceReply(
+        "d8:intervali60e5:peersld2:ip8:10.0.0.17:peer id20:aaaaaaaaaaaaaaaaaaaa4:porti1ee"
+        "d2:ip3:::17:peer id20:bbbbbbbbbbbbbbbbbbbb4:porti2eeee");
+    ASSERT_TRUE(reply.Ok()) << reply.Error();
+    ASSERT_EQ(2u, reply.Value().peers.size());
+    EXPECT_EQ("aaaaaaaaaaaaaaaaaaaa", reply.Value().peers[0].peer_id);
+    EXPECT_EQ("10.0.0.1:1", reply.Value().peers[0].endpoint.ToString());
+    EXPECT_EQ("[::1]:2", reply.Value().peers[1].endpoint.ToString());
+}
+
+TEST(HttpSessionPoolTest, HostKey) {
+    EXPECT_EQ("http://tracker.example.com:80",
+              HttpSessionPool::HostKey("http://Tracker.Example.com/announce?x=1"));
+    EXPECT_EQ("https://tracker.example.com:443",
+              HttpSessionPool::HostKey("HTTPS://tracker.example.com/announce"));
+    EXPECT_EQ("http://tracker.example.com:6969",
+              HttpSessionPool::HostKey("http://user:pw@tracker.example.com:6969/announce"));
+    EXPECT_EQ("http://[::1]:80", HttpSessionPool::HostKey("http://[::1]/announce"));
+    EXPECT_EQ("http://[::1]:8080", HttpSessionPool::HostKey("http://[::1]:8080"));
+    EXPECT_EQ("", HttpSessionPool::HostKey("tracker.example.com/announce"));
+}
+
+TEST(HttpSessionPoolTest, ReusesSessionsPerHost) {
+    HttpSessionPool pool(2);
+    const std::string a = "http://a.example.com/announce";
+    const std::string b = "http://b.example.com/announce";
+
+    cpr::Session* first;
+    {
+        auto lease = pool.Acquire(a);
+        first = &*lease;
+        EXPECT_EQ(0u, pool.IdleCount(a));
+    }
+    EXPECT_EQ(1u, pool.IdleCount(a));
+    {
+        // another torrent on the same tracker gets the warm session
+        auto lease = pool.Acquire("http://a.example.com:80/scrape");
+        EXPECT_EQ(first, &*lease);
+        // a concurrent request needs its own
+        auto other = pool.Acquire(a);
+        EXPECT_NE(first, &*other);
+        auto unrelated = pool.Acquire(b);
+        unrelated.Discard();
+    }
+    EXPECT_EQ(2u, pool.IdleCount(a));
+    EXPECT_EQ(0u, pool.IdleCount(b));
+
+    {
+        auto l1 = pool.Acquire(a), l2 = pool.Acquire(a), l3 = pool.Acquire(a);
+    }
+    // capped at max idle per host
+    EXPECT_EQ(2u, pool.IdleCount(a));
+}
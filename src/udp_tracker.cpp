@@ -0,0 +1,625 @@
+#include "udp_tracker.h"
+
+#include <endian.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <optional>
+#include <unordered_set>
+
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/strip.h"
+#include "utils/uv_callbacks.h"
+
+namespace ryu {
+
+namespace {
+constexpr uint64_t kProtocolId = 0x41727101980ULL;
+constexpr size_t kConnectReplySize = 16;
+constexpr size_t kAnnounceReplyHeaderSize = 20;
+constexpr size_t kHeaderSize = 8;
+
+void PutU16(std::string* out, uint16_t v) {
+    v = htobe16(v);
+    out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+void PutU32(std::string* out, uint32_t v) {
+    v = htobe32(v);
+    out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+void PutU64(std::string* out, uint64_t v) {
+    v = htobe64(v);
+    out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+uint32_t GetU32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return be32toh(v);
+}
+uint64_t GetU64(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return be64toh(v);
+}
+
+bool SameAddress(const sockaddr_storage& expected, const sockaddr* actual) {
+    if (expected.ss_family != actual->sa_family) return false;
+    if (actual->sa_family == AF_INET) {
+        const auto& a = reinterpret_cast<const sockaddr_in&>(expected);
+        const auto* b = reinterpret_cast<const sockaddr_in*>(actual);
+        return a.sin_port == b->sin_port && a.sin_addr.s_addr == b->sin_addr.s_addr;
+    } else {
+        const auto& a = reinterpret_cast<const sockaddr_in6&>(expected);
+        const auto* b = reinterpret_cast<const sockaddr_in6*>(actual);
+        return a.sin6_port == b->sin6_port &&
+               memcmp(&a.sin6_addr, &b->sin6_addr, sizeof(in6_addr)) == 0;
+    }
+}
+}  // namespace
+
+UdpTrackerClient::UdpTrackerClient(uv_loop_t* loop, Options options, net::Resolver* resolver)
+    : loop_(loop), options_(options), rng_(std::random_device{}()), resolver_(resolver) {
+    key_ = rng_();
+    if (resolver_ == nullptr) {
+        own_resolver_ = std::make_unique<net::Resolver>(loop_);
+        resolver_ = own_resolver_.get();
+    }
+}
+
+Result<ResultVoid, std::string> UdpTrackerClient::Start() {
+    int retcode;
+
+    timer_ = std::make_unique<uv_timer_t>();
+    retcode = uv_timer_init(loop_, timer_.get());
+    if (retcode) return Err("UdpTrackerClient uv_timer_init() failed");
+    timer_->data = this;
+    open_handles_++;
+
+    sockaddr_in addr4{};
+    uv_ip4_addr("0.0.0.0", 0, &addr4);
+    udp4_ = std::make_unique<uv_udp_t>();
+    retcode = uv_udp_init(loop_, udp4_.get());
+    if (retcode) return Err("UdpTrackerClient uv_udp_init() failed");
+    udp4_->data = this;
+    open_handles_++;
+    retcode = uv_udp_bind(udp4_.get(), reinterpret_cast<sockaddr*>(&addr4), 0);
+    if (retcode)
+        return Err(absl::StrCat("UdpTrackerClient uv_udp_bind() failed: ", uv_strerror(retcode)));
+    retcode =
+        uv_udp_recv_start(udp4_.get(), uv_callbacks::Alloc<&UdpTrackerClient::AllocRecvBuffer>,
+                          uv_callbacks::UdpRecv<&UdpTrackerClient::DatagramReceived>);
+    if (retcode) return Err("UdpTrackerClient uv_udp_recv_start() failed");
+
+    // IPv6 is best effort, trackers resolving to v6 only will fail to send
+    sockaddr_in6 addr6{};
+    uv_ip6_addr("::", 0, &addr6);
+    udp6_ = std::make_unique<uv_udp_t>();
+    retcode = uv_udp_init(loop_, udp6_.get());
+    if (retcode) return Err("UdpTrackerClient uv_udp_init() failed");
+    udp6_->data = this;
+    open_handles_++;
+    retcode = uv_udp_bind(udp6_.get(), reinterpret_cast<sockaddr*>(&addr6), UV_UDP_IPV6ONLY);
+    if (retcode == 0) {
+        retcode =
+            uv_udp_recv_start(udp6_.get(), uv_callbacks::Alloc<&UdpTrackerClient::AllocRecvBuffer>,
+                              uv_callbacks::UdpRecv<&UdpTrackerClient::DatagramReceived>);
+    }
+    ipv6_available_ = retcode == 0;
+    return {};
+}
+
+void UdpTrackerClient::Halt(std::function<void()> on_closed) {
+    if (draining_) return;
+    draining_ = true;
+    on_closed_ = std::move(on_closed);
+
+    while (!transactions_.empty()) {
+        Fail(transactions_.begin()->first, "udp tracker client halted");
+    }
+    for (auto& [key, tracker] : trackers_) {
+        if (tracker->resolve_id != 0) resolver_->Cancel(tracker->resolve_id);
+    }
+    if (own_resolver_) {
+        own_resolver_->Halt([this] {
+            own_resolver_halted_ = true;
+            CheckHalted();
+        });
+    }
+    for (uv_handle_t* handle : {reinterpret_cast<uv_handle_t*>(udp4_.get()),
+                                reinterpret_cast<uv_handle_t*>(udp6_.get()),
+                                reinterpret_cast<uv_handle_t*>(timer_.get())}) {
+        if (handle != nullptr && !uv_is_closing(handle))
+            uv_close(handle, uv_callbacks::Close<&UdpTrackerClient::HandleClosed>);
+    }
+    CheckHalted();
+}
+
+void UdpTrackerClient::CheckHalted() {
+    if (!draining_) return;
+    if (open_handles_ > 0 || !outgoing_.empty()) return;
+    if (own_resolver_ && !own_resolver_halted_) return;
+    auto cb = std::move(on_closed_);
+    on_closed_ = nullptr;
+    // may delete this
+    if (cb) cb();
+}
+
+void UdpTrackerClient::Announce(const std::string& url, const AnnounceParams& params,
+                                AnnounceCallback cb) {
+    if (draining_) return cb(Err("udp tracker client halted"));
+    if (params.info_hash.size() != 20) return cb(Err("invalid info_hash"));
+    if (params.peer_id.size() != 20) return cb(Err("invalid peer_id"));
+    Tracker* tracker = GetTracker(url);
+    if (tracker == nullptr) return cb(Err(absl::StrCat("invalid udp tracker url: ", url)));
+    uint32_t id = NewTransaction(Action::ANNOUNCE, tracker);
+    transactions_[id].params = params;
+    transactions_[id].callback = std::move(cb);
+    Dispatch(id);
+}
+
+void UdpTrackerClient::Scrape(const std::string& url, const std::vector<std::string>& info_hashes,
+                              ScrapeCallback cb) {
+    if (draining_) return cb(Err("udp tracker client halted"));
+    if (info_hashes.empty()) return cb(ScrapeReply{});
+    for (const auto& info_hash : info_hashes) {
+        if (info_hash.size() != 20) return cb(Err("invalid info_hash"));
+    }
+    Tracker* tracker = GetTracker(url);
+    if (tracker == nullptr) return cb(Err(absl::StrCat("invalid udp tracker url: ", url)));
+
+    // every batch reports into the same merged reply
+    struct Merged {
+        size_t remaining;
+        ScrapeReply reply;
+        std::optional<std::string> error;
+        ScrapeCallback cb;
+    };
+    size_t batches = (info_hashes.size() + kMaxScrapeBatch - 1) / kMaxScrapeBatch;
+    auto merged = std::make_shared<Merged>(Merged{batches, {}, {}, std::move(cb)});
+    auto on_batch = [merged](Result<ScrapeReply, std::string> reply) {
+        if (!reply) {
+            if (!merged->error) merged->error = reply.Error();
+        } else if (!reply.Value().failure_reason.empty()) {
+            merged->reply.failure_reason = reply.Value().failure_reason;
+        } else {
+            for (auto& [info_hash, info] : reply.Value().files) {
+                merged->reply.files[info_hash] = info;
+            }
+        }
+        if (--merged->remaining > 0) return;
+        if (merged->error) return merged->cb(Err(*merged->error));
+        merged->cb(std::move(merged->reply));
+    };
+
+    for (size_t offset = 0; offset < info_hashes.size(); offset += kMaxScrapeBatch) {
+        uint32_t id = NewTransaction(Action::SCRAPE, tracker);
+        Transaction& t = transactions_[id];
+        size_t end = std::min(info_hashes.size(), offset + kMaxScrapeBatch);
+        t.info_hashes.assign(info_hashes.begin() + offset, info_hashes.begin() + end);
+        t.scrape_callback = on_batch;
+        Dispatch(id);
+    }
+}
+
+template <typename T>
+Result<T, std::string> UdpTrackerClient::RunOnce(
+    Options options,
+    const std::function<void(UdpTrackerClient*, std::function<void(Result<T, std::string>)>)>&
+        request) {
+    uv_loop_t loop;
+    if (uv_loop_init(&loop)) return Err("uv_loop_init() failed");
+    Result<T, std::string> ret = Err("udp tracker client halted");
+    {
+        UdpTrackerClient client(&loop, options);
+        auto started = client.Start();
+        if (!started) {
+            ret = Err(started.Error());
+            client.Halt(nullptr);
+        } else {
+            request(&client, [&](Result<T, std::string> reply) {
+                ret = std::move(reply);
+                client.Halt(nullptr);
+            });
+        }
+        uv_run(&loop, UV_RUN_DEFAULT);
+    }
+    uv_loop_close(&loop);
+    return ret;
+}
+
+Result<TrackerReply, std::string> UdpTrackerClient::AnnounceOnce(const std::string& url,
+                                                                 const AnnounceParams& params,
+                                                                 Options options) {
+    return RunOnce<TrackerReply>(options, [&](UdpTrackerClient* client, AnnounceCallback cb) {
+        client->Announce(url, params, std::move(cb));
+    });
+}
+
+Result<ScrapeReply, std::string> UdpTrackerClient::ScrapeOnce(
+    const std::string& url, const std::vector<std::string>& info_hashes, Options options) {
+    return RunOnce<ScrapeReply>(options, [&](UdpTrackerClient* client, ScrapeCallback cb) {
+        client->Scrape(url, info_hashes, std::move(cb));
+    });
+}
+
+UdpTrackerClient::Tracker* UdpTrackerClient::GetTracker(const std::string& url) {
+    auto service = net::RemoteService::FromUrl(url);
+    if (!service || (service.Value().GetType() != net::RemoteService::Type::UDP_DOMAIN &&
+                     service.Value().GetType() != net::RemoteService::Type::UDP_IP_PORT)) {
+        return nullptr;
+    }
+    std::string key = absl::StrCat(service.Value().Host(), ":", service.Value().Port());
+    auto iter = trackers_.find(key);
+    if (iter != trackers_.end()) {
+        // resolved again in place, transactions in flight keep pointing at it
+        Tracker* tracker = iter->second.get();
+        if (tracker->state == Tracker::State::FAILED ||
+            (tracker->state == Tracker::State::RESOLVED &&
+             tracker->addr_expire_ms <= uv_now(loop_))) {
+            Resolve(key, tracker);
+        }
+        return tracker;
+    }
+
+    auto owned = std::make_unique<Tracker>();
+    Tracker* tracker = owned.get();
+    tracker->host = service.Value().Host();
+    tracker->port = service.Value().Port();
+    trackers_[key] = std::move(owned);
+    Resolve(key, tracker);
+    return tracker;
+}
+
+void UdpTrackerClient::Resolve(const std::string& key, Tracker* tracker) {
+    tracker->state = Tracker::State::RESOLVING;
+    // answered right away for IP literals, cached hosts and cached failures
+    net::Resolver::RequestId id =
+        resolver_->Resolve(tracker->host, [this, key](auto ips) { HostResolved(key, ips); });
+    if (tracker->state == Tracker::State::RESOLVING) tracker->resolve_id = id;
+}
+
+void UdpTrackerClient::HostResolved(const std::string& key,
+                                    Result<std::vector<net::IpAddress>, std::string> ips) {
+    if (draining_) return;
+    Tracker* tracker = trackers_.at(key).get();
+    tracker->resolve_id = 0;
+    if (ips) {
+        const net::IpAddress* chosen = nullptr;
+        for (const auto& ip : ips.Value()) {
+            if (ip.Type() == net::AddressType::IPv4 || ipv6_available_) {
+                chosen = &ip;
+                break;
+            }
+        }
+        if (chosen == nullptr) {
+            ips = Err(absl::StrCat("no usable address for ", tracker->host));
+        } else {
+            sockaddr_storage addr{};
+            net::Endpoint(*chosen, tracker->port).ToSockaddr(&addr);
+            // a connection id is only good with the address that handed it out
+            if (!SameAddress(tracker->addr, reinterpret_cast<const sockaddr*>(&addr))) {
+                tracker->connection_expire_ms = 0;
+            }
+            tracker->addr = addr;
+            tracker->addr_expire_ms = uv_now(loop_) + options_.address_ttl_ms;
+        }
+    }
+
+    if (!ips) {
+        // until the next request for this tracker resolves it again, requests in flight fail
+        // when they retransmit
+        tracker->state = Tracker::State::FAILED;
+        tracker->resolve_error = ips.Error();
+    } else {
+        tracker->state = Tracker::State::RESOLVED;
+    }
+    auto waiting = std::move(tracker->waiting);
+    tracker->waiting.clear();
+    for (uint32_t id : waiting) Dispatch(id);
+}
+
+uint32_t UdpTrackerClient::NewTransaction(Action action, Tracker* tracker) {
+    uint32_t id;
+    do {
+        id = rng_();
+    } while (id == 0 || transactions_.count(id) > 0);
+    Transaction& t = transactions_[id];
+    t.id = id;
+    t.action = action;
+    t.tracker = tracker;
+    return id;
+}
+
+void UdpTrackerClient::Dispatch(uint32_t transaction_id) {
+    Transaction& t = transactions_.at(transaction_id);
+    Tracker* tracker = t.tracker;
+    switch (tracker->state) {
+        case Tracker::State::RESOLVING:
+            tracker->waiting.push_back(transaction_id);
+            return;
+        case Tracker::State::FAILED:
+            return Fail(transaction_id, tracker->resolve_error);
+        case Tracker::State::RESOLVED:
+            break;
+    }
+    if (t.action != Action::CONNECT && tracker->connection_expire_ms <= uv_now(loop_)) {
+        tracker->waiting.push_back(transaction_id);
+        if (tracker->connect_transaction == 0) SendConnect(tracker);
+        return;
+    }
+    SendRequest(t);
+    ArmDeadline(t);
+}
+
+void UdpTrackerClient::SendConnect(Tracker* tracker) {
+    uint32_t id = NewTransaction(Action::CONNECT, tracker);
+    tracker->connect_transaction = id;
+    Dispatch(id);
+}
+
+void UdpTrackerClient::SendRequest(Transaction& t) {
+    std::string payload;
+    switch (t.action) {
+        case Action::CONNECT:
+            payload.reserve(16);
+            PutU64(&payload, kProtocolId);
+            PutU32(&payload, static_cast<uint32_t>(Action::CONNECT));
+            PutU32(&payload, t.id);
+            break;
+        case Action::ANNOUNCE:
+            payload.reserve(98);
+            PutU64(&payload, t.tracker->connection_id);
+            PutU32(&payload, static_cast<uint32_t>(Action::ANNOUNCE));
+            PutU32(&payload, t.id);
+            payload.append(t.params.info_hash);
+            payload.append(t.params.peer_id);
+            PutU64(&payload, t.params.downloaded);
+            PutU64(&payload, t.params.left);
+            PutU64(&payload, t.params.uploaded);
+            PutU32(&payload, static_cast<uint32_t>(t.params.event));
+            PutU32(&payload, 0);  // ip, default
+            PutU32(&payload, key_);
+            PutU32(&payload, static_cast<uint32_t>(t.params.num_want));
+            PutU16(&payload, t.params.port);
+            break;
+        case Action::SCRAPE:
+            payload.reserve(16 + 20 * t.info_hashes.size());
+            PutU64(&payload, t.tracker->connection_id);
+            PutU32(&payload, static_cast<uint32_t>(Action::SCRAPE));
+            PutU32(&payload, t.id);
+            for (const auto& info_hash : t.info_hashes) payload.append(info_hash);
+            break;
+        default:
+            assert(false);
+    }
+    Send(*t.tracker, std::move(payload));
+}
+
+void UdpTrackerClient::Send(const Tracker& tracker, std::string payload) {
+    uv_udp_t* socket = tracker.addr.ss_family == AF_INET6 ? udp6_.get() : udp4_.get();
+    const auto* addr = reinterpret_cast<const sockaddr*>(&tracker.addr);
+    uv_buf_t buf = uv_buf_init(payload.data(), payload.size());
+
+    int retcode = uv_udp_try_send(socket, &buf, 1, addr);
+    if (retcode >= 0 || (retcode != UV_EAGAIN && retcode != UV_ENOSYS)) {
+        // sent, or failed in a way the retransmission will deal with
+        return;
+    }
+    auto send_buf = std::make_unique<SendBuf>();
+    send_buf->payload = std::move(payload);
+    send_buf->data = this;
+    buf = uv_buf_init(send_buf->payload.data(), send_buf->payload.size());
+    retcode = uv_udp_send(send_buf.get(), socket, &buf, 1, addr,
+                          uv_callbacks::UdpSend<&UdpTrackerClient::SendComplete>);
+    if (retcode == 0) outgoing_[send_buf.get()] = std::move(send_buf);
+}
+
+void UdpTrackerClient::SendComplete(uv_udp_send_t* req, int status) {
+    auto iter = outgoing_.find(static_cast<SendBuf*>(req));
+    assert(iter != outgoing_.end());
+    outgoing_.erase(iter);
+    CheckHalted();
+}
+
+void UdpTrackerClient::ArmDeadline(Transaction& t) {
+    DisarmDeadline(t);
+    uint64_t timeout = options_.base_timeout_ms << t.retransmits;
+    t.deadline = deadlines_.emplace(uv_now(loop_) + timeout, t.id);
+    t.armed = true;
+    UpdateTimer();
+}
+
+void UdpTrackerClient::DisarmDeadline(Transaction& t) {
+    if (!t.armed) return;
+    deadlines_.erase(t.deadline);
+    t.armed = false;
+}
+
+void UdpTrackerClient::UpdateTimer() {
+    if (draining_) return;
+    if (deadlines_.empty()) {
+        uv_timer_stop(timer_.get());
+        return;
+    }
+    uint64_t now = uv_now(loop_);
+    uint64_t due = deadlines_.begin()->first;
+    uv_timer_start(timer_.get(), uv_callbacks::Timer<&UdpTrackerClient::RetransmitTimer>,
+                   due > now ? due - now : 0, 0);
+}
+
+void UdpTrackerClient::RetransmitTimer(uv_timer_t* handle) {
+    assert(handle == timer_.get());
+    uint64_t now = uv_now(loop_);
+    std::vector<uint32_t> expired;
+    while (!deadlines_.empty() && deadlines_.begin()->first <= now) {
+        expired.push_back(deadlines_.begin()->second);
+        transactions_.at(expired.back()).armed = false;
+        deadlines_.erase(deadlines_.begin());
+    }
+
+    for (uint32_t id : expired) {
+        auto iter = transactions_.find(id);
+        if (iter == transactions_.end()) continue;
+        Transaction& t = iter->second;
+        if (t.retransmits >= options_.max_retransmit) {
+            Fail(id, absl::StrCat("udp tracker ", t.tracker->host, ":", t.tracker->port,
+                                  " timed out"));
+            continue;
+        }
+        t.retransmits++;
+        // the connection id may have expired while waiting, Dispatch() reconnects if so
+        Dispatch(id);
+    }
+    UpdateTimer();
+}
+
+void UdpTrackerClient::Fail(uint32_t transaction_id, const std::string& reason) {
+    auto iter = transactions_.find(transaction_id);
+    if (iter == transactions_.end()) return;
+    Transaction& t = iter->second;
+    DisarmDeadline(t);
+    Tracker* tracker = t.tracker;
+
+    if (t.action == Action::CONNECT) {
+        tracker->connect_transaction = 0;
+        auto waiting = std::move(tracker->waiting);
+        tracker->waiting.clear();
+        transactions_.erase(iter);
+        for (uint32_t id : waiting) Fail(id, reason);
+        return;
+    }
+    auto& waiting = tracker->waiting;
+    waiting.erase(std::remove(waiting.begin(), waiting.end(), transaction_id), waiting.end());
+    if (t.action == Action::SCRAPE) {
+        auto cb = std::move(t.scrape_callback);
+        transactions_.erase(iter);
+        cb(Err(reason));
+    } else {
+        auto cb = std::move(t.callback);
+        transactions_.erase(iter);
+        cb(Err(reason));
+    }
+}
+
+void UdpTrackerClient::Complete(uint32_t transaction_id, Result<TrackerReply, std::string> reply) {
+    auto iter = transactions_.find(transaction_id);
+    assert(iter != transactions_.end());
+    DisarmDeadline(iter->second);
+    auto cb = std::move(iter->second.callback);
+    transactions_.erase(iter);
+    UpdateTimer();
+    cb(std::move(reply));
+}
+
+void UdpTrackerClient::CompleteScrape(uint32_t transaction_id,
+                                      Result<ScrapeReply, std::string> reply) {
+    auto iter = transactions_.find(transaction_id);
+    assert(iter != transactions_.end());
+    DisarmDeadline(iter->second);
+    auto cb = std::move(iter->second.scrape_callback);
+    transactions_.erase(iter);
+    UpdateTimer();
+    cb(std::move(reply));
+}
+
+void UdpTrackerClient::AllocRecvBuffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    buf->base = recv_buf_.data();
+    buf->len = recv_buf_.size();
+}
+
+void UdpTrackerClient::DatagramReceived(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf,
+                                        const sockaddr* addr, unsigned flags) {
+    if (nread < static_cast<ssize_t>(kHeaderSize) || addr == nullptr) return;
+    if (flags & UV_UDP_PARTIAL) return;
+    absl::string_view payload(buf->base, nread);
+
+    auto action = static_cast<Action>(GetU32(payload.data()));
+    uint32_t id = GetU32(payload.data() + 4);
+    auto iter = transactions_.find(id);
+    if (iter == transactions_.end()) return;
+    Transaction& t = iter->second;
+    // only the tracker the transaction was sent to may answer it
+    if (!t.armed || !SameAddress(t.tracker->addr, addr)) return;
+
+    if (action == Action::ERROR) {
+        std::string message(payload.substr(kHeaderSize));
+        if (t.action == Action::CONNECT) return Fail(id, "udp tracker error: " + message);
+        if (t.action == Action::SCRAPE)
+            return CompleteScrape(id, ScrapeReply{.failure_reason = message});
+        return Complete(id, TrackerReply{.failure_reason = message});
+    }
+    if (action != t.action) return;
+    switch (action) {
+        case Action::CONNECT:
+            return HandleConnectReply(t, payload);
+        case Action::ANNOUNCE:
+            return HandleAnnounceReply(t, payload);
+        case Action::SCRAPE:
+            return HandleScrapeReply(t, payload);
+        default:
+            return;
+    }
+}
+
+void UdpTrackerClient::HandleConnectReply(Transaction& t, absl::string_view payload) {
+    if (payload.size() < kConnectReplySize) return;
+    Tracker* tracker = t.tracker;
+    tracker->connection_id = GetU64(payload.data() + 8);
+    tracker->connection_expire_ms = uv_now(loop_) + options_.connection_id_ttl_ms;
+    tracker->connect_transaction = 0;
+    DisarmDeadline(t);
+    transactions_.erase(t.id);
+
+    // the fresh id is good for everything queued behind it, even with a very short ttl
+    auto waiting = std::move(tracker->waiting);
+    tracker->waiting.clear();
+    for (uint32_t id : waiting) {
+        Transaction& queued = transactions_.at(id);
+        SendRequest(queued);
+        ArmDeadline(queued);
+    }
+    UpdateTimer();
+}
+
+void UdpTrackerClient::HandleAnnounceReply(Transaction& t, absl::string_view payload) {
+    if (payload.size() < kAnnounceReplyHeaderSize) return;
+    auto type = t.tracker->addr.ss_family == AF_INET6 ? net::AddressType::IPv6
+                                                      : net::AddressType::IPv4;
+    TrackerReply reply{
+        .interval = GetU32(payload.data() + 8),
+        .seeders = GetU32(payload.data() + 16),
+        .leechers = GetU32(payload.data() + 12),
+    };
+    auto parsed =
+        Trackers::ParseCompactPeers(payload.substr(kAnnounceReplyHeaderSize), type, &reply.peers);
+    if (!parsed) return Complete(t.id, Err(parsed.Error()));
+    std::unordered_set<net::Endpoint> seen;
+    Trackers::DedupPeers(&reply.peers, &seen);
+    Complete(t.id, std::move(reply));
+}
+
+void UdpTrackerClient::HandleScrapeReply(Transaction& t, absl::string_view payload) {
+    // seeders, completed, leechers for each requested info hash, in request order
+    constexpr size_t kEntrySize = 12;
+    ScrapeReply reply;
+    size_t count = std::min((payload.size() - kHeaderSize) / kEntrySize, t.info_hashes.size());
+    for (size_t i = 0; i < count; i++) {
+        const char* entry = payload.data() + kHeaderSize + i * kEntrySize;
+        reply.files[t.info_hashes[i]] = ScrapeInfo{
+            .seeders = GetU32(entry),
+            .completed = GetU32(entry + 4),
+            .leechers = GetU32(entry + 8),
+        };
+    }
+    CompleteScrape(t.id, std::move(reply));
+}
+
+void UdpTrackerClient::HandleClosed(uv_handle_t* handle) {
+    open_handles_--;
+    CheckHalted();
+}
+
+}  // namespace ryu
@@ -0,0 +1,192 @@
+#ifndef RYU_UDP_TRACKER_H
+#define RYU_UDP_TRACKER_H
+
+#include <uv.h>
+
+#include <array>
+#include <cinttypes>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common/resolver.h"
+#include "result.h"
+#include "trackers.h"
+
+namespace ryu {
+
+// BEP-0015 UDP tracker client.
+// All trackers share one IPv4 and one IPv6 socket. Connection ids are cached per tracker and
+// requests waiting for a connection id are queued behind a single connect transaction.
+class UdpTrackerClient {
+  public:
+    using AnnounceCallback = std::function<void(Result<TrackerReply, std::string>)>;
+    using ScrapeCallback = std::function<void(Result<ScrapeReply, std::string>)>;
+
+    // BEP-0015: up to about 74 torrents fit in one scrape request
+    static constexpr size_t kMaxScrapeBatch = 74;
+
+    struct Options {
+        // Retransmit after base_timeout * 2 ^ n, n grows up to max_retransmit. BEP-0015 uses 15s
+        // and 8 (3840 seconds).
+        uint64_t base_timeout_ms = 15000;
+        int max_retransmit = 8;
+        // A connection id may be used for one minute after it is received
+        uint64_t connection_id_ttl_ms = 60000;
+        // A tracker's address is looked up again once this old, so one that moved is followed.
+        // Matches the Resolver's positive ttl, the lookup usually hits its cache.
+        uint64_t address_ttl_ms = 300000;
+    };
+
+    // Host names go through `resolver`, which must outlive the client. A private resolver is
+    // used if it's null.
+    UdpTrackerClient(uv_loop_t* loop, Options options, net::Resolver* resolver);
+    UdpTrackerClient(uv_loop_t* loop, Options options) : UdpTrackerClient(loop, options, nullptr) {}
+    explicit UdpTrackerClient(uv_loop_t* loop) : UdpTrackerClient(loop, Options{}) {}
+    UdpTrackerClient(const UdpTrackerClient&) = delete;
+    UdpTrackerClient& operator=(const UdpTrackerClient&) = delete;
+
+    // Bind the sockets. IPv6 is optional, IPv4 is not.
+    Result<ResultVoid, std::string> Start();
+    // Fail all outstanding requests and close the sockets. `on_closed` is called once every
+    // libuv handle and request has been released, the client can be destroyed after that.
+    void Halt(std::function<void()> on_closed);
+
+    // `url` is udp://host:port[/path]. `cb` is always called exactly once.
+    void Announce(const std::string& url, const AnnounceParams& params, AnnounceCallback cb);
+
+    // Scrape any number of torrents, split into requests of at most kMaxScrapeBatch info hashes.
+    // `cb` gets the merged reply once every batch is answered, or the first error.
+    void Scrape(const std::string& url, const std::vector<std::string>& info_hashes,
+                ScrapeCallback cb);
+
+    // Announce or scrape on a private loop and block until the reply arrives.
+    static Result<TrackerReply, std::string> AnnounceOnce(const std::string& url,
+                                                          const AnnounceParams& params,
+                                                          Options options);
+    static Result<TrackerReply, std::string> AnnounceOnce(const std::string& url,
+                                                          const AnnounceParams& params) {
+        return AnnounceOnce(url, params, Options{});
+    }
+    static Result<ScrapeReply, std::string> ScrapeOnce(const std::string& url,
+                                                       const std::vector<std::string>& info_hashes,
+                                                       Options options);
+    static Result<ScrapeReply, std::string> ScrapeOnce(
+        const std::string& url, const std::vector<std::string>& info_hashes) {
+        return ScrapeOnce(url, info_hashes, Options{});
+    }
+
+    // UV callbacks
+    void AllocRecvBuffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+    void DatagramReceived(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf,
+                          const sockaddr* addr, unsigned flags);
+    void SendComplete(uv_udp_send_t* req, int status);
+    void RetransmitTimer(uv_timer_t* handle);
+    void HandleClosed(uv_handle_t* handle);
+
+  private:
+    enum class Action : uint32_t {
+        CONNECT = 0,
+        ANNOUNCE = 1,
+        SCRAPE = 2,
+        ERROR = 3,
+    };
+
+    struct Tracker {
+        enum class State { RESOLVING, RESOLVED, FAILED };
+        std::string host;
+        uint16_t port{};
+        State state = State::RESOLVING;
+        std::string resolve_error;
+        net::Resolver::RequestId resolve_id{};
+        sockaddr_storage addr{};
+        // uv_now() after which `addr` is resolved again
+        uint64_t addr_expire_ms{};
+        uint64_t connection_id{};
+        uint64_t connection_expire_ms{};
+        // transaction id of the in-flight connect request, 0 if none
+        uint32_t connect_transaction{};
+        // transactions waiting for resolution or a connection id
+        std::vector<uint32_t> waiting;
+    };
+
+    struct Transaction {
+        uint32_t id{};
+        Action action{};
+        Tracker* tracker{};
+        AnnounceParams params{};
+        AnnounceCallback callback{};
+        std::vector<std::string> info_hashes{};
+        ScrapeCallback scrape_callback{};
+        int retransmits = 0;
+        std::multimap<uint64_t, uint32_t>::iterator deadline;
+        bool armed = false;
+    };
+
+    struct SendBuf : public uv_udp_send_t {
+        std::string payload;
+    };
+
+    // nullptr for urls that are not udp://host:port
+    Tracker* GetTracker(const std::string& url);
+    // Look the tracker's host up, requests wait until it's done
+    void Resolve(const std::string& key, Tracker* tracker);
+    void HostResolved(const std::string& key, Result<std::vector<net::IpAddress>, std::string> ips);
+    // Run a single request on a private loop
+    template <typename T>
+    static Result<T, std::string> RunOnce(
+        Options options,
+        const std::function<void(UdpTrackerClient*, std::function<void(Result<T, std::string>)>)>&
+            request);
+    uint32_t NewTransaction(Action action, Tracker* tracker);
+    // Send or queue a request depending on the tracker connection state
+    void Dispatch(uint32_t transaction_id);
+    void SendConnect(Tracker* tracker);
+    void SendRequest(Transaction& t);
+    void Send(const Tracker& tracker, std::string payload);
+    void ArmDeadline(Transaction& t);
+    void DisarmDeadline(Transaction& t);
+    void UpdateTimer();
+    // Fail and forget a transaction. Connect transactions fail everything waiting on them.
+    void Fail(uint32_t transaction_id, const std::string& reason);
+    void Complete(uint32_t transaction_id, Result<TrackerReply, std::string> reply);
+    void CompleteScrape(uint32_t transaction_id, Result<ScrapeReply, std::string> reply);
+
+    void HandleConnectReply(Transaction& t, absl::string_view payload);
+    void HandleAnnounceReply(Transaction& t, absl::string_view payload);
+    void HandleScrapeReply(Transaction& t, absl::string_view payload);
+    void CheckHalted();
+
+    uv_loop_t* const loop_;
+    const Options options_;
+    std::mt19937 rng_;
+    uint32_t key_;
+
+    std::unique_ptr<uv_udp_t> udp4_;
+    std::unique_ptr<uv_udp_t> udp6_;
+    std::unique_ptr<uv_timer_t> timer_;
+    std::array<char, 65536> recv_buf_;
+    net::Resolver* resolver_;
+    std::unique_ptr<net::Resolver> own_resolver_;
+    bool own_resolver_halted_ = false;
+
+    // keyed by "host:port", never erased while running: transactions point at their tracker
+    std::unordered_map<std::string, std::unique_ptr<Tracker>> trackers_;
+    std::unordered_map<uint32_t, Transaction> transactions_;
+    // deadline(ms) -> transaction id
+    std::multimap<uint64_t, uint32_t> deadlines_;
+    std::unordered_map<SendBuf*, std::unique_ptr<SendBuf>> outgoing_;
+
+    bool ipv6_available_ = false;
+    bool draining_ = false;
+    int open_handles_ = 0;
+    std::function<void()> on_closed_;
+};
+
+}  // namespace ryu
+
+#endif  // RYU_UDP_TRACKER_H
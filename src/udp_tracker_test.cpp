@@ -0,0 +1,403 @@
+#include "udp_tracker.h"
+
+#include <endian.h>
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "utils/uv_callbacks.h"
+
+using namespace ryu;
+
+namespace {
+
+// Minimal BEP-0015 tracker on the same loop as the client.
+class MockUdpTracker {
+  public:
+    explicit MockUdpTracker(uv_loop_t* loop, const char* ip = "127.0.0.1") {
+        uv_udp_init(loop, &socket_);
+        socket_.data = this;
+        sockaddr_storage addr{};
+        if (strchr(ip, ':')) {
+            uv_ip6_addr(ip, 0, reinterpret_cast<sockaddr_in6*>(&addr));
+        } else {
+            uv_ip4_addr(ip, 0, reinterpret_cast<sockaddr_in*>(&addr));
+        }
+        EXPECT_EQ(0, uv_udp_bind(&socket_, reinterpret_cast<sockaddr*>(&addr), 0));
+        int len = sizeof(addr);
+        uv_udp_getsockname(&socket_, reinterpret_cast<sockaddr*>(&addr), &len);
+        port_ = be16toh(reinterpret_cast<sockaddr_in*>(&addr)->sin_port);
+        url_ = strchr(ip, ':') ? absl::StrCat("udp://[", ip, "]:", port_, "/announce")
+                               : absl::StrCat("udp://", ip, ":", port_, "/announce");
+        uv_udp_recv_start(&socket_, uv_callbacks::Alloc<&MockUdpTracker::Alloc>,
+                          uv_callbacks::UdpRecv<&MockUdpTracker::Received>);
+    }
+
+    void Close() { uv_close(reinterpret_cast<uv_handle_t*>(&socket_), nullptr); }
+    const std::string& url() const { return url_; }
+
+    void Alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+        buf->base = buf_;
+        buf->len = sizeof(buf_);
+    }
+
+    void Received(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf, const sockaddr* addr,
+                  unsigned flags) {
+        if (nread < 16 || addr == nullptr) return;
+        uint32_t action = Get32(buf->base + 8);
+        uint32_t tid = Get32(buf->base + 12);
+        if (drop > 0) {
+            drop--;
+            return;
+        }
+        std::string reply;
+        if (action == 0) {
+            connects++;
+            EXPECT_EQ(0x41727101980ULL, be64toh(*reinterpret_cast<uint64_t*>(buf->base)));
+            if (send_stray_reply) {
+                std::string stray;
+                Put32(&stray, 0);
+                Put32(&stray, tid + 1);
+                Put64(&stray, 1);
+                Send(stray, addr);
+            }
+            Put32(&reply, 0);
+            Put32(&reply, tid);
+            Put64(&reply, kConnectionId);
+        } else if (action == 1) {
+            announces++;
+            EXPECT_EQ(98, nread);
+            EXPECT_EQ(kConnectionId, be64toh(*reinterpret_cast<uint64_t*>(buf->base)));
+            last_info_hash = std::string(buf->base + 16, 20);
+            last_event = Get32(buf->base + 80);
+            if (!error.empty()) {
+                Put32(&reply, 3);
+                Put32(&reply, tid);
+                reply += error;
+            } else {
+                Put32(&reply, 1);
+                Put32(&reply, tid);
+                Put32(&reply, 1800);  // interval
+                Put32(&reply, 3);     // leechers
+                Put32(&reply, 7);     // seeders
+                reply += peers;
+            }
+        } else if (action == 2) {
+            scrapes++;
+            size_t count = (nread - 16) / 20;
+            scraped += count;
+            Put32(&reply, 2);
+            Put32(&reply, tid);
+            for (size_t i = 0; i < count; i++) {
+                Put32(&reply, 10 + i);  // seeders
+                Put32(&reply, 20 + i);  // completed
+                Put32(&reply, 30 + i);  // leechers
+            }
+        }
+        Send(reply, addr);
+    }
+
+    int drop = 0;
+    bool send_stray_reply = false;
+    std::string error;
+    std::string peers;
+
+    int connects = 0;
+    int announces = 0;
+    int scrapes = 0;
+    size_t scraped = 0;
+    std::string last_info_hash;
+    uint32_t last_event = 0;
+
+  private:
+    static constexpr uint64_t kConnectionId = 0x1122334455667788ULL;
+    static uint32_t Get32(const char* p) { return be32toh(*reinterpret_cast<const uint32_t*>(p)); }
+    static void Put32(std::string* s, uint32_t v) {
+        v = htobe32(v);
+        s->append(reinterpret_cast<char*>(&v), 4);
+    }
+    static void Put64(std::string* s, uint64_t v) {
+        v = htobe64(v);
+        s->append(reinterpret_cast<char*>(&v), 8);
+    }
+    void Send(const std::string& payload, const sockaddr* addr) {
+        uv_buf_t b = uv_buf_init(const_cast<char*>(payload.data()), payload.size());
+        EXPECT_EQ(static_cast<int>(payload.size()), uv_udp_try_send(&socket_, &b, 1, addr));
+    }
+
+    uv_udp_t socket_;
+    uint16_t port_;
+    std::string url_;
+    char buf_[2048];
+};
+
+class UdpTrackerTest : public ::testing::Test {
+  protected:
+    void SetUp() override { uv_loop_init(&loop_); }
+    void TearDown() override { EXPECT_EQ(0, uv_loop_close(&loop_)); }
+
+    // Announce and run the loop until the reply arrives
+    Result<TrackerReply, std::string> Announce(UdpTrackerClient* client, const std::string& url,
+                                               AnnounceEvent event = AnnounceEvent::STARTED) {
+        Result<TrackerReply, std::string> ret = Err("no reply");
+        bool done = false;
+        AnnounceParams params{.info_hash = std::string(20, 'h'), .left = 100, .event = event};
+        client->Announce(url, params, [&](Result<TrackerReply, std::string> reply) {
+            ret = std::move(reply);
+            done = true;
+        });
+        while (!done) uv_run(&loop_, UV_RUN_ONCE);
+        return ret;
+    }
+
+    // Halt the client and run the loop until every handle is released
+    void Shutdown(UdpTrackerClient* client, MockUdpTracker* tracker) {
+        bool closed = false;
+        client->Halt([&]() { closed = true; });
+        if (tracker != nullptr) tracker->Close();
+        uv_run(&loop_, UV_RUN_DEFAULT);
+        EXPECT_TRUE(closed);
+    }
+
+    static UdpTrackerClient::Options FastOptions() {
+        return {.base_timeout_ms = 20,
+                .max_retransmit = 2,
+                .connection_id_ttl_ms = 60000,
+                .address_ttl_ms = 300000};
+    }
+
+    uv_loop_t loop_;
+};
+
+TEST_F(UdpTrackerTest, AnnounceIpv4) {
+    MockUdpTracker tracker(&loop_);
+    tracker.peers = std::string("\x0a\x00\x00\x01\x1a\xe1\x0a\x00\x00\x02\x1a\xe2", 12);
+    UdpTrackerClient client(&loop_, FastOptions());
+    ASSERT_TRUE(client.Start().Ok());
+
+    auto reply = Announce(&client, tracker.url());
+    ASSERT_TRUE(reply.Ok()) << reply.Error();
+    EXPECT_EQ(1800, reply.Value().interval);
+    EXPECT_EQ(7, reply.Value().seeders);
+    EXPECT_EQ(3, reply.Value().leechers);
+    ASSERT_EQ(2u, reply.Value().peers.size());
+    EXPECT_EQ("10.0.0.1:6881", reply.Value().peers[0].endpoint.ToString());
+    EXPECT_EQ("10.0.0.2:6882", reply.Value().peers[1].endpoint.ToString());
+    EXPECT_EQ(std::string(20, 'h'), tracker.last_info_hash);
+    EXPECT_EQ(2u, tracker.last_event);
+
+    Shutdown(&client, &tracker);
+}
+
+TEST_F(UdpTrackerTest, AnnounceIpv6) {
+    MockUdpTracker tracker(&loop_, "::1");
+    std::string peer(16, '\0');
+    peer[0] = '\xfe';
+    peer[1] = '\x80';
+    peer[15] = '\x01';
+    tracker.peers = peer + std::string("\x1a\xe1", 2);
+    UdpTrackerClient client(&loop_, FastOptions());
+    ASSERT_TRUE(client.Start().Ok());
+
+    auto reply = Announce(&client, tracker.url());
+    ASSERT_TRUE(reply.Ok()) << reply.Error();
+    ASSERT_EQ(1u, reply.Value().peers.size());
+    EXPECT_EQ("[fe80::1]:6881", reply.Value().peers[0].endpoint.ToString());
+
+    Shutdown(&client, &tracker);
+}
+
+TEST_F(UdpTrackerTest, ConnectionIdIsCached) {
+    MockUdpTracker tracker(&loop_);
+    UdpTrackerClient client(&loop_, FastOptions());
+    ASSERT_TRUE(client.Start().Ok());
+
+    // concurrent announces share one connect
+    int replies = 0;
+    AnnounceParams params{.info_hash = std::string(20, 'h')};
+    for (int i = 0; i < 3; i++) {
+        client.Announce(tracker.url(), params, [&](Result<TrackerReply, std::string> reply) {
+            EXPECT_TRUE(reply.Ok());
+            replies++;
+        });
+    }
+    while (replies < 3) uv_run(&loop_, UV_RUN_ONCE);
+    ASSERT_TRUE(Announce(&client, tracker.url()).Ok());
+    EXPECT_EQ(1, tracker.connects);
+    EXPECT_EQ(4, tracker.announces);
+
+    Shutdown(&client, &tracker);
+}
+
+TEST_F(UdpTrackerTest, ConnectionIdExpires) {
+    MockUdpTracker tracker(&loop_);
+    auto options = FastOptions();
+    options.connection_id_ttl_ms = 0;
+    UdpTrackerClient client(&loop_, options);
+    ASSERT_TRUE(client.Start().Ok());
+
+    ASSERT_TRUE(Announce(&client, tracker.url()).Ok());
+    ASSERT_TRUE(Announce(&client, tracker.url()).Ok());
+    EXPECT_EQ(2, tracker.connects);
+
+    Shutdown(&client, &tracker);
+}
+
+TEST_F(UdpTrackerTest, AddressExpires) {
+    MockUdpTracker tracker(&loop_);
+    auto options = FastOptions();
+    options.address_ttl_ms = 0;
+    UdpTrackerClient client(&loop_, options);
+    ASSERT_TRUE(client.Start().Ok());
+
+    ASSERT_TRUE(Announce(&client, tracker.url()).Ok());
+    // resolved again to the same address, which keeps the connection id
+    ASSERT_TRUE(Announce(&client, tracker.url()).Ok());
+    EXPECT_EQ(1, tracker.connects);
+    EXPECT_EQ(2, tracker.announces);
+
+    Shutdown(&client, &tracker);
+}
+
+TEST_F(UdpTrackerTest, AddressExpiresInFlight) {
+    MockUdpTracker tracker(&loop_);
+    net::Resolver resolver(&loop_);
+    auto options = FastOptions();
+    options.address_ttl_ms = 0;
+    UdpTrackerClient client(&loop_, options, &resolver);
+    ASSERT_TRUE(client.Start().Ok());
+    ASSERT_TRUE(Announce(&client, tracker.url()).Ok());
+
+    // sent with the cached connection id, then left unanswered
+    tracker.drop = 1000;
+    std::optional<Result<TrackerReply, std::string>> in_flight;
+    AnnounceParams params{.info_hash = std::string(20, 'h')};
+    client.Announce(tracker.url(), params,
+                    [&](Result<TrackerReply, std::string> reply) { in_flight = reply; });
+    uv_run(&loop_, UV_RUN_NOWAIT);
+    // every lookup fails from now on, twice to get past the failed tracker
+    bool resolver_closed = false;
+    resolver.Halt([&]() { resolver_closed = true; });
+    EXPECT_FALSE(Announce(&client, tracker.url()).Ok());
+    EXPECT_FALSE(Announce(&client, tracker.url()).Ok());
+
+    // the request in flight gives up on the failed tracker when it retransmits
+    while (!in_flight) uv_run(&loop_, UV_RUN_ONCE);
+    EXPECT_FALSE(in_flight->Ok());
+    Shutdown(&client, &tracker);
+    EXPECT_TRUE(resolver_closed);
+}
+
+TEST_F(UdpTrackerTest, Retransmit) {
+    MockUdpTracker tracker(&loop_);
+    tracker.drop = 2;  // the first two connect attempts
+    UdpTrackerClient client(&loop_, FastOptions());
+    ASSERT_TRUE(client.Start().Ok());
+
+    ASSERT_TRUE(Announce(&client, tracker.url()).Ok());
+    EXPECT_EQ(1, tracker.connects);
+    EXPECT_EQ(1, tracker.announces);
+
+    Shutdown(&client, &tracker);
+}
+
+TEST_F(UdpTrackerTest, Timeout) {
+    MockUdpTracker tracker(&loop_);
+    tracker.drop = 1000;
+    UdpTrackerClient client(&loop_, FastOptions());
+    ASSERT_TRUE(client.Start().Ok());
+
+    auto reply = Announce(&client, tracker.url());
+    ASSERT_FALSE(reply.Ok());
+    EXPECT_NE(std::string::npos, reply.Error().find("timed out"));
+
+    Shutdown(&client, &tracker);
+}
+
+TEST_F(UdpTrackerTest, IgnoresUnknownTransaction) {
+    MockUdpTracker tracker(&loop_);
+    tracker.send_stray_reply = true;
+    UdpTrackerClient client(&loop_, FastOptions());
+    ASSERT_TRUE(client.Start().Ok());
+
+    ASSERT_TRUE(Announce(&client, tracker.url()).Ok());
+    EXPECT_EQ(1, tracker.connects);
+
+    Shutdown(&client, &tracker);
+}
+
+TEST_F(UdpTrackerTest, ErrorReply) {
+    MockUdpTracker tracker(&loop_);
+    tracker.error = "torrent not registered";
+    UdpTrackerClient client(&loop_, FastOptions());
+    ASSERT_TRUE(client.Start().Ok());
+
+    auto reply = Announce(&client, tracker.url());
+    ASSERT_TRUE(reply.Ok());
+    EXPECT_EQ("torrent not registered", reply.Value().failure_reason);
+
+    Shutdown(&client, &tracker);
+}
+
+TEST_F(UdpTrackerTest, ScrapeBatches) {
+    MockUdpTracker tracker(&loop_);
+    UdpTrackerClient client(&loop_, FastOptions());
+    ASSERT_TRUE(client.Start().Ok());
+
+    std::vector<std::string> info_hashes;
+    for (int i = 0; i < 100; i++) info_hashes.push_back(std::string(19, 'h') + char(i));
+    Result<ScrapeReply, std::string> reply = Err("no reply");
+    bool done = false;
+    client.Scrape(tracker.url(), info_hashes, [&](Result<ScrapeReply, std::string> r) {
+        reply = std::move(r);
+        done = true;
+    });
+    while (!done) uv_run(&loop_, UV_RUN_ONCE);
+
+    ASSERT_TRUE(reply.Ok()) << reply.Error();
+    EXPECT_EQ(2, tracker.scrapes);
+    EXPECT_EQ(100u, tracker.scraped);
+    EXPECT_EQ(1, tracker.connects);
+    ASSERT_EQ(100u, reply.Value().files.size());
+    // the second batch starts at index 74
+    const ScrapeInfo& info = reply.Value().files.at(info_hashes[75]);
+    EXPECT_EQ(11, info.seeders);
+    EXPECT_EQ(21, info.completed);
+    EXPECT_EQ(31, info.leechers);
+
+    Shutdown(&client, &tracker);
+}
+
+TEST_F(UdpTrackerTest, HaltFailsPending) {
+    MockUdpTracker tracker(&loop_);
+    tracker.drop = 1000;
+    UdpTrackerClient client(&loop_);
+    ASSERT_TRUE(client.Start().Ok());
+
+    bool failed = false, closed = false;
+    AnnounceParams params{.info_hash = std::string(20, 'h')};
+    client.Announce(tracker.url(), params, [&](Result<TrackerReply, std::string> reply) {
+        EXPECT_FALSE(reply.Ok());
+        failed = true;
+    });
+    uv_run(&loop_, UV_RUN_NOWAIT);
+    client.Halt([&]() { closed = true; });
+    EXPECT_TRUE(failed);
+    tracker.Close();
+    uv_run(&loop_, UV_RUN_DEFAULT);
+    EXPECT_TRUE(closed);
+}
+
+TEST_F(UdpTrackerTest, InvalidUrl) {
+    UdpTrackerClient client(&loop_);
+    ASSERT_TRUE(client.Start().Ok());
+    EXPECT_FALSE(Announce(&client, "udp://no-port/announce").Ok());
+    EXPECT_FALSE(Announce(&client, "http://127.0.0.1:80/announce").Ok());
+    Shutdown(&client, nullptr);
+}
+
+}  // namespace
@@ -0,0 +1,572 @@
+#pragma once
+
+#include <uv.h>
+
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "result.h"
+
+// Coroutines over libuv. A coroutine returning Task<T> runs on the thread of the loop its
+// awaitables use, and each co_await of an operation below issues the libuv call and suspends
+// until its callback:
+//
+//     Task<ssize_t> Size(uv_loop_t* loop, std::string path) {
+//         ssize_t fd = co_await FsOpen(loop, path, UV_FS_O_RDONLY);
+//         if (fd < 0) co_return fd;
+//         uv_stat_t stat;
+//         ssize_t retcode = co_await FsFstat(loop, fd, &stat);
+//         co_await FsClose(loop, fd);
+//         co_return retcode < 0 ? retcode : stat.st_size;
+//     }
+//
+// Operations return libuv statuses like their callbacks would get them. Tasks are lazy, they
+// start when awaited, or when handed to Spawn(). WhenAll() runs several at once. A task must
+// not be destroyed while it waits for an operation, its callback would resume a freed frame.
+// A lambda coroutine refers to its captures through the closure, which must outlive it.
+// Coroutine frames come from a per thread pool of size classes, see FramePool.
+namespace ryu::coro {
+
+// Free lists of coroutine frames by size class, one pool per thread. A frame freed on another
+// thread than the one that allocated it joins that thread's pool.
+class FramePool {
+  public:
+    static constexpr size_t kGranularity = 64;
+    static constexpr size_t kClasses = 64;
+    // frames up to 4KiB are pooled, larger ones go to operator new
+    static constexpr size_t kMaxPooled = kGranularity * kClasses;
+    // frames kept per size class
+    static constexpr size_t kMaxFree = 256;
+
+    static void* Allocate(size_t size) {
+        if (size > kMaxPooled) return ::operator new(size);
+        auto& list = Local().free_[Class(size)];
+        if (!list.empty()) {
+            void* frame = list.back();
+            list.pop_back();
+            return frame;
+        }
+        return ::operator new((Class(size) + 1) * kGranularity);
+    }
+
+    static void Free(void* frame, size_t size) {
+        if (size <= kMaxPooled) {
+            auto& list = Local().free_[Class(size)];
+            if (list.size() < kMaxFree) {
+                list.push_back(frame);
+                return;
+            }
+        }
+        ::operator delete(frame);
+    }
+
+    // frames waiting for reuse on this thread
+    static size_t Pooled() {
+        size_t count = 0;
+        for (const auto& list : Local().free_) count += list.size();
+        return count;
+    }
+
+    ~FramePool() {
+        for (auto& list : free_) {
+            for (void* frame : list) ::operator delete(frame);
+        }
+    }
+
+  private:
+    static size_t Class(size_t size) { return (size - 1) / kGranularity; }
+    static FramePool& Local() {
+        static thread_local FramePool pool;
+        return pool;
+    }
+
+    std::array<std::vector<void*>, kClasses> free_;
+};
+
+// Base of every promise below, so their frames come from the pool
+struct PooledFrame {
+    static void* operator new(size_t size) { return FramePool::Allocate(size); }
+    static void operator delete(void* frame, size_t size) { FramePool::Free(frame, size); }
+};
+
+template <typename T>
+class Task;
+
+namespace detail {
+
+// Resumes whoever awaited the finished task
+struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+        auto continuation = handle.promise().continuation;
+        return continuation ? continuation : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+};
+
+struct PromiseBase : PooledFrame {
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    // errors are values in this code base
+    void unhandled_exception() noexcept { std::terminate(); }
+
+    std::coroutine_handle<> continuation;
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+    Task<T> get_return_object() noexcept;
+    void return_value(T v) { value.emplace(std::move(v)); }
+    T Take() { return std::move(*value); }
+
+    std::optional<T> value;
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object() noexcept;
+    void return_void() noexcept {}
+    void Take() noexcept {}
+};
+
+}  // namespace detail
+
+// A lazily started coroutine producing a T. Owns its frame, destroying an unfinished task
+// destroys the coroutine at its current suspension point.
+template <typename T = void>
+class [[nodiscard]] Task {
+  public:
+    using promise_type = detail::Promise<T>;
+
+    Task() = default;
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle_) handle_.destroy();
+            handle_ = std::exchange(other.handle_, {});
+        }
+        return *this;
+    }
+    ~Task() {
+        if (handle_) handle_.destroy();
+    }
+
+    [[nodiscard]] bool Done() const { return !handle_ || handle_.done(); }
+
+    // co_await runs the task to completion and yields its result
+    auto operator co_await() && noexcept {
+        struct Awaiter {
+            bool await_ready() noexcept { return !handle || handle.done(); }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+            T await_resume() { return handle.promise().Take(); }
+            std::coroutine_handle<promise_type> handle;
+        };
+        return Awaiter{handle_};
+    }
+
+  private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+template <typename T>
+Task<T> Promise<T>::get_return_object() noexcept {
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() noexcept {
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+// A coroutine nobody awaits, its frame frees itself when it finishes
+struct Detached {
+    struct promise_type : PooledFrame {
+        Detached get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+}  // namespace detail
+
+// Start `task` now and let it run on its own, its result is dropped. Whatever it needs must
+// outlive it.
+template <typename T>
+void Spawn(Task<T> task) {
+    [](Task<T> task) -> detail::Detached { co_await std::move(task); }(std::move(task));
+}
+
+// Run every task at once, the results keep the order of `tasks`
+template <typename T>
+Task<std::conditional_t<std::is_void_v<T>, void, std::vector<T>>> WhenAll(
+    std::vector<Task<T>> tasks) {
+    using Slot = std::conditional_t<std::is_void_v<T>, bool, std::optional<T>>;
+    struct State {
+        // one more than the tasks running until all are started, so none resumes the parent
+        // while it is still suspending
+        size_t remaining = 0;
+        std::coroutine_handle<> parent;
+        std::vector<Slot> results;
+    };
+    struct Awaiter {
+        bool await_ready() noexcept { return tasks.empty(); }
+        bool await_suspend(std::coroutine_handle<> parent) {
+            state.parent = parent;
+            state.remaining = tasks.size() + 1;
+            state.results.resize(tasks.size());
+            for (size_t i = 0; i < tasks.size(); i++) Run(std::move(tasks[i]), &state, i);
+            return --state.remaining > 0;
+        }
+        void await_resume() noexcept {}
+
+        static detail::Detached Run(Task<T> task, State* state, size_t index) {
+            if constexpr (std::is_void_v<T>) {
+                co_await std::move(task);
+            } else {
+                state->results[index].emplace(co_await std::move(task));
+            }
+            if (--state->remaining == 0) state->parent.resume();
+        }
+
+        std::vector<Task<T>>& tasks;
+        State& state;
+    };
+
+    State state;
+    co_await Awaiter{tasks, state};
+    if constexpr (!std::is_void_v<T>) {
+        std::vector<T> results;
+        results.reserve(state.results.size());
+        for (auto& result : state.results) results.push_back(std::move(*result));
+        co_return results;
+    }
+}
+
+namespace detail {
+
+// Issues a uv_fs_* call with `issue(loop, req, cb)` and resumes with req->result. Stat calls
+// copy the stat out before the request is cleaned up.
+template <typename Issue>
+class FsAwaiter {
+  public:
+    FsAwaiter(uv_loop_t* loop, Issue issue, uv_stat_t* stat = nullptr)
+        : loop_(loop), issue_(std::move(issue)), stat_(stat) {}
+    FsAwaiter(const FsAwaiter&) = delete;
+    FsAwaiter& operator=(const FsAwaiter&) = delete;
+    ~FsAwaiter() {
+        if (issued_) uv_fs_req_cleanup(&req_);
+    }
+
+    bool await_ready() noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle) {
+        handle_ = handle;
+        req_.data = this;
+        int retcode = issue_(loop_, &req_, &FsAwaiter::Done);
+        if (retcode < 0) {
+            result_ = retcode;
+            return false;
+        }
+        issued_ = true;
+        return true;
+    }
+    ssize_t await_resume() noexcept { return result_; }
+
+  private:
+    static void Done(uv_fs_t* req) {
+        auto* self = static_cast<FsAwaiter*>(req->data);
+        self->result_ = req->result;
+        if (self->stat_ && req->result == 0) *self->stat_ = req->statbuf;
+        self->handle_.resume();
+    }
+
+    uv_loop_t* const loop_;
+    Issue issue_;
+    uv_stat_t* const stat_;
+    uv_fs_t req_;
+    bool issued_ = false;
+    ssize_t result_ = 0;
+    std::coroutine_handle<> handle_;
+};
+
+template <typename Issue>
+FsAwaiter<Issue> MakeFs(uv_loop_t* loop, Issue issue, uv_stat_t* stat = nullptr) {
+    return FsAwaiter<Issue>(loop, std::move(issue), stat);
+}
+
+}  // namespace detail
+
+// The file descriptor, or a libuv error
+inline auto FsOpen(uv_loop_t* loop, std::string path, int flags, int mode = 0) {
+    return detail::MakeFs(loop, [path = std::move(path), flags, mode](auto* loop, auto* req,
+                                                                       auto cb) {
+        return uv_fs_open(loop, req, path.c_str(), flags, mode, cb);
+    });
+}
+
+// Bytes read into `buf`, 0 at the end of the file, or a libuv error. `offset` -1 reads at the
+// current position.
+inline auto FsRead(uv_loop_t* loop, uv_file fd, char* buf, size_t len, int64_t offset) {
+    return detail::MakeFs(loop, [fd, buf, len, offset](auto* loop, auto* req, auto cb) {
+        uv_buf_t iov = uv_buf_init(buf, static_cast<unsigned int>(len));
+        return uv_fs_read(loop, req, fd, &iov, 1, offset, cb);
+    });
+}
+
+inline auto FsWrite(uv_loop_t* loop, uv_file fd, const char* buf, size_t len, int64_t offset) {
+    return detail::MakeFs(loop, [fd, buf, len, offset](auto* loop, auto* req, auto cb) {
+        uv_buf_t iov = uv_buf_init(const_cast<char*>(buf), static_cast<unsigned int>(len));
+        return uv_fs_write(loop, req, fd, &iov, 1, offset, cb);
+    });
+}
+
+// Fills `stat` on success
+inline auto FsFstat(uv_loop_t* loop, uv_file fd, uv_stat_t* stat) {
+    return detail::MakeFs(
+        loop, [fd](auto* loop, auto* req, auto cb) { return uv_fs_fstat(loop, req, fd, cb); },
+        stat);
+}
+
+inline auto FsClose(uv_loop_t* loop, uv_file fd) {
+    return detail::MakeFs(
+        loop, [fd](auto* loop, auto* req, auto cb) { return uv_fs_close(loop, req, fd, cb); });
+}
+
+// Reads once from `stream` and appends to `out`. Bytes read, or a libuv error such as UV_EOF.
+// The stream's `data` is borrowed while reading.
+class ReadSome {
+  public:
+    ReadSome(uv_stream_t* stream, std::string* out) : stream_(stream), out_(out) {}
+    ReadSome(const ReadSome&) = delete;
+    ReadSome& operator=(const ReadSome&) = delete;
+
+    bool await_ready() noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle) {
+        handle_ = handle;
+        saved_data_ = stream_->data;
+        stream_->data = this;
+        int retcode = uv_read_start(stream_, &ReadSome::Alloc, &ReadSome::Done);
+        if (retcode < 0) {
+            stream_->data = saved_data_;
+            result_ = retcode;
+            return false;
+        }
+        return true;
+    }
+    ssize_t await_resume() noexcept { return result_; }
+
+  private:
+    static constexpr size_t kChunk = 64 * 1024;
+
+    // straight into the tail of `out`
+    static void Alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+        auto* self = static_cast<ReadSome*>(handle->data);
+        self->size_before_ = self->out_->size();
+        self->out_->resize(self->size_before_ + kChunk);
+        *buf = uv_buf_init(self->out_->data() + self->size_before_, kChunk);
+    }
+    static void Done(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+        auto* self = static_cast<ReadSome*>(stream->data);
+        if (buf->base) self->out_->resize(self->size_before_ + (nread > 0 ? nread : 0));
+        // EAGAIN, keep waiting
+        if (nread == 0) return;
+        uv_read_stop(stream);
+        stream->data = self->saved_data_;
+        self->result_ = nread;
+        self->handle_.resume();
+    }
+
+    uv_stream_t* const stream_;
+    std::string* const out_;
+    void* saved_data_ = nullptr;
+    size_t size_before_ = 0;
+    ssize_t result_ = 0;
+    std::coroutine_handle<> handle_;
+};
+
+// Writes all of `data`, 0 or a libuv error
+class Write {
+  public:
+    Write(uv_stream_t* stream, std::string data) : stream_(stream), data_(std::move(data)) {}
+    Write(const Write&) = delete;
+    Write& operator=(const Write&) = delete;
+
+    bool await_ready() noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle) {
+        handle_ = handle;
+        req_.data = this;
+        uv_buf_t buf = uv_buf_init(data_.data(), static_cast<unsigned int>(data_.size()));
+        result_ = uv_write(&req_, stream_, &buf, 1, &Write::Done);
+        return result_ == 0;
+    }
+    int await_resume() noexcept { return result_; }
+
+  private:
+    static void Done(uv_write_t* req, int status) {
+        auto* self = static_cast<Write*>(req->data);
+        self->result_ = status;
+        self->handle_.resume();
+    }
+
+    uv_stream_t* const stream_;
+    std::string data_;
+    uv_write_t req_;
+    int result_ = 0;
+    std::coroutine_handle<> handle_;
+};
+
+// 0 or a libuv error
+class Connect {
+  public:
+    Connect(uv_tcp_t* tcp, const sockaddr* addr) : tcp_(tcp) {
+        size_t len = addr->sa_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+        std::memcpy(&addr_, addr, len);
+    }
+    Connect(const Connect&) = delete;
+    Connect& operator=(const Connect&) = delete;
+
+    bool await_ready() noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle) {
+        handle_ = handle;
+        req_.data = this;
+        result_ = uv_tcp_connect(&req_, tcp_, reinterpret_cast<const sockaddr*>(&addr_),
+                                 &Connect::Done);
+        return result_ == 0;
+    }
+    int await_resume() noexcept { return result_; }
+
+  private:
+    static void Done(uv_connect_t* req, int status) {
+        auto* self = static_cast<Connect*>(req->data);
+        self->result_ = status;
+        self->handle_.resume();
+    }
+
+    uv_tcp_t* const tcp_;
+    sockaddr_storage addr_{};
+    uv_connect_t req_;
+    int result_ = 0;
+    std::coroutine_handle<> handle_;
+};
+
+// Resumes after `timeout_ms`. Unlike the other operations, a task may be destroyed while
+// sleeping, the timer goes with it.
+class Sleep {
+  public:
+    Sleep(uv_loop_t* loop, uint64_t timeout_ms) : loop_(loop), timeout_ms_(timeout_ms) {}
+    Sleep(const Sleep&) = delete;
+    Sleep& operator=(const Sleep&) = delete;
+    ~Sleep() {
+        if (timer_) Close();
+    }
+
+    bool await_ready() noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+        handle_ = handle;
+        // on the heap, its close completes after the awaiter is gone
+        timer_ = new uv_timer_t;
+        uv_timer_init(loop_, timer_);
+        timer_->data = this;
+        uv_timer_start(timer_, &Sleep::Fired, timeout_ms_, 0);
+    }
+    void await_resume() noexcept {}
+
+  private:
+    static void Fired(uv_timer_t* timer) {
+        auto* self = static_cast<Sleep*>(timer->data);
+        self->Close();
+        self->handle_.resume();
+    }
+    void Close() {
+        uv_close(reinterpret_cast<uv_handle_t*>(timer_),
+                 [](uv_handle_t* handle) { delete reinterpret_cast<uv_timer_t*>(handle); });
+        timer_ = nullptr;
+    }
+
+    uv_loop_t* const loop_;
+    const uint64_t timeout_ms_;
+    uv_timer_t* timer_ = nullptr;
+    std::coroutine_handle<> handle_;
+};
+
+namespace internal {
+// What OnThreadpool resumes with, a Result from `work` is passed on as is
+template <typename T>
+struct ThreadpoolResult {
+    using type = Result<T, std::string>;
+};
+template <typename T>
+struct ThreadpoolResult<Result<T, std::string>> {
+    using type = Result<T, std::string>;
+};
+}  // namespace internal
+
+// Runs `work` on the libuv threadpool so CPU heavy or blocking jobs like hashing and disk I/O do
+// not stall the loop, and resumes with what it returns, or an error if libuv cancelled the work.
+// `work` must not touch anything the loop thread uses while it runs. Name `work` and move it in:
+// GCC 12 destroys a lambda or other class temporary inside a co_await expression twice.
+//
+//     auto parse = [bytes = std::move(bytes)]() { return TorrentFile::Load(bytes); };
+//     auto torrent = co_await OnThreadpool(loop, std::move(parse));
+template <typename Work>
+class OnThreadpool {
+  public:
+    using WorkResult = std::invoke_result_t<Work&>;
+    using ResultType = typename internal::ThreadpoolResult<WorkResult>::type;
+
+    OnThreadpool(uv_loop_t* loop, Work work) : loop_(loop), work_(std::move(work)) {}
+    OnThreadpool(const OnThreadpool&) = delete;
+    OnThreadpool& operator=(const OnThreadpool&) = delete;
+
+    bool await_ready() noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+        handle_ = handle;
+        req_.data = this;
+        // only fails for a missing callback
+        uv_queue_work(loop_, &req_, &OnThreadpool::Run, &OnThreadpool::Done);
+    }
+    ResultType await_resume() {
+        if (status_ != 0) {
+            return Err(std::string("threadpool work failed: ") + uv_strerror(status_));
+        }
+        return std::move(*result_);
+    }
+
+  private:
+    static void Run(uv_work_t* req) {
+        auto* self = static_cast<OnThreadpool*>(req->data);
+        self->result_.emplace(self->work_());
+    }
+    static void Done(uv_work_t* req, int status) {
+        auto* self = static_cast<OnThreadpool*>(req->data);
+        // UV_ECANCELED, `work` never ran
+        self->status_ = status;
+        self->handle_.resume();
+    }
+
+    uv_loop_t* const loop_;
+    Work work_;
+    std::optional<WorkResult> result_;
+    int status_ = 0;
+    uv_work_t req_;
+    std::coroutine_handle<> handle_;
+};
+
+}  // namespace ryu::coro
@@ -0,0 +1,181 @@
+#include "coro.h"
+
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace ryu::coro;
+
+namespace {
+
+class CoroTest : public ::testing::Test {
+  protected:
+    void SetUp() override { uv_loop_init(&loop_); }
+    void TearDown() override {
+        uv_run(&loop_, UV_RUN_DEFAULT);
+        EXPECT_EQ(0, uv_loop_close(&loop_));
+    }
+
+    uv_loop_t loop_;
+};
+
+Task<ssize_t> WriteFile(uv_loop_t* loop, std::string path, std::string content) {
+    int flags = UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_TRUNC;
+    ssize_t fd = co_await FsOpen(loop, path, flags, 0644);
+    if (fd < 0) co_return fd;
+    ssize_t written = co_await FsWrite(loop, fd, content.data(), content.size(), 0);
+    co_await FsClose(loop, fd);
+    co_return written;
+}
+
+// open, stat, read, close
+Task<std::string> ReadFile(uv_loop_t* loop, std::string path) {
+    ssize_t fd = co_await FsOpen(loop, path, UV_FS_O_RDONLY);
+    if (fd < 0) co_return "";
+    uv_stat_t stat;
+    std::string content;
+    if (co_await FsFstat(loop, fd, &stat) == 0) {
+        content.resize(stat.st_size);
+        size_t done = 0;
+        while (done < content.size()) {
+            ssize_t n = co_await FsRead(loop, fd, &content[done], content.size() - done, done);
+            if (n <= 0) break;
+            done += n;
+        }
+        content.resize(done);
+    }
+    co_await FsClose(loop, fd);
+    co_return content;
+}
+
+TEST_F(CoroTest, FileRoundTrip) {
+    std::string path = testing::TempDir() + "coro_test_file";
+    std::string content(100'000, 'r');
+    content.back() = '!';
+    std::string read_back;
+    // the closure must outlive the coroutine, it holds the captures
+    auto body = [&]() -> Task<> {
+        EXPECT_EQ(static_cast<ssize_t>(content.size()),
+                  co_await WriteFile(&loop_, path, content));
+        read_back = co_await ReadFile(&loop_, path);
+        EXPECT_GT(0, co_await FsOpen(&loop_, path + ".missing", UV_FS_O_RDONLY));
+    };
+    Spawn(body());
+    uv_run(&loop_, UV_RUN_DEFAULT);
+    EXPECT_EQ(content, read_back);
+    std::remove(path.c_str());
+}
+
+Task<int> Nap(uv_loop_t* loop, int ms) {
+    co_await Sleep(loop, ms);
+    co_return ms;
+}
+
+TEST_F(CoroTest, WhenAllRunsConcurrently) {
+    std::vector<int> results;
+    uint64_t start = uv_hrtime();
+    auto body = [&]() -> Task<> {
+        std::vector<Task<int>> naps;
+        for (int ms : {60, 20, 40}) naps.push_back(Nap(&loop_, ms));
+        results = co_await WhenAll(std::move(naps));
+        // nothing to wait for
+        co_await WhenAll(std::vector<Task<>>{});
+    };
+    Spawn(body());
+    uv_run(&loop_, UV_RUN_DEFAULT);
+    EXPECT_EQ((std::vector<int>{60, 20, 40}), results);
+    EXPECT_LT((uv_hrtime() - start) / 1'000'000, 110u);
+}
+
+TEST_F(CoroTest, ThreadpoolAndFramePool) {
+    std::vector<bool> on_other_thread;
+    auto loop_thread = std::this_thread::get_id();
+    auto body = [&]() -> Task<> {
+        for (int i = 0; i < 3; i++) {
+            auto id = co_await OnThreadpool(&loop_, [] { return std::this_thread::get_id(); });
+            on_other_thread.push_back(id.Ok() && id.Value() != loop_thread);
+        }
+    };
+    Spawn(body());
+    uv_run(&loop_, UV_RUN_DEFAULT);
+    EXPECT_EQ(std::vector<bool>(3, true), on_other_thread);
+
+    // finished frames are reused instead of freed
+    size_t pooled = FramePool::Pooled();
+    EXPECT_GT(pooled, 0u);
+    for (int i = 0; i < 10; i++) Spawn(Nap(&loop_, 0));
+    uv_run(&loop_, UV_RUN_DEFAULT);
+    EXPECT_GE(FramePool::Pooled(), pooled);
+}
+
+// Echoes one read back to the client
+class EchoServer {
+  public:
+    explicit EchoServer(uv_loop_t* loop) : loop_(loop) {
+        uv_tcp_init(loop, &server_);
+        server_.data = this;
+        sockaddr_in addr;
+        uv_ip4_addr("127.0.0.1", 0, &addr);
+        uv_tcp_bind(&server_, reinterpret_cast<sockaddr*>(&addr), 0);
+        uv_listen(reinterpret_cast<uv_stream_t*>(&server_), 1, [](uv_stream_t* server, int) {
+            static_cast<EchoServer*>(server->data)->Accept();
+        });
+    }
+
+    sockaddr_storage Address() {
+        sockaddr_storage addr;
+        int len = sizeof(addr);
+        uv_tcp_getsockname(&server_, reinterpret_cast<sockaddr*>(&addr), &len);
+        return addr;
+    }
+
+    void Accept() {
+        uv_tcp_init(loop_, &conn_);
+        uv_accept(reinterpret_cast<uv_stream_t*>(&server_),
+                  reinterpret_cast<uv_stream_t*>(&conn_));
+        Spawn(Echo());
+    }
+
+    Task<> Echo() {
+        auto* stream = reinterpret_cast<uv_stream_t*>(&conn_);
+        std::string data;
+        if (co_await ReadSome(stream, &data) > 0) co_await Write(stream, data);
+        uv_close(reinterpret_cast<uv_handle_t*>(&conn_), nullptr);
+        uv_close(reinterpret_cast<uv_handle_t*>(&server_), nullptr);
+    }
+
+  private:
+    uv_loop_t* loop_;
+    uv_tcp_t server_;
+    uv_tcp_t conn_;
+};
+
+TEST_F(CoroTest, StreamOperations) {
+    EchoServer server(&loop_);
+    uv_tcp_t client;
+    uv_tcp_init(&loop_, &client);
+    client.data = &server;
+    std::string reply;
+    ssize_t eof = 0;
+    auto body = [&]() -> Task<> {
+        auto* stream = reinterpret_cast<uv_stream_t*>(&client);
+        sockaddr_storage addr = server.Address();
+        EXPECT_EQ(0, co_await Connect(&client, reinterpret_cast<sockaddr*>(&addr)));
+        EXPECT_EQ(0, co_await Write(stream, "ping"));
+        EXPECT_EQ(4, co_await ReadSome(stream, &reply));
+        eof = co_await ReadSome(stream, &reply);
+        uv_close(reinterpret_cast<uv_handle_t*>(&client), nullptr);
+    };
+    Spawn(body());
+    uv_run(&loop_, UV_RUN_DEFAULT);
+    EXPECT_EQ("ping", reply);
+    EXPECT_EQ(UV_EOF, eof);
+    // the stream's own data is back
+    EXPECT_EQ(&server, client.data);
+}
+
+}  // namespace
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <uv.h>
+
+#include <functional>
+#include <memory>
+#include <utility>
+
+#include "utils/mpsc_queue.h"
+#include "utils/uv_callbacks.h"
+
+namespace ryu {
+
+// Runs jobs posted from any thread on the thread of one loop, in the order each producer
+// posted them. Jobs sit in a lock free queue and an async handle wakes the loop, many posts may
+// be coalesced into one wakeup.
+class Mailbox {
+  public:
+    using Job = std::function<void()>;
+
+    // On the loop's thread, or before the loop runs
+    explicit Mailbox(uv_loop_t* loop) : async_(std::make_unique<uv_async_t>()) {
+        uv_async_init(loop, async_.get(), uv_callbacks::Async<&Mailbox::AsyncFired>);
+        async_->data = this;
+    }
+    Mailbox(const Mailbox&) = delete;
+    Mailbox& operator=(const Mailbox&) = delete;
+
+    // Any thread. Jobs posted after Close() are never run. A producer may still be inside Post()
+    // when its job runs, so the mailbox must outlive the producers, not just the jobs.
+    void Post(Job job) {
+        queue_.Push(std::move(job));
+        uv_async_send(async_.get());
+    }
+
+    // Loop thread. Runs the jobs already posted, `on_closed` is called once the mailbox can be
+    // destroyed.
+    void Close(std::function<void()> on_closed) {
+        on_closed_ = std::move(on_closed);
+        RunJobs();
+        uv_close(reinterpret_cast<uv_handle_t*>(async_.get()),
+                 uv_callbacks::Close<&Mailbox::HandleClosed>);
+    }
+
+    // UV callbacks
+    void AsyncFired(uv_async_t* handle) { RunJobs(); }
+    void HandleClosed(uv_handle_t* handle) {
+        auto cb = std::move(on_closed_);
+        on_closed_ = nullptr;
+        // may delete this
+        if (cb) cb();
+    }
+
+  private:
+    void RunJobs() {
+        while (auto job = queue_.Pop()) (*job)();
+    }
+
+    std::unique_ptr<uv_async_t> async_;
+    MpscQueue<Job> queue_;
+    std::function<void()> on_closed_;
+};
+
+}  // namespace ryu
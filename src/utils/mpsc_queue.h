@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <optional>
+#include <utility>
+
+namespace ryu {
+
+// Unbounded multi producer, single consumer queue, after Dmitry Vyukov's intrusive design.
+// Push() is one atomic exchange and may be called from any thread, Pop() only from the
+// consumer. A Pop() racing with an unfinished Push() may see an empty queue, so producers must
+// wake the consumer after pushing, never before.
+template <typename T>
+class MpscQueue {
+  public:
+    MpscQueue() : head_(&stub_), tail_(&stub_) {}
+    ~MpscQueue() {
+        while (Pop()) {
+        }
+    }
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void Push(T value) { PushNode(new Node(std::move(value))); }
+
+    // Consumer only
+    std::optional<T> Pop() {
+        Node* tail = tail_;
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (tail == &stub_) {
+            if (next == nullptr) return std::nullopt;
+            tail_ = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            tail_ = next;
+            return Take(tail);
+        }
+        // a producer swapped the head but has not linked its node yet
+        if (tail != head_.load(std::memory_order_acquire)) return std::nullopt;
+        // `tail` is the last node, put the stub behind it so it can be taken
+        PushNode(&stub_);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr) return std::nullopt;
+        tail_ = next;
+        return Take(tail);
+    }
+
+  private:
+    struct Node {
+        Node() = default;
+        explicit Node(T v) : value(std::move(v)) {}
+        std::atomic<Node*> next{nullptr};
+        std::optional<T> value;
+    };
+
+    void PushNode(Node* node) {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    static T Take(Node* node) {
+        T value = std::move(*node->value);
+        delete node;
+        return value;
+    }
+
+    // producers and the consumer on separate cache lines
+    alignas(64) std::atomic<Node*> head_;
+    alignas(64) Node* tail_;
+    Node stub_;
+};
+
+}  // namespace ryu
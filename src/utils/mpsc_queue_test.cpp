@@ -0,0 +1,79 @@
+#include "mpsc_queue.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mailbox.h"
+
+using ryu::Mailbox;
+using ryu::MpscQueue;
+
+TEST(MpscQueueTest, Fifo) {
+    MpscQueue<std::unique_ptr<std::string>> queue;
+    EXPECT_FALSE(queue.Pop());
+    queue.Push(std::make_unique<std::string>("a"));
+    queue.Push(std::make_unique<std::string>("b"));
+    EXPECT_EQ("a", **queue.Pop());
+    queue.Push(std::make_unique<std::string>("c"));
+    EXPECT_EQ("b", **queue.Pop());
+    EXPECT_EQ("c", **queue.Pop());
+    EXPECT_FALSE(queue.Pop());
+    // whatever is left is freed with the queue
+    queue.Push(std::make_unique<std::string>("d"));
+}
+
+TEST(MpscQueueTest, ManyProducers) {
+    constexpr int kProducers = 4;
+    constexpr int kItems = 200'000;
+    MpscQueue<std::pair<int, int>> queue;
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; p++) {
+        producers.emplace_back([&queue, p] {
+            for (int i = 0; i < kItems; i++) queue.Push({p, i});
+        });
+    }
+    // each producer's items arrive in order
+    std::vector<int> next(kProducers, 0);
+    int popped = 0;
+    while (popped < kProducers * kItems) {
+        auto item = queue.Pop();
+        if (!item) {
+            std::this_thread::yield();
+            continue;
+        }
+        ASSERT_EQ(next[item->first], item->second);
+        next[item->first]++;
+        popped++;
+    }
+    for (auto& producer : producers) producer.join();
+    EXPECT_FALSE(queue.Pop());
+}
+
+TEST(MailboxTest, RunsJobsOnTheLoop) {
+    uv_loop_t loop;
+    uv_loop_init(&loop);
+    auto mailbox = std::make_unique<Mailbox>(&loop);
+    std::thread::id loop_thread = std::this_thread::get_id();
+    int ran = 0;
+    bool wrong_thread = false;
+    std::thread producer([&] {
+        for (int i = 0; i < 1000; i++) {
+            mailbox->Post([&] {
+                wrong_thread |= std::this_thread::get_id() != loop_thread;
+                ran++;
+            });
+        }
+        // the last job closes the mailbox, which lets uv_run() return
+        mailbox->Post([&] { mailbox->Close([&] { ran++; }); });
+    });
+    uv_run(&loop, UV_RUN_DEFAULT);
+    producer.join();
+    mailbox.reset();
+    EXPECT_EQ(1001, ran);
+    EXPECT_FALSE(wrong_thread);
+    EXPECT_EQ(0, uv_loop_close(&loop));
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <uv.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+namespace ryu {
+
+// Receive buffer of a libuv stream. Reads land right after the unconsumed bytes, which are
+// handed out in place, so a whole line or frame is one string_view and nothing is copied per
+// message. Consuming only moves the start. The unconsumed bytes move to the front when the
+// buffer empties, which is free, or when the room left at the end runs short. The buffer
+// doubles up to `max_size` when compacting is not enough.
+//
+// It stays linear rather than wrapping around like a ring, so that a frame is never split.
+class RecvBuffer {
+  public:
+    explicit RecvBuffer(size_t initial_size = 4096, size_t max_size = 1 << 20)
+        : max_size_(std::max(max_size, initial_size)),
+          capacity_(initial_size),
+          data_(std::make_unique<char[]>(initial_size)) {}
+    RecvBuffer(const RecvBuffer&) = delete;
+    RecvBuffer& operator=(const RecvBuffer&) = delete;
+
+    // For the alloc callback. Hands out an empty buffer once `max_size` unconsumed bytes are
+    // held, which libuv reports to the read callback as UV_ENOBUFS.
+    void Prepare(uv_buf_t* buf) {
+        size_t room = capacity_ - end_;
+        if (room < capacity_ / 4 && begin_ > 0) Compact();
+        if (end_ == capacity_ && capacity_ < max_size_) Grow(capacity_ * 2);
+        buf->base = data_.get() + end_;
+        buf->len = capacity_ - end_;
+    }
+    // For the read callback, `size` bytes were read into what Prepare() handed out
+    void Commit(size_t size) { end_ += size; }
+
+    [[nodiscard]] std::string_view Data() const { return {data_.get() + begin_, end_ - begin_}; }
+    void Consume(size_t size) {
+        begin_ += size;
+        if (begin_ == end_) begin_ = end_ = 0;
+    }
+    // Make room for `size` unconsumed bytes, false if that is more than `max_size`
+    bool Reserve(size_t size) {
+        if (size > max_size_) return false;
+        if (capacity_ - begin_ >= size) return true;
+        if (capacity_ >= size) {
+            Compact();
+        } else {
+            Grow(std::max(size, std::min(capacity_ * 2, max_size_)));
+        }
+        return true;
+    }
+
+    // Hands each complete line, without its '\n', to `handler` until it returns false
+    template <typename F>
+    void ForEachLine(F&& handler) {
+        while (begin_ < end_) {
+            std::string_view data = Data();
+            size_t pos = data.find('\n');
+            if (pos == std::string_view::npos) return;
+            bool more = handler(data.substr(0, pos));
+            Consume(pos + 1);
+            if (!more) return;
+        }
+    }
+    // Hands the body of each complete frame, a 4 byte big endian length followed by that many
+    // bytes, to `handler` until it returns false. Returns false on a body longer than
+    // `max_body`, and reserves room for an incomplete frame.
+    template <typename F>
+    bool ForEachFrame(size_t max_body, F&& handler) {
+        while (end_ - begin_ >= kFrameHeaderSize) {
+            std::string_view data = Data();
+            size_t body = 0;
+            for (size_t i = 0; i < kFrameHeaderSize; i++) {
+                body = body << 8 | static_cast<uint8_t>(data[i]);
+            }
+            if (body > max_body) return false;
+            if (data.size() < kFrameHeaderSize + body) return Reserve(kFrameHeaderSize + body);
+            bool more = handler(data.substr(kFrameHeaderSize, body));
+            Consume(kFrameHeaderSize + body);
+            if (!more) return true;
+        }
+        return true;
+    }
+
+    [[nodiscard]] size_t size() const { return end_ - begin_; }
+    [[nodiscard]] size_t capacity() const { return capacity_; }
+    [[nodiscard]] size_t max_size() const { return max_size_; }
+
+    static constexpr size_t kFrameHeaderSize = 4;
+
+  private:
+    void Compact() {
+        memmove(data_.get(), data_.get() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+    }
+    void Grow(size_t capacity) {
+        capacity = std::min(capacity, max_size_);
+        auto data = std::make_unique<char[]>(capacity);
+        memcpy(data.get(), data_.get() + begin_, end_ - begin_);
+        data_ = std::move(data);
+        capacity_ = capacity;
+        end_ -= begin_;
+        begin_ = 0;
+    }
+
+    const size_t max_size_;
+    size_t capacity_;
+    std::unique_ptr<char[]> data_;
+    // unconsumed bytes are [begin_, end_)
+    size_t begin_ = 0;
+    size_t end_ = 0;
+};
+
+}  // namespace ryu
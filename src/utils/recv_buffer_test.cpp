@@ -0,0 +1,127 @@
+#include "recv_buffer.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+using ryu::RecvBuffer;
+
+namespace {
+
+// what a read callback does
+void Read(RecvBuffer* buffer, std::string_view data) {
+    while (!data.empty()) {
+        uv_buf_t buf;
+        buffer->Prepare(&buf);
+        ASSERT_GT(buf.len, 0u);
+        size_t size = std::min<size_t>(buf.len, data.size());
+        memcpy(buf.base, data.data(), size);
+        buffer->Commit(size);
+        data.remove_prefix(size);
+    }
+}
+
+std::string Frame(std::string_view body) {
+    std::string frame(RecvBuffer::kFrameHeaderSize, '\0');
+    for (size_t i = 0; i < RecvBuffer::kFrameHeaderSize; i++) {
+        frame[i] = static_cast<char>(body.size() >> (8 * (RecvBuffer::kFrameHeaderSize - 1 - i)));
+    }
+    return frame.append(body);
+}
+
+TEST(RecvBufferTest, Lines) {
+    RecvBuffer buffer(16, 64);
+    std::vector<std::string> lines;
+    auto collect = [&](std::string_view line) {
+        lines.emplace_back(line);
+        return true;
+    };
+    Read(&buffer, "ping\npi");
+    buffer.ForEachLine(collect);
+    EXPECT_EQ(std::vector<std::string>{"ping"}, lines);
+    EXPECT_EQ("pi", buffer.Data());
+
+    Read(&buffer, "ng\n\nCreateTask a-rather-long-file-name.torrent\nbye");
+    buffer.ForEachLine(collect);
+    EXPECT_EQ(4u, lines.size());
+    EXPECT_EQ("", lines[2]);
+    EXPECT_EQ("CreateTask a-rather-long-file-name.torrent", lines[3]);
+    EXPECT_EQ("bye", buffer.Data());
+    EXPECT_EQ(64u, buffer.capacity());
+
+    // the handler stops early
+    Read(&buffer, "\nstop\n");
+    buffer.ForEachLine([&](std::string_view line) { return collect(line) && false; });
+    EXPECT_EQ("bye", lines.back());
+    EXPECT_EQ("stop\n", buffer.Data());
+}
+
+TEST(RecvBufferTest, Frames) {
+    RecvBuffer buffer(16, 1024);
+    std::vector<std::string> frames;
+    auto collect = [&](std::string_view body) {
+        frames.emplace_back(body);
+        return true;
+    };
+    std::string big(600, 'x');
+    std::string stream = Frame("hello") + Frame("") + Frame(big) + Frame("tail");
+
+    // byte by byte, the frames come out whole
+    for (char c : stream) {
+        Read(&buffer, std::string_view(&c, 1));
+        ASSERT_TRUE(buffer.ForEachFrame(1000, collect));
+    }
+    EXPECT_EQ((std::vector<std::string>{"hello", "", big, "tail"}), frames);
+    EXPECT_EQ(0u, buffer.size());
+    EXPECT_GE(buffer.capacity(), 604u);
+
+    // a header announcing too much
+    Read(&buffer, Frame(std::string(1001, 'y')).substr(0, 4));
+    EXPECT_FALSE(buffer.ForEachFrame(1000, collect));
+}
+
+TEST(RecvBufferTest, CompactsLazily) {
+    RecvBuffer buffer(16, 16);
+    Read(&buffer, "0123456789");
+    const char* start = buffer.Data().data();
+    buffer.Consume(4);
+    // plenty of room left, nothing moves
+    uv_buf_t buf;
+    buffer.Prepare(&buf);
+    EXPECT_EQ(start + 4, buffer.Data().data());
+    EXPECT_EQ(6u, buf.len);
+
+    Read(&buffer, "abcd");
+    buffer.Prepare(&buf);
+    EXPECT_EQ(start, buffer.Data().data());
+    EXPECT_EQ("456789abcd", buffer.Data());
+    EXPECT_EQ(6u, buf.len);
+
+    // full at the maximum size, libuv gets an empty buffer
+    Read(&buffer, "efghij");
+    buffer.Prepare(&buf);
+    EXPECT_EQ(0u, buf.len);
+
+    // consuming everything starts over
+    buffer.Consume(buffer.size());
+    buffer.Prepare(&buf);
+    EXPECT_EQ(start, buf.base);
+    EXPECT_EQ(16u, buf.len);
+}
+
+TEST(RecvBufferTest, Reserve) {
+    RecvBuffer buffer(8, 100);
+    Read(&buffer, "abcdefgh");
+    buffer.Consume(6);
+    EXPECT_TRUE(buffer.Reserve(8));
+    EXPECT_EQ(8u, buffer.capacity());
+    EXPECT_EQ("gh", buffer.Data());
+    EXPECT_TRUE(buffer.Reserve(50));
+    EXPECT_EQ(50u, buffer.capacity());
+    EXPECT_EQ("gh", buffer.Data());
+    EXPECT_FALSE(buffer.Reserve(101));
+}
+
+}  // namespace
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <uv.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "result.h"
+#include "utils/timer_wheel.h"
+#include "utils/uv_callbacks.h"
+
+namespace ryu {
+
+// Every timer of a loop on one TimerWheel, driven by a single libuv timer. Meant for the many
+// coarse timers of connections, request timeouts, keepalives and the like, where a uv_timer_t
+// each would mean a heap operation per (re)arm.
+//
+// Scheduling and cancelling are O(1) and only touch the libuv timer when the earliest deadline
+// moves forward. When it fires, every timer due runs in one batch and the libuv timer is armed
+// once afterwards. Deadlines are rounded up to whole ticks.
+//
+//     timers->Schedule<&Peer::KeepaliveDue>(&keepalive_, 120'000, this);
+//
+// Timers are owned by their users and cancel themselves when destroyed. Not thread safe, one
+// service per loop.
+class TimerService {
+  public:
+    using Timer = TimerWheel::Timer;
+
+    struct Stats {
+        // times the libuv timer fired, and timers run
+        uint64_t wakeups = 0;
+        uint64_t fired = 0;
+    };
+
+    explicit TimerService(uv_loop_t* loop, uint64_t tick_ms = 10)
+        : loop_(loop), wheel_(uv_now(loop), tick_ms) {}
+    TimerService(const TimerService&) = delete;
+    TimerService& operator=(const TimerService&) = delete;
+
+    Result<ResultVoid, std::string> Start() {
+        timer_ = std::make_unique<uv_timer_t>();
+        if (uv_timer_init(loop_, timer_.get()) != 0) {
+            timer_.reset();
+            return Err("TimerService::Start uv_timer_init() failed");
+        }
+        timer_->data = this;
+        return {};
+    }
+
+    // No timer fires anymore, `on_closed` is called once the service can be destroyed
+    void Halt(std::function<void()> on_closed) {
+        if (draining_) return;
+        draining_ = true;
+        if (!timer_) {
+            if (on_closed) on_closed();
+            return;
+        }
+        on_closed_ = std::move(on_closed);
+        uv_close(reinterpret_cast<uv_handle_t*>(timer_.get()),
+                 uv_callbacks::Close<&TimerService::TimerClosed>);
+    }
+
+    // (Re)schedule `timer` to run `callback` `delay_ms` from now
+    void Schedule(Timer* timer, uint64_t delay_ms, std::function<void()> callback) {
+        ScheduleAt(timer, uv_now(loop_) + delay_ms, std::move(callback));
+    }
+
+    // Same, with a member function of `obj`
+    template <auto member_ptr, typename ClassType>
+    void Schedule(Timer* timer, uint64_t delay_ms, ClassType* obj) {
+        Schedule(timer, delay_ms, [obj] { (obj->*member_ptr)(); });
+    }
+
+    // At the loop time `deadline_ms`, see uv_now()
+    void ScheduleAt(Timer* timer, uint64_t deadline_ms, std::function<void()> callback) {
+        wheel_.Schedule(timer, deadline_ms, std::move(callback));
+        if (firing_) return;
+        // the wheel fires on the tick boundary at or after the deadline
+        uint64_t tick = wheel_.TickMs();
+        uint64_t due = (deadline_ms + tick - 1) / tick * tick;
+        if (armed_at_ == 0 || due < armed_at_) Arm(due);
+    }
+
+    [[nodiscard]] uint64_t NowMs() const { return uv_now(loop_); }
+    [[nodiscard]] size_t Size() const { return wheel_.Size(); }
+    [[nodiscard]] Stats GetStats() const { return stats_; }
+
+    // UV callbacks
+    void TimerFired(uv_timer_t* handle) {
+        stats_.wakeups++;
+        armed_at_ = 0;
+        // callbacks schedule freely, the timer is armed once at the end
+        firing_ = true;
+        stats_.fired += wheel_.Advance(uv_now(loop_));
+        firing_ = false;
+        if (auto next = wheel_.NextWakeup()) Arm(*next);
+    }
+
+    void TimerClosed(uv_handle_t* handle) {
+        auto cb = std::move(on_closed_);
+        on_closed_ = nullptr;
+        // may delete this
+        if (cb) cb();
+    }
+
+  private:
+    void Arm(uint64_t at_ms) {
+        if (draining_ || !timer_) return;
+        uint64_t now = uv_now(loop_);
+        armed_at_ = at_ms;
+        uv_timer_start(timer_.get(), uv_callbacks::Timer<&TimerService::TimerFired>,
+                       at_ms > now ? at_ms - now : 0, 0);
+    }
+
+    uv_loop_t* const loop_;
+    TimerWheel wheel_;
+    std::unique_ptr<uv_timer_t> timer_;
+    // when the libuv timer fires, 0 if stopped. Cancelled timers leave it armed, the wakeup
+    // finds nothing to do.
+    uint64_t armed_at_ = 0;
+    bool firing_ = false;
+    Stats stats_;
+
+    bool draining_ = false;
+    std::function<void()> on_closed_;
+};
+
+}  // namespace ryu
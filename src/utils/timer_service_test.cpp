@@ -0,0 +1,90 @@
+#include "timer_service.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <vector>
+
+using ryu::TimerService;
+
+namespace {
+
+class TimerServiceTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        uv_loop_init(&loop_);
+        timers_ = std::make_unique<TimerService>(&loop_, 5);
+        timers_->Start().Expect("start");
+    }
+    void TearDown() override {
+        bool closed = false;
+        timers_->Halt([&] { closed = true; });
+        uv_run(&loop_, UV_RUN_DEFAULT);
+        EXPECT_TRUE(closed);
+        timers_.reset();
+        EXPECT_EQ(0, uv_loop_close(&loop_));
+    }
+
+    uv_loop_t loop_;
+    std::unique_ptr<TimerService> timers_;
+};
+
+class Peer {
+  public:
+    explicit Peer(TimerService* timers) : timers_(timers) {}
+    void Connected() { timers_->Schedule<&Peer::KeepaliveDue>(&keepalive_, 20, this); }
+    void KeepaliveDue() {
+        if (++keepalives < 3) timers_->Schedule<&Peer::KeepaliveDue>(&keepalive_, 20, this);
+    }
+
+    int keepalives = 0;
+
+  private:
+    TimerService* timers_;
+    TimerService::Timer keepalive_;
+};
+
+TEST_F(TimerServiceTest, MemberCallbacksReschedule) {
+    Peer peer(timers_.get());
+    uint64_t start = uv_now(&loop_);
+    peer.Connected();
+    uv_run(&loop_, UV_RUN_DEFAULT);
+    EXPECT_EQ(3, peer.keepalives);
+    EXPECT_GE(uv_now(&loop_) - start, 60u);
+    EXPECT_EQ(0u, timers_->Size());
+}
+
+TEST_F(TimerServiceTest, ExpiresInBatches) {
+    std::vector<TimerService::Timer> timers(1000);
+    int fired = 0;
+    for (size_t i = 0; i < timers.size(); i++) {
+        // two deadlines, both rounded to the same tick
+        timers_->Schedule(&timers[i], 21 + i % 2, [&] { fired++; });
+    }
+    uv_run(&loop_, UV_RUN_DEFAULT);
+    EXPECT_EQ(1000, fired);
+    EXPECT_EQ(1000u, timers_->GetStats().fired);
+    EXPECT_LE(timers_->GetStats().wakeups, 2u);
+}
+
+TEST_F(TimerServiceTest, CancelAndEarlierDeadlines) {
+    std::vector<int> order;
+    TimerService::Timer late, early, cancelled, dropped;
+    timers_->Schedule(&late, 60, [&] { order.push_back(60); });
+    // moves the libuv timer forward
+    timers_->Schedule(&early, 10, [&] { order.push_back(10); });
+    timers_->Schedule(&cancelled, 30, [&] { order.push_back(30); });
+    cancelled.Cancel();
+    {
+        TimerService::Timer gone;
+        timers_->Schedule(&gone, 40, [&] { order.push_back(40); });
+    }
+    // rescheduling replaces the callback
+    timers_->Schedule(&dropped, 20, [&] { order.push_back(-1); });
+    timers_->Schedule(&dropped, 50, [&] { order.push_back(50); });
+    EXPECT_EQ(3u, timers_->Size());
+    uv_run(&loop_, UV_RUN_DEFAULT);
+    EXPECT_EQ((std::vector<int>{10, 50, 60}), order);
+}
+
+}  // namespace
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <utility>
+
+namespace ryu {
+
+// Hierarchical timing wheel with 4 levels of 64 slots, after the classic kernel timer design.
+// Schedule() and Cancel() are O(1). Advance() jumps over idle ticks, and a timer is re-filed
+// into a lower level at most 3 times before it fires.
+// Deadlines are rounded up to whole ticks. A deadline further away than 64^4 ticks is parked
+// at the horizon and re-filed when it gets there.
+// Not thread safe. Callbacks may schedule and cancel any timer, including the one firing.
+class TimerWheel {
+  private:
+    struct Node {
+        Node* prev = nullptr;
+        Node* next = nullptr;
+    };
+
+  public:
+    static constexpr int kLevelBits = 6;
+    static constexpr uint64_t kSlots = 1u << kLevelBits;
+    static constexpr int kLevels = 4;
+    static constexpr uint64_t kHorizonTicks = (1ull << (kLevelBits * kLevels)) - 1;
+
+    // Owned by the user of the wheel. Cancelled when destroyed, so a Timer embedded in an
+    // object never fires after the object is gone.
+    class Timer : private Node {
+      public:
+        Timer() = default;
+        ~Timer() { Cancel(); }
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        [[nodiscard]] bool Scheduled() const { return prev != nullptr; }
+        // deadline in ms, valid while scheduled
+        [[nodiscard]] uint64_t Deadline() const { return deadline_ms_; }
+        void Cancel() {
+            if (!Scheduled()) return;
+            prev->next = next;
+            next->prev = prev;
+            prev = next = nullptr;
+            wheel_->size_--;
+        }
+
+      private:
+        friend class TimerWheel;
+        TimerWheel* wheel_ = nullptr;
+        uint64_t deadline_ms_ = 0;
+        uint64_t expires_ = 0;  // tick
+        std::function<void()> callback_;
+    };
+
+    TimerWheel(uint64_t now_ms, uint64_t tick_ms)
+        : tick_ms_(tick_ms), now_tick_(now_ms / tick_ms) {
+        for (auto& level : slots_)
+            for (auto& head : level) head.prev = head.next = &head;
+    }
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+    ~TimerWheel() {
+        for (auto& level : slots_)
+            for (auto& head : level)
+                while (head.next != &head) static_cast<Timer*>(head.next)->Cancel();
+    }
+
+    // (Re)schedule `timer` to run `callback` at `deadline_ms`. A deadline in the past fires on
+    // the next tick.
+    void Schedule(Timer* timer, uint64_t deadline_ms, std::function<void()> callback) {
+        timer->Cancel();
+        timer->wheel_ = this;
+        timer->deadline_ms_ = deadline_ms;
+        timer->expires_ = std::max((deadline_ms + tick_ms_ - 1) / tick_ms_, now_tick_ + 1);
+        timer->callback_ = std::move(callback);
+        Insert(timer);
+        size_++;
+    }
+
+    // Fire every timer due at or before `now_ms`. Returns the number of callbacks run.
+    size_t Advance(uint64_t now_ms) {
+        uint64_t target = now_ms / tick_ms_;
+        size_t fired = 0;
+        while (now_tick_ < target) {
+            // skip the ticks with nothing to do
+            uint64_t next = NextWakeupTick();
+            if (next > target) {
+                now_tick_ = target;
+                break;
+            }
+            now_tick_ = next;
+            // re-file the higher level slot that now falls within reach of the level below
+            for (int level = 1; level < kLevels; level++) {
+                if ((now_tick_ & ((1ull << (kLevelBits * level)) - 1)) != 0) break;
+                Cascade(level, (now_tick_ >> (kLevelBits * level)) & (kSlots - 1));
+            }
+            fired += Expire(slots_[0][now_tick_ & (kSlots - 1)]);
+        }
+        return fired;
+    }
+
+    // Earliest time in ms Advance() may have work to do, nullopt if nothing is scheduled.
+    // Exact for timers within 64 ticks, a lower bound for the rest.
+    [[nodiscard]] std::optional<uint64_t> NextWakeup() const {
+        if (size_ == 0) return {};
+        return NextWakeupTick() * tick_ms_;
+    }
+
+    [[nodiscard]] size_t Size() const { return size_; }
+    [[nodiscard]] uint64_t TickMs() const { return tick_ms_; }
+
+  private:
+    [[nodiscard]] uint64_t NextWakeupTick() const {
+        uint64_t best = UINT64_MAX;
+        if (size_ == 0) return best;
+        for (int level = 0; level < kLevels; level++) {
+            int shift = kLevelBits * level;
+            uint64_t base = now_tick_ >> shift;
+            for (uint64_t k = 1; k <= kSlots; k++) {
+                uint64_t tick = (base + k) << shift;
+                if (tick >= best) break;
+                const Node& head = slots_[level][(base + k) & (kSlots - 1)];
+                if (head.next != &head) {
+                    best = tick;
+                    break;
+                }
+            }
+        }
+        return best;
+    }
+
+    void Insert(Timer* timer) {
+        uint64_t expires = std::min(timer->expires_, now_tick_ + kHorizonTicks);
+        uint64_t delta = expires - now_tick_;
+        int level = 0;
+        while (level < kLevels - 1 && delta >= (1ull << (kLevelBits * (level + 1)))) level++;
+        Node& head = slots_[level][(expires >> (kLevelBits * level)) & (kSlots - 1)];
+        timer->prev = head.prev;
+        timer->next = &head;
+        head.prev->next = timer;
+        head.prev = timer;
+    }
+
+    // Move the whole list at `head` onto the sentinel `out`
+    static void Splice(Node& head, Node* out) {
+        if (head.next == &head) {
+            out->prev = out->next = out;
+            return;
+        }
+        out->next = head.next;
+        out->prev = head.prev;
+        out->next->prev = out;
+        out->prev->next = out;
+        head.prev = head.next = &head;
+    }
+
+    void Cascade(int level, uint64_t slot) {
+        Node pending;
+        Splice(slots_[level][slot], &pending);
+        while (pending.next != &pending) {
+            auto* timer = static_cast<Timer*>(pending.next);
+            pending.next = timer->next;
+            timer->next->prev = &pending;
+            Insert(timer);
+        }
+    }
+
+    size_t Expire(Node& head) {
+        // timers stay linked to `pending` until they run, so callbacks can still cancel them
+        Node pending;
+        Splice(head, &pending);
+        size_t fired = 0;
+        while (pending.next != &pending) {
+            auto* timer = static_cast<Timer*>(pending.next);
+            if (timer->expires_ > now_tick_) {
+                // parked at the horizon
+                pending.next = timer->next;
+                timer->next->prev = &pending;
+                Insert(timer);
+                continue;
+            }
+            timer->Cancel();
+            auto callback = std::move(timer->callback_);
+            callback();
+            fired++;
+        }
+        return fired;
+    }
+
+    const uint64_t tick_ms_;
+    uint64_t now_tick_;
+    size_t size_ = 0;
+    std::array<std::array<Node, kSlots>, kLevels> slots_;
+};
+
+}  // namespace ryu
@@ -0,0 +1,92 @@
+#include "timer_wheel.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <random>
+#include <vector>
+
+using ryu::TimerWheel;
+
+TEST(TimerWheelTest, FiresInOrder) {
+    TimerWheel wheel(0, 10);
+    TimerWheel::Timer a, b, c;
+    std::vector<int> fired;
+    wheel.Schedule(&c, 5000, [&] { fired.push_back(3); });
+    wheel.Schedule(&a, 15, [&] { fired.push_back(1); });
+    wheel.Schedule(&b, 700, [&] { fired.push_back(2); });
+    EXPECT_EQ(wheel.Size(), 3);
+    EXPECT_EQ(*wheel.NextWakeup(), 20);
+
+    EXPECT_EQ(wheel.Advance(19), 0);
+    EXPECT_EQ(wheel.Advance(20), 1);
+    EXPECT_FALSE(a.Scheduled());
+    EXPECT_EQ(wheel.Advance(699), 0);
+    EXPECT_EQ(wheel.Advance(100000), 2);
+    EXPECT_EQ(fired, (std::vector<int>{1, 2, 3}));
+    EXPECT_EQ(wheel.Size(), 0);
+    EXPECT_FALSE(wheel.NextWakeup());
+}
+
+TEST(TimerWheelTest, CancelAndReschedule) {
+    TimerWheel wheel(1000, 1);
+    TimerWheel::Timer a, b;
+    int fired = 0;
+    wheel.Schedule(&a, 1100, [&] { fired++; });
+    wheel.Schedule(&b, 1100, [&] { fired += 10; });
+    a.Cancel();
+    wheel.Schedule(&b, 1200, [&] { fired += 100; });
+    EXPECT_EQ(wheel.Size(), 1);
+    wheel.Advance(1150);
+    EXPECT_EQ(fired, 0);
+    wheel.Advance(1200);
+    EXPECT_EQ(fired, 100);
+
+    {
+        TimerWheel::Timer scoped;
+        wheel.Schedule(&scoped, 1300, [&] { fired = -1; });
+    }
+    EXPECT_EQ(wheel.Size(), 0);
+    wheel.Advance(2000);
+    EXPECT_EQ(fired, 100);
+}
+
+TEST(TimerWheelTest, CallbacksMayTouchTimers) {
+    TimerWheel wheel(0, 1);
+    TimerWheel::Timer a, b, periodic;
+    int runs = 0;
+    // a and b are due on the same tick, whichever runs first cancels the other
+    wheel.Schedule(&a, 5, [&] { b.Cancel(); });
+    wheel.Schedule(&b, 5, [&] { a.Cancel(); });
+    std::function<void()> tick = [&] {
+        if (++runs < 3) wheel.Schedule(&periodic, periodic.Deadline() + 100, tick);
+    };
+    wheel.Schedule(&periodic, 100, tick);
+    EXPECT_EQ(wheel.Advance(10), 1);
+    EXPECT_EQ(wheel.Advance(1000), 3);
+    EXPECT_EQ(runs, 3);
+}
+
+TEST(TimerWheelTest, MatchesSortedDeadlines) {
+    std::mt19937 rng(42);
+    TimerWheel wheel(12345, 1);
+    const int kTimers = 2000;
+    std::vector<std::unique_ptr<TimerWheel::Timer>> timers;
+    std::vector<uint64_t> fired_at(kTimers);
+    std::vector<uint64_t> deadline(kTimers);
+    uint64_t now = 12345;
+    for (int i = 0; i < kTimers; i++) {
+        timers.push_back(std::make_unique<TimerWheel::Timer>());
+        // spread over every level, and a few past the horizon
+        uint64_t delay = rng() % (i % 10 == 0 ? 20000000 : 300000);
+        deadline[i] = now + delay;
+        wheel.Schedule(timers[i].get(), deadline[i], [&, i] { fired_at[i] = now; });
+    }
+    while (wheel.Size() > 0) {
+        uint64_t next = *wheel.NextWakeup();
+        ASSERT_GT(next, now);
+        now = next;
+        wheel.Advance(now);
+    }
+    for (int i = 0; i < kTimers; i++) EXPECT_EQ(fired_at[i], deadline[i]) << i;
+}
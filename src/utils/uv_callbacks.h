@@ -32,6 +32,20 @@ void Check(uv_check_t* handle) {
     (obj->*member_ptr)(handle);
 }
 
+template <auto member_ptr>
+void Prepare(uv_prepare_t* handle) {
+    USING_CLASS_TYPE;
+    ClassType* obj = static_cast<ClassType*>(handle->data);
+    (obj->*member_ptr)(handle);
+}
+
+template <auto member_ptr>
+void Idle(uv_idle_t* handle) {
+    USING_CLASS_TYPE;
+    ClassType* obj = static_cast<ClassType*>(handle->data);
+    (obj->*member_ptr)(handle);
+}
+
 template <auto member_ptr>
 void Alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
     USING_CLASS_TYPE;
@@ -88,5 +102,49 @@ void Fs(uv_fs_t* req) {
     (obj->*member_ptr)(req);
 }
 
+template <auto member_ptr>
+void Timer(uv_timer_t* handle) {
+    USING_CLASS_TYPE;
+    ClassType* obj = static_cast<ClassType*>(handle->data);
+    (obj->*member_ptr)(handle);
+}
+
+template <auto member_ptr>
+void UdpRecv(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf, const sockaddr* addr,
+             unsigned flags) {
+    USING_CLASS_TYPE;
+    ClassType* obj = static_cast<ClassType*>(handle->data);
+    (obj->*member_ptr)(handle, nread, buf, addr, flags);
+}
+
+template <auto member_ptr>
+void UdpSend(uv_udp_send_t* req, int status) {
+    USING_CLASS_TYPE;
+    ClassType* obj = static_cast<ClassType*>(req->data);
+    (obj->*member_ptr)(req, status);
+}
+
+template <auto member_ptr>
+void GetAddrInfo(uv_getaddrinfo_t* req, int status, addrinfo* res) {
+    USING_CLASS_TYPE;
+    ClassType* obj = static_cast<ClassType*>(req->data);
+    (obj->*member_ptr)(req, status, res);
+}
+
+// Runs on a threadpool thread
+template <auto member_ptr>
+void Work(uv_work_t* req) {
+    USING_CLASS_TYPE;
+    ClassType* obj = static_cast<ClassType*>(req->data);
+    (obj->*member_ptr)(req);
+}
+
+template <auto member_ptr>
+void AfterWork(uv_work_t* req, int status) {
+    USING_CLASS_TYPE;
+    ClassType* obj = static_cast<ClassType*>(req->data);
+    (obj->*member_ptr)(req, status);
+}
+
 #undef USING_CLASS_TYPE
 }  // namespace ryu::uv_callbacks
\ No newline at end of file